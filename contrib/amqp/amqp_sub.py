@@ -7,6 +7,7 @@
 #  pip install python-qpid-proton
 
 import binascii
+import struct
 from proton.handlers import MessagingHandler
 from proton.reactor import Container
 
@@ -40,6 +41,10 @@ class Server(MessagingHandler):
         elif topic == "rawtx":
             print '- RAW TX ('+sequence+') -'
             print binascii.hexlify(body)
+        elif topic == "sequence":
+            mempoolSequence = struct.unpack('<Q', body[33:41])[-1]
+            print '- MEMPOOL '+body[32]+' '+str(mempoolSequence)+' ('+sequence+') -'
+            print binascii.hexlify(body[:32])
 
 try:
     Container(Server("127.0.0.1:%i" % port)).run()
@@ -16,6 +16,7 @@ zmqSubSocket.setsockopt(zmq.SUBSCRIBE, "hashblock")
 zmqSubSocket.setsockopt(zmq.SUBSCRIBE, "hashtx")
 zmqSubSocket.setsockopt(zmq.SUBSCRIBE, "rawblock")
 zmqSubSocket.setsockopt(zmq.SUBSCRIBE, "rawtx")
+zmqSubSocket.setsockopt(zmq.SUBSCRIBE, "sequence")
 zmqSubSocket.connect("tcp://127.0.0.1:%i" % port)
 
 try:
@@ -39,6 +40,10 @@ try:
         elif topic == "rawtx":
             print '- RAW TX ('+sequence+') -'
             print binascii.hexlify(body)
+        elif topic == "sequence":
+            mempoolSequence = struct.unpack('<Q', body[33:41])[-1]
+            print '- MEMPOOL '+body[32]+' '+str(mempoolSequence)+' ('+sequence+') -'
+            print binascii.hexlify(body[:32])
 
 except KeyboardInterrupt:
     zmqContext.destroy()
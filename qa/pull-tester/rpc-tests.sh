@@ -21,6 +21,7 @@ testScripts=(
     'wallet_1941.py'
     'listtransactions.py'
     'mempool_resurrect_test.py'
+    'mempool_persist.py'
     'txn_doublespend.py'
     'txn_doublespend.py --mineblock'
     'getchaintips.py'
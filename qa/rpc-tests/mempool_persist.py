@@ -0,0 +1,72 @@
+#!/usr/bin/env python2
+# Copyright (c) 2017 The Zcash developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test that the mempool is saved on shutdown and re-admitted on
+# restart, unless -persistmempool=0.
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, start_node, stop_node
+
+import time
+
+
+class MempoolPersistTest(BitcoinTestFramework):
+
+    def setup_network(self):
+        # Just need one node for this test
+        self.args = ["-checkmempool", "-debug=mempool"]
+        self.nodes = []
+        self.nodes.append(start_node(0, self.options.tmpdir, self.args))
+        self.is_network_split = False
+
+    def create_tx(self, from_txid, to_address, amount):
+        inputs = [{ "txid" : from_txid, "vout" : 0}]
+        outputs = { to_address : amount }
+        rawtx = self.nodes[0].createrawtransaction(inputs, outputs)
+        signresult = self.nodes[0].signrawtransaction(rawtx)
+        assert_equal(signresult["complete"], True)
+        return signresult["hex"]
+
+    def restart_node(self, extra_args):
+        stop_node(self.nodes[0], 0)
+        self.nodes[0] = start_node(0, self.options.tmpdir, self.args + extra_args)
+
+    def wait_for_mempool(self, txids):
+        # The mempool is re-admitted in the background after startup
+        for i in xrange(60):
+            if set(self.nodes[0].getrawmempool()) == set(txids):
+                return
+            time.sleep(1)
+        assert_equal(set(self.nodes[0].getrawmempool()), set(txids))
+
+    def run_test(self):
+        node0_address = self.nodes[0].getnewaddress()
+
+        # Spend block 1/2/3's coinbase transactions
+        b = [ self.nodes[0].getblockhash(n) for n in range(1, 4) ]
+        coinbase_txids = [ self.nodes[0].getblock(h)['tx'][0] for h in b ]
+        spends_raw = [ self.create_tx(txid, node0_address, 10) for txid in coinbase_txids ]
+        spends_id = [ self.nodes[0].sendrawtransaction(tx) for tx in spends_raw ]
+        entry_times = dict((txid, e['time']) for txid, e in self.nodes[0].getrawmempool(True).items())
+
+        # The transactions survive a restart, with the times they entered the mempool
+        self.restart_node([])
+        self.wait_for_mempool(spends_id)
+        for txid, e in self.nodes[0].getrawmempool(True).items():
+            assert_equal(e['time'], entry_times[txid])
+
+        # Not with -persistmempool=0, which neither loads nor saves it
+        self.restart_node(["-persistmempool=0"])
+        time.sleep(5)
+        assert_equal(self.nodes[0].getrawmempool(), [])
+
+        # The previous snapshot is still there
+        self.restart_node([])
+        self.wait_for_mempool(spends_id)
+
+if __name__ == '__main__':
+    MempoolPersistTest().main()
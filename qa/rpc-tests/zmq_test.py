@@ -23,8 +23,12 @@ class ZMQTest(BitcoinTestFramework):
         self.zmqSubSocket.setsockopt(zmq.SUBSCRIBE, b"hashblock")
         self.zmqSubSocket.setsockopt(zmq.SUBSCRIBE, b"hashtx")
         self.zmqSubSocket.connect("tcp://127.0.0.1:%i" % self.port)
+        self.zmqSeqSocket = self.zmqContext.socket(zmq.SUB)
+        self.zmqSeqSocket.setsockopt(zmq.SUBSCRIBE, b"sequence")
+        self.zmqSeqSocket.connect("tcp://127.0.0.1:%i" % (self.port + 1))
         return start_nodes(4, self.options.tmpdir, extra_args=[
-            ['-zmqpubhashtx=tcp://127.0.0.1:'+str(self.port), '-zmqpubhashblock=tcp://127.0.0.1:'+str(self.port)],
+            ['-zmqpubhashtx=tcp://127.0.0.1:'+str(self.port), '-zmqpubhashblock=tcp://127.0.0.1:'+str(self.port),
+             '-zmqpubsequence=tcp://127.0.0.1:'+str(self.port + 1)],
             [],
             [],
             []
@@ -90,6 +94,34 @@ class ZMQTest(BitcoinTestFramework):
 
         assert_equal(hashRPC, hashZMQ) #blockhash from generate must be equal to the hash received over zmq
 
+        # the same tx entered node 0's mempool, which is the first change to it
+        (label, txid, mempoolSequence, reason) = self.recv_sequence()
+        assert_equal(label, b"A")
+        assert_equal(txid, hashRPC)
+        assert_equal(mempoolSequence, 1)
+        snapshot = self.nodes[0].getrawmempool(False, True)
+        assert_equal(snapshot["txids"], [hashRPC])
+        assert_equal(snapshot["mempool_sequence"], 2)
+
+        # and leaves it when it is mined
+        self.nodes[0].generate(1)
+        self.sync_all()
+        (label, txid, mempoolSequence, reason) = self.recv_sequence()
+        assert_equal(label, b"R")
+        assert_equal(txid, hashRPC)
+        assert_equal(mempoolSequence, 2)
+        assert_equal(reason, 4) # included in a block
+        assert_equal(self.nodes[0].getrawmempool(False, True)["mempool_sequence"], 3)
+
+    def recv_sequence(self):
+        msg = self.zmqSeqSocket.recv_multipart()
+        assert_equal(msg[0], b"sequence")
+        body = msg[1]
+        reason = None
+        if len(body) == 42:
+            reason = struct.unpack('<B', body[41:42])[0]
+        return (body[32:33], bytes_to_hex_str(body[:32]), struct.unpack('<Q', body[33:41])[0], reason)
+
 
 if __name__ == '__main__':
     ZMQTest ().main ()
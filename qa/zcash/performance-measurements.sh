@@ -203,6 +203,9 @@ case "$1" in
             incnotewitnesses)
                 zcash_rpc zcbenchmark incnotewitnesses 100 "${@:3}"
                 ;;
+            estimatefee)
+                zcash_rpc zcbenchmark estimatefee 10
+                ;;
             connectblockslow)
                 extract_benchmark_data
                 zcash_rpc zcbenchmark connectblockslow 10
@@ -253,6 +256,9 @@ case "$1" in
             incnotewitnesses)
                 zcash_rpc zcbenchmark incnotewitnesses 1 "${@:3}"
                 ;;
+            estimatefee)
+                zcash_rpc zcbenchmark estimatefee 1
+                ;;
             connectblockslow)
                 extract_benchmark_data
                 zcash_rpc zcbenchmark connectblockslow 1
@@ -25,6 +25,8 @@ protected:
 
     // CValidationInterface
     void SyncTransaction(const CTransaction &tx, const CBlock *pblock);
+    void TransactionAddedToMempool(const CTransaction &tx, uint64_t nMempoolSequence);
+    void TransactionRemovedFromMempool(const CTransaction &tx, MemPoolRemovalReason reason, uint64_t nMempoolSequence);
     void UpdatedBlockTip(const CBlockIndex *pindex);
 
 private:
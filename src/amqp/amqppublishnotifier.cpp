@@ -4,6 +4,7 @@
 
 #include "amqppublishnotifier.h"
 #include "main.h"
+#include "txmempool.h"
 #include "util.h"
 
 #include "amqpsender.h"
@@ -17,6 +18,7 @@ static const char *MSG_HASHBLOCK = "hashblock";
 static const char *MSG_HASHTX    = "hashtx";
 static const char *MSG_RAWBLOCK  = "rawblock";
 static const char *MSG_RAWTX     = "rawtx";
+static const char *MSG_SEQUENCE  = "sequence";
 
 // Invoke this method from a new thread to run the proton container event loop.
 void AMQPAbstractPublishNotifier::SpawnProtonContainer()
@@ -175,3 +177,28 @@ bool AMQPPublishRawTransactionNotifier::NotifyTransaction(const CTransaction &tr
     ss << transaction;
     return SendMessage(MSG_RAWTX, &(*ss.begin()), ss.size());
 }
+
+bool AMQPPublishSequenceNotifier::NotifyTransactionAcceptance(const CTransaction &transaction, uint64_t nMempoolSequence)
+{
+    uint256 hash = transaction.GetHash();
+    LogPrint("amqp", "amqp: Publish sequence %d added %s\n", nMempoolSequence, hash.GetHex());
+    unsigned char data[32 + 1 + 8];
+    for (unsigned int i = 0; i < 32; i++)
+        data[31 - i] = hash.begin()[i];
+    data[32] = 'A';
+    WriteLE64(&data[33], nMempoolSequence);
+    return SendMessage(MSG_SEQUENCE, data, sizeof(data));
+}
+
+bool AMQPPublishSequenceNotifier::NotifyTransactionRemoval(const CTransaction &transaction, MemPoolRemovalReason reason, uint64_t nMempoolSequence)
+{
+    uint256 hash = transaction.GetHash();
+    LogPrint("amqp", "amqp: Publish sequence %d removed %s\n", nMempoolSequence, hash.GetHex());
+    unsigned char data[32 + 1 + 8 + 1];
+    for (unsigned int i = 0; i < 32; i++)
+        data[31 - i] = hash.begin()[i];
+    data[32] = 'R';
+    WriteLE64(&data[33], nMempoolSequence);
+    data[41] = static_cast<unsigned char>(reason);
+    return SendMessage(MSG_SEQUENCE, data, sizeof(data));
+}
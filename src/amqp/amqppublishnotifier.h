@@ -53,4 +53,17 @@ public:
     bool NotifyTransaction(const CTransaction &transaction);
 };
 
+/**
+ * Publishes the transactions entering and leaving the mempool, in order. The body
+ * is the transaction hash (32 bytes, RPC byte order), a label ('A' for added or
+ * 'R' for removed), the mempool sequence number (8 bytes, little endian) and,
+ * for removals, the reason as one byte (see MemPoolRemovalReason).
+ */
+class AMQPPublishSequenceNotifier : public AMQPAbstractPublishNotifier
+{
+public:
+    bool NotifyTransactionAcceptance(const CTransaction &transaction, uint64_t nMempoolSequence);
+    bool NotifyTransactionRemoval(const CTransaction &transaction, MemPoolRemovalReason reason, uint64_t nMempoolSequence);
+};
+
 #endif // ZCASH_AMQP_AMQPPUBLISHNOTIFIER_H
@@ -65,6 +65,20 @@ public:
     // Override this method to add data to the default status object.
     virtual UniValue getStatus() const;
 
+    // Override this method to report the relative amount of work done by
+    // main(), e.g. the number of zk-SNARK proofs it will generate.  The
+    // AsyncRPCQueue starts lighter operations first.
+    virtual size_t getWeight() const {
+        return 1;
+    }
+
+    // Override this method if main() must not run at the same time as other
+    // operations returning the same non-empty key, e.g. because they spend
+    // from the same address.
+    virtual std::string getExclusionKey() const {
+        return "";
+    }
+
     UniValue getError() const;
     
     UniValue getResult() const;
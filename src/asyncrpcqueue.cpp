@@ -4,6 +4,12 @@
 
 #include "asyncrpcqueue.h"
 
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 static std::atomic<size_t> workerCounter(0);
 
 /**
@@ -15,57 +21,115 @@ shared_ptr<AsyncRPCQueue> AsyncRPCQueue::sharedInstance() {
     return q;
 }
 
-AsyncRPCQueue::AsyncRPCQueue() : closed_(false), finish_(false) {
+AsyncRPCQueue::AsyncRPCQueue() : closed_(false), finish_(false), secs_per_weight_(ASYNC_RPC_QUEUE_DEFAULT_SECS_PER_WEIGHT) {
 }
 
 AsyncRPCQueue::~AsyncRPCQueue() {
     closeAndWait();     // join on all worker threads
 }
 
+/**
+ * Lower scores are scheduled first.  Lighter operations go first, but an
+ * operation gains priority the longer it waits so that heavy operations are
+ * not starved.
+ */
+double AsyncRPCQueue::get_scheduling_score(const AsyncRPCQueueEntry& entry, std::chrono::steady_clock::time_point now) const {
+    std::chrono::duration<double> waited = now - entry.queueTime;
+    return (double) entry.weight - waited.count() / ASYNC_RPC_QUEUE_AGING_SECS;
+}
+
+/**
+ * Return the queued operation which should be executed next, or the end of
+ * the queue if every queued operation conflicts with an executing one.
+ * Caller must hold lock_.
+ */
+std::list<AsyncRPCQueueEntry>::iterator AsyncRPCQueue::select_next_operation() {
+    auto now = std::chrono::steady_clock::now();
+    auto best = operation_id_queue_.end();
+    double bestScore = 0;
+    for (auto it = operation_id_queue_.begin(); it != operation_id_queue_.end(); ++it) {
+        if (!it->exclusionKey.empty() && executing_keys_.count(it->exclusionKey)) {
+            continue;
+        }
+        double score = get_scheduling_score(*it, now);
+        // Strictly less than, so that ties are broken in order of arrival
+        if (best == operation_id_queue_.end() || score < bestScore) {
+            best = it;
+            bestScore = score;
+        }
+    }
+    return best;
+}
+
 /**
  * A worker will execute this method on a new thread
  */
 void AsyncRPCQueue::run(size_t workerId) {
 
     while (true) {
-        AsyncRPCOperationId key;
+        AsyncRPCQueueEntry entry;
         std::shared_ptr<AsyncRPCOperation> operation;
         {
             std::unique_lock<std::mutex> guard(lock_);
-            while (operation_id_queue_.empty() && !isClosed() && !isFinishing()) {
-                this->condition_.wait(guard);
-            }
+            auto next = operation_id_queue_.end();
+            while (true) {
+                // Exit if the queue is closing.
+                if (isClosed()) {
+                    operation_id_queue_.clear();
+                    return;
+                }
 
-            // Exit if the queue is empty and we are finishing up
-            if (isFinishing() && operation_id_queue_.empty()) {
-                break;
-            }
+                next = select_next_operation();
+                if (next != operation_id_queue_.end()) {
+                    break;
+                }
 
-            // Exit if the queue is closing.
-            if (isClosed()) {
-                while (!operation_id_queue_.empty()) {
-                    operation_id_queue_.pop();
+                // Exit if the queue is empty and we are finishing up
+                if (isFinishing() && operation_id_queue_.empty()) {
+                    return;
                 }
-                break;
+
+                this->condition_.wait(guard);
             }
 
             // Get operation id
-            key = operation_id_queue_.front();
-            operation_id_queue_.pop();
+            entry = *next;
+            operation_id_queue_.erase(next);
 
             // Search operation map
-            AsyncRPCOperationMap::const_iterator iter = operation_map_.find(key);
+            AsyncRPCOperationMap::const_iterator iter = operation_map_.find(entry.id);
             if (iter != operation_map_.end()) {
                 operation = iter->second;
             }
+
+            if (operation && !entry.exclusionKey.empty()) {
+                executing_keys_.insert(entry.exclusionKey);
+            }
         }
 
         if (!operation) {
             // cannot find operation in map, may have been removed
+            continue;
         } else if (operation->isCancelled()) {
             // skip cancelled operation
         } else {
+            auto start = std::chrono::steady_clock::now();
             operation->main();
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+            std::lock_guard<std::mutex> guard(lock_);
+            if (entry.weight > 0) {
+                secs_per_weight_ = 0.8 * secs_per_weight_ + 0.2 * (elapsed.count() / entry.weight);
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            if (!entry.exclusionKey.empty()) {
+                executing_keys_.erase(executing_keys_.find(entry.exclusionKey));
+            }
+            // Operations waiting on this one's exclusion key may now run
+            this->condition_.notify_all();
         }
     }
 }
@@ -91,7 +155,11 @@ void AsyncRPCQueue::addOperation(const std::shared_ptr<AsyncRPCOperation> &ptrOp
 
     AsyncRPCOperationId id = ptrOperation->getId();
     operation_map_.emplace(id, ptrOperation);
-    operation_id_queue_.push(id);
+    operation_id_queue_.push_back(AsyncRPCQueueEntry{
+            id,
+            ptrOperation->getWeight(),
+            ptrOperation->getExclusionKey(),
+            std::chrono::steady_clock::now()});
     this->condition_.notify_one();
 }
 
@@ -199,6 +267,41 @@ std::vector<AsyncRPCOperationId> AsyncRPCQueue::getAllOperationIds() const {
     return v;
 }
 
+/**
+ * Return the number of queued operations which will be executed before the
+ * given operation, if it is still queued, and a rough estimate of how long
+ * it will be until it starts executing.
+ */
+bool AsyncRPCQueue::getQueuePosition(AsyncRPCOperationId id, size_t& position, int64_t& estimatedWaitSecs) const {
+    std::lock_guard<std::mutex> guard(lock_);
+
+    auto now = std::chrono::steady_clock::now();
+    auto target = std::find_if(operation_id_queue_.begin(), operation_id_queue_.end(),
+            [&id](const AsyncRPCQueueEntry& entry) { return entry.id == id; });
+    if (target == operation_id_queue_.end()) {
+        return false;
+    }
+    double targetScore = get_scheduling_score(*target, now);
+
+    position = 0;
+    size_t weightAhead = 0;
+    for (auto it = operation_id_queue_.begin(); it != operation_id_queue_.end(); ++it) {
+        if (it == target) {
+            continue;
+        }
+        double score = get_scheduling_score(*it, now);
+        bool arrivedBefore = it->queueTime <= target->queueTime;
+        if (score < targetScore || (score == targetScore && arrivedBefore)) {
+            position++;
+            weightAhead += it->weight;
+        }
+    }
+
+    size_t numWorkers = std::max(workers_.size(), (size_t) 1);
+    estimatedWaitSecs = (int64_t) (weightAhead * secs_per_weight_ / numWorkers);
+    return true;
+}
+
 /**
  * Calling thread will close and wait for worker threads to join.
  */
@@ -231,3 +334,123 @@ void AsyncRPCQueue::wait_for_worker_threads() {
         }
     }
 }
+
+
+/**
+ * Static method to return the shared/default proving pool.
+ */
+shared_ptr<AsyncRPCProvingPool> AsyncRPCProvingPool::sharedInstance() {
+    // Thread-safe in C+11 and gcc 4.3
+    static shared_ptr<AsyncRPCProvingPool> p = std::make_shared<AsyncRPCProvingPool>();
+    return p;
+}
+
+AsyncRPCProvingPool::AsyncRPCProvingPool() : closed_(false), sequence_(0), omp_threads_(0) {
+}
+
+AsyncRPCProvingPool::~AsyncRPCProvingPool() {
+    closeAndWait();     // join on all worker threads
+}
+
+/**
+ * Spawn worker threads.  When libsnark is built with OpenMP, the cores are
+ * divided between the workers so that concurrent proofs do not oversubscribe
+ * the CPU.
+ */
+void AsyncRPCProvingPool::addWorkers(size_t numWorkers) {
+    std::lock_guard<std::mutex> guard(lock_);
+    size_t numCores = std::max(std::thread::hardware_concurrency(), 1u);
+    omp_threads_ = (int) std::max(numCores / (workers_.size() + numWorkers), (size_t) 1);
+    for (size_t i = 0; i < numWorkers; i++) {
+        workers_.emplace_back( std::thread(&AsyncRPCProvingPool::run, this) );
+    }
+}
+
+/**
+ * Return the number of worker threads spawned by the pool
+ */
+size_t AsyncRPCProvingPool::getNumberOfWorkers() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return workers_.size();
+}
+
+/**
+ * Return the number of tasks waiting for a worker
+ */
+size_t AsyncRPCProvingPool::getTaskCount() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return tasks_.size();
+}
+
+std::future<void> AsyncRPCProvingPool::submit(std::function<void()> task, size_t priority) {
+    auto ptask = std::make_shared<std::packaged_task<void()>>(task);
+    std::future<void> result = ptask->get_future();
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (closed_) {
+            // Shutdown fails the task instead of blocking on it
+            std::promise<void> failed;
+            failed.set_exception(std::make_exception_ptr(std::runtime_error("proving pool is shut down")));
+            return failed.get_future();
+        }
+        if (!workers_.empty()) {
+            tasks_.emplace(std::make_pair(priority, sequence_++), ptask);
+            this->condition_.notify_one();
+            return result;
+        }
+    }
+    (*ptask)();
+    return result;
+}
+
+/**
+ * A worker will execute this method on a new thread
+ */
+void AsyncRPCProvingPool::run() {
+    int ompThreads;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        ompThreads = omp_threads_;
+    }
+#ifdef _OPENMP
+    omp_set_num_threads(ompThreads);
+#else
+    (void) ompThreads;
+#endif
+
+    while (true) {
+        std::shared_ptr<std::packaged_task<void()>> task;
+        {
+            std::unique_lock<std::mutex> guard(lock_);
+            while (tasks_.empty() && !closed_) {
+                this->condition_.wait(guard);
+            }
+            if (closed_) {
+                break;
+            }
+            task = tasks_.begin()->second;
+            tasks_.erase(tasks_.begin());
+        }
+        // Exceptions are stored in the task's future
+        (*task)();
+    }
+}
+
+/**
+ * Discard queued tasks, whose futures then report a broken promise, and block
+ * until the workers have finished their current task.
+ */
+void AsyncRPCProvingPool::closeAndWait() {
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        closed_ = true;
+        tasks_.clear();
+        this->condition_.notify_all();
+    }
+
+    for (std::thread & t : this->workers_) {
+        if (t.joinable()) {
+            t.join();
+        }
+    }
+}
@@ -10,7 +10,11 @@
 #include <iostream>
 #include <string>
 #include <chrono>
+#include <functional>
+#include <list>
+#include <map>
 #include <queue>
+#include <set>
 #include <unordered_map>
 #include <vector>
 #include <future>
@@ -18,9 +22,24 @@
 #include <utility>
 #include <memory>
 
+//! -rpcasyncthreads default
+static const int DEFAULT_RPC_ASYNC_THREADS = 1;
+//! A queued operation gains one unit of weight in priority for every this many seconds it waits
+static const int64_t ASYNC_RPC_QUEUE_AGING_SECS = 60;
+//! Assumed execution time of one unit of operation weight, until operations have been timed
+static const double ASYNC_RPC_QUEUE_DEFAULT_SECS_PER_WEIGHT = 40.0;
+
 
 typedef std::unordered_map<AsyncRPCOperationId, std::shared_ptr<AsyncRPCOperation> > AsyncRPCOperationMap; 
 
+// An operation waiting in the AsyncRPCQueue, with what is needed to schedule it.
+struct AsyncRPCQueueEntry {
+    AsyncRPCOperationId id;
+    size_t weight;
+    std::string exclusionKey;
+    std::chrono::steady_clock::time_point queueTime;
+};
+
 
 class AsyncRPCQueue {
 public:
@@ -49,11 +68,14 @@ public:
     std::shared_ptr<AsyncRPCOperation> popOperationForId(AsyncRPCOperationId);
     void addOperation(const std::shared_ptr<AsyncRPCOperation> &ptrOperation);
     std::vector<AsyncRPCOperationId> getAllOperationIds() const;
+    bool getQueuePosition(AsyncRPCOperationId id, size_t& position, int64_t& estimatedWaitSecs) const;
 
 private:
     // addWorker() will spawn a new thread on run())
     void run(size_t workerId);
     void wait_for_worker_threads();
+    double get_scheduling_score(const AsyncRPCQueueEntry& entry, std::chrono::steady_clock::time_point now) const;
+    std::list<AsyncRPCQueueEntry>::iterator select_next_operation();
 
     // Why this is not a recursive lock: http://www.zaval.org/resources/library/butenhof1.html
     mutable std::mutex lock_;
@@ -61,7 +83,57 @@ private:
     std::atomic<bool> closed_;
     std::atomic<bool> finish_;
     AsyncRPCOperationMap operation_map_;
-    std::queue <AsyncRPCOperationId> operation_id_queue_;
+    std::list<AsyncRPCQueueEntry> operation_id_queue_;    // in order of arrival
+    std::multiset<std::string> executing_keys_;           // exclusion keys of executing operations
+    double secs_per_weight_;                              // moving average of execution time per unit of weight
+    std::vector<std::thread> workers_;
+};
+
+
+//! -rpcprovingthreads default (0 = one per core, as far as memory allows)
+static const int DEFAULT_RPC_PROVING_THREADS = 0;
+//! Approximate peak memory of one JoinSplit proof, on top of the proving key shared by all of them
+static const int64_t RPC_PROVING_THREAD_MEMORY = 2048LL * 1024 * 1024;
+
+/**
+ * A bounded pool of threads, shared by all async operations, on which
+ * zk-SNARK proofs are generated.  Operations hand their proofs to the pool
+ * instead of proving on their own thread, so that concurrent operations do not
+ * oversubscribe the CPU, and proofs for lighter operations (lower priority
+ * value) are generated first.
+ */
+class AsyncRPCProvingPool {
+public:
+    static shared_ptr<AsyncRPCProvingPool> sharedInstance();
+
+    AsyncRPCProvingPool();
+    virtual ~AsyncRPCProvingPool();
+
+    // We don't want the pool to be copied or moved around
+    AsyncRPCProvingPool(AsyncRPCProvingPool const&) = delete;             // Copy construct
+    AsyncRPCProvingPool(AsyncRPCProvingPool&&) = delete;                  // Move construct
+    AsyncRPCProvingPool& operator=(AsyncRPCProvingPool const&) = delete;  // Copy assign
+    AsyncRPCProvingPool& operator=(AsyncRPCProvingPool &&) = delete;      // Move assign
+
+    void addWorkers(size_t numWorkers);
+    size_t getNumberOfWorkers() const;
+    size_t getTaskCount() const;
+    // Run a task on the pool.  If the pool has no workers, the task is run
+    // on the calling thread before returning.  Once the pool is closed, the
+    // task is not run and its future reports an error.
+    std::future<void> submit(std::function<void()> task, size_t priority);
+    void closeAndWait(); // discard queued tasks, block until running tasks are done
+
+private:
+    void run();
+
+    mutable std::mutex lock_;
+    std::condition_variable condition_;
+    bool closed_;
+    uint64_t sequence_;
+    int omp_threads_;   // OpenMP threads each worker may use for one proof
+    // Keyed by priority, then order of submission
+    std::map<std::pair<size_t, uint64_t>, std::shared_ptr<std::packaged_task<void()>>> tasks_;
     std::vector<std::thread> workers_;
 };
 
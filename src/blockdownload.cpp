@@ -0,0 +1,58 @@
+// Copyright (c) 2017 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockdownload.h"
+
+#include <algorithm>
+#include <cmath>
+
+void CBlockDownloadRate::BlockRequested(int64_t nNow, int nInFlightBefore)
+{
+    // The clock only runs while the peer has something to deliver
+    if (nInFlightBefore == 0 || nLastProgress == 0)
+        nLastProgress = nNow;
+}
+
+void CBlockDownloadRate::BlockDelivered(int64_t nNow, int nInFlightAfter)
+{
+    if (nLastProgress != 0) {
+        double dSample = std::max<int64_t>(nNow - nLastProgress, 1);
+        // Smooth over the last few deliveries, as block sizes vary a lot
+        dInterval = IsMeasured() ? 0.8 * dInterval + 0.2 * dSample : dSample;
+    }
+    nLastProgress = nInFlightAfter > 0 ? nNow : 0;
+}
+
+void CBlockDownloadRate::BlockCancelled(int nInFlightAfter)
+{
+    if (nInFlightAfter == 0)
+        nLastProgress = 0;
+}
+
+double CBlockDownloadRate::GetRate() const
+{
+    return IsMeasured() ? 1000000.0 / dInterval : 0;
+}
+
+int CBlockDownloadRate::GetWindow() const
+{
+    if (!IsMeasured())
+        return DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER;
+    double dWindow = std::ceil(BLOCK_DOWNLOAD_QUEUE_TIME * GetRate());
+    return (int)std::max<double>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<double>(MAX_BLOCKS_IN_TRANSIT_PER_PEER, dWindow));
+}
+
+bool CBlockDownloadRate::IsStalling(int64_t nNow) const
+{
+    if (nLastProgress == 0)
+        return false;
+    double dStallTime = IsMeasured() ? std::max<double>(MIN_BLOCK_STALL_TIME * 1000000.0, BLOCK_STALL_INTERVALS * dInterval)
+                                     : UNMEASURED_BLOCK_STALL_TIME * 1000000.0;
+    return nNow - nLastProgress > dStallTime;
+}
+
+bool CBlockDownloadRate::IsFasterThan(const CBlockDownloadRate& other) const
+{
+    return IsMeasured() && (!other.IsMeasured() || dInterval < other.dInterval);
+}
@@ -0,0 +1,59 @@
+// Copyright (c) 2017 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKDOWNLOAD_H
+#define BITCOIN_BLOCKDOWNLOAD_H
+
+#include <stdint.h>
+
+/** Number of blocks requested at a time from a peer whose delivery rate is not known yet. */
+static const int DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Bounds of the number of blocks in flight from a single peer, which is sized to its delivery rate. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 64;
+/** Seconds of a peer's measured delivery rate that we keep in flight from it. */
+static const int BLOCK_DOWNLOAD_QUEUE_TIME = 5;
+/** A peer stalls when it takes this many times its usual interval to deliver the next block... */
+static const int BLOCK_STALL_INTERVALS = 4;
+/** ...and at least this many seconds. */
+static const int MIN_BLOCK_STALL_TIME = 10;
+/** A peer which hasn't delivered a block yet stalls after this many seconds, as a large block may take long on a slow link. */
+static const int UNMEASURED_BLOCK_STALL_TIME = 60;
+
+/**
+ * Delivery rate of the blocks we request from one peer, measured from the
+ * time between deliveries while the peer has requests outstanding. It sizes
+ * the peer's share of the block download, and tells when the peer's blocks
+ * are better requested from someone else.
+ */
+class CBlockDownloadRate
+{
+private:
+    //! Time of the last delivery, or of the first request since the peer had nothing in flight (in microseconds), or 0 while idle
+    int64_t nLastProgress;
+    //! Smoothed time between deliveries (in microseconds), or 0 until the first one
+    double dInterval;
+
+public:
+    CBlockDownloadRate() : nLastProgress(0), dInterval(0) {}
+
+    /** A block was requested from the peer, which had nInFlightBefore blocks in flight before. */
+    void BlockRequested(int64_t nNow, int nInFlightBefore);
+    /** The peer delivered a block we asked it for, and has nInFlightAfter blocks left in flight. */
+    void BlockDelivered(int64_t nNow, int nInFlightAfter);
+    /** A block is no longer expected from the peer, without having been delivered. */
+    void BlockCancelled(int nInFlightAfter);
+
+    bool IsMeasured() const { return dInterval > 0; }
+    /** Blocks per second, or 0 until the first delivery. */
+    double GetRate() const;
+    /** Number of blocks to keep in flight from the peer. */
+    int GetWindow() const;
+    /** Whether the peer is overdue with its next block. */
+    bool IsStalling(int64_t nNow) const;
+    /** Whether the peer is known to deliver faster than other, which holds against any peer that hasn't delivered yet. */
+    bool IsFasterThan(const CBlockDownloadRate& other) const;
+};
+
+#endif // BITCOIN_BLOCKDOWNLOAD_H
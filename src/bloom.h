@@ -6,12 +6,12 @@
 #define BITCOIN_BLOOM_H
 
 #include "serialize.h"
+#include "uint256.h"
 
 #include <vector>
 
 class COutPoint;
 class CTransaction;
-class uint256;
 
 //! 20,000 items with fp rate < 0.1% or 10,000 items and <0.0001%
 static const unsigned int MAX_BLOOM_FILTER_SIZE = 36000; // bytes
@@ -30,6 +30,29 @@ enum bloomflags
     BLOOM_UPDATE_MASK = 3,
 };
 
+/**
+ * The data elements of a transaction which bloom filters are matched against,
+ * extracted and serialized once, so that the transaction can be matched
+ * against many filters without parsing its scripts again.
+ */
+class CBloomTxElements
+{
+public:
+    uint256 hash;
+    //! Data pushes of each output script
+    std::vector<std::vector<std::vector<unsigned char> > > vOutputPushes;
+    //! Whether each output pays to a pubkey or a multisig (for BLOOM_UPDATE_P2PUBKEY_ONLY)
+    std::vector<bool> vOutputIsPubKey;
+    //! Serialized outpoints spent by the inputs
+    std::vector<std::vector<unsigned char> > vPrevouts;
+    //! Data pushes of all the input scripts
+    std::vector<std::vector<unsigned char> > vInputPushes;
+    //! JoinSplit nullifiers and note commitments
+    std::vector<uint256> vJoinSplitElements;
+
+    explicit CBloomTxElements(const CTransaction& tx);
+};
+
 /**
  * BloomFilter is a probabilistic filter which SPV clients provide
  * so that we can filter the transactions we send them.
@@ -53,10 +76,6 @@ private:
 
     unsigned int Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const;
 
-    // Private constructor for CRollingBloomFilter, no restrictions on size
-    CBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweak);
-    friend class CRollingBloomFilter;
-
 public:
     /**
      * Creates a new bloom filter which will provide the given fp rate when filled with the given number of elements
@@ -97,6 +116,11 @@ public:
 
     //! Also adds any outputs which match the filter to the filter (to match their spending txes)
     bool IsRelevantAndUpdate(const CTransaction& tx);
+    //! The same, for a transaction whose data elements were extracted beforehand
+    bool IsRelevantAndUpdate(const CBloomTxElements& elements);
+
+    //! Whether the filter matches everything or nothing, so that matching needs no data elements
+    bool IsTrivial() const { return isFull || isEmpty; }
 
     //! Checks for empty and full filters to avoid wasting cpu
     void UpdateEmptyFull();
@@ -129,9 +153,12 @@ public:
     void reset();
 
 private:
-    unsigned int nBloomSize;
-    unsigned int nInsertions;
-    CBloomFilter b1, b2;
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    std::vector<uint64_t> data;
+    unsigned int nTweak;
+    int nHashFuncs;
 };
 
 
@@ -10,12 +10,16 @@
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
+#include "blockdownload.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
 #include "consensus/validation.h"
+#include "core_memusage.h"
 #include "deprecation.h"
 #include "init.h"
+#include "memusage.h"
 #include "merkleblock.h"
 #include "metrics.h"
 #include "net.h"
@@ -80,10 +84,18 @@ CTxMemPool mempool(::minRelayTxFee);
 struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    size_t nUsage;
 };
-map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev GUARDED_BY(cs_main);;
+map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);
+map<uint256, set<uint256> > mapOrphanTransactionsByPrev GUARDED_BY(cs_main);
+//! Orphan transactions by the time they expire
+set<pair<int64_t, uint256> > setOrphanTransactionsByExpiry GUARDED_BY(cs_main);
+//! Memory used by the orphan transactions, in total and by each peer's
+size_t nOrphanTransactionsUsage GUARDED_BY(cs_main) = 0;
+map<NodeId, size_t> mapOrphanTransactionsUsageByPeer GUARDED_BY(cs_main);
 void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+static void ClearOrphanTxs() EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
 /**
  * Returns true if there are nRequired or more blocks of minVersion or above
@@ -190,6 +202,7 @@ namespace {
         int64_t nTime;  //! Time of "getdata" request in microseconds.
         bool fValidatedHeaders;  //! Whether this block has validated headers at the time of request.
         int64_t nTimeDisconnect; //! The timeout for this block request (for disconnecting a slow peer)
+        std::unique_ptr<PartiallyDownloadedBlock> partialBlock;  //! Optional, used for compact blocks.
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -199,6 +212,17 @@ namespace {
     /** Number of preferable block download peers. */
     int nPreferredDownload = 0;
 
+    /** Peers asked to announce new blocks with a "cmpctblock" right away, most recently chosen last. Protected by cs_main. */
+    list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
+    /**
+     * Blocks recently requested as MSG_FILTERED_BLOCK, prepared for filtering,
+     * most recently used last. Light clients ask for the same recent blocks, so
+     * these are read and parsed once rather than once per peer.
+     */
+    CCriticalSection cs_filterableBlocks;
+    list<std::shared_ptr<const CFilterableBlock> > lFilterableBlocks;
+
     /** Dirty block index entries. */
     set<CBlockIndex*> setDirtyBlockIndex;
 
@@ -251,8 +275,14 @@ struct CNodeState {
     list<QueuedBlock> vBlocksInFlight;
     int nBlocksInFlight;
     int nBlocksInFlightValidHeaders;
+    //! How fast this peer delivers the blocks we request, which sizes its share of the download.
+    CBlockDownloadRate downloadRate;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Whether this peer understands our version of compact blocks, so that we can request them.
+    bool fProvidesHeaderAndIDs;
+    //! Whether this peer wants new blocks announced to it with a "cmpctblock" instead of an "inv".
+    bool fPreferHeaderAndIDs;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -266,6 +296,8 @@ struct CNodeState {
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
         fPreferredDownload = false;
+        fProvidesHeaderAndIDs = false;
+        fPreferHeaderAndIDs = false;
     }
 };
 
@@ -324,13 +356,18 @@ void FinalizeNode(NodeId nodeid) {
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
 
     mapNodeState.erase(nodeid);
 }
 
+} // anon namespace
+
 // Requires cs_main.
-// Returns a bool indicating whether we requested this block.
-bool MarkBlockAsReceived(const uint256& hash) {
+// Returns a bool indicating whether we requested this block. If nodeidFrom
+// delivered it and is the peer we requested it from, its delivery rate is updated.
+// Not in the anonymous namespace, as the block download tests drive it.
+bool MarkBlockAsReceived(const uint256& hash, NodeId nodeidFrom = -1, int64_t nNow = GetTimeMicros()) {
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState *state = State(itInFlight->second.first);
@@ -338,6 +375,10 @@ bool MarkBlockAsReceived(const uint256& hash) {
         state->nBlocksInFlightValidHeaders -= itInFlight->second.second->fValidatedHeaders;
         state->vBlocksInFlight.erase(itInFlight->second.second);
         state->nBlocksInFlight--;
+        if (itInFlight->second.first == nodeidFrom)
+            state->downloadRate.BlockDelivered(nNow, state->nBlocksInFlight);
+        else
+            state->downloadRate.BlockCancelled(state->nBlocksInFlight);
         state->nStallingSince = 0;
         mapBlocksInFlight.erase(itInFlight);
         return true;
@@ -345,21 +386,72 @@ bool MarkBlockAsReceived(const uint256& hash) {
     return false;
 }
 
+namespace {
+
 // Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL) {
+// Returns false if the block was already in flight from the same peer, in which case
+// nothing changes. If pit is non-NULL, *pit is set to the block's entry in either case.
+bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL,
+                         list<QueuedBlock>::iterator* pit = NULL, int64_t nNow = GetTimeMicros()) {
     CNodeState *state = State(nodeid);
     assert(state != NULL);
 
+    // Short-circuit most stuff in case it is from the same node
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == nodeid) {
+        if (pit)
+            *pit = itInFlight->second.second;
+        return false;
+    }
+
     // Make sure it's not listed somewhere already.
-    MarkBlockAsReceived(hash);
+    MarkBlockAsReceived(hash, -1, nNow);
 
-    int64_t nNow = GetTimeMicros();
     QueuedBlock newentry = {hash, pindex, nNow, pindex != NULL, GetBlockTimeout(nNow, nQueuedValidatedHeaders, consensusParams)};
     nQueuedValidatedHeaders += newentry.fValidatedHeaders;
-    list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
-    state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += newentry.fValidatedHeaders;
+    list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), std::move(newentry));
+    state->downloadRate.BlockRequested(nNow, state->nBlocksInFlight);
+    state->nBlocksInFlight++;
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
+    if (pit)
+        *pit = it;
+    return true;
+}
+
+// Requires cs_main.
+// Whether we are close enough to the tip to fetch announced blocks directly.
+bool CanDirectFetch(const Consensus::Params &consensusParams)
+{
+    return chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - consensusParams.nPowTargetSpacing * 20;
+}
+
+// Requires cs_main.
+// Ask a peer which just gave us a new tip to announce its next blocks as
+// compact blocks, replacing the peer which did so longest ago.
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(CNode* pfrom)
+{
+    CNodeState* nodestate = State(pfrom->GetId());
+    if (!nodestate->fProvidesHeaderAndIDs)
+        return;
+    BOOST_FOREACH(NodeId nodeid, lNodesAnnouncingHeaderAndIDs) {
+        if (nodeid == pfrom->GetId())
+            return;
+    }
+
+    if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_CMPCTBLOCK_ANNOUNCERS) {
+        NodeId nodeidOldest = lNodesAnnouncingHeaderAndIDs.front();
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes) {
+            if (pnode->GetId() == nodeidOldest) {
+                pnode->PushMessage("sendcmpct", false, CMPCTBLOCKS_VERSION);
+                break;
+            }
+        }
+    }
+    pfrom->PushMessage("sendcmpct", true, CMPCTBLOCKS_VERSION);
+    lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
 }
 
 /** Check whether the last unknown block a peer advertized is not yet known. */
@@ -377,7 +469,9 @@ void ProcessBlockAvailability(NodeId nodeid) {
     }
 }
 
-/** Update tracking information about which blocks a peer is assumed to have. */
+} // anon namespace
+
+/** Update tracking information about which blocks a peer is assumed to have. Not in the anonymous namespace, as the block download tests drive it. */
 void UpdateBlockAvailability(NodeId nodeid, const uint256 &hash) {
     CNodeState *state = State(nodeid);
     assert(state != NULL);
@@ -395,6 +489,8 @@ void UpdateBlockAvailability(NodeId nodeid, const uint256 &hash) {
     }
 }
 
+namespace {
+
 /** Find the last common ancestor two blocks have.
  *  Both pa and pb must be non-NULL. */
 CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
@@ -415,8 +511,9 @@ CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
 }
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
- *  at most count entries. */
-void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller) {
+ *  at most count entries. The first block in flight is added as well when the peer it was requested
+ *  from is stalling and this one is faster. */
+void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller, int64_t nNow) {
     if (count == 0)
         return;
 
@@ -493,6 +590,18 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
                 waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                // It holds back the download window, so don't wait for a stalling
+                // peer to time out if this one can deliver it sooner.
+                CNodeState *stateWaitingFor = State(waitingfor);
+                if (waitingfor != nodeid && stateWaitingFor->downloadRate.IsStalling(nNow) &&
+                    state->downloadRate.IsFasterThan(stateWaitingFor->downloadRate)) {
+                    LogPrint("net", "Block %s (%d) is held up by peer=%d, re-requesting it from peer=%d\n",
+                        pindex->GetBlockHash().ToString(), pindex->nHeight, waitingfor, nodeid);
+                    vBlocks.push_back(pindex);
+                    if (vBlocks.size() == count) {
+                        return;
+                    }
+                }
             }
         }
     }
@@ -500,6 +609,34 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
 
 } // anon namespace
 
+// Requires cs_main.
+// Request the next blocks to download from a peer and mark them in flight,
+// unless its window is full or it is overdue with a block already. Used by
+// SendMessages, and by the block download tests.
+void RequestNextBlocks(NodeId nodeid, const Consensus::Params& consensusParams, int64_t nNow, std::vector<CBlockIndex*>& vToDownload)
+{
+    CNodeState *state = State(nodeid);
+    assert(state != NULL);
+
+    // The number of blocks requested at a time follows the peer's delivery
+    // rate, and a peer which is overdue gets no more until it catches up.
+    int nBlockWindow = state->downloadRate.GetWindow();
+    if (state->nBlocksInFlight >= nBlockWindow || state->downloadRate.IsStalling(nNow))
+        return;
+
+    NodeId staller = -1;
+    FindNextBlocksToDownload(nodeid, nBlockWindow - state->nBlocksInFlight, vToDownload, staller, nNow);
+    BOOST_FOREACH(CBlockIndex *pindex, vToDownload) {
+        MarkBlockAsInFlight(nodeid, pindex->GetBlockHash(), consensusParams, pindex, NULL, nNow);
+    }
+    if (state->nBlocksInFlight == 0 && staller != -1) {
+        if (State(staller)->nStallingSince == 0) {
+            State(staller)->nStallingSince = nNow;
+            LogPrint("net", "Stall started peer=%d\n", staller);
+        }
+    }
+}
+
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     LOCK(cs_main);
     CNodeState *state = State(nodeid);
@@ -512,9 +649,45 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.dBlockRate = state->downloadRate.GetRate();
+    stats.nBlockWindow = state->downloadRate.GetWindow();
     return true;
 }
 
+namespace {
+
+// Parents before their children, then by fee rate, highest first: the
+// order in which a miner would pick up transactions not depending on others.
+struct CompareInvMempoolOrder
+{
+    bool operator()(CTxMemPool::txiter a, CTxMemPool::txiter b) const
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CompareTxMemPoolEntryByScore()(*a, *b);
+    }
+};
+
+// Leaves out the transactions which have left the mempool, and sorts the
+// rest in the order to announce them.
+void SortTxInventory(std::vector<uint256>& vHashes)
+{
+    LOCK(mempool.cs);
+    std::vector<CTxMemPool::txiter> vEntries;
+    vEntries.reserve(vHashes.size());
+    BOOST_FOREACH(const uint256& hash, vHashes) {
+        CTxMemPool::txiter it = mempool.mapTx.find(hash);
+        if (it != mempool.mapTx.end())
+            vEntries.push_back(it);
+    }
+    std::sort(vEntries.begin(), vEntries.end(), CompareInvMempoolOrder());
+    vHashes.clear();
+    BOOST_FOREACH(CTxMemPool::txiter it, vEntries)
+        vHashes.push_back(it->GetTx().GetHash());
+}
+
+} // anon namespace
+
 void RegisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.GetHeight.connect(&GetHeight);
@@ -522,6 +695,7 @@ void RegisterNodeSignals(CNodeSignals& nodeSignals)
     nodeSignals.SendMessages.connect(&SendMessages);
     nodeSignals.InitializeNode.connect(&InitializeNode);
     nodeSignals.FinalizeNode.connect(&FinalizeNode);
+    nodeSignals.SortTxInventory.connect(&SortTxInventory);
 }
 
 void UnregisterNodeSignals(CNodeSignals& nodeSignals)
@@ -531,6 +705,7 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals)
     nodeSignals.SendMessages.disconnect(&SendMessages);
     nodeSignals.InitializeNode.disconnect(&InitializeNode);
     nodeSignals.FinalizeNode.disconnect(&FinalizeNode);
+    nodeSignals.SortTxInventory.disconnect(&SortTxInventory);
 }
 
 CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& locator)
@@ -567,8 +742,7 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(c
     // large transaction with a missing parent then we assume
     // it will rebroadcast it later, after the parent transaction(s)
     // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
+    // The pool as a whole is bounded by -maxorphantx and -maxorphanpool.
     unsigned int sz = tx.GetSerializeSize(SER_NETWORK, tx.nVersion);
     if (sz > 5000)
     {
@@ -576,13 +750,36 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(c
         return false;
     }
 
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
+    // The transaction itself, and its entries in the maps and indexes
+    size_t nUsage = RecursiveDynamicUsage(tx) +
+        memusage::MallocUsage(sizeof(memusage::stl_tree_node<std::pair<const uint256, COrphanTx> >)) +
+        memusage::MallocUsage(sizeof(memusage::stl_tree_node<std::pair<int64_t, uint256> >)) +
+        memusage::MallocUsage(sizeof(memusage::stl_tree_node<uint256>)) * tx.vin.size();
+
+    // Don't let a single peer take up more than its share of the pool
+    size_t nMaxPeerUsage = GetArg("-maxorphanpool", DEFAULT_MAX_ORPHAN_POOL_SIZE) * 1000 / ORPHAN_POOL_PEER_SHARE;
+    size_t& nPeerUsage = mapOrphanTransactionsUsageByPeer[peer];
+    if (nPeerUsage + nUsage > nMaxPeerUsage)
+    {
+        LogPrint("mempool", "ignoring orphan tx %s, peer=%d is over its share of the orphan pool\n", hash.ToString(), peer);
+        if (nPeerUsage == 0)
+            mapOrphanTransactionsUsageByPeer.erase(peer);
+        return false;
+    }
+    nPeerUsage += nUsage;
+    nOrphanTransactionsUsage += nUsage;
+
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.tx = tx;
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nUsage = nUsage;
+    setOrphanTransactionsByExpiry.insert(make_pair(orphan.nTimeExpire, hash));
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
         mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
-             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u usage %u)\n", hash.ToString(),
+             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size(), nOrphanTransactionsUsage);
     return true;
 }
 
@@ -600,11 +797,31 @@ void static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+    setOrphanTransactionsByExpiry.erase(make_pair(it->second.nTimeExpire, hash));
+    nOrphanTransactionsUsage -= it->second.nUsage;
+    map<NodeId, size_t>::iterator itPeer = mapOrphanTransactionsUsageByPeer.find(it->second.fromPeer);
+    assert(itPeer != mapOrphanTransactionsUsageByPeer.end() && itPeer->second >= it->second.nUsage);
+    itPeer->second -= it->second.nUsage;
+    if (itPeer->second == 0)
+        mapOrphanTransactionsUsageByPeer.erase(itPeer);
     mapOrphanTransactions.erase(it);
 }
 
+static void ClearOrphanTxs()
+{
+    mapOrphanTransactions.clear();
+    mapOrphanTransactionsByPrev.clear();
+    setOrphanTransactionsByExpiry.clear();
+    nOrphanTransactionsUsage = 0;
+    mapOrphanTransactionsUsageByPeer.clear();
+}
+
 void EraseOrphansFor(NodeId peer)
 {
+    // Most peers don't have any orphans
+    if (!mapOrphanTransactionsUsageByPeer.count(peer))
+        return;
+
     int nErased = 0;
     map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
     while (iter != mapOrphanTransactions.end())
@@ -620,10 +837,22 @@ void EraseOrphansFor(NodeId peer)
 }
 
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxUsage) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
+    // Expired orphans go first...
+    int64_t nNow = GetTime();
+    unsigned int nExpired = 0;
+    while (!setOrphanTransactionsByExpiry.empty() && setOrphanTransactionsByExpiry.begin()->first <= nNow)
+    {
+        EraseOrphanTx(setOrphanTransactionsByExpiry.begin()->second);
+        ++nExpired;
+    }
+    if (nExpired > 0)
+        LogPrint("mempool", "Erased %u expired orphan tx\n", nExpired);
+
+    // ...then random ones, until the pool fits
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTransactionsUsage > nMaxUsage)
     {
         // Evict a random orphan:
         uint256 randomhash = GetRandHash();
@@ -1052,8 +1281,75 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
+/** Expire old transactions and trim the pool to -maxmempool. */
+static void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age)
+{
+    int expired = pool.Expire(GetTime() - age);
+    if (expired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
+
+    pool.TrimToSize(limit);
+}
+
+bool CMempoolPrecheck::ScriptsChecked(const CTransaction& tx, const CCoinsViewCache& view) const
+{
+    if (vSpentOutputs.size() != tx.vin.size())
+        return false;
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        if (!(view.GetOutputFor(tx.vin[i]) == vSpentOutputs[i]))
+            return false;
+    }
+    return true;
+}
+
+bool PrecheckTransaction(const CTransaction& tx, CValidationState& state, CMempoolPrecheck& precheck)
+{
+    auto verifier = libzcash::ProofVerifier::Strict();
+    if (!CheckTransaction(tx, state, verifier))
+        return false;
+    precheck.fChecked = true;
+
+    if (tx.IsCoinBase() || tx.vin.empty())
+        return true;
+
+    // Take a snapshot of the coins it spends, from the chain or the mempool
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+    {
+        LOCK2(cs_main, mempool.cs);
+        CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+        view.SetBackend(viewMemPool);
+        bool fHaveInputs = view.HaveInputs(tx);
+        view.SetBackend(dummy);
+        if (!fHaveInputs)
+            return true;
+    }
+
+    // Check the scripts against it, with the same flags as AcceptToMemoryPool.
+    // Failures are left for AcceptToMemoryPool to report.
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        const CCoins* coins = view.AccessCoins(tx.vin[i].prevout.hash);
+        assert(coins);
+        CScriptCheck check(*coins, tx, i, STANDARD_SCRIPT_VERIFY_FLAGS, true);
+        CScriptCheck checkMandatory(*coins, tx, i, MANDATORY_SCRIPT_VERIFY_FLAGS, true);
+        if (!check() || !checkMandatory())
+            return true;
+    }
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        precheck.vSpentOutputs.push_back(view.GetOutputFor(txin));
+    return true;
+}
+
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee)
+                        bool* pfMissingInputs, bool fRejectAbsurdFee, const CMempoolPrecheck* pPrecheck, bool fOverrideMempoolLimit)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(),
+                                      fRejectAbsurdFee, pPrecheck, fOverrideMempoolLimit);
+}
+
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectAbsurdFee,
+                                const CMempoolPrecheck* pPrecheck, bool fOverrideMempoolLimit)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1070,9 +1366,14 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         }
     }
 
-    auto verifier = libzcash::ProofVerifier::Strict();
-    if (!CheckTransaction(tx, state, verifier))
-        return error("AcceptToMemoryPool: CheckTransaction failed");
+    if (pPrecheck && pPrecheck->fChecked) {
+        if (!CheckTransactionWithoutProofVerification(tx, state))
+            return error("AcceptToMemoryPool: CheckTransaction failed");
+    } else {
+        auto verifier = libzcash::ProofVerifier::Strict();
+        if (!CheckTransaction(tx, state, verifier))
+            return error("AcceptToMemoryPool: CheckTransaction failed");
+    }
 
     // Coinbase is only valid in a block, not as a loose transaction
     if (tx.IsCoinBase())
@@ -1184,7 +1485,8 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         CAmount nFees = nValueIn-nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx));
+        // The proofs were verified strictly above, or by PrecheckTransaction()
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime, dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx), true);
         unsigned int nSize = entry.GetTxSize();
 
         // Accept a tx if it contains joinsplits and has at least the default fee specified by z_sendmany.
@@ -1199,6 +1501,15 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                                 REJECT_INSUFFICIENTFEE, "insufficient fee");
         }
 
+        // After evictions, packages paying less than the evicted ones are kept out
+        // until the rolling minimum fee has decayed again.
+        CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+        if (mempoolRejectFee > 0 && nFees < mempoolRejectFee) {
+            return state.DoS(0, error("AcceptToMemoryPool: mempool min fee not met %s, %d < %d",
+                                      hash.ToString(), nFees, mempoolRejectFee),
+                             REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+        }
+
         // Require that free transactions have sufficient priority to be mined in the next block.
         if (GetBoolArg("-relaypriority", false) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
             return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
@@ -1233,9 +1544,27 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                          hash.ToString(),
                          nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
 
+        // Calculate in-mempool ancestors, up to a limit. Keeping the package
+        // statistics up to date costs time in the number of ancestors and
+        // descendants, so long chains of unconfirmed transactions are refused.
+        CTxMemPool::setEntries setAncestors;
+        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
+        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
+        std::string errString;
+        if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
+            return state.DoS(0, error("AcceptToMemoryPool: %s %s", hash.ToString(), errString),
+                             REJECT_NONSTANDARD, "too-long-mempool-chain");
+        }
+
+        // Scripts which PrecheckTransaction() found valid needn't be checked
+        // again, as long as they still spend the same outputs.
+        bool fScriptChecks = !(pPrecheck && pPrecheck->ScriptsChecked(tx, view));
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!ContextualCheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, Params().GetConsensus()))
+        if (!ContextualCheckInputs(tx, state, view, fScriptChecks, STANDARD_SCRIPT_VERIFY_FLAGS, true, Params().GetConsensus()))
         {
             return error("AcceptToMemoryPool: ConnectInputs failed %s", hash.ToString());
         }
@@ -1249,13 +1578,20 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!ContextualCheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, Params().GetConsensus()))
+        if (fScriptChecks && !ContextualCheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, Params().GetConsensus()))
         {
             return error("AcceptToMemoryPool: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
 
         // Store transaction in memory
-        pool.addUnchecked(hash, entry, !IsInitialBlockDownload());
+        pool.addUnchecked(hash, entry, setAncestors, !IsInitialBlockDownload());
+
+        // Trim the mempool, which may evict the transaction itself
+        if (!fOverrideMempoolLimit) {
+            LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+            if (!pool.exists(hash))
+                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+        }
     }
 
     SyncWithWallets(tx, NULL);
@@ -1263,6 +1599,123 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return true;
 }
 
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMicros();
+
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    std::vector<CTxMemPoolEntry> vEntriesCopy;
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+        vEntriesCopy.reserve(mempool.mapTx.size());
+        // Oldest first, so that parents are re-admitted before their children
+        CTxMemPool::indexed_transaction_set::index<entry_time>::type::iterator it = mempool.mapTx.get<entry_time>().begin();
+        for (; it != mempool.mapTx.get<entry_time>().end(); ++it)
+            vEntriesCopy.push_back(*it);
+    }
+
+    int64_t nMid = GetTimeMicros();
+
+    try {
+        boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+        FILE* filestr = fopen(pathTmp.string().c_str(), "wb");
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+        if (file.IsNull())
+            return error("%s: Failed to open file %s", __func__, pathTmp.string());
+
+        // The deltas come first, so that they are in place when the
+        // transactions they apply to are re-admitted
+        file << MEMPOOL_DUMP_VERSION;
+        file << mapDeltas;
+        file << (uint64_t)vEntriesCopy.size();
+        BOOST_FOREACH(const CTxMemPoolEntry& entry, vEntriesCopy) {
+            file << entry.GetTx();
+            file << entry.GetTime();
+        }
+        FileCommit(file.Get());
+        file.fclose();
+        if (!RenameOver(pathTmp, GetDataDir() / "mempool.dat"))
+            return error("%s: Rename-into-place failed", __func__);
+    } catch (const std::exception& e) {
+        return error("%s: Serialize or I/O error - %s", __func__, e.what());
+    }
+
+    int64_t nLast = GetTimeMicros();
+    LogPrintf("Dumped %u mempool transactions: %.2fms to copy, %.2fms to write\n",
+              vEntriesCopy.size(), (nMid - nStart) * 0.001, (nLast - nMid) * 0.001);
+    return true;
+}
+
+bool LoadMempool()
+{
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+    FILE* filestr = fopen(path.string().c_str(), "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("%s: Failed to open %s, continuing without it\n", __func__, path.string());
+        return false;
+    }
+
+    int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    int64_t nNow = GetTime();
+    unsigned int nAccepted = 0, nFailed = 0, nExpired = 0;
+
+    try {
+        uint64_t nVersion;
+        file >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("%s: unknown version %u of %s", __func__, nVersion, path.string());
+
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        file >> mapDeltas;
+        for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); ++it)
+            mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+
+        // Re-admit the transactions one at a time, so that cs_main is only held briefly
+        uint64_t nEntries;
+        file >> nEntries;
+        while (nEntries--) {
+            CTransaction tx;
+            int64_t nTime;
+            file >> tx >> nTime;
+
+            if (nTime + nExpiryTimeout <= nNow) {
+                nExpired++;
+                continue;
+            }
+
+            // Nothing on disk vouches for the proofs, as anyone able to write
+            // the file could put a transaction with bad ones in it. They are
+            // verified again here, before cs_main is taken, like the ones of
+            // transactions relayed to us.
+            CMempoolPrecheck precheck;
+            CValidationState state;
+            if (PrecheckTransaction(tx, state, precheck)) {
+                LOCK(cs_main);
+                if (AcceptToMemoryPoolWithTime(mempool, state, tx, true, NULL, nTime, false, &precheck))
+                    nAccepted++;
+                else
+                    nFailed++;
+            } else {
+                nFailed++;
+            }
+
+            if (ShutdownRequested())
+                return false;
+        }
+    } catch (const std::exception& e) {
+        LogPrintf("%s: Failed to deserialize %s: %s, continuing anyway\n", __func__, path.string(), e.what());
+        return false;
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %u succeeded, %u failed, %u expired\n",
+              nAccepted, nFailed, nExpired);
+    return true;
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1380,6 +1833,46 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
     return true;
 }
 
+bool ReadRawBlockFromDisk(CDataStream& ssBlock, const CDiskBlockPos& pos, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStart)
+{
+    // The block is preceded by the network magic and its size
+    const unsigned int nIndexHeaderSize = MESSAGE_START_SIZE + sizeof(unsigned int);
+    if (pos.nPos < nIndexHeaderSize)
+        return error("%s: invalid position %s", __func__, pos.ToString());
+    CDiskBlockPos posIndexHeader(pos.nFile, pos.nPos - nIndexHeaderSize);
+
+    CAutoFile filein(OpenBlockFile(posIndexHeader, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+
+    try {
+        CMessageHeader::MessageStartChars blockStart;
+        unsigned int nSize;
+        filein >> FLATDATA(blockStart) >> nSize;
+        if (memcmp(blockStart, messageStart, MESSAGE_START_SIZE) != 0)
+            return error("%s: block magic mismatch at %s", __func__, pos.ToString());
+        if (nSize > MAX_BLOCK_SIZE)
+            return error("%s: invalid block size %u at %s", __func__, nSize, pos.ToString());
+
+        // The disk and network serializations of a block are identical
+        ssBlock.resize(nSize);
+        filein.read(&ssBlock[0], nSize);
+
+        // The header was fully checked when the block was accepted; comparing
+        // its hash is enough to know that this is still the same block.
+        CBlockHeader header;
+        ssBlock >> header;
+        ssBlock.Rewind(::GetSerializeSize(header, SER_NETWORK, PROTOCOL_VERSION));
+        if (header.GetHash() != hashBlock)
+            return error("%s: block hash mismatch at %s", __func__, pos.ToString());
+    }
+    catch (const std::exception& e) {
+        return error("%s: I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+
+    return true;
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
 {
     if (!ReadBlockFromDisk(block, pindex->GetBlockPos()))
@@ -2042,7 +2535,8 @@ static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
-bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck)
+bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck,
+                  const std::set<uint256>* pProofsVerified)
 {
     const CChainParams& chainparams = Params();
     AssertLockHeld(cs_main);
@@ -2060,7 +2554,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     auto disabledVerifier = libzcash::ProofVerifier::Disabled();
 
     // Check it again to verify JoinSplit proofs, and in case a previous version let a bad block in
-    if (!CheckBlock(block, state, fExpensiveChecks ? verifier : disabledVerifier, !fJustCheck, !fJustCheck))
+    if (!CheckBlock(block, state, fExpensiveChecks ? verifier : disabledVerifier, !fJustCheck, !fJustCheck, pProofsVerified))
         return false;
 
     // verify that the view's current state corresponds to the previous block
@@ -2432,8 +2926,8 @@ bool static DisconnectTip(CValidationState &state) {
         // ignore validation errors in resurrected transactions
         list<CTransaction> removed;
         CValidationState stateDummy;
-        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
-            mempool.remove(tx, removed, true);
+        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, false, NULL, true))
+            mempool.remove(tx, removed, true, MemPoolRemovalReason::REORG);
     }
     if (anchorBeforeDisconnect != anchorAfterDisconnect) {
         // The anchor may not change between block disconnects,
@@ -2613,9 +3107,11 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
     const CBlockIndex *pindexFork = chainActive.FindFork(pindexMostWork);
 
     // Disconnect active blocks which are no longer in the best chain.
+    bool fBlocksDisconnected = false;
     while (chainActive.Tip() && chainActive.Tip() != pindexFork) {
         if (!DisconnectTip(state))
             return false;
+        fBlocksDisconnected = true;
     }
 
     // Build list of new blocks to connect.
@@ -2661,6 +3157,10 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
     }
     }
 
+    // Transactions returned from disconnected blocks were let in regardless of the size limit
+    if (fBlocksDisconnected)
+        LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+
     // Callbacks/notifications for a new best chain.
     if (fInvalidFound)
         CheckForkWarningConditionsOnNewFork(vpindexToConnect.back());
@@ -2709,10 +3209,29 @@ bool ActivateBestChain(CValidationState &state, CBlock *pblock) {
             // Don't relay blocks if pruning -- could cause a peer to try to download, resulting
             // in a stalled download if the block file is pruned before the request.
             if (nLocalServices & NODE_NETWORK) {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                // Peers which asked for it get the new tip as a compact block
+                // straight away, saving them a getdata round trip
+                std::unique_ptr<CBlockHeaderAndShortTxIDs> pcmpctblock;
+                if (pblock && pblock->GetHash() == hashNewTip)
+                    pcmpctblock.reset(new CBlockHeaderAndShortTxIDs(*pblock));
+                LOCK2(cs_main, cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes) {
+                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate)) {
+                        CNodeState *nodestate = State(pnode->GetId());
+                        if (pcmpctblock && nodestate && nodestate->fPreferHeaderAndIDs) {
+                            bool fNew;
+                            {
+                                LOCK(pnode->cs_inventory);
+                                fNew = !pnode->filterInventoryKnown.contains(hashNewTip);
+                                pnode->filterInventoryKnown.insert(hashNewTip);
+                            }
+                            if (fNew)
+                                pnode->PushMessage("cmpctblock", *pcmpctblock);
+                        } else {
+                            pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                        }
+                    }
+                }
             }
             // Notify external listeners about the new tip.
             GetMainSignals().UpdatedBlockTip(pindexNewTip);
@@ -2749,6 +3268,8 @@ bool InvalidateBlock(CValidationState& state, CBlockIndex *pindex) {
         }
     }
 
+    LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+
     // The resulting new best tip may not be in setBlockIndexCandidates anymore, so
     // add it again.
     BlockMap::iterator it = mapBlockIndex.begin();
@@ -3009,7 +3530,8 @@ bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool f
 
 bool CheckBlock(const CBlock& block, CValidationState& state,
                 libzcash::ProofVerifier& verifier,
-                bool fCheckPOW, bool fCheckMerkleRoot)
+                bool fCheckPOW, bool fCheckMerkleRoot,
+                const std::set<uint256>* pProofsVerified)
 {
     // These are checks that are independent of context.
 
@@ -3053,9 +3575,12 @@ bool CheckBlock(const CBlock& block, CValidationState& state,
                              REJECT_INVALID, "bad-cb-multiple");
 
     // Check transactions
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
-        if (!CheckTransaction(tx, state, verifier))
+    auto disabledVerifier = libzcash::ProofVerifier::Disabled();
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        bool fProofsVerified = pProofsVerified && !tx.vjoinsplit.empty() && pProofsVerified->count(tx.GetHash());
+        if (!CheckTransaction(tx, state, fProofsVerified ? disabledVerifier : verifier))
             return error("CheckBlock(): CheckTransaction failed");
+    }
 
     unsigned int nSigOps = 0;
     BOOST_FOREACH(const CTransaction& tx, block.vtx)
@@ -3292,7 +3817,7 @@ bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, bool
 
     {
         LOCK(cs_main);
-        bool fRequested = MarkBlockAsReceived(pblock->GetHash());
+        bool fRequested = MarkBlockAsReceived(pblock->GetHash(), pfrom ? pfrom->GetId() : -1);
         fRequested |= fForceProcessing;
         if (!checked) {
             return error("%s: CheckBlock FAILED", __func__);
@@ -3315,7 +3840,8 @@ bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, bool
     return true;
 }
 
-bool TestBlockValidity(CValidationState &state, const CBlock& block, CBlockIndex * const pindexPrev, bool fCheckPOW, bool fCheckMerkleRoot)
+bool TestBlockValidity(CValidationState &state, const CBlock& block, CBlockIndex * const pindexPrev, bool fCheckPOW, bool fCheckMerkleRoot,
+                       const std::set<uint256>* pProofsVerified)
 {
     AssertLockHeld(cs_main);
     assert(pindexPrev == chainActive.Tip());
@@ -3334,7 +3860,7 @@ bool TestBlockValidity(CValidationState &state, const CBlock& block, CBlockIndex
         return false;
     if (!ContextualCheckBlock(block, state, pindexPrev))
         return false;
-    if (!ConnectBlock(block, state, &indexDummy, viewNew, true))
+    if (!ConnectBlock(block, state, &indexDummy, viewNew, true, pProofsVerified))
         return false;
     assert(state.IsValid());
 
@@ -3746,8 +4272,7 @@ void UnloadBlockIndex()
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
     mempool.clear();
-    mapOrphanTransactions.clear();
-    mapOrphanTransactionsByPrev.clear();
+    ClearOrphanTxs();
     nSyncStarted = 0;
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
@@ -4213,122 +4738,193 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     return true;
 }
 
+static std::shared_ptr<const CFilterableBlock> FindFilterableBlock(const uint256& hash)
+{
+    LOCK(cs_filterableBlocks);
+    for (list<std::shared_ptr<const CFilterableBlock> >::iterator it = lFilterableBlocks.begin(); it != lFilterableBlocks.end(); it++) {
+        if ((*it)->block.GetHash() == hash) {
+            std::shared_ptr<const CFilterableBlock> pfblock = *it;
+            lFilterableBlocks.erase(it);
+            lFilterableBlocks.push_back(pfblock);
+            return pfblock;
+        }
+    }
+    return std::shared_ptr<const CFilterableBlock>();
+}
+
+static std::shared_ptr<const CFilterableBlock> AddFilterableBlock(const CBlock& block)
+{
+    std::shared_ptr<const CFilterableBlock> pfblock(new CFilterableBlock(block));
+    LOCK(cs_filterableBlocks);
+    lFilterableBlocks.push_back(pfblock);
+    if (lFilterableBlocks.size() > MAX_FILTERABLE_BLOCKS)
+        lFilterableBlocks.pop_front();
+    return pfblock;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
+    // A requested block is read from disk after cs_main has been released
+    CInv invBlock;
+    CDiskBlockPos posBlock;
+    uint256 hashContinueTip;
+    bool fSendCompact = false;
 
-    while (it != pfrom->vRecvGetData.end()) {
-        // Don't bother if send buffer is too full to respond anyway
-        if (pfrom->nSendSize >= SendBufferSize())
-            break;
+    {
+        LOCK(cs_main);
 
-        const CInv &inv = *it;
-        {
-            boost::this_thread::interruption_point();
-            it++;
+        while (it != pfrom->vRecvGetData.end()) {
+            // Don't bother if send buffer is too full to respond anyway
+            if (pfrom->nSendSize >= SendBufferSize())
+                break;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            const CInv &inv = *it;
             {
-                bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                boost::this_thread::interruption_point();
+                it++;
+
+                if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 {
-                    if (chainActive.Contains(mi->second)) {
-                        send = true;
-                    } else {
-                        static const int nOneMonth = 30 * 24 * 60 * 60;
-                        // To prevent fingerprinting attacks, only send blocks outside of the active
-                        // chain if they are valid, and no more than a month older (both in time, and in
-                        // best equivalent proof of work) than the best header chain we know about.
-                        send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
-                            (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
-                            (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, Params().GetConsensus()) < nOneMonth);
-                        if (!send) {
-                            LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+                    bool send = false;
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                    {
+                        if (chainActive.Contains(mi->second)) {
+                            send = true;
+                        } else {
+                            static const int nOneMonth = 30 * 24 * 60 * 60;
+                            // To prevent fingerprinting attacks, only send blocks outside of the active
+                            // chain if they are valid, and no more than a month older (both in time, and in
+                            // best equivalent proof of work) than the best header chain we know about.
+                            send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
+                                (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
+                                (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, Params().GetConsensus()) < nOneMonth);
+                            if (!send) {
+                                LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+                            }
                         }
                     }
+                    // Pruned nodes may have deleted the block, so check whether
+                    // it's available before trying to send.
+                    if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                    {
+                        invBlock = inv;
+                        posBlock = mi->second->GetBlockPos();
+                        // Older blocks are unlikely to be reconstructable from the peer's mempool
+                        fSendCompact = inv.type == MSG_CMPCT_BLOCK &&
+                            mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+                        if (inv.hash == pfrom->hashContinue)
+                            hashContinueTip = chainActive.Tip()->GetBlockHash();
+                    }
                 }
-                // Pruned nodes may have deleted the block, so check whether
-                // it's available before trying to send.
-                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                else if (inv.IsKnownType())
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
+                    // Send stream from relay memory
+                    bool pushed = false;
                     {
-                        LOCK(pfrom->cs_filter);
-                        if (pfrom->pfilter)
-                        {
-                            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
-                            pfrom->PushMessage("merkleblock", merkleBlock);
-                            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
-                            // This avoids hurting performance by pointlessly requiring a round-trip
-                            // Note that there is currently no way for a node to request any single transactions we didn't send here -
-                            // they must either disconnect and retry or request the full block.
-                            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
-                            // however we MUST always provide at least what the remote peer needs
-                            typedef std::pair<unsigned int, uint256> PairType;
-                            BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
-                                    pfrom->PushMessage("tx", block.vtx[pair.first]);
+                        LOCK(cs_mapRelay);
+                        map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                        if (mi != mapRelay.end()) {
+                            pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                            pushed = true;
                         }
-                        // else
-                            // no response
                     }
-
-                    // Trigger the peer node to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue)
-                    {
-                        // Bypass PushInventory, this must send even if redundant,
-                        // and we want it right after the last block so they don't
-                        // wait for other stuff first.
-                        vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
-                        pfrom->PushMessage("inv", vInv);
-                        pfrom->hashContinue.SetNull();
+                    if (!pushed && inv.type == MSG_TX) {
+                        CTransaction tx;
+                        if (mempool.lookup(inv.hash, tx)) {
+                            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                            ss.reserve(1000);
+                            ss << tx;
+                            pfrom->PushMessage("tx", ss);
+                            pushed = true;
+                        }
+                    }
+                    if (!pushed) {
+                        vNotFound.push_back(inv);
                     }
                 }
+
+                // Track requests for our stuff.
+                GetMainSignals().Inventory(inv.hash);
+
+                if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
+                    break;
             }
-            else if (inv.IsKnownType())
+        }
+    }
+
+    if (!posBlock.IsNull())
+    {
+        // Send block from disk. The block file may have been pruned since
+        // cs_main was released, in which case the request is dropped.
+        bool fRead;
+        CBlock block;
+        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+        std::shared_ptr<const CFilterableBlock> pfblock;
+        bool fSendRaw = !fSendCompact && (invBlock.type == MSG_BLOCK || invBlock.type == MSG_CMPCT_BLOCK);
+        if (invBlock.type == MSG_FILTERED_BLOCK)
+            pfblock = FindFilterableBlock(invBlock.hash);
+        if (fSendRaw) {
+            // Full blocks are sent as stored, without decoding and re-encoding them
+            fRead = ReadRawBlockFromDisk(ssBlock, posBlock, invBlock.hash, Params().MessageStart());
+        } else if (pfblock) {
+            fRead = true;
+        } else {
+            fRead = ReadBlockFromDisk(block, posBlock) && block.GetHash() == invBlock.hash;
+        }
+        if (!fRead) {
+            LogPrint("net", "%s: could not load block %s requested by peer=%d\n", __func__, invBlock.hash.ToString(), pfrom->GetId());
+        } else {
+            if (fSendRaw)
+                pfrom->PushMessage("block", ssBlock);
+            else if (fSendCompact)
+                pfrom->PushMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+            else // MSG_FILTERED_BLOCK)
             {
-                // Send stream from relay memory
-                bool pushed = false;
+                if (!pfblock)
+                    pfblock = AddFilterableBlock(block);
+                LOCK(pfrom->cs_filter);
+                if (pfrom->pfilter)
                 {
-                    LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                    if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                        pushed = true;
-                    }
-                }
-                if (!pushed && inv.type == MSG_TX) {
-                    CTransaction tx;
-                    if (mempool.lookup(inv.hash, tx)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << tx;
-                        pfrom->PushMessage("tx", ss);
-                        pushed = true;
+                    // The block's data elements and merkle tree are shared with the other peers filtering it
+                    CMerkleBlock merkleBlock(*pfblock, *pfrom->pfilter);
+                    pfrom->PushMessage("merkleblock", merkleBlock);
+                    // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
+                    // This avoids hurting performance by pointlessly requiring a round-trip
+                    // Note that there is currently no way for a node to request any single transactions we didn't send here -
+                    // they must either disconnect and retry or request the full block.
+                    // Thus, the protocol spec specified allows for us to provide duplicate txn here,
+                    // however we MUST always provide at least what the remote peer needs
+                    typedef std::pair<unsigned int, uint256> PairType;
+                    BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn) {
+                        bool fKnown;
+                        {
+                            LOCK(pfrom->cs_inventory);
+                            fKnown = pfrom->filterInventoryKnown.contains(pair.second);
+                        }
+                        if (!fKnown)
+                            pfrom->PushMessage("tx", pfblock->block.vtx[pair.first]);
                     }
                 }
-                if (!pushed) {
-                    vNotFound.push_back(inv);
-                }
+                // else
+                    // no response
             }
 
-            // Track requests for our stuff.
-            GetMainSignals().Inventory(inv.hash);
-
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
-                break;
+            // Trigger the peer node to send a getblocks request for the next batch of inventory
+            if (!hashContinueTip.IsNull())
+            {
+                // Bypass PushInventory, this must send even if redundant,
+                // and we want it right after the last block so they don't
+                // wait for other stuff first.
+                vector<CInv> vInv;
+                vInv.push_back(CInv(MSG_BLOCK, hashContinueTip));
+                pfrom->PushMessage("inv", vInv);
+                pfrom->hashContinue.SetNull();
+            }
         }
     }
 
@@ -4346,6 +4942,101 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+// Process a block received from a peer, in full or reconstructed from a
+// compact block. Must be called without cs_main held.
+void static ProcessBlockFromPeer(CNode* pfrom, CBlock& block, const string& strCommand)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+    pfrom->AddInventoryKnown(inv);
+
+    CValidationState state;
+    // Process all blocks from whitelisted peers, even if not requested,
+    // unless we're still syncing with the network.
+    // Such an unrequested block may still be processed, subject to the
+    // conditions in AcceptBlock().
+    bool forceProcessing = pfrom->fWhitelisted && !IsInitialBlockDownload();
+    ProcessNewBlock(state, pfrom, &block, forceProcessing, NULL);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+        if (nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), nDoS);
+        }
+    } else {
+        // The peer gave us a new tip, so it is a good source of future blocks
+        LOCK(cs_main);
+        if (!IsInitialBlockDownload() && chainActive.Tip()->GetBlockHash() == inv.hash)
+            MaybeSetPeerAsAnnouncingHeaderAndIDs(pfrom);
+    }
+}
+
+/** Queue the orphan transactions spending outputs of hashParent to be reconsidered for pfrom. */
+void static QueueOrphanWork(CNode* pfrom, const uint256& hashParent) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(hashParent);
+    if (itByPrev != mapOrphanTransactionsByPrev.end())
+        pfrom->setOrphanWork.insert(itByPrev->second.begin(), itByPrev->second.end());
+}
+
+/**
+ * Reconsider up to ORPHAN_TX_BATCH_SIZE of the orphan transactions queued for
+ * pfrom, so that a long chain of orphans doesn't hold cs_main for long. The
+ * children of accepted orphans are queued in turn.
+ */
+void static ProcessOrphanWork(CNode* pfrom)
+{
+    LOCK(cs_main);
+    set<NodeId> setMisbehaving;
+    unsigned int nProcessed = 0;
+    while (!pfrom->setOrphanWork.empty() && nProcessed < ORPHAN_TX_BATCH_SIZE)
+    {
+        const uint256 orphanHash = *pfrom->setOrphanWork.begin();
+        pfrom->setOrphanWork.erase(pfrom->setOrphanWork.begin());
+        map<uint256, COrphanTx>::iterator itOrphan = mapOrphanTransactions.find(orphanHash);
+        if (itOrphan == mapOrphanTransactions.end())
+            continue;
+        nProcessed++;
+
+        const CTransaction orphanTx = itOrphan->second.tx;
+        NodeId fromPeer = itOrphan->second.fromPeer;
+        bool fMissingInputs2 = false;
+        // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+        // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+        // anyone relaying LegitTxX banned)
+        CValidationState stateDummy;
+
+        if (setMisbehaving.count(fromPeer))
+            continue;
+        if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
+        {
+            LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+            RelayTransaction(orphanTx);
+            EraseOrphanTx(orphanHash);
+            QueueOrphanWork(pfrom, orphanHash);
+        }
+        else if (!fMissingInputs2)
+        {
+            int nDos = 0;
+            if (stateDummy.IsInvalid(nDos) && nDos > 0)
+            {
+                // Punish peer that gave us an invalid orphan tx
+                Misbehaving(fromPeer, nDos);
+                setMisbehaving.insert(fromPeer);
+                LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+            }
+            // Has inputs but not accepted to mempool
+            // Probably non-standard or insufficient fee/priority
+            LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+            EraseOrphanTx(orphanHash);
+            assert(recentRejects);
+            recentRejects->insert(orphanHash);
+        }
+        mempool.check(pcoinsTip);
+    }
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     const CChainParams& chainparams = Params();
@@ -4499,6 +5190,25 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        // Tell the peer we can use compact blocks, without asking it to
+        // announce new blocks with them until it has proven useful. Peers
+        // which don't know the message ignore it, and we only use compact
+        // blocks with those which send it to us in turn.
+        pfrom->PushMessage("sendcmpct", false, CMPCTBLOCKS_VERSION);
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounceUsingCmpctBlock = false;
+        uint64_t nCmpctBlockVersion = 0;
+        vRecv >> fAnnounceUsingCmpctBlock >> nCmpctBlockVersion;
+        if (nCmpctBlockVersion == CMPCTBLOCKS_VERSION) {
+            LOCK(cs_main);
+            State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
+            State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCmpctBlock;
+        }
     }
 
 
@@ -4609,9 +5319,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     // not a direct successor.
                     pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
                     CNodeState *nodestate = State(pfrom->GetId());
-                    if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - chainparams.GetConsensus().nPowTargetSpacing * 20 &&
-                        nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-                        vToFetch.push_back(inv);
+                    if (CanDirectFetch(chainparams.GetConsensus()) &&
+                        nodestate->nBlocksInFlight < nodestate->downloadRate.GetWindow()) {
+                        // Near the tip, most of the block's transactions are
+                        // likely to be in our mempool already
+                        if (nodestate->fProvidesHeaderAndIDs)
+                            vToFetch.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                        else
+                            vToFetch.push_back(inv);
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
                         MarkBlockAsInFlight(pfrom->GetId(), inv.hash, chainparams.GetConsensus());
@@ -4735,86 +5450,46 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
     else if (strCommand == "tx")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
         vRecv >> tx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
+        // Verify the JoinSplit proofs and scripts before taking cs_main, so
+        // that other message handler threads can make progress meanwhile
+        bool fAlreadyHave;
+        {
+            LOCK(cs_main);
+            fAlreadyHave = AlreadyHave(inv);
+        }
+        CValidationState state;
+        CMempoolPrecheck precheck;
+        bool fCheckFailed = false;
+        if (!fAlreadyHave)
+            fCheckFailed = !PrecheckTransaction(tx, state, precheck);
+
         LOCK(cs_main);
 
         bool fMissingInputs = false;
-        CValidationState state;
 
         pfrom->setAskFor.erase(inv.hash);
         mapAlreadyAskedFor.erase(inv);
 
-        if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
+        if (!fCheckFailed && !AlreadyHave(inv) &&
+            AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs, false, &precheck))
         {
             mempool.check(pcoinsTip);
             RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
 
             LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u)\n",
                 pfrom->id, pfrom->cleanSubVer,
                 tx.GetHash().ToString(),
                 mempool.mapTx.size());
 
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        assert(recentRejects);
-                        recentRejects->insert(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+            // Reconsider any orphan transactions that depended on this one,
+            // a batch at a time (see ProcessOrphanWork)
+            QueueOrphanWork(pfrom, inv.hash);
         }
         // TODO: currently, prohibit joinsplits from entering mapOrphans
         else if (fMissingInputs && tx.vjoinsplit.size() == 0)
@@ -4823,7 +5498,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
             unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+            size_t nMaxOrphanUsage = (size_t)std::max((int64_t)0, GetArg("-maxorphanpool", DEFAULT_MAX_ORPHAN_POOL_SIZE)) * 1000;
+            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx, nMaxOrphanUsage);
             if (nEvicted > 0)
                 LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
         } else {
@@ -4917,33 +5593,224 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CheckBlockIndex();
     }
 
-    else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
     {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
         CBlock block;
-        vRecv >> block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+
+            if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+                // Doesn't connect (or is genesis), instead of DoSing in AcceptBlockHeader, request deeper headers
+                if (!IsInitialBlockDownload())
+                    pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+                return true;
+            }
 
-        CInv inv(MSG_BLOCK, block.GetHash());
-        LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
+            CBlockIndex *pindex = NULL;
+            CValidationState state;
+            if (!AcceptBlockHeader(cmpctblock.header, state, &pindex)) {
+                int nDoS;
+                if (state.IsInvalid(nDoS)) {
+                    if (nDoS > 0)
+                        Misbehaving(pfrom->GetId(), nDoS);
+                    LogPrintf("Peer %d sent us invalid header via cmpctblock\n", pfrom->id);
+                    return true;
+                }
+            }
+            // If AcceptBlockHeader returned true, it set pindex
+            assert(pindex);
+            UpdateBlockAvailability(pfrom->GetId(), pindex->GetBlockHash());
 
-        pfrom->AddInventoryKnown(inv);
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator blockInFlightIt = mapBlocksInFlight.find(pindex->GetBlockHash());
+            bool fAlreadyInFlight = blockInFlightIt != mapBlocksInFlight.end();
 
-        CValidationState state;
-        // Process all blocks from whitelisted peers, even if not requested,
-        // unless we're still syncing with the network.
-        // Such an unrequested block may still be processed, subject to the
-        // conditions in AcceptBlock().
-        bool forceProcessing = pfrom->fWhitelisted && !IsInitialBlockDownload();
-        ProcessNewBlock(state, pfrom, &block, forceProcessing, NULL);
-        int nDoS;
-        if (state.IsInvalid(nDoS)) {
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0) {
+            if (pindex->nStatus & BLOCK_HAVE_DATA) // Nothing to do here
+                return true;
+
+            if (pindex->nChainWork <= chainActive.Tip()->nChainWork || // We know something better
+                    pindex->nTx != 0) { // We had this block at some point, but pruned it
+                if (fAlreadyInFlight) {
+                    // We requested this block for some reason, but our mempool will probably be useless
+                    // so we just grab the block via normal getdata
+                    vector<CInv> vInv(1, CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                    pfrom->PushMessage("getdata", vInv);
+                }
+                return true;
+            }
+
+            // If we're not close to tip yet, give up and let parallel block fetch work its magic
+            if (!fAlreadyInFlight && !CanDirectFetch(chainparams.GetConsensus()))
+                return true;
+
+            CNodeState *nodestate = State(pfrom->GetId());
+
+            // Only reconstruct blocks which would become our tip soon, as the
+            // mempool is of little use for anything further ahead; those are
+            // left to the normal block download, now that the header is known.
+            if (pindex->nHeight > chainActive.Height() + 2) {
+                if (fAlreadyInFlight) {
+                    vector<CInv> vInv(1, CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                    pfrom->PushMessage("getdata", vInv);
+                }
+                return true;
+            }
+
+            if (fAlreadyInFlight ? blockInFlightIt->second.first != pfrom->GetId()
+                                 : nodestate->nBlocksInFlight >= nodestate->downloadRate.GetWindow())
+                return true;
+
+            list<QueuedBlock>::iterator queuedBlockIt;
+            if (!MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), chainparams.GetConsensus(), pindex, &queuedBlockIt) &&
+                queuedBlockIt->partialBlock) {
+                // The block was already in flight using compact blocks from the same peer
+                LogPrint("net", "Peer sent us compact block we were already syncing!\n");
+                return true;
+            }
+            queuedBlockIt->partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+
+            PartiallyDownloadedBlock& partialBlock = *queuedBlockIt->partialBlock;
+            ReadStatus status = partialBlock.InitData(cmpctblock);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(pindex->GetBlockHash()); // Reset in-flight state in case of whitelist
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us invalid compact block\n", pfrom->id);
+                return true;
+            } else if (status == READ_STATUS_FAILED) {
+                // Duplicate txindexes, the block is now in-flight, so just request it
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                pfrom->PushMessage("getdata", vInv);
+                return true;
+            }
+
+            BlockTransactionsRequest req;
+            for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                if (!partialBlock.IsTxAvailable(i))
+                    req.indexes.push_back(i);
+            }
+            if (req.indexes.empty()) {
+                // Everything came from the prefilled transactions and our mempool
+                status = partialBlock.FillBlock(block, vector<CTransaction>());
+                if (status == READ_STATUS_OK) {
+                    fBlockReconstructed = true;
+                } else {
+                    vector<CInv> vInv(1, CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                    pfrom->PushMessage("getdata", vInv);
+                }
+            } else {
+                req.blockhash = pindex->GetBlockHash();
+                pfrom->PushMessage("getblocktxn", req);
+            }
+        }
+
+        if (fBlockReconstructed)
+            ProcessBlockFromPeer(pfrom, block, strCommand);
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        CDiskBlockPos posBlock;
+        {
+            LOCK(cs_main);
+
+            BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
+            if (it == mapBlockIndex.end() || !(it->second->nStatus & BLOCK_HAVE_DATA)) {
+                LogPrint("net", "Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+                return true;
+            }
+
+            if (it->second->nHeight >= chainActive.Height() - MAX_BLOCKTXN_DEPTH)
+                posBlock = it->second->GetBlockPos();
+        }
+
+        if (posBlock.IsNull()) {
+            // If an older block is requested (should never happen in practice,
+            // but can happen in tests) send a block response instead of a
+            // blocktxn response. Sending a full block response instead of a
+            // small blocktxn response is preferable in the case where a peer
+            // might maliciously send lots of getblocktxn requests to trigger
+            // expensive disk reads, because it will require the peer to
+            // actually receive all the data read from disk over the network.
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        // As for getdata, the block file may have been pruned meanwhile
+        CBlock block;
+        if (!ReadBlockFromDisk(block, posBlock) || block.GetHash() != req.blockhash) {
+            LogPrint("net", "%s: could not load block %s requested by peer=%d\n", __func__, req.blockhash.ToString(), pfrom->GetId());
+            return true;
+        }
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
                 LOCK(cs_main);
-                Misbehaving(pfrom->GetId(), nDoS);
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us a getblocktxn with out-of-bounds tx indices\n", pfrom->id);
+                return true;
             }
+            resp.txn[i] = block.vtx[req.indexes[i]];
         }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
 
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator it = mapBlocksInFlight.find(resp.blockhash);
+            if (it == mapBlocksInFlight.end() || !it->second.second->partialBlock ||
+                    it->second.first != pfrom->GetId()) {
+                LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+
+            PartiallyDownloadedBlock& partialBlock = *it->second.second->partialBlock;
+            ReadStatus status = partialBlock.FillBlock(block, resp.txn);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(resp.blockhash); // Reset in-flight state in case of whitelist
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->id);
+                return true;
+            } else if (status == READ_STATUS_FAILED) {
+                // Might have collided, fall back to getdata now :(
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, resp.blockhash));
+                pfrom->PushMessage("getdata", vInv);
+            } else {
+                fBlockReconstructed = true;
+            }
+        }
+
+        if (fBlockReconstructed)
+            ProcessBlockFromPeer(pfrom, block, strCommand);
+    }
+
+
+    else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlock block;
+        vRecv >> block;
+
+        LogPrint("net", "received block %s peer=%d\n", block.GetHash().ToString(), pfrom->id);
+
+        ProcessBlockFromPeer(pfrom, block, strCommand);
     }
 
 
@@ -4962,7 +5829,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addr);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -5080,12 +5950,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vRecv >> alert;
 
         uint256 alertHash = alert.GetHash();
-        if (pfrom->setKnown.count(alertHash) == 0)
+        if (!pfrom->IsAlertKnown(alertHash))
         {
             if (alert.ProcessAlert(Params().AlertKey()))
             {
                 // Relay
-                pfrom->setKnown.insert(alertHash);
+                pfrom->AddAlertKnown(alertHash);
                 {
                     LOCK(cs_vNodes);
                     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -5214,6 +6084,11 @@ bool ProcessMessages(CNode* pfrom)
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
 
+    // Finish reconsidering orphans before handling the peer's next message
+    if (!pfrom->setOrphanWork.empty())
+        ProcessOrphanWork(pfrom);
+    if (!pfrom->setOrphanWork.empty()) return fOk;
+
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
         // Don't bother if send buffer is too full to respond anyway
@@ -5254,10 +6129,10 @@ bool ProcessMessages(CNode* pfrom)
         // Message size
         unsigned int nMessageSize = hdr.nMessageSize;
 
-        // Checksum
+        // Checksum, of the data hashed as it was received
         CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
-        unsigned int nChecksum = ReadLE32((unsigned char*)&hash);
+        const uint256& hash = msg.GetMessageHash();
+        unsigned int nChecksum = ReadLE32(hash.begin());
         if (nChecksum != hdr.nChecksum)
         {
             LogPrintf("%s(%s, %u bytes): CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n", __func__,
@@ -5267,6 +6142,7 @@ bool ProcessMessages(CNode* pfrom)
 
         // Process message
         bool fRet = false;
+        int64_t nProcessStart = GetTimeMicros();
         try
         {
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
@@ -5298,6 +6174,7 @@ bool ProcessMessages(CNode* pfrom)
         } catch (...) {
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
+        pfrom->RecordMsgHandled(strCommand, GetTimeMicros() - nProcessStart);
 
         if (!fRet)
             LogPrintf("%s(%s, %u bytes) FAILED peer=%d\n", __func__, SanitizeString(strCommand), nMessageSize, pfrom->id);
@@ -5307,7 +6184,7 @@ bool ProcessMessages(CNode* pfrom)
 
     // In case the connection got shut down, its receive buffer was wiped
     if (!pfrom->fDisconnect)
-        pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+        pfrom->EraseRecvMsgs(it);
 
     return fOk;
 }
@@ -5362,8 +6239,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             BOOST_FOREACH(CNode* pnode, vNodes)
             {
                 // Periodically clear addrKnown to allow refresh broadcasts
-                if (nLastRebroadcast)
+                if (nLastRebroadcast) {
+                    LOCK(pnode->cs_addr);
                     pnode->addrKnown.reset();
+                }
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -5377,23 +6256,29 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle)
         {
+            vector<CAddress> vAddrToSend;
+            {
+                LOCK(pto->cs_addr);
+                vAddrToSend.swap(pto->vAddrToSend);
+            }
             vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+            vAddr.reserve(vAddrToSend.size());
+            BOOST_FOREACH(const CAddress& addr, vAddrToSend)
             {
-                if (!pto->addrKnown.contains(addr.GetKey()))
                 {
+                    LOCK(pto->cs_addr);
+                    if (pto->addrKnown.contains(addr.GetKey()))
+                        continue;
                     pto->addrKnown.insert(addr.GetKey());
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
-                    {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
-                    }
+                }
+                vAddr.push_back(addr);
+                // receiver rejects addr messages larger than 1000
+                if (vAddr.size() >= 1000)
+                {
+                    pto->PushMessage("addr", vAddr);
+                    vAddr.clear();
                 }
             }
-            pto->vAddrToSend.clear();
             if (!vAddr.empty())
                 pto->PushMessage("addr", vAddr);
         }
@@ -5444,47 +6329,24 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: inventory
         //
+        // Transactions are announced in batches by the inventory relay thread
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
         {
             LOCK(pto->cs_inventory);
             vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
-
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
-                {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt.IsNull())
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = ArithToUint256(UintToArith256(inv.hash) ^ UintToArith256(hashSalt));
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((UintToArith256(hashRand) & 3) != 0);
-
-                    if (fTrickleWait)
-                    {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
-                }
-
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                pto->filterInventoryKnown.insert(inv.hash);
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
-            pto->vInventoryToSend = vInvWait;
+            pto->vInventoryToSend.clear();
         }
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
@@ -5525,22 +6387,14 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload())) {
             vector<CBlockIndex*> vToDownload;
-            NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            RequestNextBlocks(pto->GetId(), consensusParams, nNow, vToDownload);
             BOOST_FOREACH(CBlockIndex *pindex, vToDownload) {
                 vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
-                MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), consensusParams, pindex);
                 LogPrint("net", "Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
                     pindex->nHeight, pto->id);
             }
-            if (state.nBlocksInFlight == 0 && staller != -1) {
-                if (State(staller)->nStallingSince == 0) {
-                    State(staller)->nStallingSince = nNow;
-                    LogPrint("net", "Stall started peer=%d\n", staller);
-                }
-            }
         }
 
         //
@@ -5590,7 +6444,6 @@ public:
         mapBlockIndex.clear();
 
         // orphan transactions
-        mapOrphanTransactions.clear();
-        mapOrphanTransactionsByPrev.clear();
+        ClearOrphanTxs();
     }
 } instance_of_cmaincleanup;
@@ -64,6 +64,28 @@ static const unsigned int MAX_STANDARD_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 static const unsigned int DEFAULT_MIN_RELAY_TX_FEE = 100;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxorphanpool, maximum memory orphan transactions use (in kilobytes) */
+static const unsigned int DEFAULT_MAX_ORPHAN_POOL_SIZE = 500;
+/** A single peer's orphan transactions may use at most 1/ORPHAN_POOL_PEER_SHARE of -maxorphanpool */
+static const unsigned int ORPHAN_POOL_PEER_SHARE = 4;
+/** Seconds an orphan transaction is kept for its parents to arrive */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Number of orphan transactions reconsidered at a time once their parents have been accepted */
+static const unsigned int ORPHAN_TX_BATCH_SIZE = 10;
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Default for -persistmempool */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -74,8 +96,14 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
-static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Depth below the tip up to which blocks requested as MSG_CMPCT_BLOCK are sent as compact blocks. */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Number of recently requested filtered blocks kept prepared for filtering for further peers. */
+static const unsigned int MAX_FILTERABLE_BLOCKS = 8;
+/** Depth below the tip up to which "getblocktxn" is answered with a "blocktxn" rather than the full block. */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Number of peers which are asked to announce new blocks with a "cmpctblock" right away. */
+static const unsigned int MAX_CMPCTBLOCK_ANNOUNCERS = 3;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
@@ -197,7 +225,7 @@ bool ProcessMessages(CNode* pfrom);
  * Send queued protocol messages to be sent to a give node.
  *
  * @param[in]   pto             The node which we are sending messages to.
- * @param[in]   fSendTrickle    When true send the trickled data, otherwise trickle the data until true.
+ * @param[in]   fSendTrickle    When true send the trickled addresses, otherwise trickle them until true.
  */
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
@@ -247,9 +275,53 @@ void FlushStateToDisk();
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
 
-/** (try to) add transaction to memory pool **/
+/**
+ * The checks of a transaction for the mempool which don't need cs_main held
+ * throughout: its format and JoinSplit proofs, and its scripts against the
+ * outputs it spends at the time (see PrecheckTransaction).
+ */
+struct CMempoolPrecheck
+{
+    //! CheckTransaction() passed with a strict verifier
+    bool fChecked;
+    //! The outputs the scripts were successfully checked against, or empty if they weren't
+    std::vector<CTxOut> vSpentOutputs;
+
+    CMempoolPrecheck() : fChecked(false) {}
+
+    /** Whether the scripts were checked, and tx still spends the same outputs in view. */
+    bool ScriptsChecked(const CTransaction& tx, const CCoinsViewCache& view) const;
+};
+
+/**
+ * Check a transaction for the mempool without holding cs_main, apart from
+ * briefly to look up the outputs it spends. Returns false only if the
+ * transaction is invalid regardless of the chain state; everything else is
+ * left for AcceptToMemoryPool to decide.
+ */
+bool PrecheckTransaction(const CTransaction& tx, CValidationState& state, CMempoolPrecheck& precheck);
+
+/**
+ * (try to) add transaction to memory pool
+ * pPrecheck may point to the result of PrecheckTransaction(), which saves
+ * verifying the proofs and scripts again while cs_main is held.
+ * fOverrideMempoolLimit skips trimming the pool to -maxmempool, for
+ * transactions which return from disconnected blocks.
+ */
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee=false);
+                        bool* pfMissingInputs, bool fRejectAbsurdFee=false, const CMempoolPrecheck* pPrecheck=NULL,
+                        bool fOverrideMempoolLimit=false);
+
+/** (try to) add transaction to memory pool, as if it had been accepted at nAcceptTime */
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectAbsurdFee=false,
+                                const CMempoolPrecheck* pPrecheck=NULL, bool fOverrideMempoolLimit=false);
+
+/** Write the mempool to mempool.dat in the data directory. */
+bool DumpMempool();
+
+/** Re-admit the transactions in mempool.dat to the mempool, one at a time, verifying their proofs again. */
+bool LoadMempool();
 
 
 struct CNodeStateStats {
@@ -257,6 +329,8 @@ struct CNodeStateStats {
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    double dBlockRate;
+    int nBlockWindow;
 };
 
 struct CDiskTxPos : public CDiskBlockPos
@@ -398,6 +472,12 @@ public:
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/**
+ * Read the serialized block at pos into ssBlock, without decoding its
+ * transactions or checking its proof of work. Fails unless the block's hash
+ * is hashBlock.
+ */
+bool ReadRawBlockFromDisk(CDataStream& ssBlock, const CDiskBlockPos& pos, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStart);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -408,21 +488,29 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
  *  of problems. Note that in any case, coins may be modified. */
 bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL);
 
-/** Apply the effects of this block (with given index) on the UTXO set represented by coins */
-bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck = false);
+/** Apply the effects of this block (with given index) on the UTXO set represented by coins.
+ *  The JoinSplit proofs of the transactions in pProofsVerified are not verified again. */
+bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck = false,
+                  const std::set<uint256>* pProofsVerified = NULL);
 
-/** Context-independent validity checks */
+/** Context-independent validity checks. The JoinSplit proofs of the
+ *  transactions in pProofsVerified are taken as verified by a strict verifier. */
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW = true);
 bool CheckBlock(const CBlock& block, CValidationState& state,
                 libzcash::ProofVerifier& verifier,
-                bool fCheckPOW = true, bool fCheckMerkleRoot = true);
+                bool fCheckPOW = true, bool fCheckMerkleRoot = true,
+                const std::set<uint256>* pProofsVerified = NULL);
 
 /** Context-dependent validity checks */
 bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex *pindexPrev);
 bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIndex *pindexPrev);
 
-/** Check a block is completely valid from start to finish (only works on top of our current best block, with cs_main held) */
-bool TestBlockValidity(CValidationState &state, const CBlock& block, CBlockIndex *pindexPrev, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
+/** Check a block is completely valid from start to finish (only works on top of our current best block, with cs_main held).
+ *  pProofsVerified lists the transactions whose JoinSplit proofs the caller
+ *  knows to have been strictly verified, such as those of a block template
+ *  taken from the mempool; all other checks still apply to them. */
+bool TestBlockValidity(CValidationState &state, const CBlock& block, CBlockIndex *pindexPrev, bool fCheckPOW = true, bool fCheckMerkleRoot = true,
+                       const std::set<uint256>* pProofsVerified = NULL);
 
 /**
  * Store block on disk.
@@ -9,6 +9,8 @@
 #include "consensus/consensus.h"
 #include "utilstrencodings.h"
 
+#include <boost/foreach.hpp>
+
 using namespace std;
 
 CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
@@ -37,6 +39,69 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
     txn = CPartialMerkleTree(vHashes, vMatch);
 }
 
+CMerkleBlock::CMerkleBlock(const CFilterableBlock& fblock, CBloomFilter& filter)
+{
+    const CBlock& block = fblock.block;
+    header = block.GetBlockHeader();
+
+    vector<bool> vMatch;
+    vMatch.reserve(block.vtx.size());
+
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        const CBloomTxElements& elements = fblock.vTxElements[i];
+        if (filter.IsRelevantAndUpdate(elements))
+        {
+            vMatch.push_back(true);
+            vMatchedTxn.push_back(make_pair(i, elements.hash));
+        }
+        else
+            vMatch.push_back(false);
+    }
+
+    txn = fblock.GetPartialMerkleTree(vMatch);
+}
+
+static std::vector<CBloomTxElements> ExtractTxElements(const CBlock& block)
+{
+    std::vector<CBloomTxElements> vTxElements;
+    vTxElements.reserve(block.vtx.size());
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        vTxElements.push_back(CBloomTxElements(tx));
+    return vTxElements;
+}
+
+CFilterableBlock::CFilterableBlock(const CBlock& blockIn) : block(blockIn), vTxElements(ExtractTxElements(blockIn))
+{
+    block.BuildMerkleTree();
+    vMerkleTree = block.vMerkleTree;
+}
+
+CPartialMerkleTree CFilterableBlock::GetPartialMerkleTree(const std::vector<bool>& vMatch) const
+{
+    LOCK(cs_partialTrees);
+    std::map<std::vector<bool>, PartialTreeList::iterator>::iterator it = mapPartialTrees.find(vMatch);
+    if (it != mapPartialTrees.end()) {
+        listPartialTrees.splice(listPartialTrees.begin(), listPartialTrees, it->second);
+        return it->second->second;
+    }
+    if (mapPartialTrees.size() >= MAX_FILTERABLE_BLOCK_TREES) {
+        // Forget the least recently used one
+        mapPartialTrees.erase(listPartialTrees.back().first);
+        listPartialTrees.pop_back();
+    }
+    CPartialMerkleTree txn(vMerkleTree, block.vtx.size(), vMatch);
+    listPartialTrees.push_front(std::make_pair(vMatch, txn));
+    mapPartialTrees.insert(std::make_pair(vMatch, listPartialTrees.begin()));
+    return txn;
+}
+
+bool CFilterableBlock::HavePartialMerkleTree(const std::vector<bool>& vMatch) const
+{
+    LOCK(cs_partialTrees);
+    return mapPartialTrees.count(vMatch) > 0;
+}
+
 CMerkleBlock::CMerkleBlock(const CBlock& block, const std::set<uint256>& txids)
 {
     header = block.GetBlockHeader();
@@ -95,6 +160,21 @@ void CPartialMerkleTree::TraverseAndBuild(int height, unsigned int pos, const st
     }
 }
 
+void CPartialMerkleTree::TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vMerkleTree, const std::vector<unsigned int> &vLevelStart, const std::vector<bool> &vMatch) {
+    bool fParentOfMatch = false;
+    for (unsigned int p = pos << height; p < (pos+1) << height && p < nTransactions; p++)
+        fParentOfMatch |= vMatch[p];
+    vBits.push_back(fParentOfMatch);
+    if (height==0 || !fParentOfMatch) {
+        // the node's hash is already in the tree
+        vHash.push_back(vMerkleTree[vLevelStart[height] + pos]);
+    } else {
+        TraverseAndBuild(height-1, pos*2, vMerkleTree, vLevelStart, vMatch);
+        if (pos*2+1 < CalcTreeWidth(height-1))
+            TraverseAndBuild(height-1, pos*2+1, vMerkleTree, vLevelStart, vMatch);
+    }
+}
+
 uint256 CPartialMerkleTree::TraverseAndExtract(int height, unsigned int pos, unsigned int &nBitsUsed, unsigned int &nHashUsed, std::vector<uint256> &vMatch) {
     if (nBitsUsed >= vBits.size()) {
         // overflowed the bits array - failure
@@ -145,6 +225,20 @@ CPartialMerkleTree::CPartialMerkleTree(const std::vector<uint256> &vTxid, const
     TraverseAndBuild(nHeight, 0, vTxid, vMatch);
 }
 
+CPartialMerkleTree::CPartialMerkleTree(const std::vector<uint256> &vMerkleTree, unsigned int nTransactionsIn, const std::vector<bool> &vMatch) : nTransactions(nTransactionsIn), fBad(false) {
+    // calculate height of tree, and where each level of it starts
+    int nHeight = 0;
+    std::vector<unsigned int> vLevelStart(1, 0);
+    while (CalcTreeWidth(nHeight) > 1) {
+        vLevelStart.push_back(vLevelStart.back() + CalcTreeWidth(nHeight));
+        nHeight++;
+    }
+    assert(vMerkleTree.size() == vLevelStart.back() + 1);
+
+    // traverse the partial tree
+    TraverseAndBuild(nHeight, 0, vMerkleTree, vLevelStart, vMatch);
+}
+
 CPartialMerkleTree::CPartialMerkleTree() : nTransactions(0), fBad(true) {}
 
 uint256 CPartialMerkleTree::ExtractMatches(std::vector<uint256> &vMatch) {
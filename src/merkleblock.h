@@ -10,7 +10,10 @@
 #include "uint256.h"
 #include "primitives/block.h"
 #include "bloom.h"
+#include "sync.h"
 
+#include <list>
+#include <map>
 #include <vector>
 
 /** Data structure that represents a partial merkle tree.
@@ -73,6 +76,9 @@ protected:
     /** recursive function that traverses tree nodes, storing the data as bits and hashes */
     void TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch);
 
+    /** the same, taking the hashes from a full merkle tree as built by CBlock::BuildMerkleTree, whose levels start at vLevelStart */
+    void TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vMerkleTree, const std::vector<unsigned int> &vLevelStart, const std::vector<bool> &vMatch);
+
     /**
      * recursive function that traverses tree nodes, consuming the bits and hashes produced by TraverseAndBuild.
      * it returns the hash of the respective node.
@@ -107,6 +113,9 @@ public:
     /** Construct a partial merkle tree from a list of transaction ids, and a mask that selects a subset of them */
     CPartialMerkleTree(const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch);
 
+    /** Construct a partial merkle tree from the full merkle tree of nTransactionsIn transactions, without hashing anything */
+    CPartialMerkleTree(const std::vector<uint256> &vMerkleTree, unsigned int nTransactionsIn, const std::vector<bool> &vMatch);
+
     CPartialMerkleTree();
 
     /**
@@ -117,6 +126,39 @@ public:
 };
 
 
+/** Number of partial merkle trees a CFilterableBlock keeps for reuse. */
+static const unsigned int MAX_FILTERABLE_BLOCK_TREES = 16;
+
+/**
+ * A block prepared for being filtered for many peers: the data elements of its
+ * transactions are extracted and its merkle tree is built once, and the partial
+ * merkle trees of the last few distinct sets of matched transactions are kept,
+ * as peers following the same wallets match the same transactions.
+ */
+class CFilterableBlock
+{
+private:
+    std::vector<uint256> vMerkleTree;
+
+    mutable CCriticalSection cs_partialTrees;
+    typedef std::list<std::pair<std::vector<bool>, CPartialMerkleTree> > PartialTreeList;
+    //! Most recently used first
+    mutable PartialTreeList listPartialTrees;
+    mutable std::map<std::vector<bool>, PartialTreeList::iterator> mapPartialTrees;
+
+public:
+    const CBlock block;
+    const std::vector<CBloomTxElements> vTxElements;
+
+    explicit CFilterableBlock(const CBlock& blockIn);
+
+    /** Get the partial merkle tree of the transactions selected by vMatch */
+    CPartialMerkleTree GetPartialMerkleTree(const std::vector<bool>& vMatch) const;
+
+    /** Whether the partial merkle tree of the transactions selected by vMatch is kept */
+    bool HavePartialMerkleTree(const std::vector<bool>& vMatch) const;
+};
+
 /**
  * Used to relay blocks as header + vector<merkle branch>
  * to filtered nodes.
@@ -139,6 +181,9 @@ public:
      */
     CMerkleBlock(const CBlock& block, CBloomFilter& filter);
 
+    // The same, for a block prepared for filtering
+    CMerkleBlock(const CFilterableBlock& fblock, CBloomFilter& filter);
+
     // Create from a CBlock, matching the txids in the set
     CMerkleBlock(const CBlock& block, const std::set<uint256>& txids);
 
@@ -24,6 +24,7 @@
 #include "primitives/transaction.h"
 #include "random.h"
 #include "timedata.h"
+#include "txmempool.h"
 #include "ui_interface.h"
 #include "util.h"
 #include "utilmoneystr.h"
@@ -33,11 +34,15 @@
 
 #include "sodium.h"
 
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/identity.hpp>
+#include <boost/multi_index/ordered_index.hpp>
 #include <boost/thread.hpp>
 #include <boost/tuple/tuple.hpp>
 #ifdef ENABLE_MINING
 #include <functional>
 #endif
+#include <limits>
 #include <mutex>
 
 using namespace std;
@@ -48,31 +53,30 @@ using namespace std;
 //
 
 //
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
+// Building a block template from scratch means validating the inputs of
+// every transaction in it again, which takes seconds for a full block, while
+// getblocktemplate is polled every few seconds. CBlockTxSelection keeps the
+// transactions selected for the next block between calls instead: as long as
+// the tip stays the same, transactions which entered the mempool since are
+// only appended to the selection, and the transactions it holds are not
+// checked again. It starts over when the tip changes, when something it
+// selected has left the pool or when a newcomer would displace part of it,
+// and even then scripts verified on the same tip are not verified again.
+//
+// Transactions are selected by the fee rate of their package, that is
+// together with their in-mempool ancestors which aren't in the block yet,
+// after filling the priority area of the block (which only changes with the
+// tip, as priority depends on the height).
 //
-class COrphan
-{
-public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
 
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
-    {
-    }
-};
+//! Number of packages that may fail to fit before a block which is close to full is considered full
+static const int MAX_CONSECUTIVE_FAILURES = 1000;
 
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 
 // We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
+typedef boost::tuple<double, CFeeRate, CTxMemPool::txiter> TxPriority;
 class TxPriorityCompare
 {
     bool byFee;
@@ -97,6 +101,505 @@ public:
     }
 };
 
+/** Order the transactions of a package so that parents come first */
+struct CompareTxIterByAncestorCount
+{
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+};
+
+/** Order mempool entries by ancestor fee rate, best first */
+struct CompareTxIterByAncestorFee
+{
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        return CompareTxMemPoolEntryByAncestorFee()(*a, *b);
+    }
+};
+
+/**
+ * A mempool entry some of whose ancestors are selected already, with the
+ * ancestor size and fees of the package that is left to add.
+ */
+struct CTxModifiedEntry
+{
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+
+    explicit CTxModifiedEntry(CTxMemPool::txiter entry) :
+        iter(entry), nSizeWithAncestors(entry->GetSizeWithAncestors()), nModFeesWithAncestors(entry->GetModFeesWithAncestors()) {}
+};
+
+struct modifiedentry_iter
+{
+    typedef CTxMemPool::txiter result_type;
+    result_type operator() (const CTxModifiedEntry& entry) const
+    {
+        return entry.iter;
+    }
+};
+
+/** Like CompareTxMemPoolEntryByAncestorFee, for the package left to add */
+struct CompareModifiedEntryByAncestorFee
+{
+    bool operator()(const CTxModifiedEntry& a, const CTxModifiedEntry& b) const
+    {
+        double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
+        double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
+        if (f1 == f2) {
+            return a.iter->GetTx().GetHash() < b.iter->GetTx().GetHash();
+        }
+        return f1 > f2;
+    }
+};
+
+typedef boost::multi_index_container<
+    CTxModifiedEntry,
+    boost::multi_index::indexed_by<
+        // sorted by txid
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CTxMemPool::CompareIteratorByHash
+        >,
+        // sorted by the fee rate of the package left to add
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxModifiedEntry>,
+            CompareModifiedEntryByAncestorFee
+        >
+    >
+> indexed_modified_transaction_set;
+
+/** Take a selected ancestor out of a modified entry's package */
+struct update_for_selected_ancestor
+{
+    update_for_selected_ancestor(CTxMemPool::txiter _ancestor) : ancestor(_ancestor) {}
+
+    void operator() (CTxModifiedEntry& e)
+    {
+        e.nSizeWithAncestors -= ancestor->GetTxSize();
+        e.nModFeesWithAncestors -= ancestor->GetModifiedFee();
+    }
+
+private:
+    CTxMemPool::txiter ancestor;
+};
+
+class CBlockTxSelection
+{
+public:
+    struct CSelectedTx
+    {
+        uint256 hash;
+        CAmount nFee;
+        unsigned int nSigOps;
+        CFeeRate feeRate; //! of the package the transaction was selected with
+    };
+
+private:
+    enum AddResult {
+        ADD_OK,
+        ADD_NO_ROOM,
+        ADD_LOW_FEE,
+        ADD_INVALID,
+    };
+
+    // What the selection was made for
+    const CBlockIndex* pindexPrev;
+    int nHeight;
+    const CCoinsViewCache* pcoinsBase;
+    uint256 hashCoinsTip;
+    unsigned int nBlockMaxSize;
+    unsigned int nBlockPrioritySize;
+    unsigned int nBlockMinSize;
+    int64_t nLockTimeCutoff;
+
+    std::vector<CSelectedTx> vSelected; //! in block order
+    std::set<uint256> setSelected;
+    uint64_t nBlockSize;
+    int nBlockSigOps;
+    CAmount nFees;
+    std::unique_ptr<CCoinsViewCache> pview; //! pcoinsTip with the selected transactions applied
+
+    //! Transactions whose scripts were verified on top of pindexPrev
+    std::set<uint256> setScriptsChecked;
+    //! Transactions which can't go into a block on top of pindexPrev, whatever else is in it
+    std::set<uint256> setInvalid;
+
+    bool fPrintPriority;
+
+    AddResult AddPackage(CTxMemPool::txiter iter, bool fCheckFee, CFeeRate& packageFeeRate, double dPriority,
+                         std::vector<CTxMemPool::txiter>* pvAdded = NULL);
+    void AddPriorityTxs();
+    void UpdatePackagesForAdded(const std::vector<CTxMemPool::txiter>& vAdded, indexed_modified_transaction_set& mapModifiedTx,
+                                const CTxMemPool::setEntries& setFailed);
+    void AddPackageTxs();
+    bool UpdateIncrementally(const std::vector<uint256>& vUpdates);
+    void Rebuild();
+
+public:
+    CBlockTxSelection() : pindexPrev(NULL), nHeight(0), pcoinsBase(NULL), nBlockMaxSize(0), nBlockPrioritySize(0), nBlockMinSize(0),
+                          nLockTimeCutoff(0), nBlockSize(0), nBlockSigOps(0), nFees(0), fPrintPriority(false) {}
+
+    /** Bring the selection up to date for a block on top of pindexPrevIn. Requires cs_main and mempool.cs. */
+    void Update(const CBlockIndex* pindexPrevIn, unsigned int nBlockMaxSizeIn, unsigned int nBlockPrioritySizeIn, unsigned int nBlockMinSizeIn);
+
+    const std::vector<CSelectedTx>& GetSelected() const { return vSelected; }
+    uint64_t GetBlockSize() const { return nBlockSize; }
+    CAmount GetFees() const { return nFees; }
+};
+
+CBlockTxSelection::AddResult CBlockTxSelection::AddPackage(CTxMemPool::txiter iter, bool fCheckFee, CFeeRate& packageFeeRate, double dPriority,
+                                                           std::vector<CTxMemPool::txiter>* pvAdded)
+{
+    // The transaction and whatever it needs from the mempool which isn't selected yet
+    CTxMemPool::setEntries setAncestors;
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string dummy;
+    mempool.CalculateMemPoolAncestors(*iter, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+
+    std::vector<CTxMemPool::txiter> vPackage;
+    uint64_t nPackageSize = iter->GetTxSize();
+    CAmount nPackageFees = iter->GetModifiedFee();
+    unsigned int nPackageSigOps = GetLegacySigOpCount(iter->GetTx());
+    BOOST_FOREACH(CTxMemPool::txiter ancestor, setAncestors) {
+        if (setSelected.count(ancestor->GetTx().GetHash()))
+            continue;
+        vPackage.push_back(ancestor);
+        nPackageSize += ancestor->GetTxSize();
+        nPackageFees += ancestor->GetModifiedFee();
+        nPackageSigOps += GetLegacySigOpCount(ancestor->GetTx());
+    }
+    vPackage.push_back(iter);
+    std::sort(vPackage.begin(), vPackage.end(), CompareTxIterByAncestorCount());
+    packageFeeRate = CFeeRate(nPackageFees, nPackageSize);
+
+    BOOST_FOREACH(CTxMemPool::txiter it, vPackage) {
+        if (setInvalid.count(it->GetTx().GetHash()))
+            return ADD_INVALID;
+    }
+
+    // Skip free transactions if we're past the minimum block size
+    if (fCheckFee && packageFeeRate < ::minRelayTxFee && nBlockSize + nPackageSize >= nBlockMinSize)
+        return ADD_LOW_FEE;
+
+    // Size and legacy sigop limits
+    if (nBlockSize + nPackageSize >= nBlockMaxSize)
+        return ADD_NO_ROOM;
+    if (nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS)
+        return ADD_NO_ROOM;
+
+    // Try the package on a view of its own, so that nothing is left behind when it doesn't fit
+    CCoinsViewCache viewPackage(pview.get());
+    std::vector<CSelectedTx> vPackageSelected;
+    int nPackageSigOpsWithP2SH = 0;
+    BOOST_FOREACH(CTxMemPool::txiter it, vPackage) {
+        const CTransaction& tx = it->GetTx();
+        const uint256& hash = tx.GetHash();
+
+        if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight, nLockTimeCutoff)) {
+            setInvalid.insert(hash);
+            return ADD_INVALID;
+        }
+
+        // Spends of something the block already spends are only invalid next to this selection
+        if (!viewPackage.HaveInputs(tx) || !viewPackage.HaveJoinSplitRequirements(tx))
+            return ADD_INVALID;
+
+        unsigned int nTxSigOps = GetLegacySigOpCount(tx) + GetP2SHSigOpCount(tx, viewPackage);
+        nPackageSigOpsWithP2SH += nTxSigOps;
+        if (nBlockSigOps + nPackageSigOpsWithP2SH >= MAX_BLOCK_SIGOPS)
+            return ADD_NO_ROOM;
+
+        // Note that flags: we don't want to set mempool/IsStandard()
+        // policy here, but we still have to ensure that the block we
+        // create only contains transactions that are valid in new blocks.
+        // Scripts only need checking once per tip.
+        CValidationState state;
+        bool fScriptChecks = !setScriptsChecked.count(hash);
+        if (!ContextualCheckInputs(tx, state, viewPackage, fScriptChecks, MANDATORY_SCRIPT_VERIFY_FLAGS, true, Params().GetConsensus())) {
+            setInvalid.insert(hash);
+            return ADD_INVALID;
+        }
+        setScriptsChecked.insert(hash);
+
+        UpdateCoins(tx, state, viewPackage, nHeight);
+
+        CSelectedTx selected;
+        selected.hash = hash;
+        selected.nFee = it->GetFee();
+        selected.nSigOps = nTxSigOps;
+        selected.feeRate = packageFeeRate;
+        vPackageSelected.push_back(selected);
+    }
+
+    viewPackage.Flush();
+    BOOST_FOREACH(const CSelectedTx& selected, vPackageSelected) {
+        vSelected.push_back(selected);
+        setSelected.insert(selected.hash);
+        nFees += selected.nFee;
+        nBlockSigOps += selected.nSigOps;
+
+        if (fPrintPriority)
+        {
+            LogPrintf("priority %.1f fee %s txid %s\n",
+                dPriority, packageFeeRate.ToString(), selected.hash.ToString());
+        }
+    }
+    nBlockSize += nPackageSize;
+    if (pvAdded)
+        *pvAdded = vPackage;
+    return ADD_OK;
+}
+
+void CBlockTxSelection::AddPriorityTxs()
+{
+    if (nBlockPrioritySize == 0)
+        return;
+
+    // This vector will be sorted into a priority queue:
+    std::vector<TxPriority> vecPriority;
+    vecPriority.reserve(mempool.mapTx.size());
+    for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
+         mi != mempool.mapTx.end(); ++mi)
+    {
+        const CTransaction& tx = mi->GetTx();
+
+        // Priority is sum(valuein * age) / modified_txsize, where inputs from
+        // the mempool have no age
+        double dPriority = 0;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            const CCoins* coins = pview->AccessCoins(txin.prevout.hash);
+            if (coins && coins->IsAvailable(txin.prevout.n))
+                dPriority += (double)coins->vout[txin.prevout.n].nValue * (nHeight - coins->nHeight);
+        }
+        dPriority = tx.ComputePriority(dPriority, mi->GetTxSize());
+
+        CAmount dummy = 0;
+        mempool.ApplyDeltas(tx.GetHash(), dPriority, dummy);
+        vecPriority.push_back(TxPriority(dPriority, CFeeRate(mi->GetModifiedFee(), mi->GetTxSize()), mi));
+    }
+
+    TxPriorityCompare comparer(false);
+    std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+
+    // Transactions waiting for their parents to be selected
+    std::map<CTxMemPool::txiter, TxPriority, CTxMemPool::CompareIteratorByHash> mapWaitingForParents;
+
+    while (!vecPriority.empty())
+    {
+        // Take highest priority transaction off the priority queue:
+        double dPriority = vecPriority.front().get<0>();
+        CTxMemPool::txiter iter = vecPriority.front().get<2>();
+        TxPriority txPriority = vecPriority.front();
+
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        vecPriority.pop_back();
+
+        // Past the priority size or out of high-priority transactions, the rest goes by fee
+        if (nBlockSize + iter->GetTxSize() >= nBlockPrioritySize || !AllowFree(dPriority))
+            break;
+
+        bool fWaiting = false;
+        BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter)) {
+            if (!setSelected.count(parent->GetTx().GetHash())) {
+                fWaiting = true;
+                break;
+            }
+        }
+        if (fWaiting) {
+            mapWaitingForParents.insert(std::make_pair(iter, txPriority));
+            continue;
+        }
+
+        CFeeRate feeRate;
+        if (AddPackage(iter, false, feeRate, dPriority) != ADD_OK)
+            continue;
+
+        // Add transactions that depend on this one to the priority queue
+        BOOST_FOREACH(CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter)) {
+            std::map<CTxMemPool::txiter, TxPriority, CTxMemPool::CompareIteratorByHash>::iterator wit = mapWaitingForParents.find(child);
+            if (wit != mapWaitingForParents.end()) {
+                vecPriority.push_back(wit->second);
+                std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                mapWaitingForParents.erase(wit);
+            }
+        }
+    }
+}
+
+void CBlockTxSelection::UpdatePackagesForAdded(const std::vector<CTxMemPool::txiter>& vAdded, indexed_modified_transaction_set& mapModifiedTx,
+                                               const CTxMemPool::setEntries& setFailed)
+{
+    BOOST_FOREACH(CTxMemPool::txiter it, vAdded) {
+        CTxMemPool::setEntries setDescendants;
+        mempool.CalculateDescendants(it, setDescendants);
+        BOOST_FOREACH(CTxMemPool::txiter desc, setDescendants) {
+            if (desc == it || setFailed.count(desc) || setSelected.count(desc->GetTx().GetHash()))
+                continue;
+            indexed_modified_transaction_set::iterator mit = mapModifiedTx.find(desc);
+            if (mit == mapModifiedTx.end())
+                mit = mapModifiedTx.insert(CTxModifiedEntry(desc)).first;
+            mapModifiedTx.modify(mit, update_for_selected_ancestor(it));
+        }
+    }
+}
+
+void CBlockTxSelection::AddPackageTxs()
+{
+    // The ancestor_score index goes by the fee rate of a transaction together
+    // with all of its ancestors. For the transactions some of whose ancestors
+    // are selected already, mapModifiedTx has the fee rate of what is left to
+    // add, so that taking the better of the two each time goes through the
+    // packages best first, and the first one paying too little ends the loop.
+    indexed_modified_transaction_set mapModifiedTx;
+    CTxMemPool::setEntries setFailed;
+    std::vector<CTxMemPool::txiter> vAdded;
+    BOOST_FOREACH(const CSelectedTx& selected, vSelected)
+        vAdded.push_back(mempool.mapTx.find(selected.hash));
+    UpdatePackagesForAdded(vAdded, mapModifiedTx, setFailed);
+
+    int nConsecutiveFailed = 0;
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
+    while (mi != mempool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty())
+    {
+        // Entries of the index which are selected, modified or failed already are dealt with
+        if (mi != mempool.mapTx.get<ancestor_score>().end()) {
+            CTxMemPool::txiter it = mempool.mapTx.project<0>(mi);
+            if (setSelected.count(it->GetTx().GetHash()) || mapModifiedTx.count(it) || setFailed.count(it)) {
+                ++mi;
+                continue;
+            }
+        }
+
+        // Take the better of the next entry of the index and the best modified one
+        CTxMemPool::txiter iter;
+        indexed_modified_transaction_set::index<ancestor_score>::type::iterator modit = mapModifiedTx.get<ancestor_score>().begin();
+        bool fUsingModified = false;
+        if (mi == mempool.mapTx.get<ancestor_score>().end()) {
+            iter = modit->iter;
+            fUsingModified = true;
+        } else {
+            iter = mempool.mapTx.project<0>(mi);
+            if (modit != mapModifiedTx.get<ancestor_score>().end() &&
+                CompareModifiedEntryByAncestorFee()(*modit, CTxModifiedEntry(iter))) {
+                iter = modit->iter;
+                fUsingModified = true;
+            } else {
+                ++mi;
+            }
+        }
+        if (fUsingModified)
+            mapModifiedTx.get<ancestor_score>().erase(modit);
+
+        CFeeRate feeRate;
+        vAdded.clear();
+        AddResult result = AddPackage(iter, true, feeRate, 0, &vAdded);
+        if (result == ADD_LOW_FEE) {
+            // Everything else pays less
+            break;
+        } else if (result == ADD_OK) {
+            nConsecutiveFailed = 0;
+            UpdatePackagesForAdded(vAdded, mapModifiedTx, setFailed);
+        } else {
+            setFailed.insert(iter);
+            if (result == ADD_NO_ROOM && ++nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockSize > nBlockMaxSize - 4000)
+                break;
+        }
+    }
+}
+
+bool CBlockTxSelection::UpdateIncrementally(const std::vector<uint256>& vUpdates)
+{
+    // Removals aren't recorded, so check what we have. A transaction leaves the
+    // pool together with its descendants, so what remains still fits together.
+    CFeeRate worstFeeRate;
+    for (size_t i = 0; i < vSelected.size(); i++) {
+        if (!mempool.mapTx.count(vSelected[i].hash))
+            return false;
+        if (i == 0 || vSelected[i].feeRate < worstFeeRate)
+            worstFeeRate = vSelected[i].feeRate;
+    }
+
+    std::vector<CTxMemPool::txiter> vCandidates;
+    std::set<uint256> setCandidates;
+    BOOST_FOREACH(const uint256& hash, vUpdates) {
+        // A selected transaction was prioritised
+        if (setSelected.count(hash))
+            return false;
+        CTxMemPool::txiter iter = mempool.mapTx.find(hash);
+        if (iter == mempool.mapTx.end() || setInvalid.count(hash) || !setCandidates.insert(hash).second)
+            continue;
+        vCandidates.push_back(iter);
+    }
+    std::sort(vCandidates.begin(), vCandidates.end(), CompareTxIterByAncestorFee());
+
+    BOOST_FOREACH(CTxMemPool::txiter iter, vCandidates) {
+        if (setSelected.count(iter->GetTx().GetHash()))
+            continue;
+        CFeeRate feeRate;
+        AddResult result = AddPackage(iter, true, feeRate, 0);
+        // Something better came along than what the block is full of
+        if (result == ADD_NO_ROOM && !vSelected.empty() && feeRate > worstFeeRate)
+            return false;
+    }
+    return true;
+}
+
+void CBlockTxSelection::Rebuild()
+{
+    vSelected.clear();
+    setSelected.clear();
+    nBlockSize = 1000;
+    nBlockSigOps = 100;
+    nFees = 0;
+    pview.reset(new CCoinsViewCache(pcoinsTip));
+
+    AddPriorityTxs();
+    AddPackageTxs();
+}
+
+void CBlockTxSelection::Update(const CBlockIndex* pindexPrevIn, unsigned int nBlockMaxSizeIn, unsigned int nBlockPrioritySizeIn, unsigned int nBlockMinSizeIn)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(mempool.cs);
+    fPrintPriority = GetBoolArg("-printpriority", false);
+
+    bool fReset = !pview || pindexPrevIn != pindexPrev || pindexPrevIn->nHeight + 1 != nHeight ||
+                  pcoinsTip != pcoinsBase || pcoinsTip->GetBestBlock() != hashCoinsTip || nBlockMaxSizeIn != nBlockMaxSize ||
+                  nBlockPrioritySizeIn != nBlockPrioritySize || nBlockMinSizeIn != nBlockMinSize;
+    if (fReset) {
+        pindexPrev = pindexPrevIn;
+        nHeight = pindexPrev->nHeight + 1;
+        pcoinsBase = pcoinsTip;
+        hashCoinsTip = pcoinsTip->GetBestBlock();
+        nBlockMaxSize = nBlockMaxSizeIn;
+        nBlockPrioritySize = nBlockPrioritySizeIn;
+        nBlockMinSize = nBlockMinSizeIn;
+        nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
+                          ? pindexPrev->GetMedianTimePast()
+                          : GetAdjustedTime();
+        setScriptsChecked.clear();
+        setInvalid.clear();
+    }
+
+    std::vector<uint256> vUpdates;
+    bool fComplete = mempool.GetTemplateUpdates(vUpdates);
+    if (fReset || !fComplete || !UpdateIncrementally(vUpdates)) {
+        LogPrint("bench", "Rebuilding block template selection\n");
+        Rebuild();
+    }
+}
+
+//! The selection for the next block, protected by cs_main and mempool.cs
+static CBlockTxSelection txSelection;
+
 void UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
 {
     pblock->nTime = std::max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
@@ -144,192 +647,23 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         CBlockIndex* pindexPrev = chainActive.Tip();
         const int nHeight = pindexPrev->nHeight + 1;
         pblock->nTime = GetAdjustedTime();
-        const int64_t nMedianTimePast = pindexPrev->GetMedianTimePast();
-        CCoinsViewCache view(pcoinsTip);
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi)
-        {
-            const CTransaction& tx = mi->second.GetTx();
-
-            int64_t nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
-                                    ? nMedianTimePast
-                                    : pblock->GetBlockTime();
-
-            if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight, nLockTimeCutoff))
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = nHeight - coins->nHeight;
-
-                dPriority += (double)nValueIn * nConf;
-            }
-            nTotalIn += tx.GetJoinSplitValueIn();
-
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
 
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
+        txSelection.Update(pindexPrev, nBlockMaxSize, nBlockPrioritySize, nBlockMinSize);
 
-            CFeeRate feeRate(nTotalIn-tx.GetValueOut(), nTxSize);
-
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            }
-            else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
-        }
-
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
+        // Collect transactions into block, noting whose proofs the mempool has verified
+        std::set<uint256> setProofsVerified;
+        BOOST_FOREACH(const CBlockTxSelection::CSelectedTx& selected, txSelection.GetSelected())
         {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!view.HaveInputs(tx))
-                continue;
-
-            CAmount nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            if (!ContextualCheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, Params().GetConsensus()))
-                continue;
-
-            UpdateCoins(tx, state, view, nHeight);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fPrintPriority)
-            {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
+            const CTxMemPoolEntry& entry = *mempool.mapTx.find(selected.hash);
+            pblock->vtx.push_back(entry.GetTx());
+            pblocktemplate->vTxFees.push_back(selected.nFee);
+            pblocktemplate->vTxSigOps.push_back(selected.nSigOps);
+            if (entry.ProofsVerified() && !entry.GetTx().vjoinsplit.empty())
+                setProofsVerified.insert(selected.hash);
         }
+        uint64_t nBlockTx = txSelection.GetSelected().size();
+        uint64_t nBlockSize = txSelection.GetBlockSize();
+        nFees = txSelection.GetFees();
 
         nLastBlockTx = nBlockTx;
         nLastBlockSize = nBlockSize;
@@ -376,7 +710,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
 
         CValidationState state;
-        if (!TestBlockValidity(state, *pblock, pindexPrev, false, false))
+        if (!TestBlockValidity(state, *pblock, pindexPrev, false, false, &setProofsVerified))
             throw std::runtime_error("CreateNewBlock(): TestBlockValidity failed");
     }
 
@@ -14,6 +14,7 @@
 #include "clientversion.h"
 #include "primitives/transaction.h"
 #include "scheduler.h"
+#include "socketevents.h"
 #include "ui_interface.h"
 #include "crypto/common.h"
 
@@ -23,6 +24,12 @@
 #include <fcntl.h>
 #endif
 
+#include <algorithm>
+#include <iterator>
+#include <math.h>
+#include <memory>
+#include <set>
+
 #include <boost/filesystem.hpp>
 #include <boost/thread.hpp>
 
@@ -48,6 +55,8 @@ using namespace std;
 
 namespace {
     const int MAX_OUTBOUND_CONNECTIONS = 8;
+    //! Size of the socket handler's receive buffer; larger message remainders are received in place
+    const unsigned int RECV_BUFFER_SIZE = 0x10000;
 
     struct ListenSocket {
         SOCKET socket;
@@ -69,12 +78,17 @@ static bool vfLimited[NET_MAX] = {};
 static CNode* pnodeLocalHost = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
+static std::unique_ptr<CSocketEvents> psocketEvents;
 CAddrMan addrman;
 int nMaxConnections = DEFAULT_MAX_PEER_CONNECTIONS;
 bool fAddressesInitialized = false;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
+//! Peers by socket, for finding those the socket event backend reports.
+//! Guarded by cs_vNodes. Entries of closed sockets linger until the peer is
+//! removed from vNodes, so check the peer's hSocket.
+static map<SOCKET, CNode*> mapSocketNodes;
 map<CInv, CDataStream> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
@@ -93,7 +107,18 @@ NodeId nLastNodeId = 0;
 CCriticalSection cs_nLastNodeId;
 
 static CSemaphore *semOutbound = NULL;
-boost::condition_variable messageHandlerCondition;
+/**
+ * Peers with work for one message handler thread, each holding a reference.
+ * Every peer belongs to a single shard, so its messages are handled in order
+ * by one thread.
+ */
+struct CMessageHandlerShard
+{
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    deque<CNode*> vQueue;
+};
+static std::vector<std::unique_ptr<CMessageHandlerShard> > vMessageHandlerShards;
 
 // Signals for message handling
 static CNodeSignals g_signals;
@@ -314,6 +339,8 @@ uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+mapMsgTypeStats CNode::mapPastStatsPerMsgType;
+CCriticalSection CNode::cs_pastMsgTypeStats;
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -351,6 +378,24 @@ CNode* FindNode(const CService& addr)
     return NULL;
 }
 
+bool InitSocketEvents(const std::string& strMode)
+{
+    CSocketEvents* pevents = CreateSocketEvents(strMode);
+    if (!pevents)
+        return false;
+    psocketEvents.reset(pevents);
+    LogPrintf("Using %s for socket events\n", pevents->GetName());
+    return true;
+}
+
+/** Returns false if the socket handler thread cannot watch s. */
+static bool IsServiceableSocket(SOCKET s)
+{
+    if (psocketEvents)
+        return psocketEvents->IsSupportedSocket(s);
+    return IsSelectableSocket(s);
+}
+
 CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
 {
     if (pszDest == NULL) {
@@ -377,7 +422,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
-        if (!IsSelectableSocket(hSocket)) {
+        if (!IsServiceableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -392,6 +437,8 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
         {
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
+            mapSocketNodes[hSocket] = pnode;
+            pnode->WatchSocket();
         }
 
         pnode->nTimeConnected = GetTime();
@@ -409,10 +456,15 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
 void CNode::CloseSocketDisconnect()
 {
     fDisconnect = true;
-    if (hSocket != INVALID_SOCKET)
     {
-        LogPrint("net", "disconnecting peer=%d\n", id);
-        CloseSocket(hSocket);
+        LOCK(cs_socketEvents);
+        if (hSocket != INVALID_SOCKET)
+        {
+            LogPrint("net", "disconnecting peer=%d\n", id);
+            if (psocketEvents)
+                psocketEvents->Remove(hSocket);
+            CloseSocket(hSocket);
+        }
     }
 
     // in case this fails, we'll empty the recv buffer when the CNode is deleted
@@ -570,9 +622,86 @@ void CNode::copyStats(CNodeStats &stats)
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+
+    {
+        LOCK(cs_vSend);
+        stats.nSendQueueMsgs = vSendMsg.size();
+        stats.nSendQueueBytes = nSendSize;
+    }
+    {
+        LOCK(cs_msgTypeStats);
+        stats.mapStatsPerMsgType = mapStatsPerMsgType;
+    }
 }
 #undef X
 
+/**
+ * Returns true if more data should be read from the peer's socket: there is
+ * no complete message waiting to be processed, or the receive buffer still
+ * has room. Requires cs_vRecvMsg.
+ */
+static bool CanReceive(CNode* pnode)
+{
+    return pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+           pnode->GetTotalRecvSize() <= ReceiveFloodSize();
+}
+
+// requires LOCK(cs_socketEvents)
+void CNode::UpdateSocketEvents()
+{
+    if (!psocketEvents || !fWatchSocket || hSocket == INVALID_SOCKET)
+        return;
+
+    // Implement the following logic:
+    // * If there is data to send, wait for sending data. As this only
+    //   happens when optimistic write failed, we choose to first drain the
+    //   write buffer in this case before receiving more. This avoids
+    //   needlessly queueing received data, if the remote peer is not themselves
+    //   receiving data. This means properly utilizing TCP flow control signalling.
+    // * Otherwise, if there is no (complete) message in the receive buffer,
+    //   or there is space left in the buffer, wait for receiving data.
+    // * (if neither of the above applies, there is certainly one message
+    //   in the receiver buffer ready to be processed).
+    // Together, that means that at least one of the following is always possible,
+    // so we don't deadlock:
+    // * We send some data.
+    // * We wait for data to be received (and disconnect after timeout).
+    // * We process a message in the buffer (message handler thread).
+    if (!psocketEvents->Watch(hSocket, fWantRecv && !fWantSend, fWantSend))
+    {
+        // We would never hear from this peer again, nor notice it timing out
+        LogPrintf("socket %s cannot watch peer=%d, disconnecting\n", psocketEvents->GetName(), id);
+        fDisconnect = true;
+    }
+}
+
+void CNode::WatchSocket()
+{
+    LOCK(cs_socketEvents);
+    fWatchSocket = true;
+    UpdateSocketEvents();
+}
+
+// requires LOCK(cs_vRecvMsg)
+void CNode::SetWantRecv(bool fWant)
+{
+    LOCK(cs_socketEvents);
+    if (fWantRecv == fWant)
+        return;
+    fWantRecv = fWant;
+    UpdateSocketEvents();
+}
+
+// requires LOCK(cs_vSend)
+void CNode::SetWantSend(bool fWant)
+{
+    LOCK(cs_socketEvents);
+    if (fWantSend == fWant)
+        return;
+    fWantSend = fWant;
+    UpdateSocketEvents();
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 {
@@ -580,8 +709,14 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 
         // get current incomplete message, or create a new one
         if (vRecvMsg.empty() ||
-            vRecvMsg.back().complete())
+            vRecvMsg.back().complete()) {
             vRecvMsg.push_back(CNetMessage(Params().MessageStart(), SER_NETWORK, nRecvVersion));
+            if (!vRecvBufferPool.empty()) {
+                vRecvMsg.back().vRecv = std::move(vRecvBufferPool.back());
+                vRecvMsg.back().vRecv.SetVersion(nRecvVersion);
+                vRecvBufferPool.pop_back();
+            }
+        }
 
         CNetMessage& msg = vRecvMsg.back();
 
@@ -592,8 +727,10 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         else
             handled = msg.readData(pch, nBytes);
 
-        if (handled < 0)
-                return false;
+        if (handled < 0) {
+            LogPrint("net", "Invalid message header from peer=%i, disconnecting\n", GetId());
+            return false;
+        }
 
         if (msg.in_data && msg.hdr.nMessageSize > MAX_PROTOCOL_MESSAGE_LENGTH) {
             LogPrint("net", "Oversized message from peer=%i, disconnecting\n", GetId());
@@ -605,7 +742,8 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
+            RecordMsgRecv(msg.hdr.GetCommand(), CMessageHeader::HEADER_SIZE + msg.hdr.nMessageSize);
+            QueueNodeForMessageHandler(this);
         }
     }
 
@@ -637,6 +775,10 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     if (hdr.nMessageSize > MAX_SIZE)
             return -1;
 
+    // check the network magic before anything is allocated for the data
+    if (memcmp(hdr.pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE) != 0)
+        return -1;
+
     // switch state to reading message data
     in_data = true;
 
@@ -654,11 +796,76 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     }
 
     memcpy(&vRecv[nDataPos], pch, nCopy);
-    nDataPos += nCopy;
+    ReceivedData(nCopy);
 
     return nCopy;
 }
 
+char* CNetMessage::GetDataBuffer(unsigned int& nSpace)
+{
+    assert(in_data && !complete());
+    if (vRecv.size() == nDataPos) {
+        // Allocate up to 256 KiB ahead, but never more than the total message size.
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + 256 * 1024));
+    }
+    nSpace = vRecv.size() - nDataPos;
+    return &vRecv[nDataPos];
+}
+
+void CNetMessage::ReceivedData(unsigned int nBytes)
+{
+    assert(nDataPos + nBytes <= vRecv.size());
+    hasher.Write((const unsigned char*)&vRecv[nDataPos], nBytes);
+    nDataPos += nBytes;
+}
+
+const uint256& CNetMessage::GetMessageHash()
+{
+    assert(complete());
+    if (data_hash.IsNull())
+        hasher.Finalize(data_hash.begin());
+    return data_hash;
+}
+
+// requires LOCK(cs_vRecvMsg)
+char* CNode::GetRecvDirectBuffer(unsigned int& nSpace)
+{
+    if (vRecvMsg.empty() || !vRecvMsg.back().in_data || vRecvMsg.back().complete())
+        return NULL;
+    CNetMessage& msg = vRecvMsg.back();
+    // Smaller remainders go through the socket handler's buffer, which can
+    // take the following messages in the same recv()
+    if (msg.hdr.nMessageSize - msg.nDataPos < RECV_BUFFER_SIZE)
+        return NULL;
+    return msg.GetDataBuffer(nSpace);
+}
+
+// requires LOCK(cs_vRecvMsg)
+void CNode::ReceivedDirect(unsigned int nBytes)
+{
+    CNetMessage& msg = vRecvMsg.back();
+    msg.ReceivedData(nBytes);
+    if (msg.complete()) {
+        msg.nTime = GetTimeMicros();
+        RecordMsgRecv(msg.hdr.GetCommand(), CMessageHeader::HEADER_SIZE + msg.hdr.nMessageSize);
+        QueueNodeForMessageHandler(this);
+    }
+}
+
+// requires LOCK(cs_vRecvMsg)
+void CNode::EraseRecvMsgs(std::deque<CNetMessage>::iterator itEnd)
+{
+    for (std::deque<CNetMessage>::iterator it = vRecvMsg.begin(); it != itEnd; ++it) {
+        size_t nCapacity = it->vRecv.capacity();
+        if (nCapacity > 0 && nCapacity <= MAX_POOLED_RECV_BUFFER_SIZE && vRecvBufferPool.size() < MAX_RECV_BUFFER_POOL) {
+            it->vRecv.clear();
+            vRecvBufferPool.push_back(std::move(it->vRecv));
+        }
+    }
+    vRecvMsg.erase(vRecvMsg.begin(), itEnd);
+    SetWantRecv(CanReceive(this));
+}
+
 
 
 
@@ -709,6 +916,7 @@ void SocketSendData(CNode *pnode)
         assert(pnode->nSendSize == 0);
     }
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+    pnode->SetWantSend(!pnode->vSendMsg.empty());
 }
 
 static list<CNode*> vNodesDisconnected;
@@ -895,7 +1103,7 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
         return;
     }
 
-    if (!IsSelectableSocket(hSocket))
+    if (!IsServiceableSocket(hSocket))
     {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
@@ -937,20 +1145,37 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
     {
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
+        mapSocketNodes[hSocket] = pnode;
+        pnode->WatchSocket();
     }
 }
 
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    int64_t nNextInventoryTrickle = 0;
+    int64_t nNextSweep = 0;
+    // Peers with readiness which has not been used up yet, each holding a
+    // reference, and whether any of them can go on without waiting
+    set<CNode*> setNodesReady;
+    bool fMoreReady = false;
     while (true)
     {
+        // The sweeps over all peers run on a timer rather than on every
+        // wakeup, which would make an idle loop cost O(peers)
+        int64_t nTimeMicros = GetTimeMicros();
+        bool fSweep = nTimeMicros >= nNextSweep;
+        if (fSweep)
+            nNextSweep = nTimeMicros + MESSAGE_HANDLER_SEND_INTERVAL * 1000;
+
         //
         // Disconnect nodes
         //
+        if (fSweep)
         {
             LOCK(cs_vNodes);
             // Disconnect unused nodes
+            bool fRemoved = false;
             vector<CNode*> vNodesCopy = vNodes;
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
             {
@@ -959,6 +1184,7 @@ void ThreadSocketHandler()
                 {
                     // remove from vNodes
                     vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                    fRemoved = true;
 
                     // release outbound grant (if any)
                     pnode->grantOutbound.Release();
@@ -972,7 +1198,15 @@ void ThreadSocketHandler()
                     vNodesDisconnected.push_back(pnode);
                 }
             }
+            if (fRemoved)
+            {
+                mapSocketNodes.clear();
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                    if (pnode->hSocket != INVALID_SOCKET)
+                        mapSocketNodes[pnode->hSocket] = pnode;
+            }
         }
+        if (fSweep)
         {
             // Delete disconnected nodes
             list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
@@ -1009,130 +1243,152 @@ void ThreadSocketHandler()
         }
 
         //
-        // Find which sockets have data to receive
+        // Wait for sockets to become ready. Peers are watched for what they
+        // want as that changes (see CNode::UpdateSocketEvents).
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
+        int64_t nTimeout = 50; // frequency of the sweeps and trickles
 
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
-        }
+        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+            psocketEvents->Watch(hListenSocket.socket, true, false, false);
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
+        // Don't wait if readiness reported earlier can be used now
+        if (fMoreReady)
+            nTimeout = 0;
 
-        if (nSelect == SOCKET_ERROR)
+        vector<CSocketEvent> vEvents;
+        if (!psocketEvents->Wait(nTimeout, vEvents))
         {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
+            int nErr = WSAGetLastError();
+            LogPrintf("socket %s error %s\n", psocketEvents->GetName(), NetworkErrorString(nErr));
+            MilliSleep(nTimeout);
         }
+        boost::this_thread::interruption_point();
 
         //
         // Accept new connections
         //
+        set<SOCKET> setReady;
+        BOOST_FOREACH(const CSocketEvent& event, vEvents)
+            setReady.insert(event.socket);
         BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            if (hListenSocket.socket != INVALID_SOCKET && setReady.count(hListenSocket.socket))
             {
                 AcceptConnection(hListenSocket);
             }
         }
 
         //
-        // Service each socket
+        // Find the peers which are ready
         //
-        vector<CNode*> vNodesCopy;
+        vector<CNode*> vNodesReady(setNodesReady.begin(), setNodesReady.end());
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
+            BOOST_FOREACH(const CSocketEvent& event, vEvents)
+            {
+                map<SOCKET, CNode*>::iterator mi = mapSocketNodes.find(event.socket);
+                if (mi == mapSocketNodes.end() || mi->second->hSocket != event.socket)
+                    continue;
+                CNode* pnode = mi->second;
+                if (event.fRecv || event.fError)
+                    pnode->fRecvReady = true;
+                if (event.fSend)
+                    pnode->fSendReady = true;
+                if (setNodesReady.insert(pnode).second)
+                    vNodesReady.push_back(pnode->AddRef());
+            }
+
+            nTimeMicros = GetTimeMicros();
+            // Trickle inventory to one random peer at a time
+            if (!vNodes.empty() && nTimeMicros >= nNextInventoryTrickle)
+            {
+                QueueNodeForMessageHandler(vNodes[GetRand(vNodes.size())], true);
+                nNextInventoryTrickle = nTimeMicros + INVENTORY_TRICKLE_INTERVAL * 1000;
+            }
+
+            if (fSweep)
+            {
+                int64_t nTime = GetTime();
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                {
+                    // Peers which have sent nothing still need SendMessages for
+                    // pings, address relay and block download scheduling
+                    if (!pnode->fDisconnect)
+                        QueueNodeForMessageHandler(pnode);
+
+                    //
+                    // Inactivity checking
+                    //
+                    if (nTime - pnode->nTimeConnected > 60)
+                    {
+                        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+                        {
+                            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+                            pnode->fDisconnect = true;
+                        }
+                        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+                        {
+                            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+                            pnode->fDisconnect = true;
+                        }
+                        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+                        {
+                            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+                            pnode->fDisconnect = true;
+                        }
+                        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+                        {
+                            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+                            pnode->fDisconnect = true;
+                        }
+                    }
+                }
+            }
         }
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        setNodesReady.clear();
+        fMoreReady = false;
+
+        //
+        // Service each ready socket
+        //
+        vector<CNode*> vNodesDone;
+        BOOST_FOREACH(CNode* pnode, vNodesReady)
         {
             boost::this_thread::interruption_point();
 
             //
             // Receive
             //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (pnode->hSocket != INVALID_SOCKET && pnode->fRecvReady)
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                if (lockRecv && !CanReceive(pnode))
+                {
+                    // Receive interest was dropped when the buffer filled up,
+                    // and restoring it reports the socket again
+                    pnode->fRecvReady = false;
+                }
+                else if (lockRecv)
                 {
                     {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                        // typical socket buffer is 8K-64K; the rest of a
+                        // large message is received straight into its buffer
+                        char pchBuf[RECV_BUFFER_SIZE];
+                        unsigned int nSpace = sizeof(pchBuf);
+                        char* pchDirect = pnode->GetRecvDirectBuffer(nSpace);
+                        int nBytes = recv(pnode->hSocket, pchDirect ? pchDirect : pchBuf, nSpace, MSG_DONTWAIT);
                         if (nBytes > 0)
                         {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                            // A short read means the socket has been drained
+                            if (nBytes < (int)nSpace)
+                                pnode->fRecvReady = false;
+                            else
+                                fMoreReady = true;
+                            if (pchDirect)
+                                pnode->ReceivedDirect(nBytes);
+                            else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
                                 pnode->CloseSocketDisconnect();
+                            pnode->SetWantRecv(CanReceive(pnode));
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
                             pnode->RecordBytesRecv(nBytes);
@@ -1148,7 +1404,11 @@ void ThreadSocketHandler()
                         {
                             // error
                             int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                            if (nErr == WSAEWOULDBLOCK)
+                            {
+                                pnode->fRecvReady = false;
+                            }
+                            else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                             {
                                 if (!pnode->fDisconnect)
                                     LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
@@ -1162,46 +1422,32 @@ void ThreadSocketHandler()
             //
             // Send
             //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (pnode->hSocket != INVALID_SOCKET && pnode->fSendReady)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
-                    SocketSendData(pnode);
-            }
-
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
                 {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
+                    // Anything left over means the socket buffer is full, and
+                    // a drained queue drops the write interest; either way the
+                    // backend reports the socket again when there is room
+                    if (!pnode->vSendMsg.empty())
+                        SocketSendData(pnode);
+                    pnode->fSendReady = false;
+                    if (pnode->nSendSize < SendBufferSize() && pnode->fPausedForSend.exchange(false))
+                        QueueNodeForMessageHandler(pnode);
                 }
             }
+
+            // Keep the reference of peers which are still ready, which only
+            // happens after a full read or when a lock was busy
+            if (pnode->hSocket != INVALID_SOCKET && (pnode->fRecvReady || pnode->fSendReady))
+                setNodesReady.insert(pnode);
+            else
+                vNodesDone.push_back(pnode);
         }
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            BOOST_FOREACH(CNode* pnode, vNodesDone)
                 pnode->Release();
         }
     }
@@ -1491,75 +1737,165 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
-void ThreadMessageHandler()
+void QueueNodeForMessageHandler(CNode* pnode, bool fSendTrickle)
 {
-    boost::mutex condition_mutex;
-    boost::unique_lock<boost::mutex> lock(condition_mutex);
+    // Nothing handles messages before StartNode
+    if (vMessageHandlerShards.empty())
+        return;
+    CMessageHandlerShard& shard = *vMessageHandlerShards[pnode->GetId() % vMessageHandlerShards.size()];
+    boost::unique_lock<boost::mutex> lock(shard.mutex);
+    if (fSendTrickle)
+        pnode->fSendTrickleDue = true;
+    if (pnode->fMessageHandlerQueued)
+        return;
+    pnode->fMessageHandlerQueued = true;
+    shard.vQueue.push_back(pnode->AddRef());
+    shard.cond.notify_one();
+}
 
+void ThreadMessageHandler(CMessageHandlerShard* pshard)
+{
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true)
     {
-        vector<CNode*> vNodesCopy;
+        // Wait for a peer with something to do
+        CNode* pnode;
+        bool fSendTrickle;
         {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
-                pnode->AddRef();
-            }
+            boost::unique_lock<boost::mutex> lock(pshard->mutex);
+            while (pshard->vQueue.empty())
+                pshard->cond.wait(lock);
+            pnode = pshard->vQueue.front();
+            pshard->vQueue.pop_front();
+            pnode->fMessageHandlerQueued = false;
+            fSendTrickle = pnode->fSendTrickleDue;
+            pnode->fSendTrickleDue = false;
         }
 
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-
-        bool fSleep = true;
-
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        if (!pnode->fDisconnect)
         {
-            if (pnode->fDisconnect)
-                continue;
-
             // Receive messages
+            bool fMoreWork;
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    if (!g_signals.ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
-
-                    if (pnode->nSendSize < SendBufferSize())
-                    {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
-                    }
-                }
+                LOCK(pnode->cs_vRecvMsg);
+                if (!g_signals.ProcessMessages(pnode))
+                    pnode->CloseSocketDisconnect();
+                fMoreWork = !pnode->vRecvGetData.empty() || !pnode->setOrphanWork.empty() ||
+                            (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete());
             }
-            boost::this_thread::interruption_point();
 
             // Send messages
             {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    g_signals.SendMessages(pnode, pnode == pnodeTrickle || pnode->fWhitelisted);
+                LOCK(pnode->cs_vSend);
+                g_signals.SendMessages(pnode, fSendTrickle || pnode->fWhitelisted);
+            }
+
+            // ProcessMessages handles one message at a time, so go to the
+            // back of the queue to share the thread fairly between peers
+            if (fMoreWork && !pnode->fDisconnect)
+            {
+                if (pnode->nSendSize < SendBufferSize()) {
+                    QueueNodeForMessageHandler(pnode);
+                } else {
+                    // Don't bother until the socket handler has made room to
+                    // respond, unless it already has
+                    pnode->fPausedForSend = true;
+                    if (pnode->nSendSize < SendBufferSize() && pnode->fPausedForSend.exchange(false))
+                        QueueNodeForMessageHandler(pnode);
+                }
             }
-            boost::this_thread::interruption_point();
         }
 
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            pnode->Release();
         }
+        boost::this_thread::interruption_point();
+    }
+}
+
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds)
+{
+    return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * average_interval_seconds * -1000000.0 + 0.5);
+}
+
+void CNode::SendInventoryBatch(int64_t nNow)
+{
+    // Don't send anything until we get its version message
+    if (nVersion == 0)
+        return;
+
+    vector<uint256> vQueued;
+    {
+        LOCK(cs_inventory);
+        if (setInventoryTxToSend.empty())
+            return;
+        // Trickle out transactions to protect privacy; whitelisted peers get
+        // them right away
+        if (nNow < nNextInvSend && !fWhitelisted)
+            return;
+        nNextInvSend = PoissonNextSend(nNow, fInbound ? INVENTORY_BROADCAST_INTERVAL : INVENTORY_BROADCAST_INTERVAL >> 1);
+        vQueued.assign(setInventoryTxToSend.begin(), setInventoryTxToSend.end());
+    }
 
-        if (fSleep)
-            messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+    // Announce the best transactions first, so that none of them waits
+    // behind a flood of others for longer than its fee rate warrants, and
+    // forget those which have left the mempool since
+    vector<uint256> vHashes(vQueued);
+    g_signals.SortTxInventory(vHashes);
+    vector<uint256> vKept(vHashes);
+    std::sort(vKept.begin(), vKept.end());
+    vector<uint256> vDropped;
+    std::set_difference(vQueued.begin(), vQueued.end(), vKept.begin(), vKept.end(), std::back_inserter(vDropped));
+
+    vector<CInv> vInv;
+    {
+        LOCK(cs_inventory);
+        BOOST_FOREACH(const uint256& hash, vDropped)
+            setInventoryTxToSend.erase(hash);
+        vInv.reserve(std::min<size_t>(vHashes.size(), INVENTORY_BROADCAST_MAX));
+        for (vector<uint256>::const_iterator it = vHashes.begin(); it != vHashes.end() && vInv.size() < INVENTORY_BROADCAST_MAX; it++) {
+            if (!filterInventoryKnown.contains(*it)) {
+                filterInventoryKnown.insert(*it);
+                vInv.push_back(CInv(MSG_TX, *it));
+            }
+            setInventoryTxToSend.erase(*it);
+        }
     }
+    if (!vInv.empty())
+        PushMessage("inv", vInv);
 }
 
+// Sends the transaction inventory batches, so that announcing transactions,
+// however many there are, doesn't hold up the message handler threads
+void ThreadInventoryRelay()
+{
+    while (true)
+    {
+        vector<CNode*> vNodesCopy;
+        {
+            LOCK(cs_vNodes);
+            vNodesCopy = vNodes;
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
+        }
+
+        int64_t nNow = GetTimeMicros();
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        {
+            if (!pnode->fDisconnect)
+                pnode->SendInventoryBatch(nNow);
+        }
+
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->Release();
+        }
 
+        MilliSleep(INVENTORY_RELAY_POLL_INTERVAL);
+    }
+}
 
 
 
@@ -1738,6 +2074,17 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     Discover(threadGroup);
 
+    // Peers are shared out between the message handler threads, so the
+    // shards must exist before any peer does
+    int nMessageHandlerThreads = GetArg("-msghandlerthreads", DEFAULT_MESSAGE_HANDLER_THREADS);
+    if (nMessageHandlerThreads <= 0)
+        nMessageHandlerThreads = std::min(GetNumCores(), MAX_MESSAGE_HANDLER_THREADS);
+    nMessageHandlerThreads = std::max(1, std::min(nMessageHandlerThreads, MAX_MESSAGE_HANDLER_THREADS));
+    LogPrintf("Using %d message handler threads\n", nMessageHandlerThreads);
+    vMessageHandlerShards.clear();
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        vMessageHandlerShards.push_back(std::unique_ptr<CMessageHandlerShard>(new CMessageHandlerShard()));
+
     //
     // Start threads
     //
@@ -1747,6 +2094,10 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     else
         threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "dnsseed", &ThreadDNSAddressSeed));
 
+    // Normally set up from -socketevents during initialization
+    if (!psocketEvents && !InitSocketEvents(DEFAULT_SOCKET_EVENTS))
+        InitSocketEvents("select");
+
     // Send and receive from sockets, accept connections
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
@@ -1757,7 +2108,12 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    BOOST_FOREACH(const std::unique_ptr<CMessageHandlerShard>& pshard, vMessageHandlerShards)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand",
+                                              boost::function<void()>(boost::bind(&ThreadMessageHandler, pshard.get()))));
+
+    // Announce transactions
+    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "invrelay", &ThreadInventoryRelay));
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpAddresses, DUMP_ADDRESSES_INTERVAL);
@@ -1801,6 +2157,7 @@ public:
         BOOST_FOREACH(CNode *pnode, vNodesDisconnected)
             delete pnode;
         vNodes.clear();
+        mapSocketNodes.clear();
         vNodesDisconnected.clear();
         vhListenSocket.clear();
         delete semOutbound;
@@ -1846,6 +2203,8 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
         mapRelay.insert(std::make_pair(inv, ss));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
+    // The transaction's data elements are extracted once for all the filtering peers
+    std::unique_ptr<CBloomTxElements> pelements;
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
     {
@@ -1854,7 +2213,15 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
         LOCK(pnode->cs_filter);
         if (pnode->pfilter)
         {
-            if (pnode->pfilter->IsRelevantAndUpdate(tx))
+            bool fRelevant;
+            if (pnode->pfilter->IsTrivial())
+                fRelevant = pnode->pfilter->IsRelevantAndUpdate(tx);
+            else {
+                if (!pelements)
+                    pelements.reset(new CBloomTxElements(tx));
+                fRelevant = pnode->pfilter->IsRelevantAndUpdate(*pelements);
+            }
+            if (fRelevant)
                 pnode->PushInventory(inv);
         } else
             pnode->PushInventory(inv);
@@ -1885,6 +2252,91 @@ uint64_t CNode::GetTotalBytesSent()
     return nTotalBytesSent;
 }
 
+CMessageTypeStats::CMessageTypeStats()
+{
+    nSendMsgs = 0;
+    nSendBytes = 0;
+    nRecvMsgs = 0;
+    nRecvBytes = 0;
+    nHandledMsgs = 0;
+    nHandlingTime = 0;
+    nMaxHandlingTime = 0;
+    memset(vHandlingTimeHist, 0, sizeof(vHandlingTimeHist));
+}
+
+void CMessageTypeStats::RecordHandlingTime(int64_t nMicros)
+{
+    int nBucket = 0;
+    while (nBucket < MSG_HANDLING_TIME_BUCKETS - 1 && nMicros >= BucketUpperBound(nBucket))
+        nBucket++;
+    vHandlingTimeHist[nBucket]++;
+    nHandledMsgs++;
+    nHandlingTime += nMicros;
+    nMaxHandlingTime = std::max(nMaxHandlingTime, nMicros);
+}
+
+CMessageTypeStats& CMessageTypeStats::operator+=(const CMessageTypeStats& other)
+{
+    nSendMsgs += other.nSendMsgs;
+    nSendBytes += other.nSendBytes;
+    nRecvMsgs += other.nRecvMsgs;
+    nRecvBytes += other.nRecvBytes;
+    nHandledMsgs += other.nHandledMsgs;
+    nHandlingTime += other.nHandlingTime;
+    nMaxHandlingTime = std::max(nMaxHandlingTime, other.nMaxHandlingTime);
+    for (int i = 0; i < MSG_HANDLING_TIME_BUCKETS; i++)
+        vHandlingTimeHist[i] += other.vHandlingTimeHist[i];
+    return *this;
+}
+
+int64_t CMessageTypeStats::BucketUpperBound(int nBucket)
+{
+    if (nBucket >= MSG_HANDLING_TIME_BUCKETS - 1)
+        return -1;
+    int64_t nBound = 10;
+    for (int i = 0; i < nBucket; i++)
+        nBound *= 10;
+    return nBound;
+}
+
+/** The statistics key for a command; anything a peer makes up shares one entry */
+static const std::string& MsgTypeStatsKey(const std::string& strCommand)
+{
+    static const std::set<std::string> setKnownTypes(getAllNetMessageTypes().begin(), getAllNetMessageTypes().end());
+    static const std::string strOther(MSG_TYPE_OTHER);
+    std::set<std::string>::const_iterator it = setKnownTypes.find(strCommand);
+    return it == setKnownTypes.end() ? strOther : *it;
+}
+
+void CNode::RecordMsgSent(const std::string& strCommand, unsigned int nBytes)
+{
+    LOCK(cs_msgTypeStats);
+    CMessageTypeStats& stats = mapStatsPerMsgType[MsgTypeStatsKey(strCommand)];
+    stats.nSendMsgs++;
+    stats.nSendBytes += nBytes;
+}
+
+void CNode::RecordMsgRecv(const std::string& strCommand, unsigned int nBytes)
+{
+    LOCK(cs_msgTypeStats);
+    CMessageTypeStats& stats = mapStatsPerMsgType[MsgTypeStatsKey(strCommand)];
+    stats.nRecvMsgs++;
+    stats.nRecvBytes += nBytes;
+}
+
+void CNode::RecordMsgHandled(const std::string& strCommand, int64_t nMicros)
+{
+    LOCK(cs_msgTypeStats);
+    mapStatsPerMsgType[MsgTypeStatsKey(strCommand)].RecordHandlingTime(nMicros);
+}
+
+void CNode::GetPastMsgTypeStats(mapMsgTypeStats& stats)
+{
+    LOCK(cs_pastMsgTypeStats);
+    BOOST_FOREACH(const PAIRTYPE(std::string, CMessageTypeStats)& item, mapPastStatsPerMsgType)
+        stats[item.first] += item.second;
+}
+
 void CNode::Fuzz(int nChance)
 {
     if (!fSuccessfullyConnected) return; // Don't fuzz initial handshake
@@ -2027,7 +2479,7 @@ unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNameIn, bool fInboundIn) :
     ssSend(SER_NETWORK, INIT_PROTO_VERSION),
     addrKnown(5000, 0.001),
-    setInventoryKnown(SendBufferSize() / 1000)
+    filterInventoryKnown(10000, 0.000001)
 {
     nServices = 0;
     hSocket = hSocketIn;
@@ -2052,8 +2504,17 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
+    fRecvReady = false;
+    fSendReady = false;
+    fWatchSocket = false;
+    fWantRecv = true;
+    fWantSend = false;
+    fMessageHandlerQueued = false;
+    fSendTrickleDue = false;
+    fPausedForSend = false;
     hashContinue = uint256();
     nStartingHeight = -1;
+    nNextInvSend = 0;
     fGetAddr = false;
     fRelayTxes = false;
     fSentAddr = false;
@@ -2088,6 +2549,12 @@ CNode::~CNode()
     if (pfilter)
         delete pfilter;
 
+    {
+        LOCK(cs_pastMsgTypeStats);
+        BOOST_FOREACH(const PAIRTYPE(std::string, CMessageTypeStats)& item, mapStatsPerMsgType)
+            mapPastStatsPerMsgType[item.first] += item.second;
+    }
+
     GetNodeSignals().FinalizeNode(GetId());
 }
 
@@ -2174,6 +2641,9 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
+    const char* pchCommand = &ssSend[MESSAGE_START_SIZE];
+    RecordMsgSent(std::string(pchCommand, strnlen(pchCommand, CMessageHeader::COMMAND_SIZE)), ssSend.size());
+
     std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
     ssSend.GetAndClear(*it);
     nSendSize += (*it).size();
@@ -10,7 +10,6 @@
 #include "compat.h"
 #include "hash.h"
 #include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
@@ -19,7 +18,9 @@
 #include "uint256.h"
 #include "utilstrencodings.h"
 
+#include <atomic>
 #include <deque>
+#include <map>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -49,6 +50,10 @@ static const unsigned int MAX_INV_SZ = 50000;
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
 /** Maximum length of incoming protocol messages (no message over 2 MiB is currently acceptable). */
 static const unsigned int MAX_PROTOCOL_MESSAGE_LENGTH = 2 * 1024 * 1024;
+/** Number of emptied receive buffers each peer keeps for reuse by later messages. */
+static const size_t MAX_RECV_BUFFER_POOL = 4;
+/** Largest receive buffer (in bytes) kept for reuse; bigger ones are freed. */
+static const size_t MAX_POOLED_RECV_BUFFER_SIZE = 256 * 1024;
 /** -listen default */
 static const bool DEFAULT_LISTEN = true;
 /** The maximum number of entries in mapAskFor */
@@ -57,6 +62,21 @@ static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 static const size_t SETASKFOR_MAX_SZ = 2 * MAX_INV_SZ;
 /** The maximum number of peer connections to maintain. */
 static const unsigned int DEFAULT_MAX_PEER_CONNECTIONS = 125;
+/** -msghandlerthreads default; 0 means one per core, up to MAX_MESSAGE_HANDLER_THREADS */
+static const int DEFAULT_MESSAGE_HANDLER_THREADS = 0;
+/** Maximum number of message handler threads */
+static const int MAX_MESSAGE_HANDLER_THREADS = 8;
+/** Time between the socket handler's sweeps over all peers, which check for inactivity and queue
+ *  SendMessages for peers which have sent us nothing (in milliseconds). */
+static const int64_t MESSAGE_HANDLER_SEND_INTERVAL = 250;
+/** Time between address trickles, each to one randomly chosen peer (in milliseconds). */
+static const int64_t INVENTORY_TRICKLE_INTERVAL = 100;
+/** Average time between transaction inventory batches sent to an inbound peer (in seconds); outbound peers get them twice as often. */
+static const unsigned int INVENTORY_BROADCAST_INTERVAL = 5;
+/** Maximum number of transactions announced to a peer in one batch. */
+static const unsigned int INVENTORY_BROADCAST_MAX = 1000;
+/** Time between the inventory relay thread's passes over the peers (in milliseconds). */
+static const int64_t INVENTORY_RELAY_POLL_INTERVAL = 100;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -71,6 +91,14 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest = NULL);
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
 unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhitelisted = false);
+bool InitSocketEvents(const std::string& strMode);
+/**
+ * Ask a message handler thread to process the peer's received messages and
+ * call SendMessages for it, trickling inventory if fSendTrickle is set.
+ */
+void QueueNodeForMessageHandler(CNode* pnode, bool fSendTrickle = false);
+/** Return a time (in microseconds) an exponentially distributed delay with the given average after nNow. */
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds);
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
 void SocketSendData(CNode *pnode);
@@ -100,6 +128,8 @@ struct CNodeSignals
     boost::signals2::signal<bool (CNode*, bool), CombinerAll> SendMessages;
     boost::signals2::signal<void (NodeId, const CNode*)> InitializeNode;
     boost::signals2::signal<void (NodeId)> FinalizeNode;
+    // Drops the transactions not worth announcing any more, and puts the rest in the order to announce them
+    boost::signals2::signal<void (std::vector<uint256>&)> SortTxInventory;
 };
 
 
@@ -162,6 +192,39 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+//! Number of buckets of the message handling time histograms
+static const int MSG_HANDLING_TIME_BUCKETS = 8;
+//! Statistics key shared by all the message types we don't know about
+static const char* const MSG_TYPE_OTHER = "*other*";
+
+/**
+ * Traffic and handling time of one message type, for one peer or summed over
+ * several. Handling times are bucketed by powers of ten, from under 10us to
+ * 10s and more.
+ */
+class CMessageTypeStats
+{
+public:
+    uint64_t nSendMsgs;
+    uint64_t nSendBytes;
+    uint64_t nRecvMsgs;
+    uint64_t nRecvBytes;
+    uint64_t nHandledMsgs;
+    int64_t nHandlingTime;          // total time spent in ProcessMessage (in microseconds)
+    int64_t nMaxHandlingTime;
+    uint64_t vHandlingTimeHist[MSG_HANDLING_TIME_BUCKETS];
+
+    CMessageTypeStats();
+
+    void RecordHandlingTime(int64_t nMicros);
+    CMessageTypeStats& operator+=(const CMessageTypeStats& other);
+
+    /** Upper bound (in microseconds) of a histogram bucket, or -1 for the last, unbounded one */
+    static int64_t BucketUpperBound(int nBucket);
+};
+
+typedef std::map<std::string, CMessageTypeStats> mapMsgTypeStats;
+
 class CNodeStats
 {
 public:
@@ -182,6 +245,9 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    size_t nSendQueueMsgs;
+    size_t nSendQueueBytes;
+    mapMsgTypeStats mapStatsPerMsgType;
 };
 
 
@@ -200,6 +266,11 @@ public:
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
+private:
+    CHash256 hasher;                // hash of the data received so far
+    uint256 data_hash;              // set once the message is complete
+
+public:
     CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
         hdrbuf.resize(24);
         in_data = false;
@@ -223,6 +294,16 @@ public:
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+    /**
+     * Where the next nSpace bytes of message data go, so that they can be
+     * received in place. Must be followed by ReceivedData().
+     */
+    char* GetDataBuffer(unsigned int& nSpace);
+    void ReceivedData(unsigned int nBytes);
+
+    /** Double SHA256 of the message data, which is hashed as it arrives. Requires complete(). */
+    const uint256& GetMessageHash();
 };
 
 
@@ -244,11 +325,39 @@ public:
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
+    // Orphan transactions to reconsider, whose parents this peer sent us
+    std::set<uint256> setOrphanWork;
     std::deque<CNetMessage> vRecvMsg;
+    // Emptied buffers of processed messages, reused by new ones
+    std::vector<CDataStream> vRecvBufferPool;
     CCriticalSection cs_vRecvMsg;
     uint64_t nRecvBytes;
     int nRecvVersion;
 
+    // Readiness reported by the socket event backend which has not yet been
+    // used up by a recv() or send() that would block. Only accessed by the
+    // socket handler thread.
+    bool fRecvReady;
+    bool fSendReady;
+
+    // What the socket event backend watches the socket for, once the peer
+    // can be found by its socket. Kept up to date where the send queue and
+    // the receive buffer change, so the socket handler need not look at idle
+    // peers. Guarded by cs_socketEvents, which also keeps the socket from
+    // being closed while it is being watched.
+    bool fWatchSocket;
+    bool fWantRecv;
+    bool fWantSend;
+    CCriticalSection cs_socketEvents;
+
+    // Set while the peer is in the message handler queue; guarded by the
+    // queue's mutex.
+    bool fMessageHandlerQueued;
+    bool fSendTrickleDue;
+    // Set when the message handler stopped processing because the send buffer
+    // was full; the socket handler requeues the peer once it has drained.
+    std::atomic<bool> fPausedForSend;
+
     int64_t nLastSend;
     int64_t nLastRecv;
     int64_t nTimeConnected;
@@ -278,7 +387,7 @@ public:
     CSemaphoreGrant grantOutbound;
     CCriticalSection cs_filter;
     CBloomFilter* pfilter;
-    int nRefCount;
+    std::atomic<int> nRefCount;
     NodeId id;
 protected:
 
@@ -299,15 +408,26 @@ public:
     uint256 hashContinue;
     int nStartingHeight;
 
-    // flood relay
+    // flood relay; other message handler threads relay addresses to us, so
+    // vAddrToSend and addrKnown are guarded by cs_addr
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
+    CCriticalSection cs_addr;
     bool fGetAddr;
+    // alerts known to the peer; other message handler threads relay alerts
+    // to us, so setKnown is guarded by cs_setKnown
     std::set<uint256> setKnown;
+    CCriticalSection cs_setKnown;
 
-    // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    // inventory based relay; filterInventoryKnown remembers the last 10000 to
+    // 15000 hashes, ten full batches or more, in about 108KB
+    CRollingBloomFilter filterInventoryKnown;
+    // Block and other non-transaction invs, sent by SendMessages right away
     std::vector<CInv> vInventoryToSend;
+    // Transactions to announce in the peer's next inventory batch, sent by
+    // the inventory relay thread at Poisson distributed times
+    std::set<uint256> setInventoryTxToSend;
+    int64_t nNextInvSend;
     CCriticalSection cs_inventory;
     std::set<uint256> setAskFor;
     std::multimap<int64_t, CInv> mapAskFor;
@@ -334,9 +454,18 @@ private:
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
 
+    // Per message type statistics of this peer, and of the peers which have disconnected
+    CCriticalSection cs_msgTypeStats;
+    mapMsgTypeStats mapStatsPerMsgType;
+    static CCriticalSection cs_pastMsgTypeStats;
+    static mapMsgTypeStats mapPastStatsPerMsgType;
+
     CNode(const CNode&);
     void operator=(const CNode&);
 
+    // requires LOCK(cs_socketEvents)
+    void UpdateSocketEvents();
+
 public:
 
     NodeId GetId() const {
@@ -361,6 +490,24 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    // requires LOCK(cs_vRecvMsg)
+    // Returns where the rest of a partially received large message can be
+    // received in place, or NULL if bytes should go through ReceiveMsgBytes.
+    char* GetRecvDirectBuffer(unsigned int& nSpace);
+    // requires LOCK(cs_vRecvMsg)
+    void ReceivedDirect(unsigned int nBytes);
+
+    // requires LOCK(cs_vRecvMsg)
+    // Remove the messages before itEnd, keeping their buffers for reuse
+    void EraseRecvMsgs(std::deque<CNetMessage>::iterator itEnd);
+
+    // Start watching the socket, once the socket handler can find the peer
+    void WatchSocket();
+    // Whether there is room to receive more; requires LOCK(cs_vRecvMsg)
+    void SetWantRecv(bool fWant);
+    // Whether the send queue is non-empty; requires LOCK(cs_vSend)
+    void SetWantSend(bool fWant);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -382,8 +529,22 @@ public:
 
 
 
+    // Returns whether the alert wasn't known to the peer before
+    bool AddAlertKnown(const uint256& hash)
+    {
+        LOCK(cs_setKnown);
+        return setKnown.insert(hash).second;
+    }
+
+    bool IsAlertKnown(const uint256& hash)
+    {
+        LOCK(cs_setKnown);
+        return setKnown.count(hash) > 0;
+    }
+
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_addr);
         addrKnown.insert(addr.GetKey());
     }
 
@@ -392,6 +553,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_addr);
         if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
@@ -406,7 +568,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
@@ -414,11 +576,22 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
-                vInventoryToSend.push_back(inv);
+            if (filterInventoryKnown.contains(inv.hash))
+                return;
+            if (inv.type == MSG_TX) {
+                setInventoryTxToSend.insert(inv.hash);
+                return;
+            }
+            vInventoryToSend.push_back(inv);
         }
+        // Announce new blocks without waiting for the next scheduled send
+        if (inv.type == MSG_BLOCK)
+            QueueNodeForMessageHandler(this);
     }
 
+    /** Announce the queued transactions to the peer if its next inventory batch is due at nNow */
+    void SendInventoryBatch(int64_t nNow);
+
     void AskFor(const CInv& inv);
 
     // TODO: Document the postcondition of this function.  Is cs_vSend locked?
@@ -625,6 +798,12 @@ public:
     static void RecordBytesRecv(uint64_t bytes);
     static void RecordBytesSent(uint64_t bytes);
 
+    void RecordMsgSent(const std::string& strCommand, unsigned int nBytes);
+    void RecordMsgRecv(const std::string& strCommand, unsigned int nBytes);
+    void RecordMsgHandled(const std::string& strCommand, int64_t nMicros);
+    /** Add the per message type statistics of all the peers which have disconnected to stats */
+    static void GetPastMsgTypeStats(mapMsgTypeStats& stats);
+
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
 };
@@ -11,8 +11,13 @@
 #include "txmempool.h"
 #include "util.h"
 
+#include <algorithm>
+
+/** Marks an estimate which hasn't been calculated yet (EstimateMedianVal returns -1 on failure) */
+static const double ESTIMATE_NOT_CACHED = -2;
+
 void TxConfirmStats::Initialize(std::vector<double>& defaultBuckets,
-                                unsigned int maxConfirms, double _decay, std::string _dataTypeString)
+                                unsigned int _maxConfirms, double _decay, std::string _dataTypeString)
 {
     decay = _decay;
     dataTypeString = _dataTypeString;
@@ -20,44 +25,44 @@ void TxConfirmStats::Initialize(std::vector<double>& defaultBuckets,
     buckets.insert(buckets.end(), defaultBuckets.begin(), defaultBuckets.end());
     buckets.push_back(std::numeric_limits<double>::infinity());
 
-    for (unsigned int i = 0; i < buckets.size(); i++) {
-        bucketMap[buckets[i]] = i;
-    }
+    maxConfirms = _maxConfirms;
+    confAvg.assign(maxConfirms * buckets.size(), 0);
+    txCtAvg.assign(buckets.size(), 0);
+    avg.assign(buckets.size(), 0);
+    Resize();
+}
 
-    confAvg.resize(maxConfirms);
-    curBlockConf.resize(maxConfirms);
-    unconfTxs.resize(maxConfirms);
-    for (unsigned int i = 0; i < maxConfirms; i++) {
-        confAvg[i].resize(buckets.size());
-        curBlockConf[i].resize(buckets.size());
-        unconfTxs[i].resize(buckets.size());
-    }
+void TxConfirmStats::Resize()
+{
+    curBlockConf.assign(maxConfirms * buckets.size(), 0);
+    curBlockTxCt.assign(buckets.size(), 0);
+    curBlockVal.assign(buckets.size(), 0);
 
-    oldUnconfTxs.resize(buckets.size());
-    curBlockTxCt.resize(buckets.size());
-    txCtAvg.resize(buckets.size());
-    curBlockVal.resize(buckets.size());
-    avg.resize(buckets.size());
+    unconfTxs.assign(buckets.size() * maxConfirms, 0);
+    unconfTxsTotal.assign(buckets.size(), 0);
+    oldUnconfTxs.assign(buckets.size(), 0);
 }
 
 // Zero out the data for the current block
 void TxConfirmStats::ClearCurrent(unsigned int nBlockHeight)
 {
+    unsigned int blockIndex = nBlockHeight % maxConfirms;
     for (unsigned int j = 0; j < buckets.size(); j++) {
-        oldUnconfTxs[j] += unconfTxs[nBlockHeight%unconfTxs.size()][j];
-        unconfTxs[nBlockHeight%unconfTxs.size()][j] = 0;
-        for (unsigned int i = 0; i < curBlockConf.size(); i++)
-            curBlockConf[i][j] = 0;
-        curBlockTxCt[j] = 0;
-        curBlockVal[j] = 0;
+        int& unconf = unconfTxs[j * maxConfirms + blockIndex];
+        oldUnconfTxs[j] += unconf;
+        unconfTxsTotal[j] -= unconf;
+        unconf = 0;
     }
+    std::fill(curBlockConf.begin(), curBlockConf.end(), 0);
+    std::fill(curBlockTxCt.begin(), curBlockTxCt.end(), 0);
+    std::fill(curBlockVal.begin(), curBlockVal.end(), 0);
 }
 
 unsigned int TxConfirmStats::FindBucketIndex(double val)
 {
-    auto it = bucketMap.lower_bound(val);
-    assert(it != bucketMap.end());
-    return it->second;
+    auto it = std::lower_bound(buckets.begin(), buckets.end(), val);
+    assert(it != buckets.end());
+    return it - buckets.begin();
 }
 
 void TxConfirmStats::Record(int blocksToConfirm, double val)
@@ -66,18 +71,29 @@ void TxConfirmStats::Record(int blocksToConfirm, double val)
     if (blocksToConfirm < 1)
         return;
     unsigned int bucketindex = FindBucketIndex(val);
-    for (size_t i = blocksToConfirm; i <= curBlockConf.size(); i++) {
-        curBlockConf[i - 1][bucketindex]++;
-    }
+    // The counts for every number of blocks from blocksToConfirm up are
+    // incremented by UpdateMovingAverages
+    if ((unsigned int)blocksToConfirm <= maxConfirms)
+        curBlockConf[(blocksToConfirm - 1) * buckets.size() + bucketindex]++;
     curBlockTxCt[bucketindex]++;
     curBlockVal[bucketindex] += val;
 }
 
 void TxConfirmStats::UpdateMovingAverages()
 {
-    for (unsigned int j = 0; j < buckets.size(); j++) {
-        for (unsigned int i = 0; i < confAvg.size(); i++)
-            confAvg[i][j] = confAvg[i][j] * decay + curBlockConf[i][j];
+    unsigned int numBuckets = buckets.size();
+    // Running totals of the txs in the current block confirmed within Y blocks,
+    // built up one Y at a time from the counts for exactly Y blocks
+    std::vector<int> curConfirmed(numBuckets, 0);
+    for (unsigned int i = 0; i < maxConfirms; i++) {
+        double* confRow = &confAvg[i * numBuckets];
+        const int* curRow = &curBlockConf[i * numBuckets];
+        for (unsigned int j = 0; j < numBuckets; j++) {
+            curConfirmed[j] += curRow[j];
+            confRow[j] = confRow[j] * decay + curConfirmed[j];
+        }
+    }
+    for (unsigned int j = 0; j < numBuckets; j++) {
         avg[j] = avg[j] * decay + curBlockVal[j];
         txCtAvg[j] = txCtAvg[j] * decay + curBlockTxCt[j];
     }
@@ -113,15 +129,19 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
     unsigned int bestFarBucket = startbucket;
 
     bool foundAnswer = false;
-    unsigned int bins = unconfTxs.size();
+    const double* confRow = &confAvg[(confTarget - 1) * buckets.size()];
 
     // Start counting from highest(default) or lowest fee/pri transactions
     for (int bucket = startbucket; bucket >= 0 && bucket <= maxbucketindex; bucket += step) {
         curFarBucket = bucket;
-        nConf += confAvg[confTarget - 1][bucket];
+        nConf += confRow[bucket];
         totalNum += txCtAvg[bucket];
-        for (unsigned int confct = confTarget; confct < GetMaxConfirms(); confct++)
-            extraNum += unconfTxs[(nBlockHeight - confct)%bins][bucket];
+        // Of the txs in the mempool, count all but those that entered less than
+        // confTarget blocks ago
+        const int* unconfBucket = &unconfTxs[bucket * maxConfirms];
+        extraNum += unconfTxsTotal[bucket];
+        for (unsigned int confct = 0; confct < (unsigned int)confTarget && confct < maxConfirms; confct++)
+            extraNum -= unconfBucket[(nBlockHeight - confct) % maxConfirms];
         extraNum += oldUnconfTxs[bucket];
         // If we have enough transaction data points in this range of buckets,
         // we can test for success
@@ -184,11 +204,16 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
 
 void TxConfirmStats::Write(CAutoFile& fileout)
 {
+    // The file keeps one vector of bucket averages per number of confirmations
+    std::vector<std::vector<double> > fileConfAvg(maxConfirms);
+    for (unsigned int i = 0; i < maxConfirms; i++)
+        fileConfAvg[i].assign(confAvg.begin() + i * buckets.size(), confAvg.begin() + (i + 1) * buckets.size());
+
     fileout << decay;
     fileout << buckets;
     fileout << avg;
     fileout << txCtAvg;
-    fileout << confAvg;
+    fileout << fileConfAvg;
 }
 
 void TxConfirmStats::Read(CAutoFile& filein)
@@ -199,7 +224,7 @@ void TxConfirmStats::Read(CAutoFile& filein)
     std::vector<std::vector<double> > fileConfAvg;
     std::vector<double> fileTxCtAvg;
     double fileDecay;
-    size_t maxConfirms;
+    size_t fileMaxConfirms;
     size_t numBuckets;
 
     filein >> fileDecay;
@@ -209,6 +234,8 @@ void TxConfirmStats::Read(CAutoFile& filein)
     numBuckets = fileBuckets.size();
     if (numBuckets <= 1 || numBuckets > 1000)
         throw std::runtime_error("Corrupt estimates file. Must have between 2 and 1000 fee/pri buckets");
+    if (!std::is_sorted(fileBuckets.begin(), fileBuckets.end()))
+        throw std::runtime_error("Corrupt estimates file. Fee/pri buckets must be in increasing order");
     filein >> fileAvg;
     if (fileAvg.size() != numBuckets)
         throw std::runtime_error("Corrupt estimates file. Mismatch in fee/pri average bucket count");
@@ -216,10 +243,10 @@ void TxConfirmStats::Read(CAutoFile& filein)
     if (fileTxCtAvg.size() != numBuckets)
         throw std::runtime_error("Corrupt estimates file. Mismatch in tx count bucket count");
     filein >> fileConfAvg;
-    maxConfirms = fileConfAvg.size();
-    if (maxConfirms <= 0 || maxConfirms > 6 * 24 * 7) // one week
+    fileMaxConfirms = fileConfAvg.size();
+    if (fileMaxConfirms <= 0 || fileMaxConfirms > 6 * 24 * 7) // one week
         throw std::runtime_error("Corrupt estimates file.  Must maintain estimates for between 1 and 1008 (one week) confirms");
-    for (unsigned int i = 0; i < maxConfirms; i++) {
+    for (unsigned int i = 0; i < fileMaxConfirms; i++) {
         if (fileConfAvg[i].size() != numBuckets)
             throw std::runtime_error("Corrupt estimates file. Mismatch in fee/pri conf average bucket count");
     }
@@ -228,27 +255,16 @@ void TxConfirmStats::Read(CAutoFile& filein)
     decay = fileDecay;
     buckets = fileBuckets;
     avg = fileAvg;
-    confAvg = fileConfAvg;
     txCtAvg = fileTxCtAvg;
-    bucketMap.clear();
+    maxConfirms = fileMaxConfirms;
+    confAvg.clear();
+    confAvg.reserve(maxConfirms * numBuckets);
+    for (unsigned int i = 0; i < maxConfirms; i++)
+        confAvg.insert(confAvg.end(), fileConfAvg[i].begin(), fileConfAvg[i].end());
 
-    // Resize the current block variables which aren't stored in the data file
+    // Resize the current block and mempool variables which aren't stored in the data file
     // to match the number of confirms and buckets
-    curBlockConf.resize(maxConfirms);
-    for (unsigned int i = 0; i < maxConfirms; i++) {
-        curBlockConf[i].resize(buckets.size());
-    }
-    curBlockTxCt.resize(buckets.size());
-    curBlockVal.resize(buckets.size());
-
-    unconfTxs.resize(maxConfirms);
-    for (unsigned int i = 0; i < maxConfirms; i++) {
-        unconfTxs[i].resize(buckets.size());
-    }
-    oldUnconfTxs.resize(buckets.size());
-
-    for (unsigned int i = 0; i < buckets.size(); i++)
-        bucketMap[buckets[i]] = i;
+    Resize();
 
     LogPrint("estimatefee", "Reading estimates: %u %s buckets counting confirms up to %u blocks\n",
              numBuckets, dataTypeString, maxConfirms);
@@ -257,8 +273,9 @@ void TxConfirmStats::Read(CAutoFile& filein)
 unsigned int TxConfirmStats::NewTx(unsigned int nBlockHeight, double val)
 {
     unsigned int bucketindex = FindBucketIndex(val);
-    unsigned int blockIndex = nBlockHeight % unconfTxs.size();
-    unconfTxs[blockIndex][bucketindex]++;
+    unsigned int blockIndex = nBlockHeight % maxConfirms;
+    unconfTxs[bucketindex * maxConfirms + blockIndex]++;
+    unconfTxsTotal[bucketindex]++;
     LogPrint("estimatefee", "adding to %s", dataTypeString);
     return bucketindex;
 }
@@ -274,7 +291,7 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
         return;  //This can't happen because we call this with our best seen height, no entries can have higher
     }
 
-    if (blocksAgo >= (int)unconfTxs.size()) {
+    if (blocksAgo >= (int)maxConfirms) {
         if (oldUnconfTxs[bucketindex] > 0)
             oldUnconfTxs[bucketindex]--;
         else
@@ -282,10 +299,12 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
                      bucketindex);
     }
     else {
-        unsigned int blockIndex = entryHeight % unconfTxs.size();
-        if (unconfTxs[blockIndex][bucketindex] > 0)
-            unconfTxs[blockIndex][bucketindex]--;
-        else
+        unsigned int blockIndex = entryHeight % maxConfirms;
+        int& unconf = unconfTxs[bucketindex * maxConfirms + blockIndex];
+        if (unconf > 0) {
+            unconf--;
+            unconfTxsTotal[bucketindex]--;
+        } else
             LogPrint("estimatefee", "Blockpolicy error, mempool tx removed from blockIndex=%u,bucketIndex=%u already\n",
                      blockIndex, bucketindex);
     }
@@ -303,11 +322,21 @@ void CBlockPolicyEstimator::removeTx(uint256 hash)
     unsigned int entryHeight = pos->second.blockHeight;
     unsigned int bucketIndex = pos->second.bucketIndex;
 
-    if (stats != NULL)
+    if (stats != NULL) {
         stats->removeTx(entryHeight, nBestSeenHeight, bucketIndex);
+        ClearEstimateCache(stats);
+    }
     mapMemPoolTxs.erase(hash);
 }
 
+void CBlockPolicyEstimator::ClearEstimateCache(const TxConfirmStats* stats)
+{
+    if (stats == &feeStats)
+        feeEstimateCache.clear();
+    else if (stats == &priStats)
+        priEstimateCache.clear();
+}
+
 CBlockPolicyEstimator::CBlockPolicyEstimator(const CFeeRate& _minRelayFee)
     : nBestSeenHeight(0)
 {
@@ -391,11 +420,13 @@ void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, boo
     if (entry.GetFee() == 0 || isPriDataPoint(feeRate, curPri)) {
         mapMemPoolTxs[hash].stats = &priStats;
         mapMemPoolTxs[hash].bucketIndex =  priStats.NewTx(txHeight, curPri);
+        ClearEstimateCache(&priStats);
     }
     // Record this as a fee estimate
     else if (isFeeDataPoint(feeRate, curPri)) {
         mapMemPoolTxs[hash].stats = &feeStats;
         mapMemPoolTxs[hash].bucketIndex = feeStats.NewTx(txHeight, (double)feeRate.GetFeePerK());
+        ClearEstimateCache(&feeStats);
     }
     else {
         LogPrint("estimatefee", "not adding");
@@ -453,6 +484,10 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
     }
     nBestSeenHeight = nBlockHeight;
 
+    // The estimates depend on the height, as well as on the stats updated below
+    ClearEstimateCache(&feeStats);
+    ClearEstimateCache(&priStats);
+
     // Only want to be updating estimates when our blockchain is synced,
     // otherwise we'll miscalculate how many blocks its taking to get included.
     if (!fCurrentEstimate)
@@ -504,7 +539,11 @@ CFeeRate CBlockPolicyEstimator::estimateFee(int confTarget)
     if (confTarget <= 0 || (unsigned int)confTarget > feeStats.GetMaxConfirms())
         return CFeeRate(0);
 
-    double median = feeStats.EstimateMedianVal(confTarget, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    if (feeEstimateCache.empty())
+        feeEstimateCache.resize(feeStats.GetMaxConfirms(), ESTIMATE_NOT_CACHED);
+    double& median = feeEstimateCache[confTarget - 1];
+    if (median == ESTIMATE_NOT_CACHED)
+        median = feeStats.EstimateMedianVal(confTarget, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
 
     if (median < 0)
         return CFeeRate(0);
@@ -518,7 +557,13 @@ double CBlockPolicyEstimator::estimatePriority(int confTarget)
     if (confTarget <= 0 || (unsigned int)confTarget > priStats.GetMaxConfirms())
         return -1;
 
-    return priStats.EstimateMedianVal(confTarget, SUFFICIENT_PRITXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    if (priEstimateCache.empty())
+        priEstimateCache.resize(priStats.GetMaxConfirms(), ESTIMATE_NOT_CACHED);
+    double& median = priEstimateCache[confTarget - 1];
+    if (median == ESTIMATE_NOT_CACHED)
+        median = priStats.EstimateMedianVal(confTarget, SUFFICIENT_PRITXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+
+    return median;
 }
 
 void CBlockPolicyEstimator::Write(CAutoFile& fileout)
@@ -532,6 +577,8 @@ void CBlockPolicyEstimator::Read(CAutoFile& filein)
 {
     int nFileBestSeenHeight;
     filein >> nFileBestSeenHeight;
+    ClearEstimateCache(&feeStats);
+    ClearEstimateCache(&priStats);
     feeStats.Read(filein);
     priStats.Read(filein);
     nBestSeenHeight = nFileBestSeenHeight;
@@ -84,8 +84,10 @@ class TxConfirmStats
 {
 private:
     //Define the buckets we will group transactions into (both fee buckets and priority buckets)
-    std::vector<double> buckets;              // The upper-bound of the range for the bucket (inclusive)
-    std::map<double, unsigned int> bucketMap; // Map of bucket upper-bound to index into all vectors by bucket
+    std::vector<double> buckets;              // The upper-bound of the range for the bucket (inclusive), in increasing order
+
+    // Number of confirmations Y we're tracking
+    unsigned int maxConfirms = 0;
 
     // For each bucket X:
     // Count the total # of txs in each bucket
@@ -94,11 +96,16 @@ private:
     // and calcuate the total for the current block to update the moving average
     std::vector<int> curBlockTxCt;
 
+    // The counters kept for each Y and X live in a single vector each, rather than
+    // one vector per Y, so that updating them every block and scanning the buckets
+    // for an estimate both walk through contiguous memory.
+
     // Count the total # of txs confirmed within Y blocks in each bucket
     // Track the historical moving average of theses totals over blocks
-    std::vector<std::vector<double> > confAvg; // confAvg[Y][X]
-    // and calcuate the totals for the current block to update the moving averages
-    std::vector<std::vector<int> > curBlockConf; // curBlockConf[Y][X]
+    std::vector<double> confAvg; // confAvg[Y * buckets.size() + X]
+    // and count the txs confirmed in exactly Y blocks in the current block,
+    // which UpdateMovingAverages adds up to the totals for each Y
+    std::vector<int> curBlockConf; // curBlockConf[Y * buckets.size() + X]
 
     // Sum the total priority/fee of all tx's in each bucket
     // Track the historical moving average of this total over blocks
@@ -115,10 +122,15 @@ private:
     // Mempool counts of outstanding transactions
     // For each bucket X, track the number of transactions in the mempool
     // that are unconfirmed for each possible confirmation value Y
-    std::vector<std::vector<int> > unconfTxs;  //unconfTxs[Y][X]
+    std::vector<int> unconfTxs;  // unconfTxs[X * maxConfirms + Y]
+    // and their total over all Y
+    std::vector<int> unconfTxsTotal;
     // transactions still unconfirmed after MAX_CONFIRMS for each bucket
     std::vector<int> oldUnconfTxs;
 
+    /** Size all the counters for the current buckets and maxConfirms */
+    void Resize();
+
 public:
     /** Find the bucket index of a given value */
     unsigned int FindBucketIndex(double val);
@@ -172,7 +184,7 @@ public:
                              double minSuccess, bool requireGreater, unsigned int nBlockHeight);
 
     /** Return the max number of confirms we're tracking */
-    unsigned int GetMaxConfirms() { return confAvg.size(); }
+    unsigned int GetMaxConfirms() { return maxConfirms; }
 
     /** Write state of estimation data to a file*/
     void Write(CAutoFile& fileout);
@@ -279,5 +291,15 @@ private:
     /** Breakpoints to help determine whether a transaction was confirmed by priority or Fee */
     CFeeRate feeLikely, feeUnlikely;
     double priLikely, priUnlikely;
+
+    /**
+     * Results of estimateFee and estimatePriority for each target, so that repeated
+     * calls don't scan the buckets again. They are dropped whenever the stats they
+     * come from change.
+     */
+    std::vector<double> feeEstimateCache, priEstimateCache;
+
+    /** Forget the cached estimates based on stats */
+    void ClearEstimateCache(const TxConfirmStats* stats);
 };
 #endif /*BITCOIN_POLICYESTIMATOR_H */
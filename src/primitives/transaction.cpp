@@ -17,7 +17,8 @@ JSDescription::JSDescription(ZCJoinSplit& params,
             CAmount vpub_old,
             CAmount vpub_new,
             bool computeProof,
-            uint256 *esk // payment disclosure
+            uint256 *esk, // payment disclosure
+            ZCJSProofWitness *witness // deferred proving
             ) : vpub_old(vpub_old), vpub_new(vpub_new), anchor(anchor)
 {
     boost::array<libzcash::Note, ZC_NUM_JS_OUTPUTS> notes;
@@ -37,7 +38,8 @@ JSDescription::JSDescription(ZCJoinSplit& params,
         vpub_new,
         anchor,
         computeProof,
-        esk // payment disclosure
+        esk, // payment disclosure
+        witness // deferred proving
     );
 }
 
@@ -53,7 +55,8 @@ JSDescription JSDescription::Randomized(
             CAmount vpub_new,
             bool computeProof,
             uint256 *esk, // payment disclosure
-            std::function<int(int)> gen
+            std::function<int(int)> gen,
+            ZCJSProofWitness *witness // deferred proving
         )
 {
     // Randomize the order of the inputs and outputs
@@ -68,7 +71,8 @@ JSDescription JSDescription::Randomized(
     return JSDescription(
         params, pubKeyHash, anchor, inputs, outputs,
         vpub_old, vpub_new, computeProof,
-        esk // payment disclosure
+        esk, // payment disclosure
+        witness // deferred proving
     );
 }
 
@@ -78,7 +78,8 @@ public:
             CAmount vpub_old,
             CAmount vpub_new,
             bool computeProof = true, // Set to false in some tests
-            uint256 *esk = nullptr // payment disclosure
+            uint256 *esk = nullptr, // payment disclosure
+            ZCJSProofWitness *witness = nullptr // deferred proving
     );
 
     static JSDescription Randomized(
@@ -93,7 +94,8 @@ public:
             CAmount vpub_new,
             bool computeProof = true, // Set to false in some tests
             uint256 *esk = nullptr, // payment disclosure
-            std::function<int(int)> gen = GetRandInt
+            std::function<int(int)> gen = GetRandInt,
+            ZCJSProofWitness *witness = nullptr // deferred proving
     );
 
     // Verifies that the JoinSplit proof is correct.
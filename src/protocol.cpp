@@ -17,7 +17,37 @@ static const char* ppszTypeName[] =
     "ERROR",
     "tx",
     "block",
-    "filtered block"
+    "filtered block",
+    "compact block"
+};
+
+static const char* ppszNetMessageType[] =
+{
+    "version",
+    "verack",
+    "addr",
+    "inv",
+    "getdata",
+    "merkleblock",
+    "getblocks",
+    "getheaders",
+    "tx",
+    "headers",
+    "block",
+    "getaddr",
+    "mempool",
+    "ping",
+    "pong",
+    "alert",
+    "notfound",
+    "filterload",
+    "filteradd",
+    "filterclear",
+    "reject",
+    "sendcmpct",
+    "cmpctblock",
+    "getblocktxn",
+    "blocktxn"
 };
 
 CMessageHeader::CMessageHeader(const MessageStartChars& pchMessageStartIn)
@@ -140,3 +170,9 @@ std::string CInv::ToString() const
 {
     return strprintf("%s %s", GetCommand(), hash.ToString());
 }
+
+const std::vector<std::string>& getAllNetMessageTypes()
+{
+    static const std::vector<std::string> vTypes(ppszNetMessageType, ppszNetMessageType + ARRAYLEN(ppszNetMessageType));
+    return vTypes;
+}
@@ -17,6 +17,7 @@
 
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 #define MESSAGE_START_SIZE 4
 
@@ -149,6 +150,12 @@ enum {
     // Nodes may always request a MSG_FILTERED_BLOCK in a getdata, however,
     // MSG_FILTERED_BLOCK should not appear in any invs except as a part of getdata.
     MSG_FILTERED_BLOCK,
+    // Only valid in getdata, from peers which sent a "sendcmpct"; answered
+    // with a "cmpctblock" for recent blocks and a "block" otherwise.
+    MSG_CMPCT_BLOCK,
 };
 
+/** All the message types of the protocol, in the order they are documented */
+const std::vector<std::string>& getAllNetMessageTypes();
+
 #endif // BITCOIN_PROTOCOL_H
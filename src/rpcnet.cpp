@@ -74,6 +74,33 @@ static void CopyNodeStats(std::vector<CNodeStats>& vstats)
     }
 }
 
+static UniValue MsgTypeStatsToJSON(const CMessageTypeStats& stats, bool fHistogram)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("msgssent", stats.nSendMsgs));
+    obj.push_back(Pair("bytessent", stats.nSendBytes));
+    obj.push_back(Pair("msgsrecv", stats.nRecvMsgs));
+    obj.push_back(Pair("bytesrecv", stats.nRecvBytes));
+    obj.push_back(Pair("handled", stats.nHandledMsgs));
+    obj.push_back(Pair("handlingtime", ((double)stats.nHandlingTime) / 1e6));
+    if (fHistogram) {
+        obj.push_back(Pair("maxhandlingtime", ((double)stats.nMaxHandlingTime) / 1e6));
+        UniValue hist(UniValue::VARR);
+        for (int i = 0; i < MSG_HANDLING_TIME_BUCKETS; i++)
+            hist.push_back(stats.vHandlingTimeHist[i]);
+        obj.push_back(Pair("handlingtimehist", hist));
+    }
+    return obj;
+}
+
+static UniValue MsgTypeStatsToJSON(const mapMsgTypeStats& mapStats, bool fHistogram)
+{
+    UniValue obj(UniValue::VOBJ);
+    BOOST_FOREACH(const PAIRTYPE(string, CMessageTypeStats)& item, mapStats)
+        obj.push_back(Pair(item.first, MsgTypeStatsToJSON(item.second, fHistogram)));
+    return obj;
+}
+
 UniValue getpeerinfo(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -105,7 +132,22 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"blockrate\": n,            (numeric) The blocks per second this peer delivers when we request them, 0 if not known yet\n"
+            "    \"blockwindow\": n,          (numeric) The number of blocks we request from this peer at a time\n"
+            "    \"whitelisted\": true|false, (boolean) Whether the peer is whitelisted\n"
+            "    \"sendqueuemsgs\": n,        (numeric) The number of messages waiting to be sent to the peer\n"
+            "    \"sendqueuebytes\": n,       (numeric) The size of the messages waiting to be sent\n"
+            "    \"msgtypes\": {              (json object) Traffic and handling time per message type, \"*other*\" for unknown ones\n"
+            "      \"type\": {\n"
+            "        \"msgssent\": n,         (numeric) The number of messages sent\n"
+            "        \"bytessent\": n,        (numeric) Their total size, including headers\n"
+            "        \"msgsrecv\": n,         (numeric) The number of messages received\n"
+            "        \"bytesrecv\": n,        (numeric) Their total size, including headers\n"
+            "        \"handled\": n,          (numeric) The number of messages processed\n"
+            "        \"handlingtime\": n      (numeric) The time spent processing them, in seconds\n"
+            "      }, ...\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -155,8 +197,13 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            obj.push_back(Pair("blockrate", statestats.dBlockRate));
+            obj.push_back(Pair("blockwindow", statestats.nBlockWindow));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
+        obj.push_back(Pair("sendqueuemsgs", (uint64_t)stats.nSendQueueMsgs));
+        obj.push_back(Pair("sendqueuebytes", (uint64_t)stats.nSendQueueBytes));
+        obj.push_back(Pair("msgtypes", MsgTypeStatsToJSON(stats.mapStatsPerMsgType, false)));
 
         ret.push_back(obj);
     }
@@ -377,6 +424,108 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     return obj;
 }
 
+UniValue getnetworkprofile(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getnetworkprofile ( peerid )\n"
+            "\nReturns the traffic and message handling time per message type, summed over all peers\n"
+            "since startup, or for one connected peer.\n"
+            "\nArguments:\n"
+            "1. peerid                 (numeric, optional) Only report this peer (see getpeerinfo for ids)\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"peers\": n,             (numeric) The number of connected peers included\n"
+            "  \"handlingtimebuckets\": [ (json array) Upper bounds of the handling time histogram buckets, in seconds;\n"
+            "     n, ...                 the last bucket holds everything slower\n"
+            "  ],\n"
+            "  \"msgtypes\": {          (json object) Statistics per message type, \"*other*\" for unknown ones\n"
+            "    \"type\": {\n"
+            "      \"msgssent\": n,       (numeric) The number of messages sent\n"
+            "      \"bytessent\": n,      (numeric) Their total size, including headers\n"
+            "      \"msgsrecv\": n,       (numeric) The number of messages received\n"
+            "      \"bytesrecv\": n,      (numeric) Their total size, including headers\n"
+            "      \"handled\": n,        (numeric) The number of messages processed\n"
+            "      \"handlingtime\": n,   (numeric) The time spent processing them, in seconds\n"
+            "      \"maxhandlingtime\": n, (numeric) The longest time spent on one of them, in seconds\n"
+            "      \"handlingtimehist\": [ (json array) The number of messages per handling time bucket\n"
+            "         n, ...\n"
+            "      ]\n"
+            "    }, ...\n"
+            "  },\n"
+            "  \"peers_by_handlingtime\": [ (json array) Connected peers, those which used the most processing time first\n"
+            "    {\n"
+            "      \"id\": n,             (numeric) Peer index\n"
+            "      \"addr\": \"host:port\", (string) The ip address and port of the peer\n"
+            "      \"handled\": n,        (numeric) The number of messages processed\n"
+            "      \"handlingtime\": n,   (numeric) The time spent processing them, in seconds\n"
+            "      \"bytessent\": n,      (numeric) The total bytes sent\n"
+            "      \"bytesrecv\": n,      (numeric) The total bytes received\n"
+            "      \"sendqueuebytes\": n  (numeric) The size of the messages waiting to be sent\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getnetworkprofile", "")
+            + HelpExampleCli("getnetworkprofile", "3")
+            + HelpExampleRpc("getnetworkprofile", "3")
+        );
+
+    bool fPeer = params.size() > 0;
+    NodeId nPeer = fPeer ? params[0].get_int() : -1;
+
+    vector<CNodeStats> vstats;
+    CopyNodeStats(vstats);
+
+    mapMsgTypeStats mapStats;
+    if (!fPeer)
+        CNode::GetPastMsgTypeStats(mapStats);
+
+    // Peers ordered by the time spent on their messages
+    vector<pair<int64_t, const CNodeStats*> > vPeerTime;
+    BOOST_FOREACH(const CNodeStats& stats, vstats) {
+        if (fPeer && stats.nodeid != nPeer)
+            continue;
+        int64_t nHandlingTime = 0;
+        BOOST_FOREACH(const PAIRTYPE(string, CMessageTypeStats)& item, stats.mapStatsPerMsgType) {
+            mapStats[item.first] += item.second;
+            nHandlingTime += item.second.nHandlingTime;
+        }
+        vPeerTime.push_back(make_pair(nHandlingTime, &stats));
+    }
+    if (fPeer && vPeerTime.empty())
+        throw JSONRPCError(RPC_CLIENT_NODE_NOT_CONNECTED, "Node not found in connected nodes");
+    sort(vPeerTime.rbegin(), vPeerTime.rend());
+
+    UniValue buckets(UniValue::VARR);
+    for (int i = 0; i < MSG_HANDLING_TIME_BUCKETS - 1; i++)
+        buckets.push_back(UniValue(((double)CMessageTypeStats::BucketUpperBound(i)) / 1e6));
+
+    UniValue peers(UniValue::VARR);
+    for (size_t i = 0; i < vPeerTime.size(); i++) {
+        const CNodeStats& stats = *vPeerTime[i].second;
+        uint64_t nHandled = 0;
+        BOOST_FOREACH(const PAIRTYPE(string, CMessageTypeStats)& item, stats.mapStatsPerMsgType)
+            nHandled += item.second.nHandledMsgs;
+        UniValue peer(UniValue::VOBJ);
+        peer.push_back(Pair("id", stats.nodeid));
+        peer.push_back(Pair("addr", stats.addrName));
+        peer.push_back(Pair("handled", nHandled));
+        peer.push_back(Pair("handlingtime", ((double)vPeerTime[i].first) / 1e6));
+        peer.push_back(Pair("bytessent", stats.nSendBytes));
+        peer.push_back(Pair("bytesrecv", stats.nRecvBytes));
+        peer.push_back(Pair("sendqueuebytes", (uint64_t)stats.nSendQueueBytes));
+        peers.push_back(peer);
+    }
+
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("peers", (int)vPeerTime.size()));
+    obj.push_back(Pair("handlingtimebuckets", buckets));
+    obj.push_back(Pair("msgtypes", MsgTypeStatsToJSON(mapStats, true)));
+    obj.push_back(Pair("peers_by_handlingtime", peers));
+    return obj;
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
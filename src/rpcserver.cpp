@@ -271,6 +271,7 @@ static const CRPCCommand vRPCCommands[] =
     { "network",            "getconnectioncount",     &getconnectioncount,     true  },
     { "network",            "getnettotals",           &getnettotals,           true  },
     { "network",            "getpeerinfo",            &getpeerinfo,            true  },
+    { "network",            "getnetworkprofile",      &getnetworkprofile,      true  },
     { "network",            "ping",                   &ping,                   true  },
     { "network",            "setban",                 &setban,                 true  },
     { "network",            "listbanned",             &listbanned,             true  },
@@ -432,20 +433,32 @@ bool StartRPC()
     fRPCRunning = true;
     g_rpcSignals.Started();
 
-    // Launch one async rpc worker.  The ability to launch multiple workers is not recommended at present and thus the option is disabled.
-    getAsyncRPCQueue()->addWorker();
-/*
-    int n = GetArg("-rpcasyncthreads", 1);
-    if (n<1) {
+    // Only z_sendmany operations spending from the same address are kept
+    // from running concurrently.  Nothing stops concurrent operations from
+    // picking the same notes or utxos, so the default is a single worker.
+    int n = GetArg("-rpcasyncthreads", DEFAULT_RPC_ASYNC_THREADS);
+    if (n < 1) {
         LogPrintf("ERROR: Invalid value %d for -rpcasyncthreads.  Must be at least 1.\n", n);
-        strerr = strprintf(_("An error occurred while setting up the Async RPC threads, invalid parameter value of %d (must be at least 1)."), n);
-        uiInterface.ThreadSafeMessageBox(strerr, "", CClientUIInterface::MSG_ERROR);
-        StartShutdown();
-        return;
+        return false;
     }
     for (int i = 0; i < n; i++)
         getAsyncRPCQueue()->addWorker();
-*/
+
+    // Proofs for all async rpc workers share one pool, so the number of
+    // concurrent proofs is bounded regardless of the number of workers.
+    // Each concurrent proof needs RPC_PROVING_THREAD_MEMORY, so by default
+    // no more are run than the memory of the system allows.
+    int nProvers = GetArg("-rpcprovingthreads", DEFAULT_RPC_PROVING_THREADS);
+    int nCoreProvers = std::max(GetNumCores(), 1);
+    int64_t nMemory = GetTotalMemory();
+    int nMemoryProvers = nMemory > 0 ? (int)std::max<int64_t>(nMemory / RPC_PROVING_THREAD_MEMORY, 1) : nCoreProvers;
+    if (nProvers <= 0) {
+        nProvers = std::min(nCoreProvers, nMemoryProvers);
+    } else if (nMemory > 0 && nProvers > nMemoryProvers) {
+        LogPrintf("Warning: %d proving threads may need more than the %d MB of memory of this system\n",
+                  nProvers, (int)(nMemory / (1024 * 1024)));
+    }
+    AsyncRPCProvingPool::sharedInstance()->addWorkers(nProvers);
     return true;
 }
 
@@ -462,6 +475,10 @@ void StopRPC()
     deadlineTimers.clear();
     g_rpcSignals.Stopped();
 
+    // Discard queued proofs first, so that operations waiting on them fail
+    // instead of blocking shutdown.
+    AsyncRPCProvingPool::sharedInstance()->closeAndWait();
+
     // Tells async queue to cancel all operations and shutdown.
     LogPrintf("%s: waiting for async rpc workers to stop\n", __func__);
     getAsyncRPCQueue()->closeAndWait();
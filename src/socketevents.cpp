@@ -0,0 +1,179 @@
+// Copyright (c) 2017 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "socketevents.h"
+
+#include "netbase.h"
+#include "utiltime.h"
+
+#ifdef USE_EPOLL
+#include <errno.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
+bool CSelectSocketEvents::Watch(SOCKET s, bool fRecv, bool fSend, bool fEdgeTriggered)
+{
+    if (!IsSupportedSocket(s))
+        return false;
+    LOCK(cs);
+    mapSockets[s] = std::make_pair(fRecv, fSend);
+    return true;
+}
+
+void CSelectSocketEvents::Remove(SOCKET s)
+{
+    LOCK(cs);
+    mapSockets.erase(s);
+}
+
+bool CSelectSocketEvents::Wait(int64_t nTimeout, std::vector<CSocketEvent>& vEvents)
+{
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    std::vector<SOCKET> vSockets;
+
+    {
+        LOCK(cs);
+        vSockets.reserve(mapSockets.size());
+        for (const std::pair<SOCKET, std::pair<bool, bool> >& item : mapSockets) {
+            if (item.second.first)
+                FD_SET(item.first, &fdsetRecv);
+            if (item.second.second)
+                FD_SET(item.first, &fdsetSend);
+            FD_SET(item.first, &fdsetError);
+            hSocketMax = std::max(hSocketMax, item.first);
+            vSockets.push_back(item.first);
+        }
+    }
+
+    if (vSockets.empty()) {
+        MilliSleep(nTimeout);
+        return true;
+    }
+
+    struct timeval timeout = MillisToTimeval(nTimeout);
+    int nSelect = select(hSocketMax + 1, &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    if (nSelect == SOCKET_ERROR)
+        return false;
+    if (nSelect == 0)
+        return true;
+
+    for (SOCKET s : vSockets) {
+        CSocketEvent event(s);
+        event.fRecv = FD_ISSET(s, &fdsetRecv);
+        event.fSend = FD_ISSET(s, &fdsetSend);
+        event.fError = FD_ISSET(s, &fdsetError);
+        if (event.fRecv || event.fSend || event.fError)
+            vEvents.push_back(event);
+    }
+    return true;
+}
+
+#ifdef USE_EPOLL
+//! Maximum number of events collected by one epoll_wait() call
+static const int MAX_EPOLL_EVENTS = 256;
+
+CEpollSocketEvents::CEpollSocketEvents()
+{
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+}
+
+CEpollSocketEvents::~CEpollSocketEvents()
+{
+    if (epollfd != -1)
+        close(epollfd);
+}
+
+bool CEpollSocketEvents::Watch(SOCKET s, bool fRecv, bool fSend, bool fEdgeTriggered)
+{
+    // Errors and hangups are reported even without any interest
+    uint32_t nEvents = 0;
+    if (fRecv)
+        nEvents |= EPOLLIN | EPOLLRDHUP;
+    if (fSend)
+        nEvents |= EPOLLOUT;
+    if (fEdgeTriggered)
+        nEvents |= EPOLLET;
+
+    LOCK(cs);
+    std::map<SOCKET, uint32_t>::iterator it = mapSockets.find(s);
+    if (it != mapSockets.end() && it->second == nEvents)
+        return true;
+
+    struct epoll_event event;
+    event.events = nEvents;
+    event.data.fd = s;
+    int op = (it == mapSockets.end() ? EPOLL_CTL_ADD : EPOLL_CTL_MOD);
+    if (epoll_ctl(epollfd, op, s, &event) != 0) {
+        // The descriptor was closed and reused without being removed
+        if (op == EPOLL_CTL_ADD && errno == EEXIST)
+            op = EPOLL_CTL_MOD;
+        else if (op == EPOLL_CTL_MOD && errno == ENOENT)
+            op = EPOLL_CTL_ADD;
+        else
+            return false;
+        if (epoll_ctl(epollfd, op, s, &event) != 0)
+            return false;
+    }
+    mapSockets[s] = nEvents;
+    return true;
+}
+
+void CEpollSocketEvents::Remove(SOCKET s)
+{
+    LOCK(cs);
+    if (mapSockets.erase(s)) {
+        struct epoll_event event;
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, s, &event);
+    }
+}
+
+bool CEpollSocketEvents::Wait(int64_t nTimeout, std::vector<CSocketEvent>& vEvents)
+{
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int nReady = epoll_wait(epollfd, events, MAX_EPOLL_EVENTS, nTimeout);
+    if (nReady < 0)
+        return errno == EINTR;
+
+    for (int i = 0; i < nReady; i++) {
+        CSocketEvent event(events[i].data.fd);
+        event.fRecv = events[i].events & (EPOLLIN | EPOLLRDHUP);
+        event.fSend = events[i].events & EPOLLOUT;
+        event.fError = events[i].events & (EPOLLERR | EPOLLHUP);
+        vEvents.push_back(event);
+    }
+    return true;
+}
+#endif
+
+std::vector<std::string> GetSocketEventsModes()
+{
+    std::vector<std::string> vModes;
+    vModes.push_back("select");
+#ifdef USE_EPOLL
+    vModes.push_back("epoll");
+#endif
+    return vModes;
+}
+
+CSocketEvents* CreateSocketEvents(const std::string& strMode)
+{
+    if (strMode == "select")
+        return new CSelectSocketEvents();
+#ifdef USE_EPOLL
+    if (strMode == "epoll") {
+        CEpollSocketEvents* pevents = new CEpollSocketEvents();
+        if (pevents->IsValid())
+            return pevents;
+        delete pevents;
+    }
+#endif
+    return NULL;
+}
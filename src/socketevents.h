@@ -0,0 +1,130 @@
+// Copyright (c) 2017 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SOCKETEVENTS_H
+#define BITCOIN_SOCKETEVENTS_H
+
+#if defined(HAVE_CONFIG_H)
+#include "config/bitcoin-config.h"
+#endif
+
+#include "compat.h"
+#include "sync.h"
+
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#if defined(HAVE_SYS_EPOLL_H) && !defined(WIN32)
+#define USE_EPOLL 1
+#endif
+
+/** -socketevents default */
+#ifdef USE_EPOLL
+static const char* const DEFAULT_SOCKET_EVENTS = "epoll";
+#else
+static const char* const DEFAULT_SOCKET_EVENTS = "select";
+#endif
+
+/** Readiness of one socket, as reported by CSocketEvents::Wait() */
+struct CSocketEvent
+{
+    SOCKET socket;
+    bool fRecv;
+    bool fSend;
+    bool fError;
+
+    CSocketEvent(SOCKET socketIn) : socket(socketIn), fRecv(false), fSend(false), fError(false) {}
+};
+
+/**
+ * Waits for sockets to become ready for receiving or sending.
+ *
+ * Backends may be edge triggered, reporting readiness only once until the
+ * socket has been drained. Callers must therefore remember readiness until a
+ * recv() or send() on the socket would block, and not merely until the next
+ * Wait(). Adding interest with Watch() reports the socket again if it is
+ * already ready for it, so readiness may also be forgotten while the interest
+ * in it is dropped.
+ *
+ * Sockets must be removed before they are closed. All methods are thread safe.
+ */
+class CSocketEvents
+{
+public:
+    virtual ~CSocketEvents() {}
+
+    virtual const char* GetName() const = 0;
+
+    /** Returns false if this backend cannot watch s (e.g. fd >= FD_SETSIZE for select). */
+    virtual bool IsSupportedSocket(SOCKET s) const = 0;
+
+    /**
+     * Start watching s, or change what it is watched for. Listening sockets
+     * should not be edge triggered, as only one connection is accepted for
+     * each event.
+     */
+    virtual bool Watch(SOCKET s, bool fRecv, bool fSend, bool fEdgeTriggered = true) = 0;
+    virtual void Remove(SOCKET s) = 0;
+
+    /**
+     * Wait for at most nTimeout milliseconds for any watched socket to
+     * become ready, appending the ready sockets to vEvents. Returns false,
+     * with the error left in WSAGetLastError(), if waiting failed.
+     */
+    virtual bool Wait(int64_t nTimeout, std::vector<CSocketEvent>& vEvents) = 0;
+};
+
+/** Level triggered backend using select(), which works everywhere. */
+class CSelectSocketEvents : public CSocketEvents
+{
+public:
+    const char* GetName() const { return "select"; }
+    bool IsSupportedSocket(SOCKET s) const { return IsSelectableSocket(s); }
+    bool Watch(SOCKET s, bool fRecv, bool fSend, bool fEdgeTriggered = true);
+    void Remove(SOCKET s);
+    bool Wait(int64_t nTimeout, std::vector<CSocketEvent>& vEvents);
+
+private:
+    CCriticalSection cs;
+    //! Receive and send interest of each watched socket
+    std::map<SOCKET, std::pair<bool, bool> > mapSockets;
+};
+
+#ifdef USE_EPOLL
+/**
+ * Edge triggered backend using Linux epoll, which has no limit on socket
+ * numbers and whose cost does not grow with the number of idle sockets.
+ * Write interest is registered only while a socket has something to send.
+ */
+class CEpollSocketEvents : public CSocketEvents
+{
+public:
+    CEpollSocketEvents();
+    ~CEpollSocketEvents();
+
+    const char* GetName() const { return "epoll"; }
+    bool IsSupportedSocket(SOCKET s) const { return true; }
+    bool Watch(SOCKET s, bool fRecv, bool fSend, bool fEdgeTriggered = true);
+    void Remove(SOCKET s);
+    bool Wait(int64_t nTimeout, std::vector<CSocketEvent>& vEvents);
+
+    bool IsValid() const { return epollfd != -1; }
+
+private:
+    CCriticalSection cs;
+    int epollfd;
+    //! Events currently registered for each watched socket
+    std::map<SOCKET, uint32_t> mapSockets;
+};
+#endif
+
+/** The -socketevents modes which are available on this platform. */
+std::vector<std::string> GetSocketEventsModes();
+
+/** Create the backend named by strMode, or return NULL if it is unavailable. */
+CSocketEvents* CreateSocketEvents(const std::string& strMode);
+
+#endif // BITCOIN_SOCKETEVENTS_H
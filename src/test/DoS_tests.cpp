@@ -28,13 +28,18 @@
 // Tests this internal-to-main.cpp method:
 extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
 extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
+extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxUsage);
 struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    size_t nUsage;
 };
 extern std::map<uint256, COrphanTx> mapOrphanTransactions;
 extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern std::set<std::pair<int64_t, uint256> > setOrphanTransactionsByExpiry;
+extern size_t nOrphanTransactionsUsage;
+extern std::map<NodeId, size_t> mapOrphanTransactionsUsageByPeer;
 
 CService ip(uint32_t i)
 {
@@ -189,13 +194,73 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     }
 
     // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
+    LimitOrphanTxSize(40, SIZE_MAX);
     BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
+    LimitOrphanTxSize(10, SIZE_MAX);
     BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
+    LimitOrphanTxSize(0, SIZE_MAX);
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK(setOrphanTransactionsByExpiry.empty());
+    BOOST_CHECK_EQUAL(nOrphanTransactionsUsage, 0);
+    BOOST_CHECK(mapOrphanTransactionsUsageByPeer.empty());
+}
+
+static CTransaction MakeOrphan()
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.n = 0;
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1*CENT;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphans_usage)
+{
+    int64_t nStartTime = GetTime();
+    SetMockTime(nStartTime);
+
+    // A peer can only fill its share of the pool...
+    size_t nMaxPeerUsage = DEFAULT_MAX_ORPHAN_POOL_SIZE * 1000 / ORPHAN_POOL_PEER_SHARE;
+    int nAdded = 0;
+    while (AddOrphanTx(MakeOrphan(), 0))
+        nAdded++;
+    BOOST_CHECK(nAdded > 0);
+    BOOST_CHECK(mapOrphanTransactionsUsageByPeer[0] <= nMaxPeerUsage);
+    BOOST_CHECK_EQUAL(nOrphanTransactionsUsage, mapOrphanTransactionsUsageByPeer[0]);
+
+    // ...while others still have room
+    SetMockTime(nStartTime + ORPHAN_TX_EXPIRE_TIME / 2);
+    BOOST_CHECK(AddOrphanTx(MakeOrphan(), 1));
+    BOOST_CHECK(AddOrphanTx(MakeOrphan(), 2));
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsUsageByPeer.size(), 3);
+
+    // The pool is trimmed to its memory limit
+    size_t nUsage = nOrphanTransactionsUsage;
+    LimitOrphanTxSize(nAdded + 2, SIZE_MAX);
+    BOOST_CHECK_EQUAL(nOrphanTransactionsUsage, nUsage);
+    LimitOrphanTxSize(nAdded + 2, nUsage / 2);
+    BOOST_CHECK(nOrphanTransactionsUsage <= nUsage / 2);
+    BOOST_CHECK(mapOrphanTransactions.size() < (size_t)nAdded);
+
+    // Orphans expire in the order they arrived
+    SetMockTime(nStartTime + ORPHAN_TX_EXPIRE_TIME);
+    LimitOrphanTxSize(nAdded + 2, SIZE_MAX);
+    BOOST_CHECK(!mapOrphanTransactionsUsageByPeer.count(0));
+    BOOST_CHECK(mapOrphanTransactions.size() <= 2);
+
+    SetMockTime(nStartTime + ORPHAN_TX_EXPIRE_TIME * 3 / 2);
+    LimitOrphanTxSize(nAdded + 2, SIZE_MAX);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK(setOrphanTransactionsByExpiry.empty());
+    BOOST_CHECK_EQUAL(nOrphanTransactionsUsage, 0);
+    BOOST_CHECK(mapOrphanTransactionsUsageByPeer.empty());
+
+    SetMockTime(0);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,291 @@
+// Copyright (c) 2017 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockdownload.h"
+#include "chain.h"
+#include "chainparams.h"
+#include "main.h"
+#include "net.h"
+#include "random.h"
+
+#include "test/test_bitcoin.h"
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+// Tests these internal-to-main.cpp methods:
+extern bool MarkBlockAsReceived(const uint256& hash, NodeId nodeidFrom, int64_t nNow);
+extern void UpdateBlockAvailability(NodeId nodeid, const uint256 &hash);
+extern void RequestNextBlocks(NodeId nodeid, const Consensus::Params& consensusParams, int64_t nNow, std::vector<CBlockIndex*>& vToDownload);
+
+//! Round trip time of the simulated peers (in microseconds)
+static const int64_t SIM_LATENCY = 100000;
+//! Start and step of the simulated clock (in microseconds)
+static const int64_t SIM_START = 1000000;
+static const int64_t SIM_STEP = 10000;
+
+/** A peer which serves our block requests in order, taking nServiceTime for each, or never if it is 0. */
+struct SimPeer
+{
+    int64_t nServiceTime;
+    std::unique_ptr<CNode> pnode;
+    deque<pair<int, int64_t> > vRequests; // height and time of delivery
+
+    SimPeer(int64_t nServiceTimeIn, const string& strAddr) : nServiceTime(nServiceTimeIn),
+        pnode(new CNode(INVALID_SOCKET, CAddress(CService(strAddr, Params().GetDefaultPort())), "", true)) {}
+};
+
+/**
+ * Headers for nBlocks blocks on top of our tip, downloaded from simulated
+ * peers by the same code SendMessages uses.
+ */
+class SimDownload
+{
+public:
+    vector<CBlockIndex*> vBlocks;
+    vector<int> vOwner;             // peer a missing block is in flight from, or -1
+    vector<std::unique_ptr<SimPeer> > vPeers;
+    int nFirstMissing;
+    int nRerequests;
+    int64_t nNow;
+
+    SimDownload(int nBlocks, const vector<int64_t>& vServiceTimes) :
+        vOwner(nBlocks, -1), nFirstMissing(0), nRerequests(0), nNow(SIM_START)
+    {
+        LOCK(cs_main);
+        CBlockIndex* pprev = chainActive.Tip();
+        for (int i = 0; i < nBlocks; i++) {
+            CBlockIndex* pindex = new CBlockIndex();
+            pindex->pprev = pprev;
+            pindex->nHeight = pprev->nHeight + 1;
+            pindex->nChainWork = pprev->nChainWork + 1;
+            pindex->nStatus = BLOCK_VALID_TREE;
+            pindex->phashBlock = &mapBlockIndex.insert(make_pair(GetRandHash(), pindex)).first->first;
+            pindex->BuildSkip();
+            vBlocks.push_back(pindex);
+            pprev = pindex;
+        }
+        for (size_t i = 0; i < vServiceTimes.size(); i++) {
+            vPeers.emplace_back(new SimPeer(vServiceTimes[i], strprintf("10.0.1.%d", i + 1)));
+            UpdateBlockAvailability(GetId(i), vBlocks.back()->GetBlockHash());
+        }
+    }
+
+    ~SimDownload()
+    {
+        // Disconnecting the peers forgets what they had in flight
+        vPeers.clear();
+        LOCK(cs_main);
+        BOOST_FOREACH(CBlockIndex* pindex, vBlocks) {
+            mapBlockIndex.erase(pindex->GetBlockHash());
+            delete pindex;
+        }
+    }
+
+    NodeId GetId(int nPeer) const { return vPeers[nPeer]->pnode->GetId(); }
+
+    CNodeStateStats GetStats(int nPeer) const
+    {
+        CNodeStateStats stats;
+        BOOST_REQUIRE(GetNodeStateStats(GetId(nPeer), stats));
+        return stats;
+    }
+
+    void Deliver()
+    {
+        LOCK(cs_main);
+        for (size_t i = 0; i < vPeers.size(); i++) {
+            SimPeer& peer = *vPeers[i];
+            while (!peer.vRequests.empty() && peer.vRequests.front().second != -1 && peer.vRequests.front().second <= nNow) {
+                int n = peer.vRequests.front().first;
+                peer.vRequests.pop_front();
+                // Like ProcessMessages, whether we still expect it from this peer or not
+                MarkBlockAsReceived(vBlocks[n]->GetBlockHash(), GetId(i), nNow);
+                vBlocks[n]->nStatus |= BLOCK_HAVE_DATA;
+                vOwner[n] = -1;
+            }
+        }
+        while (nFirstMissing < (int)vBlocks.size() && (vBlocks[nFirstMissing]->nStatus & BLOCK_HAVE_DATA)) {
+            vBlocks[nFirstMissing]->nChainTx = 1;
+            nFirstMissing++;
+        }
+    }
+
+    void Request(int nPeer)
+    {
+        LOCK(cs_main);
+        SimPeer& peer = *vPeers[nPeer];
+        vector<CBlockIndex*> vToDownload;
+        RequestNextBlocks(GetId(nPeer), Params().GetConsensus(), nNow, vToDownload);
+        BOOST_FOREACH(CBlockIndex* pindex, vToDownload) {
+            int n = pindex->nHeight - vBlocks[0]->nHeight;
+            if (vOwner[n] != -1)
+                nRerequests++;
+            vOwner[n] = nPeer;
+            int64_t nDelivery = -1;
+            if (peer.nServiceTime > 0) {
+                nDelivery = nNow + SIM_LATENCY + peer.nServiceTime;
+                if (!peer.vRequests.empty())
+                    nDelivery = max(nDelivery, peer.vRequests.back().second + peer.nServiceTime);
+            }
+            peer.vRequests.push_back(make_pair(n, nDelivery));
+        }
+    }
+
+    /** Time the whole download takes (in microseconds), or -1 if it isn't done by nLimit */
+    int64_t Run(int64_t nLimit)
+    {
+        while (nNow - SIM_START <= nLimit) {
+            Deliver();
+            if (nFirstMissing == (int)vBlocks.size())
+                return nNow - SIM_START;
+            for (size_t i = 0; i < vPeers.size(); i++)
+                Request(i);
+            nNow += SIM_STEP;
+        }
+        return -1;
+    }
+};
+
+BOOST_FIXTURE_TEST_SUITE(blockdownload_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(blockdownload_rate)
+{
+    CBlockDownloadRate rate;
+    BOOST_CHECK(!rate.IsMeasured());
+    BOOST_CHECK_EQUAL(rate.GetRate(), 0);
+    BOOST_CHECK_EQUAL(rate.GetWindow(), DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // Ten blocks per second while there is something in flight
+    int64_t nNow = 1000000;
+    rate.BlockRequested(nNow, 0);
+    rate.BlockRequested(nNow, 1);
+    for (int i = 0; i < 20; i++) {
+        nNow += 100000;
+        rate.BlockDelivered(nNow, 1);
+        rate.BlockRequested(nNow, 1);
+    }
+    BOOST_CHECK(rate.IsMeasured());
+    BOOST_CHECK_CLOSE(rate.GetRate(), 10.0, 0.01);
+    BOOST_CHECK_EQUAL(rate.GetWindow(), BLOCK_DOWNLOAD_QUEUE_TIME * 10);
+
+    // Time without anything in flight doesn't count
+    nNow += 100000;
+    rate.BlockDelivered(nNow, 0);
+    nNow += 60 * 1000000;
+    BOOST_CHECK(!rate.IsStalling(nNow));
+    rate.BlockRequested(nNow, 0);
+    nNow += 100000;
+    rate.BlockDelivered(nNow, 0);
+    BOOST_CHECK_CLOSE(rate.GetRate(), 10.0, 0.01);
+
+    // The window stays within its bounds
+    CBlockDownloadRate fast, slow;
+    fast.BlockRequested(nNow, 0);
+    fast.BlockDelivered(nNow + 1000, 0);
+    slow.BlockRequested(nNow, 0);
+    slow.BlockDelivered(nNow + 10 * 1000000, 0);
+    BOOST_CHECK_EQUAL(fast.GetWindow(), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(slow.GetWindow(), MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK(fast.IsFasterThan(slow));
+    BOOST_CHECK(!slow.IsFasterThan(fast));
+    BOOST_CHECK(fast.IsFasterThan(CBlockDownloadRate()));
+    BOOST_CHECK(!CBlockDownloadRate().IsFasterThan(slow));
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_stalling)
+{
+    // A peer we know nothing about gets UNMEASURED_BLOCK_STALL_TIME
+    int64_t nNow = 1000000;
+    CBlockDownloadRate rate;
+    rate.BlockRequested(nNow, 0);
+    BOOST_CHECK(!rate.IsStalling(nNow + UNMEASURED_BLOCK_STALL_TIME * 1000000));
+    BOOST_CHECK(rate.IsStalling(nNow + UNMEASURED_BLOCK_STALL_TIME * 1000000 + 1));
+
+    // A slow peer gets BLOCK_STALL_INTERVALS of its usual interval
+    int64_t nInterval = MIN_BLOCK_STALL_TIME * 1000000;
+    nNow += nInterval;
+    rate.BlockDelivered(nNow, 1);
+    BOOST_CHECK(!rate.IsStalling(nNow + BLOCK_STALL_INTERVALS * nInterval));
+    BOOST_CHECK(rate.IsStalling(nNow + BLOCK_STALL_INTERVALS * nInterval + 1));
+
+    // A fast peer gets MIN_BLOCK_STALL_TIME
+    CBlockDownloadRate fast;
+    fast.BlockRequested(nNow, 0);
+    fast.BlockRequested(nNow, 1);
+    nNow += 100000;
+    fast.BlockDelivered(nNow, 1);
+    BOOST_CHECK(!fast.IsStalling(nNow + MIN_BLOCK_STALL_TIME * 1000000));
+    BOOST_CHECK(fast.IsStalling(nNow + MIN_BLOCK_STALL_TIME * 1000000 + 1));
+
+    // Nothing is expected from a peer which has nothing in flight
+    rate.BlockCancelled(0);
+    BOOST_CHECK(!rate.IsStalling(nNow + nInterval * 100));
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_simulated_mixed_peers)
+{
+    // Two fast peers and two slow ones
+    vector<int64_t> vServiceTimes;
+    vServiceTimes.push_back(20000);
+    vServiceTimes.push_back(30000);
+    vServiceTimes.push_back(1000000);
+    vServiceTimes.push_back(1500000);
+
+    SimDownload sim(2000, vServiceTimes);
+    int64_t nTime = sim.Run(3600 * 1000000LL);
+    BOOST_REQUIRE(nTime > 0);
+    BOOST_TEST_MESSAGE("download took " << nTime / 1000 << "ms, " << sim.nRerequests << " blocks re-requested");
+
+    // Slow peers don't hold up the download window for long
+    BOOST_CHECK(nTime < 120 * 1000000LL);
+
+    // The windows follow the peers' speed
+    CNodeStateStats fast = sim.GetStats(0), slow = sim.GetStats(2), slowest = sim.GetStats(3);
+    BOOST_CHECK(fast.dBlockRate > slow.dBlockRate);
+    BOOST_CHECK(fast.nBlockWindow > slow.nBlockWindow);
+    BOOST_CHECK(slowest.nBlockWindow < DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER);
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_simulated_dead_peer)
+{
+    // One of the peers never delivers anything
+    vector<int64_t> vServiceTimes;
+    vServiceTimes.push_back(20000);
+    vServiceTimes.push_back(0);
+    vServiceTimes.push_back(50000);
+
+    // Its blocks are re-requested from the others once it has had
+    // UNMEASURED_BLOCK_STALL_TIME to deliver the first one
+    SimDownload sim(1000, vServiceTimes);
+    int64_t nTime = sim.Run(600 * 1000000LL);
+    BOOST_REQUIRE(nTime > 0);
+    BOOST_CHECK(nTime > UNMEASURED_BLOCK_STALL_TIME * 1000000LL);
+    BOOST_CHECK(nTime < (UNMEASURED_BLOCK_STALL_TIME + 30) * 1000000LL);
+    BOOST_CHECK(sim.nRerequests >= DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(sim.GetStats(1).dBlockRate, 0);
+}
+
+BOOST_AUTO_TEST_CASE(blockdownload_simulated_slow_link)
+{
+    // A peer which takes 20s for each block is slow, but not stalling
+    vector<int64_t> vServiceTimes;
+    vServiceTimes.push_back(20000);
+    vServiceTimes.push_back(20 * 1000000LL);
+
+    SimDownload sim(200, vServiceTimes);
+    int64_t nTime = sim.Run(3600 * 1000000LL);
+    BOOST_REQUIRE(nTime > 0);
+    BOOST_CHECK_EQUAL(sim.nRerequests, 0);
+    BOOST_CHECK(sim.GetStats(1).dBlockRate > 0);
+    BOOST_CHECK_EQUAL(sim.GetStats(1).nBlockWindow, MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -460,6 +460,122 @@ BOOST_AUTO_TEST_CASE(merkle_block_4_test_update_none)
     BOOST_CHECK(!filter.contains(COutPoint(uint256S("0x02981fa052f0481dbc5868f4fc2166035a10f27a03cfd2de67326471df5bc041"), 0)));
 }
 
+BOOST_AUTO_TEST_CASE(bloom_match_joinsplit)
+{
+    CMutableTransaction mtx;
+    JSDescription jsdesc;
+    jsdesc.nullifiers[0] = GetRandHash();
+    jsdesc.nullifiers[1] = GetRandHash();
+    jsdesc.commitments[0] = GetRandHash();
+    jsdesc.commitments[1] = GetRandHash();
+    mtx.vjoinsplit.push_back(jsdesc);
+    CTransaction tx(mtx);
+
+    CBloomFilter filter(10, 0.000001, 0, BLOOM_UPDATE_ALL);
+    filter.insert(GetRandHash());
+    BOOST_CHECK_MESSAGE(!filter.IsRelevantAndUpdate(tx), "Simple Bloom filter matched random tx");
+
+    filter = CBloomFilter(10, 0.000001, 0, BLOOM_UPDATE_ALL);
+    filter.insert(jsdesc.nullifiers[1]);
+    BOOST_CHECK_MESSAGE(filter.IsRelevantAndUpdate(tx), "Simple Bloom filter didn't match JoinSplit nullifier");
+
+    filter = CBloomFilter(10, 0.000001, 0, BLOOM_UPDATE_ALL);
+    filter.insert(jsdesc.commitments[0]);
+    BOOST_CHECK_MESSAGE(filter.IsRelevantAndUpdate(CBloomTxElements(tx)), "Simple Bloom filter didn't match JoinSplit commitment");
+}
+
+static CBlock BuildFilterableBlock(unsigned int nTx, std::vector<std::vector<unsigned char> >& vKeys)
+{
+    CBlock block;
+    for (unsigned int i = 0; i < nTx; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), i);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = i;
+        vKeys.push_back(ParseHex(GetRandHash().ToString().substr(0, 40)));
+        tx.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vKeys.back() << OP_EQUALVERIFY << OP_CHECKSIG;
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(merkle_block_filterable)
+{
+    // Odd numbers of transactions make for levels of odd width
+    for (unsigned int nTx = 1; nTx < 40; nTx += 7) {
+        std::vector<std::vector<unsigned char> > vKeys;
+        CBlock block = BuildFilterableBlock(nTx, vKeys);
+        CFilterableBlock fblock(block);
+
+        // Peers with the same filter get the same merkleblock, and their filters are updated the same
+        for (unsigned int nStep = 1; nStep <= nTx; nStep += 3) {
+            CBloomFilter filter(10, 0.000001, nStep, BLOOM_UPDATE_ALL);
+            for (unsigned int i = 0; i < nTx; i += nStep)
+                filter.insert(vKeys[i]);
+            CBloomFilter filterCached = filter;
+
+            CMerkleBlock merkleBlock(block, filter);
+            CMerkleBlock merkleBlockCached(fblock, filterCached);
+
+            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION), ssCached(SER_NETWORK, PROTOCOL_VERSION);
+            ss << merkleBlock << filter;
+            ssCached << merkleBlockCached << filterCached;
+            BOOST_CHECK(ss.str() == ssCached.str());
+            BOOST_CHECK(merkleBlock.vMatchedTxn == merkleBlockCached.vMatchedTxn);
+
+            vector<uint256> vMatched;
+            BOOST_CHECK(merkleBlockCached.txn.ExtractMatches(vMatched) == block.hashMerkleRoot);
+            BOOST_CHECK_EQUAL(vMatched.size(), (nTx + nStep - 1) / nStep);
+            BOOST_CHECK(filterCached.contains(COutPoint(block.vtx[0].GetHash(), 0)));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(merkle_block_filterable_reuse)
+{
+    std::vector<std::vector<unsigned char> > vKeys;
+    CFilterableBlock fblock(BuildFilterableBlock(10, vKeys));
+
+    // Filters with different tweaks matching the same transactions share the partial merkle tree
+    std::vector<bool> vMatch(10, false);
+    vMatch[3] = true;
+    CPartialMerkleTree txn = fblock.GetPartialMerkleTree(vMatch);
+    for (unsigned int nTweak = 0; nTweak < 3; nTweak++) {
+        CBloomFilter filter(10, 0.000001, nTweak, BLOOM_UPDATE_NONE);
+        filter.insert(vKeys[3]);
+        CMerkleBlock merkleBlock(fblock, filter);
+        BOOST_REQUIRE_EQUAL(merkleBlock.vMatchedTxn.size(), 1);
+        BOOST_CHECK_EQUAL(merkleBlock.vMatchedTxn[0].first, 3);
+
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION), ssShared(SER_NETWORK, PROTOCOL_VERSION);
+        ss << merkleBlock.txn;
+        ssShared << txn;
+        BOOST_CHECK(ss.str() == ssShared.str());
+    }
+
+    // Only so many are kept, and the least recently used go first
+    std::vector<bool> vMatchNone(10, false);
+    fblock.GetPartialMerkleTree(vMatchNone);
+    std::vector<std::vector<bool> > vMatchOthers;
+    for (unsigned int i = 0; i < MAX_FILTERABLE_BLOCK_TREES * 2; i++) {
+        std::vector<bool> vMatchOther(10, false);
+        for (unsigned int j = 0; j < 6; j++)
+            vMatchOther[j] = ((i + 1) >> j) & 1;
+        vMatchOther[9] = true;
+        vMatchOthers.push_back(vMatchOther);
+        vector<uint256> vMatched;
+        BOOST_CHECK(fblock.GetPartialMerkleTree(vMatchOther).ExtractMatches(vMatched) == fblock.block.hashMerkleRoot);
+        fblock.GetPartialMerkleTree(vMatchNone);
+    }
+    BOOST_CHECK(fblock.HavePartialMerkleTree(vMatchNone));
+    BOOST_CHECK(!fblock.HavePartialMerkleTree(vMatch));
+    BOOST_CHECK(!fblock.HavePartialMerkleTree(vMatchOthers[MAX_FILTERABLE_BLOCK_TREES]));
+    for (unsigned int i = MAX_FILTERABLE_BLOCK_TREES + 1; i < vMatchOthers.size(); i++)
+        BOOST_CHECK(fblock.HavePartialMerkleTree(vMatchOthers[i]));
+}
+
 static std::vector<unsigned char> RandomData()
 {
     uint256 r = GetRandHash();
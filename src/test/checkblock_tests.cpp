@@ -5,11 +5,16 @@
 #include "clientversion.h"
 #include "consensus/validation.h"
 #include "main.h"
+#include "random.h"
+#include "script/interpreter.h"
 #include "test/test_bitcoin.h"
 #include "utiltime.h"
 #include "zcash/Proof.hpp"
 
 #include <cstdio>
+#include <set>
+
+#include "sodium.h"
 
 #include <boost/filesystem/operations.hpp>
 #include <boost/filesystem/path.hpp>
@@ -64,4 +69,47 @@ BOOST_AUTO_TEST_CASE(May15)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(SkipVerifiedProofs)
+{
+    // A signed transaction with a JoinSplit whose proof doesn't verify
+    CMutableTransaction mtx;
+    mtx.nVersion = 2;
+    mtx.vjoinsplit.resize(1);
+    mtx.vjoinsplit[0].nullifiers.at(0) = GetRandHash();
+    mtx.vjoinsplit[0].nullifiers.at(1) = GetRandHash();
+
+    unsigned char joinSplitPrivKey[crypto_sign_SECRETKEYBYTES];
+    crypto_sign_keypair(mtx.joinSplitPubKey.begin(), joinSplitPrivKey);
+    CScript scriptCode;
+    uint256 dataToBeSigned = SignatureHash(scriptCode, CTransaction(mtx), NOT_AN_INPUT, SIGHASH_ALL);
+    BOOST_REQUIRE(crypto_sign_detached(&mtx.joinSplitSig[0], NULL, dataToBeSigned.begin(), 32, joinSplitPrivKey) == 0);
+    CTransaction tx(mtx);
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vin[0].scriptSig = CScript() << 1 << OP_0;
+    coinbase.vout.resize(1);
+
+    CBlock block;
+    block.nVersion = MIN_BLOCK_VERSION;
+    block.vtx.push_back(coinbase);
+    block.vtx.push_back(tx);
+
+    auto verifier = libzcash::ProofVerifier::Strict();
+    CValidationState state;
+    BOOST_CHECK(!CheckBlock(block, state, verifier, false, false));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "bad-txns-joinsplit-verification-failed");
+
+    // Proofs we were told have been verified already are skipped, other ones aren't
+    std::set<uint256> setProofsVerified;
+    setProofsVerified.insert(GetRandHash());
+    CValidationState state2;
+    BOOST_CHECK(!CheckBlock(block, state2, verifier, false, false, &setProofsVerified));
+
+    setProofsVerified.insert(tx.GetHash());
+    CValidationState state3;
+    BOOST_CHECK(CheckBlock(block, state3, verifier, false, false, &setProofsVerified));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,7 @@
 
 #include "chainparams.h"
 #include "main.h"
+#include "streams.h"
 
 #include "test/test_bitcoin.h"
 
@@ -101,4 +102,30 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     BOOST_CHECK(Test());
 }
 
+BOOST_AUTO_TEST_CASE(read_raw_block_from_disk)
+{
+    LOCK(cs_main);
+    const CBlockIndex* pindex = chainActive.Genesis();
+    BOOST_REQUIRE(pindex);
+
+    CBlock block;
+    BOOST_REQUIRE(ReadBlockFromDisk(block, pindex));
+    CDataStream ssExpected(SER_NETWORK, PROTOCOL_VERSION);
+    ssExpected << block;
+
+    // The raw bytes are exactly what sending the decoded block would produce
+    CDataStream ssRaw(SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK(ReadRawBlockFromDisk(ssRaw, pindex->GetBlockPos(), pindex->GetBlockHash(), Params().MessageStart()));
+    BOOST_CHECK(ssRaw.str() == ssExpected.str());
+
+    // A different block at the same position is refused
+    CDataStream ssWrong(SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK(!ReadRawBlockFromDisk(ssWrong, pindex->GetBlockPos(), uint256(), Params().MessageStart()));
+
+    // As are positions not preceded by the block file's index header
+    CDiskBlockPos posBad(pindex->GetBlockPos().nFile, pindex->GetBlockPos().nPos + 1);
+    CDataStream ssBad(SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK(!ReadRawBlockFromDisk(ssBad, posBad, pindex->GetBlockHash(), Params().MessageStart()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
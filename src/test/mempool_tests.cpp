@@ -2,7 +2,9 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "consensus/validation.h"
 #include "main.h"
+#include "random.h"
 #include "txmempool.h"
 #include "util.h"
 
@@ -101,4 +103,389 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+static CMutableTransaction MakeSpend(const uint256& hashPrev, unsigned int nOutputs, CAmount nValue)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vin[0].prevout.hash = hashPrev;
+    tx.vin[0].prevout.n = 0;
+    tx.vout.resize(nOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        tx.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[i].nValue = nValue;
+    }
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(MempoolAncestorDescendantTracking)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // A chain of three transactions, with fees 1000, 2000 and 3000
+    CMutableTransaction tx1 = MakeSpend(GetRandHash(), 1, 10000);
+    CMutableTransaction tx2 = MakeSpend(tx1.GetHash(), 1, 9000);
+    CMutableTransaction tx3 = MakeSpend(tx2.GetHash(), 1, 8000);
+    CTxMemPoolEntry entry1(tx1, 1000, 0, 0.0, 1);
+    CTxMemPoolEntry entry2(tx2, 2000, 0, 0.0, 1);
+    CTxMemPoolEntry entry3(tx3, 3000, 0, 0.0, 1);
+    uint64_t nSize = entry1.GetTxSize();
+    BOOST_CHECK_EQUAL(entry2.GetTxSize(), nSize);
+
+    pool.addUnchecked(tx1.GetHash(), entry1);
+    pool.addUnchecked(tx2.GetHash(), entry2);
+    pool.addUnchecked(tx3.GetHash(), entry3);
+
+    CTxMemPool::txiter it1 = pool.mapTx.find(tx1.GetHash());
+    CTxMemPool::txiter it2 = pool.mapTx.find(tx2.GetHash());
+    CTxMemPool::txiter it3 = pool.mapTx.find(tx3.GetHash());
+    BOOST_CHECK_EQUAL(it1->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(it1->GetSizeWithDescendants(), 3 * nSize);
+    BOOST_CHECK_EQUAL(it1->GetModFeesWithDescendants(), 6000);
+    BOOST_CHECK_EQUAL(it2->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(it2->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(it3->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(it3->GetSizeWithAncestors(), 3 * nSize);
+    BOOST_CHECK_EQUAL(it3->GetModFeesWithAncestors(), 6000);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(it1).size(), 1);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolParents(it3).size(), 1);
+
+    // Prioritising a transaction moves the package fees of its relatives
+    pool.PrioritiseTransaction(tx2.GetHash(), tx2.GetHash().ToString(), 0.0, 500);
+    BOOST_CHECK_EQUAL(it2->GetModifiedFee(), 2500);
+    BOOST_CHECK_EQUAL(it1->GetModFeesWithDescendants(), 6500);
+    BOOST_CHECK_EQUAL(it3->GetModFeesWithAncestors(), 6500);
+
+    // The ancestor limits refuse a fourth link in the chain
+    CMutableTransaction tx4 = MakeSpend(tx3.GetHash(), 1, 7000);
+    CTxMemPool::setEntries setAncestors;
+    std::string errString;
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(CTxMemPoolEntry(tx4, 0, 0, 0.0, 1), setAncestors, 4, 100000, 4, 100000, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 3);
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(CTxMemPoolEntry(tx4, 0, 0, 0.0, 1), setAncestors, 3, 100000, 4, 100000, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(CTxMemPoolEntry(tx4, 0, 0, 0.0, 1), setAncestors, 4, 100000, 3, 100000, errString));
+
+    // Mining the first transaction leaves the rest with one ancestor less
+    std::vector<CTransaction> vtx;
+    vtx.push_back(tx1);
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(vtx, 2, conflicts);
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+    BOOST_CHECK_EQUAL(it2->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(it2->GetModFeesWithAncestors(), 2500);
+    BOOST_CHECK_EQUAL(it3->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(it3->GetSizeWithAncestors(), 2 * nSize);
+
+    // Removing the last one leaves its parent without descendants
+    std::list<CTransaction> removed;
+    pool.remove(tx3, removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK_EQUAL(it2->GetCountWithDescendants(), 1);
+    BOOST_CHECK_EQUAL(it2->GetModFeesWithDescendants(), 2500);
+    BOOST_CHECK(pool.GetMemPoolChildren(it2).empty());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolReaddParentTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // After a reorg a parent can come back after its child
+    CMutableTransaction txParent = MakeSpend(GetRandHash(), 2, 10000);
+    CMutableTransaction txChild = MakeSpend(txParent.GetHash(), 1, 9000);
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 2000, 0, 0.0, 1));
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000, 0, 0.0, 1));
+
+    CTxMemPool::txiter itParent = pool.mapTx.find(txParent.GetHash());
+    CTxMemPool::txiter itChild = pool.mapTx.find(txChild.GetHash());
+    BOOST_CHECK_EQUAL(itParent->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 3000);
+    BOOST_CHECK_EQUAL(itChild->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(itChild->GetModFeesWithAncestors(), 3000);
+    BOOST_CHECK(pool.GetMemPoolParents(itChild).count(itParent));
+}
+
+BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // A cheap parent with a rich child, and two unrelated transactions
+    CMutableTransaction txParent = MakeSpend(GetRandHash(), 1, 10000);
+    CMutableTransaction txChild = MakeSpend(txParent.GetHash(), 1, 9000);
+    CMutableTransaction txMiddle = MakeSpend(GetRandHash(), 1, 10000);
+    CMutableTransaction txLow = MakeSpend(GetRandHash(), 1, 10000);
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 100, 3, 0.0, 1));
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 3000, 4, 0.0, 1));
+    pool.addUnchecked(txMiddle.GetHash(), CTxMemPoolEntry(txMiddle, 2000, 1, 0.0, 1));
+    pool.addUnchecked(txLow.GetHash(), CTxMemPoolEntry(txLow, 1000, 2, 0.0, 1));
+
+    // By the transactions' own fee rate, highest first
+    std::vector<uint256> vExpected;
+    vExpected.push_back(txChild.GetHash());
+    vExpected.push_back(txMiddle.GetHash());
+    vExpected.push_back(txLow.GetHash());
+    vExpected.push_back(txParent.GetHash());
+    std::vector<uint256> vFound;
+    CTxMemPool::indexed_transaction_set::index<mining_score>::type::iterator it = pool.mapTx.get<mining_score>().begin();
+    for (; it != pool.mapTx.get<mining_score>().end(); ++it)
+        vFound.push_back(it->GetTx().GetHash());
+    BOOST_CHECK(vFound == vExpected);
+
+    // By ancestor fee rate, where the child pays for its parent
+    vExpected.clear();
+    vExpected.push_back(txMiddle.GetHash());
+    vExpected.push_back(txChild.GetHash());
+    vExpected.push_back(txLow.GetHash());
+    vExpected.push_back(txParent.GetHash());
+    vFound.clear();
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator ait = pool.mapTx.get<ancestor_score>().begin();
+    for (; ait != pool.mapTx.get<ancestor_score>().end(); ++ait)
+        vFound.push_back(ait->GetTx().GetHash());
+    BOOST_CHECK(vFound == vExpected);
+
+    // By descendant fee rate, lowest first, which lifts the parent with its child
+    vExpected.clear();
+    vExpected.push_back(txLow.GetHash());
+    vExpected.push_back(txParent.GetHash());
+    vExpected.push_back(txMiddle.GetHash());
+    vExpected.push_back(txChild.GetHash());
+    vFound.clear();
+    CTxMemPool::indexed_transaction_set::index<descendant_score>::type::iterator dit = pool.mapTx.get<descendant_score>().begin();
+    for (; dit != pool.mapTx.get<descendant_score>().end(); ++dit)
+        vFound.push_back(dit->GetTx().GetHash());
+    BOOST_CHECK(vFound == vExpected);
+
+    // By entry time, oldest first
+    CTxMemPool::indexed_transaction_set::index<entry_time>::type::iterator tit = pool.mapTx.get<entry_time>().begin();
+    BOOST_CHECK(tit->GetTx().GetHash() == txMiddle.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+    int64_t nStartTime = 1000000000;
+    SetMockTime(nStartTime);
+
+    // A well paying transaction, and a poorly paying parent with its child
+    CMutableTransaction tx1 = MakeSpend(GetRandHash(), 1, 10000);
+    CMutableTransaction tx2 = MakeSpend(GetRandHash(), 1, 10000);
+    CMutableTransaction tx3 = MakeSpend(tx2.GetHash(), 1, 9000);
+    CTxMemPoolEntry entry2(tx2, 100, nStartTime, 0.0, 1);
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000, nStartTime, 0.0, 1));
+    pool.addUnchecked(tx2.GetHash(), entry2);
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 200, nStartTime, 0.0, 1));
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), 0);
+
+    // Trimming evicts the cheap package as a whole
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(!pool.exists(tx2.GetHash()));
+    BOOST_CHECK(!pool.exists(tx3.GetHash()));
+
+    // ...and raises the minimum fee above the package's fee rate
+    size_t nPackageSize = 2 * entry2.GetTxSize();
+    CAmount nRollingFee = CFeeRate(300 + CFeeRate(1000).GetFee(nPackageSize), nPackageSize).GetFeePerK();
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), nRollingFee);
+
+    // Which stays until a block has been found...
+    SetMockTime(nStartTime + CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), nRollingFee);
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(std::vector<CTransaction>(), 2, conflicts);
+
+    // ...and then halves every half-life while the pool is more than half full
+    SetMockTime(nStartTime + 2 * CTxMemPool::ROLLING_FEE_HALFLIFE);
+    size_t nLimit = pool.DynamicMemoryUsage();
+    BOOST_CHECK_EQUAL(pool.GetMinFee(nLimit).GetFeePerK(), std::max<CAmount>(nRollingFee / 2, 1000));
+
+    // ...until it drops below half the relay fee
+    SetMockTime(nStartTime + 10 * CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(nLimit).GetFeePerK(), 0);
+
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolExpireTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+
+    // An old transaction takes its newer child along when it expires
+    CMutableTransaction txOld = MakeSpend(GetRandHash(), 1, 10000);
+    CMutableTransaction txChild = MakeSpend(txOld.GetHash(), 1, 9000);
+    CMutableTransaction txNew = MakeSpend(GetRandHash(), 1, 10000);
+    pool.addUnchecked(txOld.GetHash(), CTxMemPoolEntry(txOld, 1000, 100, 0.0, 1));
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 1000, 300, 0.0, 1));
+    pool.addUnchecked(txNew.GetHash(), CTxMemPoolEntry(txNew, 1000, 200, 0.0, 1));
+
+    BOOST_CHECK_EQUAL(pool.Expire(100), 0);
+    BOOST_CHECK_EQUAL(pool.Expire(150), 2);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    BOOST_CHECK(pool.exists(txNew.GetHash()));
+}
+
+struct MempoolEvent
+{
+    char label;
+    uint256 hash;
+    MemPoolRemovalReason reason;
+    uint64_t nSequence;
+};
+
+BOOST_AUTO_TEST_CASE(MempoolNotificationsTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+    std::vector<MempoolEvent> vEvents;
+    boost::signals2::scoped_connection connAdded = pool.NotifyEntryAdded.connect(
+        [&vEvents](const CTransaction& tx, uint64_t nSequence) {
+            vEvents.push_back({'A', tx.GetHash(), MemPoolRemovalReason::UNKNOWN, nSequence});
+        });
+    boost::signals2::scoped_connection connRemoved = pool.NotifyEntryRemoved.connect(
+        [&vEvents](const CTransaction& tx, MemPoolRemovalReason reason, uint64_t nSequence) {
+            vEvents.push_back({'R', tx.GetHash(), reason, nSequence});
+        });
+    BOOST_CHECK_EQUAL(pool.GetSequence(), 1);
+
+    CMutableTransaction txParent = MakeSpend(GetRandHash(), 1, 10000);
+    CMutableTransaction txChild = MakeSpend(txParent.GetHash(), 1, 9000);
+    CMutableTransaction txOld = MakeSpend(GetRandHash(), 1, 10000);
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000, 300, 0.0, 1));
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 1000, 300, 0.0, 1));
+    pool.addUnchecked(txOld.GetHash(), CTxMemPoolEntry(txOld, 1000, 100, 0.0, 1));
+
+    // Mined, expired and otherwise removed transactions are all reported, in order
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(std::vector<CTransaction>(1, txParent), 2, conflicts);
+    BOOST_CHECK_EQUAL(pool.Expire(200), 1);
+    std::list<CTransaction> removed;
+    pool.remove(txChild, removed, true);
+
+    BOOST_REQUIRE_EQUAL(vEvents.size(), 6);
+    const char expectedLabels[] = {'A', 'A', 'A', 'R', 'R', 'R'};
+    const uint256 expectedHashes[] = {txParent.GetHash(), txChild.GetHash(), txOld.GetHash(),
+                                      txParent.GetHash(), txOld.GetHash(), txChild.GetHash()};
+    for (unsigned int i = 0; i < vEvents.size(); i++) {
+        BOOST_CHECK_EQUAL(vEvents[i].label, expectedLabels[i]);
+        BOOST_CHECK(vEvents[i].hash == expectedHashes[i]);
+        BOOST_CHECK_EQUAL(vEvents[i].nSequence, i + 1);
+    }
+    BOOST_CHECK(vEvents[3].reason == MemPoolRemovalReason::BLOCK);
+    BOOST_CHECK(vEvents[4].reason == MemPoolRemovalReason::EXPIRY);
+    BOOST_CHECK(vEvents[5].reason == MemPoolRemovalReason::UNKNOWN);
+    BOOST_CHECK_EQUAL(pool.GetSequence(), 7);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolPrecheckTest)
+{
+    // A child of a mempool transaction has its scripts checked against the parent's outputs
+    CMutableTransaction txParent = MakeSpend(GetRandHash(), 1, 10000);
+    CMutableTransaction txChild = MakeSpend(txParent.GetHash(), 1, 9000);
+    mempool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000, 0, 0.0, 1));
+
+    CValidationState state;
+    CMempoolPrecheck precheck;
+    BOOST_CHECK(PrecheckTransaction(txChild, state, precheck));
+    BOOST_CHECK(precheck.fChecked);
+    BOOST_CHECK_EQUAL(precheck.vSpentOutputs.size(), 1);
+
+    // Which only counts while it spends the same outputs
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+    view.ModifyCoins(txParent.GetHash())->FromTx(txParent, 1);
+    BOOST_CHECK(precheck.ScriptsChecked(txChild, view));
+    view.ModifyCoins(txParent.GetHash())->vout[0].scriptPubKey = CScript() << OP_12 << OP_EQUAL;
+    BOOST_CHECK(!precheck.ScriptsChecked(txChild, view));
+
+    // Failing scripts are left for AcceptToMemoryPool to report...
+    CMutableTransaction txBadScript = txChild;
+    txBadScript.vin[0].scriptSig = CScript() << OP_12;
+    CMempoolPrecheck precheckBadScript;
+    BOOST_CHECK(PrecheckTransaction(txBadScript, state, precheckBadScript));
+    BOOST_CHECK(precheckBadScript.fChecked);
+    BOOST_CHECK(precheckBadScript.vSpentOutputs.empty());
+
+    // ...as are missing inputs, while invalid transactions fail right away
+    CMutableTransaction txOrphan = MakeSpend(GetRandHash(), 1, 9000);
+    CMempoolPrecheck precheckOrphan;
+    BOOST_CHECK(PrecheckTransaction(txOrphan, state, precheckOrphan));
+    BOOST_CHECK(precheckOrphan.vSpentOutputs.empty());
+
+    CMutableTransaction txInvalid = txChild;
+    txInvalid.vout[0].nValue = -1;
+    CMempoolPrecheck precheckInvalid;
+    BOOST_CHECK(!PrecheckTransaction(txInvalid, state, precheckInvalid));
+    BOOST_CHECK(!precheckInvalid.fChecked);
+
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_CASE(MempoolJoinSplitIndexTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    uint256 rt1 = GetRandHash();
+    uint256 rt2 = GetRandHash();
+
+    // Two transactions spending from the first anchor, one of them twice,
+    // and one spending from the second
+    CMutableTransaction txAnchored1;
+    txAnchored1.vout.resize(1);
+    txAnchored1.vout[0].nValue = 10 * COIN;
+    txAnchored1.vjoinsplit.resize(2);
+    txAnchored1.vjoinsplit[0].anchor = rt1;
+    txAnchored1.vjoinsplit[1].anchor = rt1;
+    for (int i = 0; i < 2; i++) {
+        txAnchored1.vjoinsplit[i].nullifiers.at(0) = GetRandHash();
+        txAnchored1.vjoinsplit[i].nullifiers.at(1) = GetRandHash();
+    }
+    CMutableTransaction txAnchored2;
+    txAnchored2.vjoinsplit.resize(2);
+    txAnchored2.vjoinsplit[0].anchor = rt2;
+    txAnchored2.vjoinsplit[1].anchor = rt1;
+    CMutableTransaction txOther;
+    txOther.vjoinsplit.resize(1);
+    txOther.vjoinsplit[0].anchor = rt2;
+    txOther.vjoinsplit[0].nullifiers.at(0) = GetRandHash();
+    txOther.vjoinsplit[0].nullifiers.at(1) = GetRandHash();
+
+    // ...and a transparent child of the first
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(txAnchored1.GetHash(), 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].nValue = 10 * COIN;
+
+    pool.addUnchecked(txAnchored1.GetHash(), CTxMemPoolEntry(txAnchored1, 0, 0, 0.0, 1));
+    pool.addUnchecked(txAnchored2.GetHash(), CTxMemPoolEntry(txAnchored2, 0, 0, 0.0, 1));
+    pool.addUnchecked(txOther.GetHash(), CTxMemPoolEntry(txOther, 0, 0, 0.0, 1));
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 0, 0, 0.0, 1));
+    BOOST_CHECK_EQUAL(pool.size(), 4);
+    BOOST_CHECK(pool.mapNullifiers.count(txAnchored1.vjoinsplit[1].nullifiers.at(0)));
+
+    // An anchor nothing spends from leaves the pool alone
+    pool.removeWithAnchor(GetRandHash());
+    BOOST_CHECK_EQUAL(pool.size(), 4);
+
+    // Invalidating the first anchor takes its spenders with their descendants
+    pool.removeWithAnchor(rt1);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    BOOST_CHECK(pool.exists(txOther.GetHash()));
+    BOOST_CHECK(!pool.mapNullifiers.count(txAnchored1.vjoinsplit[0].nullifiers.at(0)));
+    BOOST_CHECK(pool.mapNullifiers.count(txOther.vjoinsplit[0].nullifiers.at(1)));
+
+    // A transaction reusing a nullifier conflicts with its holder
+    CMutableTransaction txDoubleSpend;
+    txDoubleSpend.vjoinsplit.resize(1);
+    txDoubleSpend.vjoinsplit[0].nullifiers.at(1) = txOther.vjoinsplit[0].nullifiers.at(1);
+    std::list<CTransaction> conflicts;
+    pool.removeConflicts(txDoubleSpend, conflicts);
+    BOOST_CHECK_EQUAL(conflicts.size(), 1);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    BOOST_CHECK(pool.mapNullifiers.empty());
+
+    // Nothing is left behind for the second anchor either
+    pool.addUnchecked(txAnchored1.GetHash(), CTxMemPoolEntry(txAnchored1, 0, 0, 0.0, 1));
+    pool.removeWithAnchor(rt2);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
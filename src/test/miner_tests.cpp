@@ -433,6 +433,29 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
     delete pblocktemplate;
 
+    // The selection is kept between calls: a transaction entering the pool joins it...
+    CMutableTransaction tx3;
+    tx3.vin.resize(1);
+    tx3.vin[0].prevout.hash = tx.GetHash();
+    tx3.vin[0].prevout.n = 0;
+    tx3.vin[0].scriptSig = CScript() << OP_1;
+    tx3.vout.resize(1);
+    tx3.vout[0].nValue = tx.vout[0].nValue - 10000;
+    tx3.vout[0].scriptPubKey = CScript() << OP_1;
+    mempool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 10000, GetTime(), 111.0, 11));
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 3);
+    BOOST_CHECK(pblocktemplate->block.vtx[2].GetHash() == tx3.GetHash());
+    BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[2], 10000);
+    delete pblocktemplate;
+
+    // ...and one leaving it is dropped from it
+    std::list<CTransaction> removed;
+    mempool.remove(tx3, removed);
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    delete pblocktemplate;
+
     chainActive.Tip()->nHeight--;
     SetMockTime(0);
     mempool.clear();
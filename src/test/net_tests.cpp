@@ -0,0 +1,243 @@
+// Copyright (c) 2017 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "hash.h"
+#include "main.h"
+#include "net.h"
+#include "random.h"
+#include "streams.h"
+
+#include "test/test_bitcoin.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+static CDataStream MakeMessage(const char* pszCommand, const vector<unsigned char>& vData)
+{
+    CMessageHeader hdr(Params().MessageStart(), pszCommand, vData.size());
+    uint256 hash = Hash(vData.begin(), vData.end());
+    memcpy(&hdr.nChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    ss.write((const char*)vData.data(), vData.size());
+    return ss;
+}
+
+static vector<unsigned char> MakeData(size_t nSize)
+{
+    vector<unsigned char> vData(nSize);
+    for (size_t i = 0; i < nSize; i++)
+        vData[i] = i * 7;
+    return vData;
+}
+
+BOOST_FIXTURE_TEST_SUITE(net_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(receive_messages_in_pieces)
+{
+    CNode node(INVALID_SOCKET, CAddress(CService("10.0.0.1", Params().GetDefaultPort())), "", true);
+    LOCK(node.cs_vRecvMsg);
+
+    // A small message and a large one, split at awkward places
+    vector<unsigned char> vSmall = MakeData(100);
+    vector<unsigned char> vLarge = MakeData(300 * 1024);
+    CDataStream ss = MakeMessage("ping", vSmall);
+    ss += MakeMessage("block", vLarge);
+
+    size_t nPos = 0;
+    size_t nChunk = 1;
+    while (nPos < ss.size()) {
+        // Large remainders are offered for receiving in place, like the socket handler does
+        unsigned int nSpace = 0;
+        char* pchDirect = node.GetRecvDirectBuffer(nSpace);
+        if (pchDirect) {
+            BOOST_REQUIRE(nSpace > 0);
+            unsigned int nBytes = min((size_t)nSpace, ss.size() - nPos);
+            memcpy(pchDirect, &ss[nPos], nBytes);
+            node.ReceivedDirect(nBytes);
+            nPos += nBytes;
+            continue;
+        }
+        unsigned int nBytes = min(nChunk, ss.size() - nPos);
+        BOOST_REQUIRE(node.ReceiveMsgBytes(&ss[nPos], nBytes));
+        nPos += nBytes;
+        nChunk = nChunk * 3 + 1;
+    }
+
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 2);
+    CNetMessage& msgSmall = node.vRecvMsg[0];
+    CNetMessage& msgLarge = node.vRecvMsg[1];
+    BOOST_CHECK(msgSmall.complete());
+    BOOST_CHECK(msgLarge.complete());
+    BOOST_CHECK_EQUAL(msgSmall.hdr.GetCommand(), "ping");
+    BOOST_CHECK_EQUAL(msgLarge.hdr.GetCommand(), "block");
+    BOOST_CHECK(vector<unsigned char>(msgSmall.vRecv.begin(), msgSmall.vRecv.end()) == vSmall);
+    BOOST_CHECK(vector<unsigned char>(msgLarge.vRecv.begin(), msgLarge.vRecv.end()) == vLarge);
+
+    // The data was hashed as it arrived
+    BOOST_CHECK(msgSmall.GetMessageHash() == Hash(vSmall.begin(), vSmall.end()));
+    BOOST_CHECK(msgLarge.GetMessageHash() == Hash(vLarge.begin(), vLarge.end()));
+
+    // Only the small message's buffer is kept for reuse
+    node.EraseRecvMsgs(node.vRecvMsg.end());
+    BOOST_CHECK(node.vRecvMsg.empty());
+    BOOST_CHECK_EQUAL(node.vRecvBufferPool.size(), 1);
+
+    // ...and taken by the next message
+    CDataStream ssNext = MakeMessage("ping", vSmall);
+    BOOST_REQUIRE(node.ReceiveMsgBytes(&ssNext[0], ssNext.size()));
+    BOOST_CHECK(node.vRecvBufferPool.empty());
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 1);
+    BOOST_CHECK(node.vRecvMsg[0].complete());
+    BOOST_CHECK(node.vRecvMsg[0].GetMessageHash() == Hash(vSmall.begin(), vSmall.end()));
+}
+
+BOOST_AUTO_TEST_CASE(receive_rejects_bad_header)
+{
+    CNode node(INVALID_SOCKET, CAddress(CService("10.0.0.2", Params().GetDefaultPort())), "", true);
+    LOCK(node.cs_vRecvMsg);
+
+    // A header for another network is refused before its data arrives
+    CDataStream ss = MakeMessage("ping", MakeData(100));
+    ss[0] ^= 0xff;
+    BOOST_CHECK(!node.ReceiveMsgBytes(&ss[0], CMessageHeader::HEADER_SIZE));
+    BOOST_CHECK(node.vRecvMsg.back().vRecv.empty());
+}
+
+BOOST_AUTO_TEST_CASE(message_type_stats)
+{
+    CMessageTypeStats stats;
+    stats.RecordHandlingTime(0);
+    stats.RecordHandlingTime(9);
+    stats.RecordHandlingTime(10);
+    stats.RecordHandlingTime(250000);
+    stats.RecordHandlingTime(60 * 1000000);
+    BOOST_CHECK_EQUAL(stats.nHandledMsgs, 5);
+    BOOST_CHECK_EQUAL(stats.nHandlingTime, 60250019);
+    BOOST_CHECK_EQUAL(stats.nMaxHandlingTime, 60 * 1000000);
+    BOOST_CHECK_EQUAL(stats.vHandlingTimeHist[0], 2);
+    BOOST_CHECK_EQUAL(stats.vHandlingTimeHist[1], 1);
+    BOOST_CHECK_EQUAL(stats.vHandlingTimeHist[5], 1);
+    BOOST_CHECK_EQUAL(stats.vHandlingTimeHist[MSG_HANDLING_TIME_BUCKETS - 1], 1);
+    BOOST_CHECK_EQUAL(CMessageTypeStats::BucketUpperBound(5), 1000000);
+    BOOST_CHECK_EQUAL(CMessageTypeStats::BucketUpperBound(MSG_HANDLING_TIME_BUCKETS - 1), -1);
+
+    CMessageTypeStats sum;
+    sum += stats;
+    sum += stats;
+    BOOST_CHECK_EQUAL(sum.nHandledMsgs, 10);
+    BOOST_CHECK_EQUAL(sum.nMaxHandlingTime, 60 * 1000000);
+    BOOST_CHECK_EQUAL(sum.vHandlingTimeHist[0], 4);
+}
+
+BOOST_AUTO_TEST_CASE(message_type_stats_per_peer)
+{
+    CNode node(INVALID_SOCKET, CAddress(CService("10.0.0.3", Params().GetDefaultPort())), "", true);
+
+    CDataStream ss = MakeMessage("ping", MakeData(8));
+    ss += MakeMessage("ping", MakeData(8));
+    ss += MakeMessage("madeup", MakeData(100));
+    {
+        LOCK(node.cs_vRecvMsg);
+        BOOST_REQUIRE(node.ReceiveMsgBytes(&ss[0], ss.size()));
+    }
+    node.RecordMsgHandled("ping", 20);
+    node.RecordMsgHandled("madeup", 5);
+
+    CNodeStats stats;
+    node.copyStats(stats);
+    BOOST_CHECK_EQUAL(stats.nSendQueueMsgs, 0);
+    BOOST_CHECK_EQUAL(stats.mapStatsPerMsgType.size(), 2);
+    BOOST_REQUIRE(stats.mapStatsPerMsgType.count("ping"));
+    const CMessageTypeStats& ping = stats.mapStatsPerMsgType["ping"];
+    BOOST_CHECK_EQUAL(ping.nRecvMsgs, 2);
+    BOOST_CHECK_EQUAL(ping.nRecvBytes, 2 * (CMessageHeader::HEADER_SIZE + 8));
+    BOOST_CHECK_EQUAL(ping.nHandledMsgs, 1);
+    BOOST_CHECK_EQUAL(ping.nHandlingTime, 20);
+
+    // Commands a peer makes up don't get entries of their own
+    BOOST_REQUIRE(stats.mapStatsPerMsgType.count(MSG_TYPE_OTHER));
+    BOOST_CHECK_EQUAL(stats.mapStatsPerMsgType[MSG_TYPE_OTHER].nRecvMsgs, 1);
+    BOOST_CHECK_EQUAL(stats.mapStatsPerMsgType[MSG_TYPE_OTHER].nHandledMsgs, 1);
+}
+
+BOOST_AUTO_TEST_CASE(poisson_next_send)
+{
+    int64_t nNow = 1000000;
+    int64_t nTotal = 0;
+    for (int i = 0; i < 10000; i++) {
+        int64_t nNext = PoissonNextSend(nNow, INVENTORY_BROADCAST_INTERVAL);
+        BOOST_CHECK(nNext >= nNow);
+        nTotal += nNext - nNow;
+    }
+    // The average delay is within a few percent of the interval
+    double dAverage = (double)nTotal / 10000 / 1000000;
+    BOOST_CHECK(dAverage > INVENTORY_BROADCAST_INTERVAL * 0.9);
+    BOOST_CHECK(dAverage < INVENTORY_BROADCAST_INTERVAL * 1.1);
+}
+
+BOOST_AUTO_TEST_CASE(inventory_batches)
+{
+    CNode node(INVALID_SOCKET, CAddress(CService("10.0.0.4", Params().GetDefaultPort())), "", true);
+    node.nVersion = PROTOCOL_VERSION;
+
+    // Transactions are queued once, however often they are relayed
+    vector<uint256> vHashes;
+    for (unsigned int i = 0; i < INVENTORY_BROADCAST_MAX + 10; i++) {
+        CMutableTransaction mtx;
+        mtx.vin.resize(1);
+        mtx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        mtx.vout.resize(1);
+        mtx.vout[0].nValue = 1;
+        CTransaction tx(mtx);
+        mempool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 1000 + i, 0, 0.0, 1));
+        vHashes.push_back(tx.GetHash());
+        node.PushInventory(CInv(MSG_TX, vHashes.back()));
+        node.PushInventory(CInv(MSG_TX, vHashes.back()));
+    }
+    // ...and not at all if the peer already knows them
+    uint256 hashKnown = GetRandHash();
+    node.AddInventoryKnown(CInv(MSG_TX, hashKnown));
+    node.PushInventory(CInv(MSG_TX, hashKnown));
+    BOOST_CHECK_EQUAL(node.setInventoryTxToSend.size(), INVENTORY_BROADCAST_MAX + 10);
+    BOOST_CHECK(node.vInventoryToSend.empty());
+
+    // Transactions which have left the mempool since are forgotten
+    uint256 hashGone = GetRandHash();
+    node.PushInventory(CInv(MSG_TX, hashGone));
+
+    // The first batch goes out right away, and has at most
+    // INVENTORY_BROADCAST_MAX entries, the ones paying the most
+    int64_t nNow = 1000000;
+    node.SendInventoryBatch(nNow);
+    BOOST_CHECK_EQUAL(node.setInventoryTxToSend.size(), 10);
+    BOOST_CHECK(!node.setInventoryTxToSend.count(hashGone));
+    for (unsigned int i = 0; i < 10; i++)
+        BOOST_CHECK(node.setInventoryTxToSend.count(vHashes[i]));
+    BOOST_CHECK(node.nNextInvSend >= nNow);
+    size_t nSendSize = node.nSendSize;
+    BOOST_CHECK(nSendSize > 0);
+
+    // The next one waits for its time
+    if (node.nNextInvSend > nNow) {
+        node.SendInventoryBatch(nNow);
+        BOOST_CHECK_EQUAL(node.setInventoryTxToSend.size(), 10);
+    }
+    node.SendInventoryBatch(node.nNextInvSend);
+    BOOST_CHECK(node.setInventoryTxToSend.empty());
+    BOOST_CHECK(node.nSendSize > nSendSize);
+
+    // Announced transactions aren't queued again
+    node.PushInventory(CInv(MSG_TX, vHashes[5]));
+    BOOST_CHECK(node.setInventoryTxToSend.empty());
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -2,8 +2,10 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "clientversion.h"
 #include "policy/fees.h"
 #include "txmempool.h"
+#include "streams.h"
 #include "uint256.h"
 #include "util.h"
 
@@ -184,6 +186,71 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
 }
 
 
+BOOST_AUTO_TEST_CASE(BlockPolicyEstimatesReadWrite)
+{
+    CTxMemPool mpool(CFeeRate(1000));
+    std::list<CTransaction> dummyConflicted;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 0LL;
+
+    // Fee transactions of increasing fee, where the higher ones get mined sooner
+    std::vector<uint256> txHashes[10];
+    for (int blocknum = 0; blocknum < 95; blocknum++) {
+        for (int j = 0; j < 10; j++) {
+            for (int k = 0; k < 4; k++) {
+                tx.vin[0].prevout.n = 10000*blocknum+100*j+k;
+                uint256 hash = tx.GetHash();
+                mpool.addUnchecked(hash, CTxMemPoolEntry(tx, 1000 * (j+1), GetTime(), 0, blocknum, mpool.HasNoInputsOf(tx)));
+                txHashes[j].push_back(hash);
+            }
+        }
+        std::vector<CTransaction> block;
+        for (int h = 0; h <= blocknum%10; h++) {
+            while (txHashes[9-h].size()) {
+                CTransaction btx;
+                if (mpool.lookup(txHashes[9-h].back(), btx))
+                    block.push_back(btx);
+                txHashes[9-h].pop_back();
+            }
+        }
+        mpool.removeForBlock(block, blocknum + 1, dummyConflicted);
+    }
+
+    std::vector<CFeeRate> origFeeEst;
+    for (int i = 1; i <= 10; i++) {
+        origFeeEst.push_back(mpool.estimateFee(i));
+        // Asking again gives the same answer
+        BOOST_CHECK(mpool.estimateFee(i) == origFeeEst.back());
+    }
+    BOOST_CHECK(origFeeEst[1] > CFeeRate(0));
+
+    // Drop the transactions still waiting for a block
+    for (int j = 0; j < 10; j++) {
+        while (txHashes[j].size()) {
+            CTransaction btx;
+            if (mpool.lookup(txHashes[j].back(), btx))
+                mpool.remove(btx, dummyConflicted, false);
+            txHashes[j].pop_back();
+        }
+    }
+    std::vector<CFeeRate> feeEst;
+    for (int i = 1; i <= 10; i++)
+        feeEst.push_back(mpool.estimateFee(i));
+
+    // The estimates survive a round trip through the estimates file, which
+    // doesn't keep any mempool transactions either
+    CAutoFile file(tmpfile(), SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(!file.IsNull());
+    BOOST_CHECK(mpool.WriteFeeEstimates(file));
+    rewind(file.Get());
+    CTxMemPool mpool2(CFeeRate(1000));
+    BOOST_CHECK(mpool2.ReadFeeEstimates(file));
+    for (int i = 1; i <= 10; i++)
+        BOOST_CHECK(mpool2.estimateFee(i) == feeEst[i-1]);
+}
+
 BOOST_AUTO_TEST_CASE(TxConfirmStats_FindBucketIndex)
 {
     std::vector<double> buckets {0.0, 3.5, 42.0};
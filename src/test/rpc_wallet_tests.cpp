@@ -774,6 +774,117 @@ BOOST_AUTO_TEST_CASE(rpc_wallet_async_operations_parallel_cancel)
     BOOST_CHECK(ids.size()==0);
 }
 
+// Records the highest number of keyed operations which ran at once
+std::atomic<int> gRunning(0);
+std::atomic<int> gMaxRunning(0);
+
+class WeightedOperation : public AsyncRPCOperation {
+public:
+    size_t weight;
+    std::string key;
+    WeightedOperation(size_t weight, std::string key) : weight(weight), key(key) {}
+    virtual ~WeightedOperation() {}
+    virtual size_t getWeight() const { return weight; }
+    virtual std::string getExclusionKey() const { return key; }
+    virtual void main() {
+        set_state(OperationStatus::EXECUTING);
+        int running = key.empty() ? 0 : ++gRunning;
+        int expected = gMaxRunning.load();
+        while (running > expected && !gMaxRunning.compare_exchange_weak(expected, running)) {}
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        if (!key.empty()) {
+            gRunning--;
+        }
+        set_state(OperationStatus::SUCCESS);
+    }
+};
+
+// This tests that lighter operations are scheduled first and that operations
+// sharing an exclusion key never run concurrently
+BOOST_AUTO_TEST_CASE(rpc_wallet_async_operations_scheduling)
+{
+    std::shared_ptr<AsyncRPCQueue> q = std::make_shared<AsyncRPCQueue>();
+
+    std::shared_ptr<AsyncRPCOperation> heavy(new WeightedOperation(5, ""));
+    std::shared_ptr<AsyncRPCOperation> light(new WeightedOperation(1, ""));
+    q->addOperation(heavy);
+    q->addOperation(light);
+
+    size_t position;
+    int64_t estimatedWaitSecs;
+    BOOST_CHECK(q->getQueuePosition(light->getId(), position, estimatedWaitSecs));
+    BOOST_CHECK_EQUAL(position, 0);
+    BOOST_CHECK_EQUAL(estimatedWaitSecs, 0);
+    BOOST_CHECK(q->getQueuePosition(heavy->getId(), position, estimatedWaitSecs));
+    BOOST_CHECK_EQUAL(position, 1);
+    BOOST_CHECK(estimatedWaitSecs > 0);
+    BOOST_CHECK(!q->getQueuePosition("opid-1234", position, estimatedWaitSecs));
+
+    gRunning = 0;
+    gMaxRunning = 0;
+    for (int i = 0; i < 4; i++) {
+        std::shared_ptr<AsyncRPCOperation> op(new WeightedOperation(1, "zaddr"));
+        q->addOperation(op);
+    }
+    q->addWorker();
+    q->addWorker();
+    q->addWorker();
+    q->finishAndWait();
+
+    BOOST_CHECK(heavy->isSuccess());
+    BOOST_CHECK(light->isSuccess());
+    BOOST_CHECK_EQUAL(q->getOperationCount(), 0);
+    BOOST_CHECK_EQUAL(gMaxRunning.load(), 1);
+}
+
+// This tests that the proving pool runs tasks in priority order
+BOOST_AUTO_TEST_CASE(rpc_wallet_async_proving_pool)
+{
+    AsyncRPCProvingPool pool;
+
+    // Without workers, tasks run on the calling thread
+    bool ran = false;
+    pool.submit([&ran]() { ran = true; }, 0).get();
+    BOOST_CHECK(ran);
+
+    pool.addWorkers(1);
+    BOOST_CHECK_EQUAL(pool.getNumberOfWorkers(), 1);
+
+    // Occupy the worker while the other tasks are queued
+    std::promise<void> gate;
+    std::shared_future<void> gateFuture(gate.get_future());
+    std::future<void> blocker = pool.submit([gateFuture]() { gateFuture.wait(); }, 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    std::mutex orderMutex;
+    std::vector<size_t> order;
+    std::vector<std::future<void>> results;
+    for (size_t priority : {3, 1, 2}) {
+        results.push_back(pool.submit([priority, &order, &orderMutex]() {
+            std::lock_guard<std::mutex> lock(orderMutex);
+            order.push_back(priority);
+        }, priority));
+    }
+    results.push_back(pool.submit([]() { throw std::runtime_error("failed"); }, 4));
+    BOOST_CHECK_EQUAL(pool.getTaskCount(), 4);
+
+    gate.set_value();
+    blocker.get();
+    for (size_t i = 0; i < 3; i++) {
+        results[i].get();
+    }
+    BOOST_CHECK_THROW(results[3].get(), std::runtime_error);
+    BOOST_CHECK(order == std::vector<size_t>({1, 2, 3}));
+
+    pool.closeAndWait();
+
+    // Once closed, tasks fail instead of running on the calling thread
+    ran = false;
+    std::future<void> late = pool.submit([&ran]() { ran = true; }, 0);
+    BOOST_CHECK_THROW(late.get(), std::runtime_error);
+    BOOST_CHECK(!ran);
+}
+
 // This tests z_getoperationstatus, z_getoperationresult, z_listoperationids
 BOOST_AUTO_TEST_CASE(rpc_z_getoperations)
 {
@@ -1171,9 +1282,11 @@ BOOST_AUTO_TEST_CASE(rpc_z_sendmany_internals)
             BOOST_CHECK( string(e.what()).find("unsupported joinsplit input")!= string::npos);
         }
 
+        // Proofs are generated and verified once all joinsplits are planned
         info.vjsin.clear();
         try {
-            proxy.perform_joinsplit(info);
+            UniValue obj = proxy.perform_joinsplit(info);
+            proxy.prove_joinsplits(obj);
         } catch (const std::runtime_error & e) {
             BOOST_CHECK( string(e.what()).find("error verifying joinsplit")!= string::npos);
         }
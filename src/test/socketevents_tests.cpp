@@ -0,0 +1,209 @@
+// Copyright (c) 2017 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "socketevents.h"
+#include "netbase.h"
+#include "utiltime.h"
+#include "test/test_bitcoin.h"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+#ifndef WIN32
+#include <arpa/inet.h>
+#endif
+
+using namespace std;
+
+//! Enough peers to show the cost of a backend, while staying below FD_SETSIZE for select
+static const int NUM_LOOPBACK_PEERS = 300;
+
+/** Connected pairs of loopback sockets, standing in for inbound peers */
+class LoopbackPeers
+{
+public:
+    SOCKET hListenSocket;
+    vector<SOCKET> vRemote;
+    vector<SOCKET> vLocal;
+
+    LoopbackPeers(int nPeers)
+    {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        socklen_t len = sizeof(addr);
+
+        hListenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        BOOST_REQUIRE(hListenSocket != INVALID_SOCKET);
+        BOOST_REQUIRE(::bind(hListenSocket, (struct sockaddr*)&addr, len) != SOCKET_ERROR);
+        BOOST_REQUIRE(listen(hListenSocket, SOMAXCONN) != SOCKET_ERROR);
+        BOOST_REQUIRE(getsockname(hListenSocket, (struct sockaddr*)&addr, &len) != SOCKET_ERROR);
+
+        for (int i = 0; i < nPeers; i++) {
+            SOCKET hRemote = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            BOOST_REQUIRE(hRemote != INVALID_SOCKET);
+            BOOST_REQUIRE(connect(hRemote, (struct sockaddr*)&addr, sizeof(addr)) != SOCKET_ERROR);
+            SOCKET hLocal = accept(hListenSocket, NULL, NULL);
+            BOOST_REQUIRE(hLocal != INVALID_SOCKET);
+            BOOST_REQUIRE(SetSocketNonBlocking(hLocal, true));
+            vRemote.push_back(hRemote);
+            vLocal.push_back(hLocal);
+        }
+    }
+
+    ~LoopbackPeers()
+    {
+        for (SOCKET& hSocket : vRemote)
+            CloseSocket(hSocket);
+        for (SOCKET& hSocket : vLocal)
+            CloseSocket(hSocket);
+        CloseSocket(hListenSocket);
+    }
+};
+
+/** Wait until nExpected sockets have been reported, or a timeout, merging repeated events. */
+static map<SOCKET, CSocketEvent> WaitForEvents(CSocketEvents& events, size_t nExpected)
+{
+    map<SOCKET, CSocketEvent> mapEvents;
+    int64_t nEnd = GetTimeMillis() + 10000;
+    while (mapEvents.size() < nExpected && GetTimeMillis() < nEnd) {
+        vector<CSocketEvent> vEvents;
+        BOOST_REQUIRE(events.Wait(50, vEvents));
+        for (const CSocketEvent& event : vEvents) {
+            CSocketEvent& merged = mapEvents.insert(make_pair(event.socket, CSocketEvent(event.socket))).first->second;
+            merged.fRecv |= event.fRecv;
+            merged.fSend |= event.fSend;
+            merged.fError |= event.fError;
+        }
+    }
+    return mapEvents;
+}
+
+static size_t CountImmediateEvents(CSocketEvents& events)
+{
+    vector<CSocketEvent> vEvents;
+    BOOST_REQUIRE(events.Wait(0, vEvents));
+    return vEvents.size();
+}
+
+static void DrainSocket(SOCKET hSocket)
+{
+    char pchBuf[256];
+    while (recv(hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT) > 0);
+}
+
+static void CheckLoopbackPeers(CSocketEvents& events)
+{
+    LoopbackPeers peers(NUM_LOOPBACK_PEERS);
+    for (SOCKET hSocket : peers.vLocal)
+        BOOST_REQUIRE(events.Watch(hSocket, true, false));
+
+    // Idle peers, without anything to send, are never reported
+    BOOST_CHECK_EQUAL(CountImmediateEvents(events), 0);
+
+    // Every peer which sends something is reported as readable
+    for (SOCKET hSocket : peers.vRemote)
+        BOOST_REQUIRE(send(hSocket, "x", 1, MSG_NOSIGNAL) == 1);
+    map<SOCKET, CSocketEvent> mapEvents = WaitForEvents(events, peers.vLocal.size());
+    BOOST_CHECK_EQUAL(mapEvents.size(), peers.vLocal.size());
+    for (SOCKET hSocket : peers.vLocal) {
+        BOOST_CHECK(mapEvents.count(hSocket) && mapEvents.at(hSocket).fRecv);
+        BOOST_CHECK(!mapEvents.count(hSocket) || !mapEvents.at(hSocket).fSend);
+    }
+
+    // Nothing is reported once the data has been read
+    for (SOCKET hSocket : peers.vLocal)
+        DrainSocket(hSocket);
+    BOOST_CHECK_EQUAL(CountImmediateEvents(events), 0);
+
+    // Write interest is only reported for sockets which registered it
+    size_t nSenders = peers.vLocal.size() / 2;
+    for (size_t i = 0; i < nSenders; i++)
+        BOOST_REQUIRE(events.Watch(peers.vLocal[i], true, true));
+    mapEvents = WaitForEvents(events, nSenders);
+    BOOST_CHECK_EQUAL(mapEvents.size(), nSenders);
+    for (size_t i = 0; i < nSenders; i++)
+        BOOST_CHECK(mapEvents.count(peers.vLocal[i]) && mapEvents.at(peers.vLocal[i]).fSend);
+    for (size_t i = 0; i < nSenders; i++)
+        BOOST_REQUIRE(events.Watch(peers.vLocal[i], true, false));
+    BOOST_CHECK_EQUAL(CountImmediateEvents(events), 0);
+
+    // A peer hanging up is reported, and removed sockets are not
+    CloseSocket(peers.vRemote[0]);
+    events.Remove(peers.vLocal[1]);
+    CloseSocket(peers.vRemote[1]);
+    mapEvents = WaitForEvents(events, 1);
+    BOOST_CHECK_EQUAL(mapEvents.size(), 1);
+    BOOST_CHECK(mapEvents.count(peers.vLocal[0]));
+
+    for (SOCKET hSocket : peers.vLocal)
+        events.Remove(hSocket);
+}
+
+BOOST_FIXTURE_TEST_SUITE(socketevents_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(socketevents_modes)
+{
+    vector<string> vModes = GetSocketEventsModes();
+    BOOST_CHECK(find(vModes.begin(), vModes.end(), DEFAULT_SOCKET_EVENTS) != vModes.end());
+    for (const string& strMode : vModes) {
+        unique_ptr<CSocketEvents> pevents(CreateSocketEvents(strMode));
+        BOOST_REQUIRE(pevents);
+        BOOST_CHECK_EQUAL(pevents->GetName(), strMode);
+    }
+    BOOST_CHECK(CreateSocketEvents("kqueue") == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(socketevents_select_loopback_peers)
+{
+    CSelectSocketEvents events;
+    CheckLoopbackPeers(events);
+}
+
+#ifdef USE_EPOLL
+BOOST_AUTO_TEST_CASE(socketevents_epoll_loopback_peers)
+{
+    CEpollSocketEvents events;
+    BOOST_REQUIRE(events.IsValid());
+    CheckLoopbackPeers(events);
+}
+
+BOOST_AUTO_TEST_CASE(socketevents_epoll_edge_triggered)
+{
+    CEpollSocketEvents events;
+    LoopbackPeers peers(1);
+    BOOST_REQUIRE(events.Watch(peers.vLocal[0], true, false));
+
+    // Readiness is reported once, even though the data is still unread...
+    BOOST_REQUIRE(send(peers.vRemote[0], "x", 1, MSG_NOSIGNAL) == 1);
+    BOOST_CHECK_EQUAL(WaitForEvents(events, 1).size(), 1);
+    BOOST_CHECK_EQUAL(CountImmediateEvents(events), 0);
+
+    // ...until more arrives
+    BOOST_REQUIRE(send(peers.vRemote[0], "y", 1, MSG_NOSIGNAL) == 1);
+    BOOST_CHECK_EQUAL(WaitForEvents(events, 1).size(), 1);
+
+    // Registering write interest on a writable socket reports it at once
+    BOOST_REQUIRE(events.Watch(peers.vLocal[0], true, true));
+    map<SOCKET, CSocketEvent> mapEvents = WaitForEvents(events, 1);
+    BOOST_CHECK(mapEvents.count(peers.vLocal[0]) && mapEvents.at(peers.vLocal[0]).fSend);
+
+    // Without receive interest unread data is not reported, but restoring
+    // the interest reports it again
+    BOOST_REQUIRE(events.Watch(peers.vLocal[0], false, false));
+    BOOST_CHECK_EQUAL(CountImmediateEvents(events), 0);
+    BOOST_REQUIRE(events.Watch(peers.vLocal[0], true, false));
+    mapEvents = WaitForEvents(events, 1);
+    BOOST_CHECK(mapEvents.count(peers.vLocal[0]) && mapEvents.at(peers.vLocal[0]).fRecv);
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -914,3 +914,19 @@ int GetNumCores()
     return boost::thread::physical_concurrency();
 }
 
+int64_t GetTotalMemory()
+{
+#ifdef WIN32
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    if (GlobalMemoryStatusEx(&status))
+        return status.ullTotalPhys;
+#elif defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
+    long nPages = sysconf(_SC_PHYS_PAGES);
+    long nPageSize = sysconf(_SC_PAGESIZE);
+    if (nPages > 0 && nPageSize > 0)
+        return (int64_t)nPages * nPageSize;
+#endif
+    return 0;
+}
+
@@ -226,6 +226,12 @@ std::string HelpMessageOpt(const std::string& option, const std::string& message
  */
 int GetNumCores();
 
+/**
+ * Return the amount of physical memory on the current system in bytes, or 0
+ * if it cannot be determined.
+ */
+int64_t GetTotalMemory();
+
 void SetThreadPriority(int nPriority);
 void RenameThread(const char* name);
 
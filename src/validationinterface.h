@@ -14,9 +14,11 @@ class CBlock;
 class CBlockIndex;
 struct CBlockLocator;
 class CTransaction;
+class CTxMemPool;
 class CValidationInterface;
 class CValidationState;
 class uint256;
+enum class MemPoolRemovalReason;
 
 // These functions dispatch to one or all registered wallets
 
@@ -28,11 +30,17 @@ void UnregisterValidationInterface(CValidationInterface* pwalletIn);
 void UnregisterAllValidationInterfaces();
 /** Push an updated transaction to all registered wallets */
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL);
+/** Pass the additions to and removals from pool on to the registered interfaces */
+void RegisterMempoolSignals(CTxMemPool& pool);
+/** Stop passing on the mempool notifications of pool */
+void UnregisterMempoolSignals(CTxMemPool& pool);
 
 class CValidationInterface {
 protected:
     virtual void UpdatedBlockTip(const CBlockIndex *pindex) {}
     virtual void SyncTransaction(const CTransaction &tx, const CBlock *pblock) {}
+    virtual void TransactionAddedToMempool(const CTransaction &tx, uint64_t nMempoolSequence) {}
+    virtual void TransactionRemovedFromMempool(const CTransaction &tx, MemPoolRemovalReason reason, uint64_t nMempoolSequence) {}
     virtual void EraseFromWallet(const uint256 &hash) {}
     virtual void ChainTip(const CBlockIndex *pindex, const CBlock *pblock, ZCIncrementalMerkleTree tree, bool added) {}
     virtual void SetBestChain(const CBlockLocator &locator) {}
@@ -50,6 +58,14 @@ struct CMainSignals {
     boost::signals2::signal<void (const CBlockIndex *)> UpdatedBlockTip;
     /** Notifies listeners of updated transaction data (transaction, and optionally the block it is found in. */
     boost::signals2::signal<void (const CTransaction &, const CBlock *)> SyncTransaction;
+    /**
+     * Notifies listeners of a transaction entering the mempool. Together with
+     * TransactionRemovedFromMempool these are given in the order they happen,
+     * numbered consecutively by the mempool's sequence number.
+     */
+    boost::signals2::signal<void (const CTransaction &, uint64_t)> TransactionAddedToMempool;
+    /** Notifies listeners of a transaction leaving the mempool, for whatever reason (including being mined). */
+    boost::signals2::signal<void (const CTransaction &, MemPoolRemovalReason, uint64_t)> TransactionRemovedFromMempool;
     /** Notifies listeners of an erased transaction (currently disabled, requires transaction replacement). */
     boost::signals2::signal<void (const uint256 &)> EraseTransaction;
     /** Notifies listeners of an updated transaction without new data (for now: a coinbase potentially becoming visible). */
@@ -466,7 +466,7 @@ bool AsyncRPCOperation_sendmany::main_impl() {
             }
             obj = perform_joinsplit(info);
         }
-        sign_send_raw_transaction(obj);
+        sign_send_raw_transaction(prove_joinsplits(obj));
         return true;
     }
     /**
@@ -743,11 +743,33 @@ bool AsyncRPCOperation_sendmany::main_impl() {
     assert(zOutputsDeque.size() == 0);
     assert(vpubNewProcessed);
 
-    sign_send_raw_transaction(obj);
+    sign_send_raw_transaction(prove_joinsplits(obj));
     return true;
 }
 
 
+/**
+ * The weight is the number of JoinSplits the operation is expected to prove.
+ * Each JoinSplit spends up to two notes and creates up to two notes, and a
+ * transfer out of a zaddr needs at least one JoinSplit.
+ */
+size_t AsyncRPCOperation_sendmany::getWeight() const {
+    size_t numZOutputs = z_outputs_.size();
+    if (isfromzaddr_) {
+        return std::max(numZOutputs, (size_t) 1);
+    }
+    return (numZOutputs + 1) / 2;
+}
+
+/**
+ * Operations spending from the same address must not run concurrently, as
+ * they could otherwise select the same notes or utxos.
+ */
+std::string AsyncRPCOperation_sendmany::getExclusionKey() const {
+    return fromaddress_;
+}
+
+
 /**
  * Sign and send a raw transaction.
  * Raw transaction as hex string should be in object field "rawtxn"
@@ -959,7 +981,9 @@ UniValue AsyncRPCOperation_sendmany::perform_joinsplit(
             FormatMoney(info.vjsout[0].value), FormatMoney(info.vjsout[1].value)
             );
 
-    // Generate the proof, this can take over a minute.
+    // Compute the public fields of the JoinSplit.  The proof, which can take
+    // over a minute, is generated later by prove_joinsplits() so that the
+    // proofs for a chain of JoinSplits can be generated concurrently.
     boost::array<libzcash::JSInput, ZC_NUM_JS_INPUTS> inputs
             {info.vjsin[0], info.vjsin[1]};
     boost::array<libzcash::JSOutput, ZC_NUM_JS_OUTPUTS> outputs
@@ -968,6 +992,7 @@ UniValue AsyncRPCOperation_sendmany::perform_joinsplit(
     boost::array<size_t, ZC_NUM_JS_OUTPUTS> outputMap;
 
     uint256 esk; // payment disclosure - secret
+    ZCJSProofWitness proofWitness;
 
     JSDescription jsdesc = JSDescription::Randomized(
             *pzcashParams,
@@ -979,39 +1004,15 @@ UniValue AsyncRPCOperation_sendmany::perform_joinsplit(
             outputMap,
             info.vpub_old,
             info.vpub_new,
-            !this->testmode,
-            &esk); // parameter expects pointer to esk, so pass in address
-    {
-        auto verifier = libzcash::ProofVerifier::Strict();
-        if (!(jsdesc.Verify(*pzcashParams, verifier, joinSplitPubKey_))) {
-            throw std::runtime_error("error verifying joinsplit");
-        }
-    }
+            false,
+            &esk, // parameter expects pointer to esk, so pass in address
+            GetRandInt,
+            &proofWitness);
 
+    jsProofWitnesses_.push_back(std::make_pair(mtx.vjoinsplit.size(), proofWitness));
     mtx.vjoinsplit.push_back(jsdesc);
 
-    // Empty output script.
-    CScript scriptCode;
-    CTransaction signTx(mtx);
-    uint256 dataToBeSigned = SignatureHash(scriptCode, signTx, NOT_AN_INPUT, SIGHASH_ALL);
-
-    // Add the signature
-    if (!(crypto_sign_detached(&mtx.joinSplitSig[0], NULL,
-            dataToBeSigned.begin(), 32,
-            joinSplitPrivKey_
-            ) == 0))
-    {
-        throw std::runtime_error("crypto_sign_detached failed");
-    }
-
-    // Sanity check
-    if (!(crypto_sign_verify_detached(&mtx.joinSplitSig[0],
-            dataToBeSigned.begin(), 32,
-            mtx.joinSplitPubKey.begin()
-            ) == 0))
-    {
-        throw std::runtime_error("crypto_sign_verify_detached failed");
-    }
+    sign_joinsplits(mtx);
 
     CTransaction rawTx(mtx);
     tx_ = rawTx;
@@ -1080,6 +1081,119 @@ UniValue AsyncRPCOperation_sendmany::perform_joinsplit(
     return obj;
 }
 
+/**
+ * Generate the proofs for the JoinSplits created by perform_joinsplit.
+ * The JoinSplit chain has already been planned, so the proofs are
+ * independent of each other and are generated concurrently.  The transaction
+ * is then signed again, and the raw transaction in obj is replaced.
+ */
+UniValue AsyncRPCOperation_sendmany::prove_joinsplits(UniValue obj)
+{
+    if (jsProofWitnesses_.empty()) {
+        return obj;
+    }
+
+    CMutableTransaction mtx(tx_);
+
+    // Test mode does not generate proofs, so verification below fails.
+    if (!testmode) {
+        size_t numProofs = jsProofWitnesses_.size();
+        auto pool = AsyncRPCProvingPool::sharedInstance();
+
+        LogPrint("zrpcunsafe", "%s: generating %d joinsplit proofs on %d shared proving threads\n",
+                getId(), numProofs, pool->getNumberOfWorkers());
+
+        // Proofs are generated by the shared proving pool so that concurrent
+        // operations cannot oversubscribe the CPU.  Lighter operations are
+        // given priority so that they are not stuck behind heavy ones.
+        std::vector<ZCProof> proofs(numProofs);
+        std::vector<std::future<void>> results;
+        for (size_t i = 0; i < numProofs; i++) {
+            const ZCJSProofWitness& witness = jsProofWitnesses_[i].second;
+            ZCProof& proof = proofs[i];
+            results.push_back(pool->submit([&witness, &proof]() {
+                proof = pzcashParams->prove(witness);
+            }, getWeight()));
+        }
+
+        // Wait for every proof before rethrowing, as the tasks reference
+        // witnesses and proofs owned by this operation.
+        std::exception_ptr error;
+        for (std::future<void>& result : results) {
+            try {
+                result.get();
+            } catch (...) {
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+
+        for (size_t i = 0; i < numProofs; i++) {
+            mtx.vjoinsplit[jsProofWitnesses_[i].first].proof = proofs[i];
+        }
+    }
+
+    for (const std::pair<size_t, ZCJSProofWitness>& p : jsProofWitnesses_) {
+        auto verifier = libzcash::ProofVerifier::Strict();
+        if (!(mtx.vjoinsplit[p.first].Verify(*pzcashParams, verifier, joinSplitPubKey_))) {
+            throw std::runtime_error("error verifying joinsplit");
+        }
+    }
+    jsProofWitnesses_.clear();
+
+    sign_joinsplits(mtx);
+
+    CTransaction rawTx(mtx);
+    tx_ = rawTx;
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << rawTx;
+
+    UniValue provedObj(UniValue::VOBJ);
+    for (size_t i = 0; i < obj.size(); i++) {
+        const std::string& key = obj.getKeys()[i];
+        if (key == "rawtxn") {
+            provedObj.push_back(Pair(key, HexStr(ss.begin(), ss.end())));
+        } else {
+            provedObj.push_back(Pair(key, obj.getValues()[i]));
+        }
+    }
+    return provedObj;
+}
+
+/**
+ * Sign the JoinSplits of a transaction with the ephemeral JoinSplit key.
+ */
+void AsyncRPCOperation_sendmany::sign_joinsplits(CMutableTransaction& mtx)
+{
+    // Empty output script.
+    CScript scriptCode;
+    CTransaction signTx(mtx);
+    uint256 dataToBeSigned = SignatureHash(scriptCode, signTx, NOT_AN_INPUT, SIGHASH_ALL);
+
+    // Add the signature
+    if (!(crypto_sign_detached(&mtx.joinSplitSig[0], NULL,
+            dataToBeSigned.begin(), 32,
+            joinSplitPrivKey_
+            ) == 0))
+    {
+        throw std::runtime_error("crypto_sign_detached failed");
+    }
+
+    // Sanity check
+    if (!(crypto_sign_verify_detached(&mtx.joinSplitSig[0],
+            dataToBeSigned.begin(), 32,
+            mtx.joinSplitPubKey.begin()
+            ) == 0))
+    {
+        throw std::runtime_error("crypto_sign_verify_detached failed");
+    }
+}
+
 void AsyncRPCOperation_sendmany::add_taddr_outputs_to_tx() {
 
     CMutableTransaction rawTx(tx_);
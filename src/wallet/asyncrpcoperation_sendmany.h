@@ -64,6 +64,10 @@ public:
 
     virtual UniValue getStatus() const;
 
+    virtual size_t getWeight() const;
+
+    virtual std::string getExclusionKey() const;
+
     bool testmode = false;  // Set to true to disable sending txs and generating proofs
 
     bool paymentDisclosureMode = false; // Set to true to save esk for encrypted notes in payment disclosure database.
@@ -114,8 +118,16 @@ private:
         std::vector<boost::optional < ZCIncrementalWitness>> witnesses,
         uint256 anchor);
 
+    // Generate the proofs for the JoinSplits created so far on the shared proving pool
+    UniValue prove_joinsplits(UniValue obj);
+
+    void sign_joinsplits(CMutableTransaction& mtx);
+
     void sign_send_raw_transaction(UniValue obj);     // throws exception if there was an error
 
+    // JoinSplits awaiting a proof, by index into tx_.vjoinsplit
+    std::vector<std::pair<size_t, ZCJSProofWitness>> jsProofWitnesses_;
+
     // payment disclosure!
     std::vector<PaymentDisclosureKeyInfo> paymentDisclosureData_;
 };
@@ -178,6 +190,10 @@ public:
         return delegate->perform_joinsplit(info, witnesses, anchor);
     }
 
+    UniValue prove_joinsplits(UniValue obj) {
+        return delegate->prove_joinsplits(obj);
+    }
+
     void sign_send_raw_transaction(UniValue obj) {
         delegate->sign_send_raw_transaction(obj);
     }
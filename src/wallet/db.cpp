@@ -26,6 +26,24 @@ using namespace std;
 
 unsigned int nWalletDBUpdated;
 
+static WalletBackend walletBackend = WALLET_BACKEND_BDB;
+
+bool SetWalletBackend(const std::string& strBackend)
+{
+    if (strBackend == "bdb")
+        walletBackend = WALLET_BACKEND_BDB;
+    else if (strBackend == "log")
+        walletBackend = WALLET_BACKEND_LOG;
+    else
+        return false;
+    return true;
+}
+
+WalletBackend GetWalletBackend()
+{
+    return walletBackend;
+}
+
 
 //
 // CDB
@@ -224,7 +242,107 @@ void CDBEnv::CheckpointLSN(const std::string& strFile)
 }
 
 
-CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnCloseIn) : pdb(NULL), activeTxn(NULL)
+/** Cursor over a Berkeley DB database */
+class CBDBCursor : public CDBCursor
+{
+private:
+    Dbc* pcursor;
+
+public:
+    CBDBCursor(Dbc* pcursorIn) : pcursor(pcursorIn) {}
+
+    int Read(CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags)
+    {
+        // Read at cursor
+        Dbt datKey;
+        if (fFlags == DB_SET || fFlags == DB_SET_RANGE || fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE) {
+            datKey.set_data(&ssKey[0]);
+            datKey.set_size(ssKey.size());
+        }
+        Dbt datValue;
+        if (fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE) {
+            datValue.set_data(&ssValue[0]);
+            datValue.set_size(ssValue.size());
+        }
+        datKey.set_flags(DB_DBT_MALLOC);
+        datValue.set_flags(DB_DBT_MALLOC);
+        int ret = pcursor->get(&datKey, &datValue, fFlags);
+        if (ret != 0)
+            return ret;
+        else if (datKey.get_data() == NULL || datValue.get_data() == NULL)
+            return 99999;
+
+        // Convert to streams
+        ssKey.SetType(SER_DISK);
+        ssKey.clear();
+        ssKey.write((char*)datKey.get_data(), datKey.get_size());
+        ssValue.SetType(SER_DISK);
+        ssValue.clear();
+        ssValue.write((char*)datValue.get_data(), datValue.get_size());
+
+        // Clear and free memory
+        memset(datKey.get_data(), 0, datKey.get_size());
+        memset(datValue.get_data(), 0, datValue.get_size());
+        free(datKey.get_data());
+        free(datValue.get_data());
+        return 0;
+    }
+
+    void close()
+    {
+        pcursor->close();
+        delete this;
+    }
+};
+
+/**
+ * Cursor over a log-structured database. It remembers the last key it
+ * returned rather than a position, so the database may be modified while
+ * the cursor is in use.
+ */
+class CLogDBCursor : public CDBCursor
+{
+private:
+    CLogDB* plogdb;
+    CLogDB::Bytes vchLastKey;
+    bool fStarted;
+
+public:
+    CLogDBCursor(CLogDB* plogdbIn) : plogdb(plogdbIn), fStarted(false) {}
+
+    int Read(CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags)
+    {
+        bool fAfter = fStarted;
+        if (fFlags == DB_SET_RANGE) {
+            vchLastKey.assign(ssKey.begin(), ssKey.end());
+            fAfter = false;
+        } else if (fFlags != DB_NEXT) {
+            return EINVAL;
+        }
+
+        CLogDB::Bytes vchKey, vchValue;
+        if (!plogdb->Seek(vchLastKey, fAfter, vchKey, vchValue))
+            return DB_NOTFOUND;
+        vchLastKey = vchKey;
+        fStarted = true;
+
+        ssKey.SetType(SER_DISK);
+        ssKey.clear();
+        ssKey.write((char*)&vchKey[0], vchKey.size());
+        ssValue.SetType(SER_DISK);
+        ssValue.clear();
+        if (!vchValue.empty())
+            ssValue.write((char*)&vchValue[0], vchValue.size());
+        return 0;
+    }
+
+    void close()
+    {
+        delete this;
+    }
+};
+
+CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnCloseIn) : pdb(NULL), activeTxn(NULL), plogdb(NULL)
 {
     int ret;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
@@ -233,6 +351,22 @@ CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnClose
         return;
 
     bool fCreate = strchr(pszMode, 'c') != NULL;
+
+    if (GetWalletBackend() == WALLET_BACKEND_LOG) {
+        plogdb = logdbenv.Open(strFilename, fCreate);
+        if (plogdb == NULL)
+            throw runtime_error(strprintf("CDB: Can't open log-structured database %s", strFilename));
+        strFile = strFilename;
+
+        if (fCreate && !Exists(string("version"))) {
+            bool fTmp = fReadOnly;
+            fReadOnly = false;
+            WriteVersion(CLIENT_VERSION);
+            fReadOnly = fTmp;
+        }
+        return;
+    }
+
     unsigned int nFlags = DB_THREAD;
     if (fCreate)
         nFlags |= DB_CREATE;
@@ -283,8 +417,82 @@ CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnClose
     }
 }
 
+CDBCursor* CDB::GetCursor()
+{
+    if (plogdb)
+        return new CLogDBCursor(plogdb);
+    if (!pdb)
+        return NULL;
+    Dbc* pcursor = NULL;
+    int ret = pdb->cursor(NULL, &pcursor, 0);
+    if (ret != 0)
+        return NULL;
+    return new CBDBCursor(pcursor);
+}
+
+bool CDB::LogRead(const CDataStream& ssKey, CDataStream& ssValue)
+{
+    CLogDB::Bytes vchKey(ssKey.begin(), ssKey.end());
+    CLogDB::Bytes vchValue;
+    if (activeBatch) {
+        // Reads within a transaction see its own changes
+        boost::optional<CLogDB::Bytes> value;
+        if (activeBatch->Lookup(vchKey, value)) {
+            if (!value)
+                return false;
+            vchValue = *value;
+        } else if (!plogdb->Read(vchKey, vchValue)) {
+            return false;
+        }
+    } else if (!plogdb->Read(vchKey, vchValue)) {
+        return false;
+    }
+    ssValue.write((char*)vchValue.data(), vchValue.size());
+    return true;
+}
+
+bool CDB::LogExists(const CDataStream& ssKey)
+{
+    CLogDB::Bytes vchKey(ssKey.begin(), ssKey.end());
+    boost::optional<CLogDB::Bytes> value;
+    if (activeBatch && activeBatch->Lookup(vchKey, value))
+        return (bool)value;
+    return plogdb->Exists(vchKey);
+}
+
+bool CDB::LogWrite(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite)
+{
+    if (!fOverwrite && LogExists(ssKey))
+        return false;
+    CLogDB::Bytes vchKey(ssKey.begin(), ssKey.end());
+    CLogDB::Bytes vchValue(ssValue.begin(), ssValue.end());
+    if (activeBatch) {
+        activeBatch->Write(vchKey, vchValue);
+        return true;
+    }
+    CLogDBBatch batch;
+    batch.Write(vchKey, vchValue);
+    return plogdb->Commit(batch);
+}
+
+bool CDB::LogErase(const CDataStream& ssKey)
+{
+    CLogDB::Bytes vchKey(ssKey.begin(), ssKey.end());
+    if (activeBatch) {
+        activeBatch->Erase(vchKey);
+        return true;
+    }
+    CLogDBBatch batch;
+    batch.Erase(vchKey);
+    return plogdb->Commit(batch);
+}
+
 void CDB::Flush()
 {
+    // Committed changes to the log are already with the OS; they are made
+    // durable by ThreadFlushWalletDB.
+    if (plogdb)
+        return;
     if (activeTxn)
         return;
 
@@ -298,6 +506,12 @@ void CDB::Flush()
 
 void CDB::Close()
 {
+    if (plogdb) {
+        activeBatch.reset();
+        plogdb = NULL;
+        logdbenv.Release(strFile);
+        return;
+    }
     if (!pdb)
         return;
     if (activeTxn)
@@ -339,6 +553,18 @@ bool CDBEnv::RemoveDb(const string& strFile)
 
 bool CDB::Rewrite(const string& strFile, const char* pszSkip)
 {
+    if (GetWalletBackend() == WALLET_BACKEND_LOG) {
+        LogPrintf("CDB::Rewrite: Rewriting %s...\n", strFile);
+        CLogDB* plogdb = logdbenv.Open(strFile, false);
+        if (plogdb == NULL)
+            return false;
+        bool fSuccess = plogdb->Compact(pszSkip);
+        logdbenv.Release(strFile);
+        if (!fSuccess)
+            LogPrintf("CDB::Rewrite: Failed to rewrite database file %s\n", strFile);
+        return fSuccess;
+    }
+
     while (true) {
         {
             LOCK(bitdb.cs_db);
@@ -366,7 +592,7 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                         fSuccess = false;
                     }
 
-                    Dbc* pcursor = db.GetCursor();
+                    CDBCursor* pcursor = db.GetCursor();
                     if (pcursor)
                         while (fSuccess) {
                             CDataStream ssKey(SER_DISK, CLIENT_VERSION);
@@ -420,6 +646,74 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
     return false;
 }
 
+bool CDB::ConvertToLog(const string& strFile)
+{
+    LOCK(bitdb.cs_db);
+    assert(bitdb.mapFileUseCount.count(strFile) == 0 || bitdb.mapFileUseCount[strFile] == 0);
+    if (!bitdb.Open(GetDataDir()))
+        return error("CDB::ConvertToLog: Failed to open database environment");
+
+    LogPrintf("CDB::ConvertToLog: Converting %s to the log-structured backend...\n", strFile);
+    boost::filesystem::path pathFile = GetDataDir() / strFile;
+    boost::filesystem::path pathLog = pathFile;
+    pathLog += ".log";
+    boost::filesystem::path pathBak = pathFile;
+    pathBak += ".bdb.bak";
+    boost::filesystem::remove(pathLog);
+
+    CLogDB logdb(pathLog);
+    uint64_t nDiscardedBytes;
+    if (!logdb.Open(true, nDiscardedBytes))
+        return false;
+
+    // Copy every record in a single batch
+    CLogDBBatch batch;
+    {
+        Db db(bitdb.dbenv, 0);
+        int ret = db.open(NULL, strFile.c_str(), "main", DB_BTREE, DB_RDONLY, 0);
+        if (ret != 0)
+            return error("CDB::ConvertToLog: Error %d, can't open database %s", ret, strFile);
+        Dbc* pdbc = NULL;
+        if (db.cursor(NULL, &pdbc, 0) != 0 || pdbc == NULL) {
+            db.close(0);
+            return error("CDB::ConvertToLog: Can't create cursor for %s", strFile);
+        }
+        CDBCursor* pcursor = new CBDBCursor(pdbc);
+        while (true) {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            ret = pcursor->Read(ssKey, ssValue, DB_NEXT);
+            if (ret == DB_NOTFOUND)
+                break;
+            if (ret != 0) {
+                pcursor->close();
+                db.close(0);
+                return error("CDB::ConvertToLog: Error %d reading %s", ret, strFile);
+            }
+            batch.Write(CLogDB::Bytes(ssKey.begin(), ssKey.end()), CLogDB::Bytes(ssValue.begin(), ssValue.end()));
+        }
+        pcursor->close();
+        db.close(0);
+    }
+    if (!logdb.Commit(batch, true))
+        return false;
+    LogPrintf("CDB::ConvertToLog: Copied %u records\n", logdb.GetRecordCount());
+    logdb.Close();
+
+    // Detach the original from the environment before moving it aside
+    bitdb.CloseDb(strFile);
+    bitdb.CheckpointLSN(strFile);
+    bitdb.mapFileUseCount.erase(strFile);
+    try {
+        boost::filesystem::rename(pathFile, pathBak);
+        boost::filesystem::rename(pathLog, pathFile);
+    } catch (const boost::filesystem::filesystem_error& e) {
+        return error("CDB::ConvertToLog: Error replacing %s - %s", strFile, e.what());
+    }
+    LogPrintf("CDB::ConvertToLog: Original %s kept as %s\n", strFile, pathBak.string());
+    return true;
+}
+
 
 void CDBEnv::Flush(bool fShutdown)
 {
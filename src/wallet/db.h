@@ -11,8 +11,10 @@
 #include "streams.h"
 #include "sync.h"
 #include "version.h"
+#include "wallet/logdb.h"
 
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -22,6 +24,19 @@
 
 extern unsigned int nWalletDBUpdated;
 
+/** Storage engines for wallet.dat */
+enum WalletBackend {
+    WALLET_BACKEND_BDB,
+    WALLET_BACKEND_LOG
+};
+
+//! -walletbackend default
+static const char* const DEFAULT_WALLET_BACKEND = "bdb";
+
+/** Select the storage engine for wallets opened from now on. Returns false if strBackend is unknown. */
+bool SetWalletBackend(const std::string& strBackend);
+WalletBackend GetWalletBackend();
+
 class CDBEnv
 {
 private:
@@ -86,6 +101,19 @@ public:
 
 extern CDBEnv bitdb;
 
+/** Cursor over the records of a CDB, in key order */
+class CDBCursor
+{
+public:
+    virtual ~CDBCursor() {}
+
+    /** Read the record selected by fFlags (DB_NEXT or DB_SET_RANGE), returning 0, DB_NOTFOUND or an error. */
+    virtual int Read(CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags) = 0;
+
+    /** Release the cursor; it must not be used afterwards. */
+    virtual void close() = 0;
+};
+
 
 /** RAII class that provides access to a Berkeley database */
 class CDB
@@ -97,6 +125,11 @@ protected:
     bool fReadOnly;
     bool fFlushOnClose;
 
+    //! Set instead of pdb when the wallet uses the log-structured backend
+    CLogDB* plogdb;
+    //! Changes made since TxnBegin() on the log-structured backend
+    std::unique_ptr<CLogDBBatch> activeBatch;
+
     explicit CDB(const std::string& strFilename, const char* pszMode = "r+", bool fFlushOnCloseIn=true);
     ~CDB() { Close(); }
 
@@ -108,17 +141,35 @@ private:
     CDB(const CDB&);
     void operator=(const CDB&);
 
+    bool LogRead(const CDataStream& ssKey, CDataStream& ssValue);
+    bool LogWrite(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite);
+    bool LogErase(const CDataStream& ssKey);
+    bool LogExists(const CDataStream& ssKey);
+
 protected:
     template <typename K, typename T>
     bool Read(const K& key, T& value)
     {
-        if (!pdb)
+        if (!pdb && !plogdb)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (plogdb) {
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            if (!LogRead(ssKey, ssValue))
+                return false;
+            try {
+                ssValue >> value;
+            } catch (const std::exception&) {
+                return false;
+            }
+            return true;
+        }
+
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Read
@@ -146,7 +197,7 @@ protected:
     template <typename K, typename T>
     bool Write(const K& key, const T& value, bool fOverwrite = true)
     {
-        if (!pdb)
+        if (!pdb && !plogdb)
             return false;
         if (fReadOnly)
             assert(!"Write called on database in read-only mode");
@@ -155,12 +206,16 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
         // Value
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(10000);
         ssValue << value;
+
+        if (plogdb)
+            return LogWrite(ssKey, ssValue, fOverwrite);
+
+        Dbt datKey(&ssKey[0], ssKey.size());
         Dbt datValue(&ssValue[0], ssValue.size());
 
         // Write
@@ -175,7 +230,7 @@ protected:
     template <typename K>
     bool Erase(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !plogdb)
             return false;
         if (fReadOnly)
             assert(!"Erase called on database in read-only mode");
@@ -184,6 +239,10 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (plogdb)
+            return LogErase(ssKey);
+
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Erase
@@ -197,13 +256,17 @@ protected:
     template <typename K>
     bool Exists(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !plogdb)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (plogdb)
+            return LogExists(ssKey);
+
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Exists
@@ -214,57 +277,22 @@ protected:
         return (ret == 0);
     }
 
-    Dbc* GetCursor()
-    {
-        if (!pdb)
-            return NULL;
-        Dbc* pcursor = NULL;
-        int ret = pdb->cursor(NULL, &pcursor, 0);
-        if (ret != 0)
-            return NULL;
-        return pcursor;
-    }
+    CDBCursor* GetCursor();
 
-    int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags = DB_NEXT)
+    int ReadAtCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags = DB_NEXT)
     {
-        // Read at cursor
-        Dbt datKey;
-        if (fFlags == DB_SET || fFlags == DB_SET_RANGE || fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE) {
-            datKey.set_data(&ssKey[0]);
-            datKey.set_size(ssKey.size());
-        }
-        Dbt datValue;
-        if (fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE) {
-            datValue.set_data(&ssValue[0]);
-            datValue.set_size(ssValue.size());
-        }
-        datKey.set_flags(DB_DBT_MALLOC);
-        datValue.set_flags(DB_DBT_MALLOC);
-        int ret = pcursor->get(&datKey, &datValue, fFlags);
-        if (ret != 0)
-            return ret;
-        else if (datKey.get_data() == NULL || datValue.get_data() == NULL)
-            return 99999;
-
-        // Convert to streams
-        ssKey.SetType(SER_DISK);
-        ssKey.clear();
-        ssKey.write((char*)datKey.get_data(), datKey.get_size());
-        ssValue.SetType(SER_DISK);
-        ssValue.clear();
-        ssValue.write((char*)datValue.get_data(), datValue.get_size());
-
-        // Clear and free memory
-        memset(datKey.get_data(), 0, datKey.get_size());
-        memset(datValue.get_data(), 0, datValue.get_size());
-        free(datKey.get_data());
-        free(datValue.get_data());
-        return 0;
+        return pcursor->Read(ssKey, ssValue, fFlags);
     }
 
 public:
     bool TxnBegin()
     {
+        if (plogdb) {
+            if (activeBatch)
+                return false;
+            activeBatch.reset(new CLogDBBatch());
+            return true;
+        }
         if (!pdb || activeTxn)
             return false;
         DbTxn* ptxn = bitdb.TxnBegin();
@@ -274,17 +302,31 @@ public:
         return true;
     }
 
-    bool TxnCommit()
+    /** Commit the active transaction, waiting for it to reach the disk if fSync is set. */
+    bool TxnCommit(bool fSync = false)
     {
+        if (plogdb) {
+            if (!activeBatch)
+                return false;
+            bool fOk = plogdb->Commit(*activeBatch, fSync);
+            activeBatch.reset();
+            return fOk;
+        }
         if (!pdb || !activeTxn)
             return false;
-        int ret = activeTxn->commit(0);
+        int ret = activeTxn->commit(fSync ? DB_TXN_SYNC : 0);
         activeTxn = NULL;
         return (ret == 0);
     }
 
     bool TxnAbort()
     {
+        if (plogdb) {
+            if (!activeBatch)
+                return false;
+            activeBatch.reset();
+            return true;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->abort();
@@ -292,6 +334,16 @@ public:
         return (ret == 0);
     }
 
+    /** Wait for the transactions committed so far to reach the disk. */
+    bool TxnSync()
+    {
+        if (plogdb)
+            return plogdb->Sync();
+        if (!pdb)
+            return false;
+        return bitdb.dbenv->log_flush(NULL) == 0;
+    }
+
     bool ReadVersion(int& nVersion)
     {
         nVersion = 0;
@@ -304,6 +356,12 @@ public:
     }
 
     bool static Rewrite(const std::string& strFile, const char* pszSkip = NULL);
+
+    /**
+     * Convert the Berkeley DB wallet in strFile to the log-structured backend.
+     * The original file is kept as strFile.bdb.bak.
+     */
+    bool static ConvertToLog(const std::string& strFile);
 };
 
 #endif // BITCOIN_WALLET_DB_H
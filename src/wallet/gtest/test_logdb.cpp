@@ -0,0 +1,451 @@
+#include <gtest/gtest.h>
+
+#include "chain.h"
+#include "chainparams.h"
+#include "primitives/block.h"
+#include "random.h"
+#include "util.h"
+#include "wallet/logdb.h"
+#include "wallet/wallet.h"
+#include "wallet/walletdb.h"
+#include "zcash/Address.hpp"
+
+#include <boost/filesystem.hpp>
+
+static CLogDB::Bytes ToBytes(const std::string& str)
+{
+    return CLogDB::Bytes(str.begin(), str.end());
+}
+
+static boost::filesystem::path GetTempLogPath()
+{
+    boost::filesystem::path pathTemp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    boost::filesystem::create_directories(pathTemp);
+    return pathTemp / "wallet.dat";
+}
+
+TEST(logdb_tests, commit_and_replay) {
+    boost::filesystem::path path = GetTempLogPath();
+    uint64_t nDiscarded;
+
+    {
+        CLogDB db(path);
+        ASSERT_FALSE(db.Open(false, nDiscarded));
+        ASSERT_TRUE(db.Open(true, nDiscarded));
+        ASSERT_TRUE(CLogDB::IsLogFile(path));
+
+        CLogDBBatch batch;
+        batch.Write(ToBytes("a"), ToBytes("1"));
+        batch.Write(ToBytes("b"), ToBytes("2"));
+        batch.Write(ToBytes("c"), ToBytes("3"));
+        ASSERT_TRUE(db.Commit(batch));
+
+        // Rewriting identical records appends nothing
+        uint64_t nSize = db.GetFileSize();
+        ASSERT_TRUE(db.Commit(batch));
+        EXPECT_EQ(nSize, db.GetFileSize());
+
+        batch.Clear();
+        batch.Write(ToBytes("b"), ToBytes("20"));
+        batch.Erase(ToBytes("c"));
+        ASSERT_TRUE(db.Commit(batch, true));
+        EXPECT_GT(db.GetFileSize(), nSize);
+        db.Close();
+    }
+
+    CLogDB db(path);
+    ASSERT_TRUE(db.Open(false, nDiscarded));
+    EXPECT_EQ(0, nDiscarded);
+    EXPECT_EQ(2, db.GetRecordCount());
+
+    CLogDB::Bytes value;
+    ASSERT_TRUE(db.Read(ToBytes("a"), value));
+    EXPECT_EQ(ToBytes("1"), value);
+    ASSERT_TRUE(db.Read(ToBytes("b"), value));
+    EXPECT_EQ(ToBytes("20"), value);
+    EXPECT_FALSE(db.Exists(ToBytes("c")));
+
+    // Records are visited in key order
+    CLogDB::Bytes key;
+    ASSERT_TRUE(db.Seek(ToBytes(""), false, key, value));
+    EXPECT_EQ(ToBytes("a"), key);
+    ASSERT_TRUE(db.Seek(key, true, key, value));
+    EXPECT_EQ(ToBytes("b"), key);
+    EXPECT_FALSE(db.Seek(key, true, key, value));
+}
+
+TEST(logdb_tests, batch_merges_keys_with_prefix) {
+    std::set<CLogDB::Bytes> setKeys;
+    setKeys.insert(ToBytes("wa"));
+    setKeys.insert(ToBytes("wb"));
+
+    // Keys written by the batch are added and erased ones dropped, while
+    // changes outside the prefix are left alone
+    CLogDBBatch batch;
+    batch.Write(ToBytes("wc"), ToBytes("3"));
+    batch.Erase(ToBytes("wa"));
+    batch.Write(ToBytes("x"), ToBytes("4"));
+    batch.Erase(ToBytes("v"));
+    batch.MergeKeysWithPrefix(ToBytes("w"), setKeys);
+
+    std::set<CLogDB::Bytes> setExpected;
+    setExpected.insert(ToBytes("wb"));
+    setExpected.insert(ToBytes("wc"));
+    EXPECT_EQ(setExpected, setKeys);
+}
+
+TEST(logdb_tests, discard_torn_write) {
+    boost::filesystem::path path = GetTempLogPath();
+    uint64_t nDiscarded;
+    uint64_t nGoodSize;
+
+    {
+        CLogDB db(path);
+        ASSERT_TRUE(db.Open(true, nDiscarded));
+        CLogDBBatch batch;
+        batch.Write(ToBytes("key"), ToBytes("value"));
+        ASSERT_TRUE(db.Commit(batch, true));
+        nGoodSize = db.GetFileSize();
+
+        batch.Clear();
+        batch.Write(ToBytes("key"), ToBytes("lost"));
+        batch.Write(ToBytes("other"), ToBytes("lost"));
+        ASSERT_TRUE(db.Commit(batch, true));
+        db.Close();
+    }
+
+    // Simulate a crash part way through writing the second entry
+    boost::filesystem::resize_file(path, boost::filesystem::file_size(path) - 3);
+
+    {
+        CLogDB db(path);
+        ASSERT_TRUE(db.Open(false, nDiscarded));
+        EXPECT_GT(nDiscarded, 0);
+        EXPECT_EQ(nGoodSize, boost::filesystem::file_size(path));
+
+        // None of the torn entry is applied
+        CLogDB::Bytes value;
+        ASSERT_TRUE(db.Read(ToBytes("key"), value));
+        EXPECT_EQ(ToBytes("value"), value);
+        EXPECT_FALSE(db.Exists(ToBytes("other")));
+
+        // and entries after it are not hidden behind it
+        CLogDBBatch batch;
+        batch.Write(ToBytes("other"), ToBytes("kept"));
+        ASSERT_TRUE(db.Commit(batch, true));
+        db.Close();
+    }
+
+    CLogDB db(path);
+    ASSERT_TRUE(db.Open(false, nDiscarded));
+    EXPECT_EQ(0, nDiscarded);
+    CLogDB::Bytes value;
+    ASSERT_TRUE(db.Read(ToBytes("other"), value));
+    EXPECT_EQ(ToBytes("kept"), value);
+}
+
+TEST(logdb_tests, compact) {
+    boost::filesystem::path path = GetTempLogPath();
+    uint64_t nDiscarded;
+
+    CLogDB db(path);
+    ASSERT_TRUE(db.Open(true, nDiscarded));
+    for (int i = 0; i < 100; i++) {
+        CLogDBBatch batch;
+        batch.Write(ToBytes("counter"), ToBytes(std::to_string(i)));
+        batch.Write(ToBytes("\x04poolentry"), ToBytes(std::to_string(i)));
+        ASSERT_TRUE(db.Commit(batch));
+    }
+    uint64_t nSize = db.GetFileSize();
+
+    ASSERT_TRUE(db.Compact("\x04pool"));
+    EXPECT_LT(db.GetFileSize(), nSize);
+    EXPECT_EQ(db.GetFileSize(), boost::filesystem::file_size(path));
+    EXPECT_FALSE(db.Exists(ToBytes("\x04poolentry")));
+    db.Close();
+
+    ASSERT_TRUE(db.Open(false, nDiscarded));
+    EXPECT_EQ(1, db.GetRecordCount());
+    CLogDB::Bytes value;
+    ASSERT_TRUE(db.Read(ToBytes("counter"), value));
+    EXPECT_EQ(ToBytes("99"), value);
+}
+
+/** Runs a wallet on the log backend in a temporary data directory of its own. */
+class LogDBWalletTest : public ::testing::Test {
+protected:
+    virtual void SetUp() {
+        SelectParams(CBaseChainParams::TESTNET);
+        fHadDatadir = mapArgs.count("-datadir") > 0;
+        if (fHadDatadir)
+            strPrevDatadir = mapArgs["-datadir"];
+        pathTemp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+        boost::filesystem::create_directories(pathTemp);
+        mapArgs["-datadir"] = pathTemp.string();
+        ClearDatadirCache();
+        ASSERT_TRUE(SetWalletBackend("log"));
+    }
+
+    virtual void TearDown() {
+        SetWalletBackend(DEFAULT_WALLET_BACKEND);
+        if (fHadDatadir)
+            mapArgs["-datadir"] = strPrevDatadir;
+        else
+            mapArgs.erase("-datadir");
+        ClearDatadirCache();
+        boost::filesystem::remove_all(pathTemp);
+    }
+
+    boost::filesystem::path pathTemp;
+    bool fHadDatadir;
+    std::string strPrevDatadir;
+};
+
+TEST_F(LogDBWalletTest, wallet_stores_witnesses_separately) {
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = 1;
+    CWalletTx wtx(NULL, mtx);
+
+    JSOutPoint jsop(wtx.GetHash(), 0, 1);
+    CNoteData nd(libzcash::SpendingKey::random().address());
+    ZCIncrementalMerkleTree tree;
+    tree.append(GetRandHash());
+    nd.witnesses.push_front(tree.witness());
+    for (int i = 0; i < 2; i++) {
+        uint256 commitment = GetRandHash();
+        tree.append(commitment);
+        ZCIncrementalWitness witness = nd.witnesses.front();
+        witness.append(commitment);
+        nd.witnesses.push_front(witness);
+    }
+    nd.witnessHeight = 10;
+    wtx.mapNoteData.insert(std::make_pair(jsop, nd));
+
+    std::string strFile = "wallet-log.dat";
+    {
+        CWalletDB walletdb(strFile, "cr+");
+        ASSERT_TRUE(walletdb.WriteTx(wtx.GetHash(), wtx));
+    }
+    ASSERT_TRUE(CLogDB::IsLogFile(GetDataDir() / strFile));
+
+    // Advancing the cache by one block only appends the new witness
+    CLogDB* plogdb = logdbenv.Open(strFile, false);
+    ASSERT_TRUE(plogdb != NULL);
+    uint64_t nSize = plogdb->GetFileSize();
+    CNoteData& ndTip = wtx.mapNoteData[jsop];
+    uint256 commitment = GetRandHash();
+    tree.append(commitment);
+    ZCIncrementalWitness witness = ndTip.witnesses.front();
+    witness.append(commitment);
+    ndTip.witnesses.push_front(witness);
+    ndTip.witnesses.pop_back();
+    ndTip.witnessHeight = 11;
+    {
+        CWalletDB walletdb(strFile);
+        ASSERT_TRUE(walletdb.WriteTx(wtx.GetHash(), wtx));
+    }
+    uint64_t nWitnessSize = ::GetSerializeSize(witness, SER_DISK, CLIENT_VERSION);
+    EXPECT_LT(plogdb->GetFileSize() - nSize, 2 * nWitnessSize);
+    logdbenv.Release(strFile);
+
+    // The witnesses are reattached when the wallet is loaded
+    CWallet wallet(strFile);
+    bool fFirstRun;
+    ASSERT_EQ(DB_LOAD_OK, wallet.LoadWallet(fFirstRun));
+    ASSERT_EQ(1, wallet.mapWallet.count(wtx.GetHash()));
+    const CNoteData& ndLoaded = wallet.mapWallet[wtx.GetHash()].mapNoteData[jsop];
+    EXPECT_EQ(11, ndLoaded.witnessHeight);
+    ASSERT_EQ(3, ndLoaded.witnesses.size());
+    auto it = ndTip.witnesses.begin();
+    for (const ZCIncrementalWitness& loaded : ndLoaded.witnesses) {
+        EXPECT_EQ(it->root(), loaded.root());
+        ++it;
+    }
+    logdbenv.CloseDb(strFile);
+}
+
+static CTransaction PayToScript(const CScript& script)
+{
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = 1;
+    mtx.vout[0].scriptPubKey = script;
+    return mtx;
+}
+
+static void ConnectBlock(CWallet& wallet, const CBlock& block, int nHeight)
+{
+    for (const CTransaction& tx : block.vtx) {
+        wallet.SyncTransaction(tx, &block);
+    }
+    CBlockIndex index(block);
+    index.nHeight = nHeight;
+    ZCIncrementalMerkleTree tree;
+    wallet.ChainTip(&index, &block, tree, true);
+}
+
+TEST_F(LogDBWalletTest, wallet_batches_block_writes) {
+    std::string strFile = "wallet-batch.dat";
+    CScript script = CScript() << OP_TRUE;
+    CBlock block1;
+    block1.vtx.push_back(PayToScript(script));
+    CBlock block2;
+    block2.hashPrevBlock = block1.GetHash();
+    for (int i = 0; i < 3; i++) {
+        block2.vtx.push_back(PayToScript(script));
+    }
+
+    {
+        CWallet wallet(strFile);
+        bool fFirstRun;
+        ASSERT_EQ(DB_LOAD_OK, wallet.LoadWallet(fFirstRun));
+        ASSERT_TRUE(wallet.AddWatchOnly(script));
+        ConnectBlock(wallet, block1, 1);
+
+        CLogDB* plogdb = logdbenv.Open(strFile, false);
+        ASSERT_TRUE(plogdb != NULL);
+        uint64_t nSize = plogdb->GetFileSize();
+
+        // Each transaction's writes are committed before cs_wallet is
+        // released, and synced together once the block is complete
+        for (const CTransaction& tx : block2.vtx) {
+            wallet.SyncTransaction(tx, &block2);
+            EXPECT_GT(plogdb->GetFileSize(), nSize);
+            nSize = plogdb->GetFileSize();
+        }
+        EXPECT_EQ(4, wallet.mapWallet.size());
+
+        CBlockIndex index2(block2);
+        index2.nHeight = 2;
+        ZCIncrementalMerkleTree tree;
+        wallet.ChainTip(&index2, &block2, tree, true);
+        EXPECT_EQ(nSize, plogdb->GetFileSize());
+
+        // Transactions seen outside a block are still written immediately
+        nSize = plogdb->GetFileSize();
+        wallet.SyncTransaction(PayToScript(script), NULL);
+        EXPECT_GT(plogdb->GetFileSize(), nSize);
+        logdbenv.Release(strFile);
+    }
+    logdbenv.CloseDb(strFile);
+
+    CWallet wallet(strFile);
+    bool fFirstRun;
+    ASSERT_EQ(DB_LOAD_OK, wallet.LoadWallet(fFirstRun));
+    EXPECT_EQ(5, wallet.mapWallet.size());
+    for (const CTransaction& tx : block2.vtx) {
+        EXPECT_EQ(1, wallet.mapWallet.count(tx.GetHash()));
+    }
+    logdbenv.CloseDb(strFile);
+}
+
+TEST_F(LogDBWalletTest, wallet_discards_torn_block) {
+    std::string strFile = "wallet-torn.dat";
+    CScript script = CScript() << OP_TRUE;
+    CBlock block1;
+    block1.vtx.push_back(PayToScript(script));
+    CBlock block2;
+    block2.hashPrevBlock = block1.GetHash();
+    for (int i = 0; i < 3; i++) {
+        block2.vtx.push_back(PayToScript(script));
+    }
+
+    {
+        CWallet wallet(strFile);
+        bool fFirstRun;
+        ASSERT_EQ(DB_LOAD_OK, wallet.LoadWallet(fFirstRun));
+        ASSERT_TRUE(wallet.AddWatchOnly(script));
+        ConnectBlock(wallet, block1, 1);
+        ConnectBlock(wallet, block2, 2);
+    }
+    logdbenv.CloseDb(strFile);
+
+    // Simulate a crash while the second block's last transaction was being written
+    boost::filesystem::path pathWallet = GetDataDir() / strFile;
+    boost::filesystem::resize_file(pathWallet, boost::filesystem::file_size(pathWallet) - 3);
+
+    std::string strWarning;
+    ASSERT_TRUE(logdbenv.Verify(strFile, strWarning));
+    EXPECT_FALSE(strWarning.empty());
+
+    // The wallet comes back without the torn transaction; the block is
+    // rescanned through the SetBestChain mechanism
+    CWallet wallet(strFile);
+    bool fFirstRun;
+    ASSERT_EQ(DB_LOAD_OK, wallet.LoadWallet(fFirstRun));
+    EXPECT_EQ(3, wallet.mapWallet.size());
+    EXPECT_EQ(1, wallet.mapWallet.count(block1.vtx[0].GetHash()));
+    EXPECT_EQ(0, wallet.mapWallet.count(block2.vtx[2].GetHash()));
+    EXPECT_TRUE(wallet.HaveWatchOnly(script));
+    logdbenv.CloseDb(strFile);
+}
+
+TEST(logdb_tests, bdb_wallet_locator_lags_partial_block) {
+    SelectParams(CBaseChainParams::TESTNET);
+    ASSERT_EQ(WALLET_BACKEND_BDB, GetWalletBackend());
+    // The BDB environment stays where it was first opened, so this uses the
+    // data directory of the other wallet tests and removes its file afterwards
+    if (!mapArgs.count("-datadir")) {
+        boost::filesystem::path pathTemp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+        boost::filesystem::create_directories(pathTemp);
+        mapArgs["-datadir"] = pathTemp.string();
+    }
+
+    std::string strFile = "wallet-bdb-torn.dat";
+    CScript script = CScript() << OP_TRUE;
+    CBlock block1;
+    block1.vtx.push_back(PayToScript(script));
+    CBlock block2;
+    block2.hashPrevBlock = block1.GetHash();
+    for (int i = 0; i < 3; i++) {
+        block2.vtx.push_back(PayToScript(script));
+    }
+    CBlockLocator loc1(std::vector<uint256>(1, block1.GetHash()));
+    CBlockLocator loc2(std::vector<uint256>(1, block2.GetHash()));
+
+    {
+        CWallet wallet(strFile);
+        bool fFirstRun;
+        ASSERT_EQ(DB_LOAD_OK, wallet.LoadWallet(fFirstRun));
+        ASSERT_TRUE(wallet.AddWatchOnly(script));
+        ConnectBlock(wallet, block1, 1);
+        wallet.SetBestChain(loc1);
+
+        // A crash now would leave the second block's first transactions on
+        // disk, but the locator still points at the first block, so the
+        // second one is rescanned
+        wallet.SyncTransaction(block2.vtx[0], &block2);
+        wallet.SyncTransaction(block2.vtx[1], &block2);
+        CBlockLocator loc;
+        {
+            CWalletDB walletdb(strFile, "r");
+            ASSERT_TRUE(walletdb.ReadBestBlock(loc));
+        }
+        EXPECT_EQ(loc1.vHave, loc.vHave);
+
+        // Only SetBestChain moves it, after the block's writes were synced
+        wallet.SyncTransaction(block2.vtx[2], &block2);
+        CBlockIndex index2(block2);
+        index2.nHeight = 2;
+        ZCIncrementalMerkleTree tree;
+        wallet.ChainTip(&index2, &block2, tree, true);
+        {
+            CWalletDB walletdb(strFile, "r");
+            ASSERT_TRUE(walletdb.ReadBestBlock(loc));
+        }
+        EXPECT_EQ(loc1.vHave, loc.vHave);
+
+        wallet.SetBestChain(loc2);
+        {
+            CWalletDB walletdb(strFile, "r");
+            ASSERT_TRUE(walletdb.ReadBestBlock(loc));
+        }
+        EXPECT_EQ(loc2.vHave, loc.vHave);
+    }
+    bitdb.RemoveDb(strFile);
+}
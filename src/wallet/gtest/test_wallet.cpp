@@ -294,6 +294,98 @@ TEST(wallet_tests, find_unspent_notes) {
 }
 
 
+TEST(wallet_tests, unspent_notes_follow_chain_tip) {
+    SelectParams(CBaseChainParams::TESTNET);
+    CWallet wallet;
+    ZCIncrementalMerkleTree tree;
+    auto sk = libzcash::SpendingKey::random();
+    wallet.AddSpendingKey(sk);
+
+    auto wtx = GetValidReceive(sk, 10, true);
+    auto note = GetNote(sk, wtx, 0, 1);
+    auto nullifier = note.nullifier(sk);
+
+    mapNoteData_t noteData;
+    JSOutPoint jsoutpt {wtx.GetHash(), 0, 1};
+    CNoteData nd {sk.address(), nullifier};
+    noteData[jsoutpt] = nd;
+
+    wtx.SetNoteData(noteData);
+    wallet.AddToWallet(wtx, true, NULL);
+
+    // Fake-mine the transaction
+    CBlock block;
+    block.vtx.push_back(wtx);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    auto blockHash = block.GetHash();
+    CBlockIndex fakeIndex {block};
+    mapBlockIndex.insert(std::make_pair(blockHash, &fakeIndex));
+    chainActive.SetTip(&fakeIndex);
+    wallet.ChainTip(&fakeIndex, &block, tree, true);
+
+    wtx.SetMerkleBranch(block);
+    wallet.AddToWallet(wtx, true, NULL);
+
+    // The first query builds the unspent note index
+    std::vector<CNotePlaintextEntry> entries;
+    wallet.GetFilteredNotes(entries, "", 1);
+    EXPECT_EQ(1, entries.size());
+    entries.clear();
+    wallet.GetFilteredNotes(entries, CZCPaymentAddress(sk.address()).ToString(), 1);
+    EXPECT_EQ(1, entries.size());
+    EXPECT_EQ(jsoutpt, entries[0].jsop);
+    EXPECT_EQ(10, entries[0].plaintext.value);
+    entries.clear();
+
+    // Notes sent to other addresses are not returned
+    auto sk2 = libzcash::SpendingKey::random();
+    wallet.GetFilteredNotes(entries, CZCPaymentAddress(sk2.address()).ToString(), 1);
+    EXPECT_EQ(0, entries.size());
+    entries.clear();
+
+    // Spend the note in the next block
+    auto wtx2 = GetValidSpend(sk, note, 5);
+    wallet.AddToWallet(wtx2, true, NULL);
+
+    CBlock block2;
+    block2.vtx.push_back(wtx2);
+    block2.hashMerkleRoot = block2.BuildMerkleTree();
+    block2.hashPrevBlock = blockHash;
+    auto blockHash2 = block2.GetHash();
+    CBlockIndex fakeIndex2 {block2};
+    mapBlockIndex.insert(std::make_pair(blockHash2, &fakeIndex2));
+    fakeIndex2.nHeight = 1;
+    chainActive.SetTip(&fakeIndex2);
+
+    wtx2.SetMerkleBranch(block2);
+    wallet.AddToWallet(wtx2, true, NULL);
+    wallet.ChainTip(&fakeIndex2, &block2, tree, true);
+    EXPECT_TRUE(wallet.IsSpent(nullifier));
+
+    wallet.GetFilteredNotes(entries, "", 1);
+    EXPECT_EQ(0, entries.size());
+    entries.clear();
+    // Spent notes are still found by walking the wallet
+    wallet.GetFilteredNotes(entries, "", 1, false);
+    EXPECT_EQ(1, entries.size());
+    entries.clear();
+
+    // Disconnecting the spending block makes the note spendable again
+    chainActive.SetTip(&fakeIndex);
+    wallet.ChainTip(&fakeIndex2, &block2, tree, false);
+    EXPECT_FALSE(wallet.IsSpent(nullifier));
+
+    wallet.GetFilteredNotes(entries, "", 1);
+    EXPECT_EQ(1, entries.size());
+    entries.clear();
+
+    // Tear down
+    chainActive.SetTip(NULL);
+    mapBlockIndex.erase(blockHash);
+    mapBlockIndex.erase(blockHash2);
+}
+
+
 TEST(wallet_tests, set_note_addrs_in_cwallettx) {
     auto sk = libzcash::SpendingKey::random();
     auto wtx = GetValidReceive(sk, 10, true);
@@ -0,0 +1,526 @@
+// Copyright (c) 2017 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "wallet/logdb.h"
+
+#include "clientversion.h"
+#include "crypto/common.h"
+#include "hash.h"
+#include "serialize.h"
+#include "streams.h"
+#include "util.h"
+
+#include <algorithm>
+#include <string.h>
+
+#include <boost/filesystem.hpp>
+
+using namespace std;
+
+//! Every log starts with this magic and a format version
+static const char LOGDB_MAGIC[8] = {'z', 'c', 'w', 'l', 'o', 'g', 'd', 'b'};
+static const uint32_t LOGDB_VERSION = 1;
+static const size_t LOGDB_HEADER_SIZE = sizeof(LOGDB_MAGIC) + 4;
+//! Each entry is prefixed with its payload size and checksum
+static const size_t LOGDB_ENTRY_HEADER_SIZE = 8;
+static const uint32_t LOGDB_MAX_ENTRY_SIZE = 0x7fffffff;
+
+CLogDBEnv logdbenv;
+
+void CLogDBBatch::Write(const Bytes& key, const Bytes& value)
+{
+    mapChanges[key] = value;
+}
+
+void CLogDBBatch::Erase(const Bytes& key)
+{
+    mapChanges[key] = boost::none;
+}
+
+bool CLogDBBatch::Lookup(const Bytes& key, boost::optional<Bytes>& value) const
+{
+    std::map<Bytes, boost::optional<Bytes> >::const_iterator it = mapChanges.find(key);
+    if (it == mapChanges.end())
+        return false;
+    value = it->second;
+    return true;
+}
+
+void CLogDBBatch::MergeKeysWithPrefix(const Bytes& prefix, std::set<Bytes>& setKeys) const
+{
+    std::map<Bytes, boost::optional<Bytes> >::const_iterator it = mapChanges.lower_bound(prefix);
+    for (; it != mapChanges.end(); ++it) {
+        if (it->first.size() < prefix.size() || !std::equal(prefix.begin(), prefix.end(), it->first.begin()))
+            break;
+        if (it->second)
+            setKeys.insert(it->first);
+        else
+            setKeys.erase(it->first);
+    }
+}
+
+static bool WriteHeader(FILE* fileout)
+{
+    unsigned char header[LOGDB_HEADER_SIZE];
+    memcpy(header, LOGDB_MAGIC, sizeof(LOGDB_MAGIC));
+    WriteLE32(header + sizeof(LOGDB_MAGIC), LOGDB_VERSION);
+    return fwrite(header, 1, sizeof(header), fileout) == sizeof(header);
+}
+
+static uint32_t EntryChecksum(const std::vector<char>& vchEntry)
+{
+    uint256 hash = Hash(vchEntry.begin(), vchEntry.end());
+    return ReadLE32(hash.begin());
+}
+
+CLogDB::CLogDB(const boost::filesystem::path& pathIn, bool fMockIn) :
+    path(pathIn), fMock(fMockIn), file(NULL), nFileSize(0), nLiveSize(0), fDirty(false)
+{
+}
+
+CLogDB::~CLogDB()
+{
+    Close();
+}
+
+bool CLogDB::IsLogFile(const boost::filesystem::path& path)
+{
+    FILE* filein = fopen(path.string().c_str(), "rb");
+    if (!filein)
+        return false;
+    char magic[sizeof(LOGDB_MAGIC)];
+    bool fMatch = fread(magic, 1, sizeof(magic), filein) == sizeof(magic) &&
+                  memcmp(magic, LOGDB_MAGIC, sizeof(magic)) == 0;
+    fclose(filein);
+    return fMatch;
+}
+
+void CLogDB::Apply(const Bytes& key, const boost::optional<Bytes>& value)
+{
+    std::map<Bytes, Bytes>::iterator it = mapRecords.find(key);
+    if (it != mapRecords.end()) {
+        nLiveSize -= it->first.size() + it->second.size();
+        if (!value) {
+            mapRecords.erase(it);
+            return;
+        }
+        it->second = *value;
+    } else {
+        if (!value)
+            return;
+        mapRecords.insert(std::make_pair(key, *value));
+    }
+    nLiveSize += key.size() + value->size();
+}
+
+bool CLogDB::Open(bool fCreate, uint64_t& nDiscardedBytes)
+{
+    LOCK(cs);
+    nDiscardedBytes = 0;
+    mapRecords.clear();
+    nLiveSize = 0;
+    nFileSize = 0;
+    if (fMock)
+        return true;
+
+    if (!boost::filesystem::exists(path)) {
+        if (!fCreate)
+            return error("CLogDB::Open: %s does not exist", path.string());
+        FILE* fileout = fopen(path.string().c_str(), "wb");
+        if (!fileout)
+            return error("CLogDB::Open: Unable to create %s", path.string());
+        bool fOk = WriteHeader(fileout);
+        FileCommit(fileout);
+        fclose(fileout);
+        if (!fOk)
+            return error("CLogDB::Open: Unable to write header to %s", path.string());
+    }
+
+    FILE* filein = fopen(path.string().c_str(), "rb");
+    if (!filein)
+        return error("CLogDB::Open: Unable to open %s", path.string());
+
+    unsigned char header[LOGDB_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), filein) != sizeof(header) ||
+        memcmp(header, LOGDB_MAGIC, sizeof(LOGDB_MAGIC)) != 0) {
+        fclose(filein);
+        return error("CLogDB::Open: %s is not a log-structured wallet", path.string());
+    }
+    uint32_t nVersion = ReadLE32(header + sizeof(LOGDB_MAGIC));
+    if (nVersion > LOGDB_VERSION) {
+        fclose(filein);
+        return error("CLogDB::Open: %s has unsupported version %u", path.string(), nVersion);
+    }
+
+    // Replay every complete entry; stop at the first one which is truncated
+    // or fails its checksum, as it can only be the result of a torn write.
+    uint64_t nGoodSize = LOGDB_HEADER_SIZE;
+    size_t nEntries = 0;
+    while (true) {
+        unsigned char entryHeader[LOGDB_ENTRY_HEADER_SIZE];
+        if (fread(entryHeader, 1, sizeof(entryHeader), filein) != sizeof(entryHeader))
+            break;
+        uint32_t nSize = ReadLE32(entryHeader);
+        uint32_t nChecksum = ReadLE32(entryHeader + 4);
+        if (nSize > LOGDB_MAX_ENTRY_SIZE)
+            break;
+        std::vector<char> vchEntry(nSize);
+        if (nSize > 0 && fread(&vchEntry[0], 1, nSize, filein) != nSize)
+            break;
+        if (EntryChecksum(vchEntry) != nChecksum)
+            break;
+
+        std::vector<std::pair<Bytes, boost::optional<Bytes> > > vChanges;
+        try {
+            CDataStream ssEntry(vchEntry, SER_DISK, CLIENT_VERSION);
+            uint64_t nChanges = ReadCompactSize(ssEntry);
+            for (uint64_t i = 0; i < nChanges; i++) {
+                unsigned char fWrite;
+                Bytes key;
+                ssEntry >> fWrite >> key;
+                boost::optional<Bytes> value;
+                if (fWrite) {
+                    value = Bytes();
+                    ssEntry >> *value;
+                }
+                vChanges.push_back(std::make_pair(key, value));
+            }
+        } catch (const std::exception&) {
+            break;
+        }
+        for (size_t i = 0; i < vChanges.size(); i++)
+            Apply(vChanges[i].first, vChanges[i].second);
+        nGoodSize += LOGDB_ENTRY_HEADER_SIZE + nSize;
+        nEntries++;
+    }
+    fclose(filein);
+
+    uint64_t nActualSize = boost::filesystem::file_size(path);
+    if (nActualSize > nGoodSize) {
+        nDiscardedBytes = nActualSize - nGoodSize;
+        LogPrintf("CLogDB::Open: Discarding %u bytes of incomplete writes at the end of %s\n",
+            nDiscardedBytes, path.string());
+        boost::filesystem::resize_file(path, nGoodSize);
+    }
+    nFileSize = nGoodSize;
+
+    file = fopen(path.string().c_str(), "ab");
+    if (!file)
+        return error("CLogDB::Open: Unable to open %s for appending", path.string());
+
+    LogPrint("db", "CLogDB::Open: Replayed %u entries, %u records from %s\n",
+        nEntries, mapRecords.size(), path.string());
+    return true;
+}
+
+void CLogDB::Close()
+{
+    LOCK(cs);
+    if (file) {
+        FileCommit(file);
+        fclose(file);
+        file = NULL;
+    }
+    fDirty = false;
+}
+
+bool CLogDB::Read(const Bytes& key, Bytes& value) const
+{
+    LOCK(cs);
+    std::map<Bytes, Bytes>::const_iterator it = mapRecords.find(key);
+    if (it == mapRecords.end())
+        return false;
+    value = it->second;
+    return true;
+}
+
+bool CLogDB::Exists(const Bytes& key) const
+{
+    LOCK(cs);
+    return mapRecords.count(key) > 0;
+}
+
+bool CLogDB::Seek(const Bytes& key, bool fAfter, Bytes& keyOut, Bytes& valueOut) const
+{
+    LOCK(cs);
+    std::map<Bytes, Bytes>::const_iterator it = fAfter ? mapRecords.upper_bound(key) : mapRecords.lower_bound(key);
+    if (it == mapRecords.end())
+        return false;
+    keyOut = it->first;
+    valueOut = it->second;
+    return true;
+}
+
+bool CLogDB::AppendEntry(FILE* fileout, const std::vector<char>& vchEntry)
+{
+    if (vchEntry.size() > LOGDB_MAX_ENTRY_SIZE)
+        return false;
+    unsigned char entryHeader[LOGDB_ENTRY_HEADER_SIZE];
+    WriteLE32(entryHeader, vchEntry.size());
+    WriteLE32(entryHeader + 4, EntryChecksum(vchEntry));
+    if (fwrite(entryHeader, 1, sizeof(entryHeader), fileout) != sizeof(entryHeader))
+        return false;
+    if (!vchEntry.empty() && fwrite(&vchEntry[0], 1, vchEntry.size(), fileout) != vchEntry.size())
+        return false;
+    return fflush(fileout) == 0;
+}
+
+bool CLogDB::Commit(const CLogDBBatch& batch, bool fSync)
+{
+    LOCK(cs);
+
+    // Only log changes which actually modify a record
+    std::vector<std::map<Bytes, boost::optional<Bytes> >::const_iterator> vChanges;
+    for (std::map<Bytes, boost::optional<Bytes> >::const_iterator it = batch.mapChanges.begin(); it != batch.mapChanges.end(); ++it) {
+        std::map<Bytes, Bytes>::const_iterator mi = mapRecords.find(it->first);
+        if (it->second ? (mi != mapRecords.end() && mi->second == *it->second) : mi == mapRecords.end())
+            continue;
+        vChanges.push_back(it);
+    }
+    if (vChanges.empty())
+        return true;
+
+    if (!fMock) {
+        if (!file)
+            return error("CLogDB::Commit: %s is not open", path.string());
+
+        CDataStream ssEntry(SER_DISK, CLIENT_VERSION);
+        WriteCompactSize(ssEntry, vChanges.size());
+        for (size_t i = 0; i < vChanges.size(); i++) {
+            unsigned char fWrite = vChanges[i]->second ? 1 : 0;
+            ssEntry << fWrite << vChanges[i]->first;
+            if (fWrite)
+                ssEntry << *vChanges[i]->second;
+        }
+        std::vector<char> vchEntry(ssEntry.begin(), ssEntry.end());
+
+        if (!AppendEntry(file, vchEntry)) {
+            // Cut off whatever part of the entry was written, so that later
+            // entries are not hidden behind it when the log is replayed.
+            fclose(file);
+            boost::filesystem::resize_file(path, nFileSize);
+            file = fopen(path.string().c_str(), "ab");
+            return error("CLogDB::Commit: Failed to append to %s", path.string());
+        }
+        nFileSize += LOGDB_ENTRY_HEADER_SIZE + vchEntry.size();
+        if (fSync) {
+            FileCommit(file);
+            fDirty = false;
+        } else {
+            fDirty = true;
+        }
+    }
+
+    for (size_t i = 0; i < vChanges.size(); i++)
+        Apply(vChanges[i]->first, vChanges[i]->second);
+    return true;
+}
+
+bool CLogDB::Sync()
+{
+    LOCK(cs);
+    if (file && fDirty) {
+        FileCommit(file);
+        fDirty = false;
+    }
+    return true;
+}
+
+bool CLogDB::NeedsCompaction() const
+{
+    LOCK(cs);
+    if (fMock || nFileSize < LOGDB_COMPACT_MIN_SIZE)
+        return false;
+    return nFileSize - std::min(nLiveSize, nFileSize) > nFileSize * LOGDB_COMPACT_MIN_GARBAGE;
+}
+
+bool CLogDB::Compact(const char* pszSkip)
+{
+    LOCK(cs);
+    int64_t nStart = GetTimeMillis();
+    size_t nSkipLen = pszSkip ? strlen(pszSkip) : 0;
+
+    std::vector<Bytes> vSkipped;
+    CDataStream ssEntry(SER_DISK, CLIENT_VERSION);
+    for (std::map<Bytes, Bytes>::const_iterator it = mapRecords.begin(); it != mapRecords.end(); ++it) {
+        if (pszSkip && it->first.size() >= nSkipLen && memcmp(&it->first[0], pszSkip, nSkipLen) == 0)
+            vSkipped.push_back(it->first);
+    }
+
+    if (!fMock) {
+        WriteCompactSize(ssEntry, mapRecords.size() - vSkipped.size());
+        unsigned char fWrite = 1;
+        size_t nSkipped = 0;
+        for (std::map<Bytes, Bytes>::const_iterator it = mapRecords.begin(); it != mapRecords.end(); ++it) {
+            if (nSkipped < vSkipped.size() && it->first == vSkipped[nSkipped]) {
+                nSkipped++;
+                continue;
+            }
+            ssEntry << fWrite << it->first << it->second;
+        }
+        std::vector<char> vchEntry(ssEntry.begin(), ssEntry.end());
+
+        boost::filesystem::path pathTmp = path;
+        pathTmp += ".compact";
+        FILE* fileout = fopen(pathTmp.string().c_str(), "wb");
+        if (!fileout)
+            return error("CLogDB::Compact: Unable to create %s", pathTmp.string());
+        bool fOk = WriteHeader(fileout) && AppendEntry(fileout, vchEntry);
+        FileCommit(fileout);
+        fclose(fileout);
+        if (!fOk) {
+            boost::filesystem::remove(pathTmp);
+            return error("CLogDB::Compact: Unable to write %s", pathTmp.string());
+        }
+
+        if (file) {
+            fclose(file);
+            file = NULL;
+        }
+        bool fRenamed = RenameOver(pathTmp, path);
+        file = fopen(path.string().c_str(), "ab");
+        if (!fRenamed || !file)
+            return error("CLogDB::Compact: Unable to replace %s", path.string());
+
+        LogPrint("db", "CLogDB::Compact: %s compacted from %u to %u bytes in %dms\n",
+            path.string(), nFileSize, LOGDB_HEADER_SIZE + LOGDB_ENTRY_HEADER_SIZE + vchEntry.size(),
+            GetTimeMillis() - nStart);
+        nFileSize = LOGDB_HEADER_SIZE + LOGDB_ENTRY_HEADER_SIZE + vchEntry.size();
+        fDirty = false;
+    }
+
+    for (size_t i = 0; i < vSkipped.size(); i++)
+        Apply(vSkipped[i], boost::none);
+    return true;
+}
+
+bool CLogDB::Backup(const boost::filesystem::path& pathDest)
+{
+    LOCK(cs);
+    if (fMock)
+        return false;
+    if (file)
+        FileCommit(file);
+    fDirty = false;
+    try {
+        boost::filesystem::copy_file(path, pathDest, boost::filesystem::copy_option::overwrite_if_exists);
+    } catch (const boost::filesystem::filesystem_error& e) {
+        return error("CLogDB::Backup: Error copying %s to %s - %s", path.string(), pathDest.string(), e.what());
+    }
+    return true;
+}
+
+uint64_t CLogDB::GetFileSize() const
+{
+    LOCK(cs);
+    return nFileSize;
+}
+
+uint64_t CLogDB::GetLiveSize() const
+{
+    LOCK(cs);
+    return nLiveSize;
+}
+
+size_t CLogDB::GetRecordCount() const
+{
+    LOCK(cs);
+    return mapRecords.size();
+}
+
+
+//
+// CLogDBEnv
+//
+
+CLogDBEnv::CLogDBEnv() : fMockDb(false)
+{
+}
+
+CLogDBEnv::~CLogDBEnv()
+{
+    for (std::map<std::string, CLogDB*>::iterator it = mapDb.begin(); it != mapDb.end(); ++it)
+        delete it->second;
+    mapDb.clear();
+}
+
+void CLogDBEnv::MakeMock()
+{
+    LogPrint("db", "CLogDBEnv::MakeMock\n");
+    fMockDb = true;
+}
+
+CLogDB* CLogDBEnv::Open(const std::string& strFile, bool fCreate)
+{
+    LOCK(cs_db);
+    CLogDB*& pdb = mapDb[strFile];
+    if (pdb == NULL) {
+        pdb = new CLogDB(GetDataDir() / strFile, fMockDb);
+        uint64_t nDiscardedBytes;
+        if (!pdb->Open(fCreate, nDiscardedBytes)) {
+            delete pdb;
+            mapDb.erase(strFile);
+            return NULL;
+        }
+    }
+    ++mapFileUseCount[strFile];
+    return pdb;
+}
+
+void CLogDBEnv::Release(const std::string& strFile)
+{
+    LOCK(cs_db);
+    --mapFileUseCount[strFile];
+}
+
+bool CLogDBEnv::Verify(const std::string& strFile, std::string& strWarning)
+{
+    LOCK(cs_db);
+    assert(mapFileUseCount.count(strFile) == 0 || mapFileUseCount[strFile] == 0);
+
+    boost::filesystem::path path = GetDataDir() / strFile;
+    if (fMockDb || !boost::filesystem::exists(path))
+        return true;
+
+    CLogDB db(path);
+    uint64_t nDiscardedBytes;
+    if (!db.Open(false, nDiscardedBytes))
+        return false;
+    if (nDiscardedBytes > 0)
+        strWarning += strprintf(_("Warning: %u bytes of incomplete writes were discarded from the end of %s."),
+                                nDiscardedBytes, strFile);
+    db.Close();
+    return true;
+}
+
+void CLogDBEnv::Flush(bool fShutdown)
+{
+    int64_t nStart = GetTimeMillis();
+    LOCK(cs_db);
+    std::map<std::string, CLogDB*>::iterator mi = mapDb.begin();
+    while (mi != mapDb.end()) {
+        CLogDB* pdb = mi->second;
+        pdb->Sync();
+        if (pdb->NeedsCompaction())
+            pdb->Compact();
+        if (fShutdown && mapFileUseCount[mi->first] == 0) {
+            delete pdb;
+            mapFileUseCount.erase(mi->first);
+            mapDb.erase(mi++);
+        } else {
+            mi++;
+        }
+    }
+    LogPrint("db", "CLogDBEnv::Flush: Flush(%s) took %15dms\n", fShutdown ? "true" : "false", GetTimeMillis() - nStart);
+}
+
+void CLogDBEnv::CloseDb(const std::string& strFile)
+{
+    LOCK(cs_db);
+    std::map<std::string, CLogDB*>::iterator mi = mapDb.find(strFile);
+    if (mi != mapDb.end()) {
+        delete mi->second;
+        mapDb.erase(mi);
+    }
+}
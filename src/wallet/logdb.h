@@ -0,0 +1,163 @@
+// Copyright (c) 2017 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_WALLET_LOGDB_H
+#define BITCOIN_WALLET_LOGDB_H
+
+#include "sync.h"
+
+#include <map>
+#include <set>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/optional.hpp>
+
+//! Compact a log once it is larger than this...
+static const uint64_t LOGDB_COMPACT_MIN_SIZE = 4 * 1024 * 1024;
+//! ...and superseded records make up more than this fraction of it
+static const double LOGDB_COMPACT_MIN_GARBAGE = 0.5;
+
+/** A set of changes to a CLogDB which is committed atomically */
+class CLogDBBatch
+{
+public:
+    typedef std::vector<unsigned char> Bytes;
+
+    void Write(const Bytes& key, const Bytes& value);
+    void Erase(const Bytes& key);
+
+    /**
+     * Look up a key among the pending changes. Returns false if the batch
+     * does not touch the key; otherwise value is set, or left empty if the
+     * key is erased by the batch.
+     */
+    bool Lookup(const Bytes& key, boost::optional<Bytes>& value) const;
+
+    /** Apply the pending writes and erases of keys starting with prefix to setKeys. */
+    void MergeKeysWithPrefix(const Bytes& prefix, std::set<Bytes>& setKeys) const;
+
+    bool IsEmpty() const { return mapChanges.empty(); }
+    void Clear() { mapChanges.clear(); }
+
+private:
+    friend class CLogDB;
+    std::map<Bytes, boost::optional<Bytes> > mapChanges;
+};
+
+/**
+ * Append-only, log-structured key/value store, used as an alternative to
+ * Berkeley DB for wallet.dat (-walletbackend=log).
+ *
+ * All records are held in memory. Each committed batch is appended to the
+ * file as a single checksummed entry, so a torn write at the end of the file
+ * is detected and discarded when the log is replayed. Writes which would not
+ * change a record are dropped, so rewriting unchanged wallet data costs
+ * nothing. The file is rewritten without superseded entries by Compact().
+ */
+class CLogDB
+{
+public:
+    typedef CLogDBBatch::Bytes Bytes;
+
+    /** A mock database is never written to disk. */
+    CLogDB(const boost::filesystem::path& pathIn, bool fMockIn = false);
+    ~CLogDB();
+
+    /** Returns true if the file at path starts with the log header. */
+    static bool IsLogFile(const boost::filesystem::path& path);
+
+    /**
+     * Replay the log into memory, creating it if fCreate is set. A damaged
+     * entry at the end of the file is truncated away, and reported through
+     * nDiscardedBytes.
+     */
+    bool Open(bool fCreate, uint64_t& nDiscardedBytes);
+    void Close();
+
+    bool Read(const Bytes& key, Bytes& value) const;
+    bool Exists(const Bytes& key) const;
+
+    /**
+     * Find the first record whose key is at least key, or strictly after it
+     * if fAfter is set. Returns false if there is no such record.
+     */
+    bool Seek(const Bytes& key, bool fAfter, Bytes& keyOut, Bytes& valueOut) const;
+
+    /** Append a batch to the log, optionally waiting for it to reach the disk. */
+    bool Commit(const CLogDBBatch& batch, bool fSync = false);
+
+    /** Make everything committed so far durable. */
+    bool Sync();
+
+    bool NeedsCompaction() const;
+
+    /**
+     * Rewrite the log with one entry per live record, dropping any records
+     * whose key starts with pszSkip.
+     */
+    bool Compact(const char* pszSkip = NULL);
+
+    /** Copy a consistent snapshot of the log to pathDest. */
+    bool Backup(const boost::filesystem::path& pathDest);
+
+    uint64_t GetFileSize() const;
+    uint64_t GetLiveSize() const;
+    size_t GetRecordCount() const;
+
+private:
+    mutable CCriticalSection cs;
+    boost::filesystem::path path;
+    bool fMock;
+    FILE* file;
+    std::map<Bytes, Bytes> mapRecords;
+    uint64_t nFileSize;
+    uint64_t nLiveSize;
+    bool fDirty;
+
+    bool AppendEntry(FILE* fileout, const std::vector<char>& vchEntry);
+    void Apply(const Bytes& key, const boost::optional<Bytes>& value);
+
+    CLogDB(const CLogDB&);
+    void operator=(const CLogDB&);
+};
+
+/** Keeps track of the open log-structured wallet databases. */
+class CLogDBEnv
+{
+private:
+    bool fMockDb;
+
+public:
+    mutable CCriticalSection cs_db;
+    std::map<std::string, int> mapFileUseCount;
+    std::map<std::string, CLogDB*> mapDb;
+
+    CLogDBEnv();
+    ~CLogDBEnv();
+
+    void MakeMock();
+    bool IsMock() { return fMockDb; }
+
+    /** Open (or share) the database in strFile, within the data directory. */
+    CLogDB* Open(const std::string& strFile, bool fCreate);
+    void Release(const std::string& strFile);
+
+    /**
+     * Check that strFile can be replayed, truncating a damaged tail. Must be
+     * called before strFile is opened.
+     */
+    bool Verify(const std::string& strFile, std::string& strWarning);
+
+    /** Sync all open logs, compacting those which need it. */
+    void Flush(bool fShutdown);
+    void CloseDb(const std::string& strFile);
+};
+
+extern CLogDBEnv logdbenv;
+
+#endif // BITCOIN_WALLET_LOGDB_H
@@ -2605,6 +2605,8 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
             sample_times.push_back(benchmark_loadwallet());
         } else if (benchmarktype == "listunspent") {
             sample_times.push_back(benchmark_listunspent());
+        } else if (benchmarktype == "estimatefee") {
+            sample_times.push_back(benchmark_estimatefee());
         } else {
             throw JSONRPCError(RPC_TYPE_ERROR, "Invalid benchmarktype");
         }
@@ -3267,6 +3269,8 @@ UniValue z_getoperationstatus(const UniValue& params, bool fHelp)
             "1. \"operationid\"         (array, optional) A list of operation ids we are interested in.  If not provided, examine all operations known to the node.\n"
             "\nResult:\n"
             "\"    [object, ...]\"      (array) A list of JSON objects\n"
+            "\nQueued operations also report \"queue_position\" (the number of queued operations which will run first),\n"
+            "\"queue_depth\" (the number of queued operations) and \"estimated_wait_secs\".\n"
             "\nExamples:\n"
             + HelpExampleCli("z_getoperationstatus", "'[\"operationid\", ... ]'")
             + HelpExampleRpc("z_getoperationstatus", "'[\"operationid\", ... ]'")
@@ -3313,6 +3317,15 @@ UniValue z_getoperationstatus_IMPL(const UniValue& params, bool fRemoveFinishedO
                 q->popOperationForId(id);
             }
         } else {
+            if ("queued"==s) {
+                size_t position;
+                int64_t estimatedWaitSecs;
+                if (q->getQueuePosition(id, position, estimatedWaitSecs)) {
+                    obj.push_back(Pair("queue_position", (uint64_t) position));
+                    obj.push_back(Pair("queue_depth", (uint64_t) q->getOperationCount()));
+                    obj.push_back(Pair("estimated_wait_secs", estimatedWaitSecs));
+                }
+            }
             ret.push_back(obj);
         }
     }
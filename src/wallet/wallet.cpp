@@ -411,14 +411,60 @@ void CWallet::ChainTip(const CBlockIndex *pindex, const CBlock *pblock,
     } else {
         DecrementNoteWitnesses(pindex);
     }
+    UpdateUnspentNotesWithBlock(pblock, added);
+    SyncBlockBatch();
 }
 
 void CWallet::SetBestChain(const CBlockLocator& loc)
 {
+    SyncBlockBatch();
     CWalletDB walletdb(strWalletFile);
     SetBestChainINTERNAL(walletdb, loc);
 }
 
+CWalletDB* CWallet::GetBlockBatch()
+{
+    AssertLockHeld(cs_wallet);
+    if (!fFileBacked)
+        return NULL;
+    if (!pwalletdbBlock) {
+        pwalletdbBlock = new CWalletDB(strWalletFile, "r+", false);
+        if (!pwalletdbBlock->TxnBegin()) {
+            LogPrintf("%s: Couldn't start block transaction, writing changes individually\n", __func__);
+            delete pwalletdbBlock;
+            pwalletdbBlock = NULL;
+        }
+    }
+    return pwalletdbBlock;
+}
+
+void CWallet::CommitBlockBatch()
+{
+    LOCK(cs_wallet);
+    if (!pwalletdbBlock)
+        return;
+    // Couldn't commit the block's changes, but in-memory state is fine
+    if (pwalletdbBlock->TxnCommit(false))
+        fBlockWritesUnsynced = true;
+    else
+        LogPrintf("%s: Couldn't commit block transaction\n", __func__);
+    delete pwalletdbBlock;
+    pwalletdbBlock = NULL;
+}
+
+void CWallet::SyncBlockBatch()
+{
+    LOCK(cs_wallet);
+    CommitBlockBatch();
+    fBatchBlockWrites = false;
+    if (!fBlockWritesUnsynced)
+        return;
+    fBlockWritesUnsynced = false;
+    CWalletDB walletdb(strWalletFile, "r+", false);
+    if (!walletdb.TxnSync())
+        LogPrintf("%s: Couldn't sync block transactions\n", __func__);
+}
+
 bool CWallet::SetMinVersion(enum WalletFeature nVersion, CWalletDB* pwalletdbIn, bool fExplicit)
 {
     LOCK(cs_wallet); // nWalletVersion
@@ -498,10 +544,37 @@ set<uint256> CWallet::GetConflicts(const uint256& txid) const
 void CWallet::Flush(bool shutdown)
 {
     bitdb.Flush(shutdown);
+    logdbenv.Flush(shutdown);
 }
 
 bool CWallet::Verify(const string& walletFile, string& warningString, string& errorString)
 {
+    boost::filesystem::path pathWallet = GetDataDir() / walletFile;
+    bool fLogFile = boost::filesystem::exists(pathWallet) && CLogDB::IsLogFile(pathWallet);
+
+    if (GetWalletBackend() == WALLET_BACKEND_LOG)
+    {
+        if (boost::filesystem::exists(pathWallet) && !fLogFile)
+        {
+            if (!CDB::ConvertToLog(walletFile))
+            {
+                errorString += strprintf(_("Error converting %s to the log wallet backend"), walletFile);
+                return true;
+            }
+            warningString += strprintf(_("Warning: %s was converted to the log wallet backend;"
+                                         " the original was saved as %s.bdb.bak in %s."), walletFile, walletFile, GetDataDir());
+        }
+        if (!logdbenv.Verify(walletFile, warningString))
+            errorString += strprintf(_("%s corrupt, unable to replay the wallet log"), walletFile);
+        return true;
+    }
+
+    if (fLogFile)
+    {
+        errorString += strprintf(_("%s was written by the log wallet backend; restart with -walletbackend=log"), walletFile);
+        return true;
+    }
+
     if (!bitdb.Open(GetDataDir()))
     {
         // try moving the database env out of the way
@@ -625,6 +698,26 @@ bool CWallet::IsSpent(const uint256& nullifier) const
     return false;
 }
 
+/**
+ * Note is spent by a transaction in the active chain. Such notes can be
+ * dropped from the unspent note index until the spending block is
+ * disconnected.
+ */
+bool CWallet::IsSpentInMainChain(const uint256& nullifier) const
+{
+    pair<TxNullifiers::const_iterator, TxNullifiers::const_iterator> range;
+    range = mapTxNullifiers.equal_range(nullifier);
+
+    for (TxNullifiers::const_iterator it = range.first; it != range.second; ++it) {
+        const uint256& wtxid = it->second;
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(wtxid);
+        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain() > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 void CWallet::AddToSpends(const COutPoint& outpoint, const uint256& wtxid)
 {
     mapTxSpends.insert(make_pair(outpoint, wtxid));
@@ -1041,6 +1134,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
         mapWallet[hash].BindWallet(this);
         UpdateNullifierNoteMapWithTx(mapWallet[hash]);
         AddToSpends(hash);
+        AddToUnspentNotes(mapWallet[hash]);
     }
     else
     {
@@ -1132,6 +1226,9 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
         //// debug print
         LogPrintf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
 
+        if (fInsertedNew || fUpdated)
+            AddToUnspentNotes(wtx);
+
         // Write to disk
         if (fInsertedNew || fUpdated)
             if (!wtx.WriteToDisk(pwalletdb))
@@ -1199,6 +1296,12 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
             if (pblock)
                 wtx.SetMerkleBranch(*pblock);
 
+            // Transactions found in a block are written as part of the
+            // block's batch, which ChainTip commits once the block is done
+            CWalletDB* pwalletdbBatch = fBatchBlockWrites ? GetBlockBatch() : NULL;
+            if (pwalletdbBatch)
+                return AddToWallet(wtx, false, pwalletdbBatch);
+
             // Do not flush the wallet here for performance reasons
             // this is safe, as in case of a crash, we rescan the necessary blocks on startup through our SetBestChain-mechanism
             CWalletDB walletdb(strWalletFile, "r+", false);
@@ -1212,10 +1315,15 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
 void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
 {
     LOCK2(cs_main, cs_wallet);
-    if (!AddToWalletIfInvolvingMe(tx, pblock, true))
-        return; // Not one of ours
+    // Transactions in a connected block are followed by ChainTip
+    if (pblock)
+        fBatchBlockWrites = true;
+    if (AddToWalletIfInvolvingMe(tx, pblock, true))
+        MarkAffectedTransactionsDirty(tx);
 
-    MarkAffectedTransactionsDirty(tx);
+    // Other writers may run once cs_wallet is released, so the block's
+    // transaction must not stay open; ChainTip syncs it with the others
+    CommitBlockBatch();
 }
 
 void CWallet::MarkAffectedTransactionsDirty(const CTransaction& tx)
@@ -1244,6 +1352,9 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         return;
     {
         LOCK(cs_wallet);
+        std::map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+        if (it != mapWallet.end())
+            RemoveFromUnspentNotes(it->second);
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
     }
@@ -3644,9 +3755,172 @@ bool CMerkleTx::AcceptToMemoryPool(bool fLimitFree, bool fRejectAbsurdFee)
     return ::AcceptToMemoryPool(mempool, state, *this, fLimitFree, NULL, fRejectAbsurdFee);
 }
 
+/**
+ * Decrypt a note in a wallet transaction using the cached note decryptor for
+ * its payment address.
+ * Throws std::runtime_error if the note cannot be decrypted.
+ */
+NotePlaintext CWallet::DecryptNote(const CWalletTx& wtx, const JSOutPoint& jsop, const PaymentAddress& pa) const
+{
+    int i = jsop.js; // Index into CTransaction.vjoinsplit
+    int j = jsop.n; // Index into JSDescription.ciphertexts
+
+    // Get cached decryptor
+    ZCNoteDecryption decryptor;
+    if (!GetNoteDecryptor(pa, decryptor)) {
+        // Note decryptors are created when the wallet is loaded, so it should always exist
+        throw std::runtime_error(strprintf("Could not find note decryptor for payment address %s", CZCPaymentAddress(pa).ToString()));
+    }
+
+    // determine amount of funds in the note
+    auto hSig = wtx.vjoinsplit[i].h_sig(*pzcashParams, wtx.joinSplitPubKey);
+    try {
+        return NotePlaintext::decrypt(
+                decryptor,
+                wtx.vjoinsplit[i].ciphertexts[j],
+                wtx.vjoinsplit[i].ephemeralKey,
+                hSig,
+                (unsigned char) j);
+    } catch (const note_decryption_failed &err) {
+        // Couldn't decrypt with this spending key
+        throw std::runtime_error(strprintf("Could not decrypt note for payment address %s", CZCPaymentAddress(pa).ToString()));
+    } catch (const std::exception &exc) {
+        // Unexpected failure
+        throw std::runtime_error(strprintf("Error while decrypting note for payment address %s: %s", CZCPaymentAddress(pa).ToString(), exc.what()));
+    }
+}
+
+/**
+ * Walk the whole wallet once to populate the unspent note index.
+ * Throws std::runtime_error if a note cannot be decrypted, leaving the index
+ * unbuilt.
+ */
+void CWallet::BuildUnspentNotes()
+{
+    AssertLockHeld(cs_wallet);
+
+    DiscardUnspentNotes();
+    try {
+        for (const std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
+            IndexUnspentNotes(wtxItem.second);
+        }
+    } catch (...) {
+        DiscardUnspentNotes();
+        throw;
+    }
+    fUnspentNotesIndexed = true;
+    LogPrint("zrpc", "%s: indexed %d unspent notes\n", __func__, mapUnspentNotes.size());
+}
+
+/**
+ * Add the notes of a wallet transaction to the unspent note index, skipping
+ * notes already in the index and notes spent in the active chain.
+ * Throws std::runtime_error if a note cannot be decrypted.
+ */
+void CWallet::IndexUnspentNotes(const CWalletTx& wtx)
+{
+    for (const mapNoteData_t::value_type& item : wtx.mapNoteData) {
+        const JSOutPoint& jsop = item.first;
+        const CNoteData& nd = item.second;
+        if (mapUnspentNotes.count(jsop)) {
+            continue;
+        }
+        if (nd.nullifier && IsSpentInMainChain(*nd.nullifier)) {
+            continue;
+        }
+
+        NotePlaintext plaintext = DecryptNote(wtx, jsop, nd.address);
+        setUnspentNotes.insert(UnspentNoteKey(nd.address, CAmount(plaintext.value), jsop));
+        mapUnspentNotes.insert(std::make_pair(jsop, CUnspentNote{nd.address, plaintext}));
+    }
+}
+
+/**
+ * Keep the unspent note index current with a new or updated wallet
+ * transaction. Does nothing until the index has been built.
+ */
+void CWallet::AddToUnspentNotes(const CWalletTx& wtx)
+{
+    if (!fUnspentNotesIndexed) {
+        return;
+    }
+
+    try {
+        IndexUnspentNotes(wtx);
+    } catch (const std::exception &exc) {
+        // Rebuild from scratch on the next query, which reports the error
+        LogPrintf("%s: %s, discarding unspent note index\n", __func__, exc.what());
+        DiscardUnspentNotes();
+    }
+}
+
+void CWallet::DiscardUnspentNotes()
+{
+    setUnspentNotes.clear();
+    mapUnspentNotes.clear();
+    fUnspentNotesIndexed = false;
+}
+
+void CWallet::RemoveFromUnspentNotes(const JSOutPoint& jsop)
+{
+    std::map<JSOutPoint, CUnspentNote>::iterator it = mapUnspentNotes.find(jsop);
+    if (it == mapUnspentNotes.end()) {
+        return;
+    }
+    setUnspentNotes.erase(UnspentNoteKey(it->second.address, CAmount(it->second.plaintext.value), jsop));
+    mapUnspentNotes.erase(it);
+}
+
+void CWallet::RemoveFromUnspentNotes(const CWalletTx& wtx)
+{
+    for (const mapNoteData_t::value_type& item : wtx.mapNoteData) {
+        RemoveFromUnspentNotes(item.first);
+    }
+}
+
+/**
+ * Notes spent in a connected block leave the unspent note index, and notes
+ * spent in a disconnected block return to it.
+ */
+void CWallet::UpdateUnspentNotesWithBlock(const CBlock* pblock, bool added)
+{
+    LOCK(cs_wallet);
+    if (!fUnspentNotesIndexed) {
+        return;
+    }
+
+    try {
+        for (const CTransaction& tx : pblock->vtx) {
+            for (const JSDescription& jsdesc : tx.vjoinsplit) {
+                for (const uint256& nullifier : jsdesc.nullifiers) {
+                    std::map<uint256, JSOutPoint>::const_iterator nit = mapNullifiersToNotes.find(nullifier);
+                    if (nit == mapNullifiersToNotes.end()) {
+                        continue;
+                    }
+                    if (added) {
+                        RemoveFromUnspentNotes(nit->second);
+                        continue;
+                    }
+                    std::map<uint256, CWalletTx>::const_iterator wit = mapWallet.find(nit->second.hash);
+                    if (wit != mapWallet.end()) {
+                        IndexUnspentNotes(wit->second);
+                    }
+                }
+            }
+        }
+    } catch (const std::exception &exc) {
+        // Rebuild from scratch on the next query, which reports the error
+        LogPrintf("%s: %s, discarding unspent note index\n", __func__, exc.what());
+        DiscardUnspentNotes();
+    }
+}
+
 /**
  * Find notes in the wallet filtered by payment address, min depth and ability to spend.
  * These notes are decrypted and added to the output parameter vector, outEntries.
+ *
+ * Unspent notes are served from the unspent note index, so the cost scales
+ * with the number of unspent notes rather than with the wallet history.
  */
 void CWallet::GetFilteredNotes(std::vector<CNotePlaintextEntry> & outEntries, std::string address, int minDepth, bool ignoreSpent, bool ignoreUnspendable)
 {
@@ -3659,6 +3933,58 @@ void CWallet::GetFilteredNotes(std::vector<CNotePlaintextEntry> & outEntries, st
 
     LOCK2(cs_main, cs_wallet);
 
+    if (ignoreSpent) {
+        if (!fUnspentNotesIndexed) {
+            BuildUnspentNotes();
+        }
+
+        std::set<UnspentNoteKey>::const_iterator it = setUnspentNotes.begin();
+        if (fFilterAddress) {
+            it = setUnspentNotes.lower_bound(UnspentNoteKey(filterPaymentAddress, 0, JSOutPoint()));
+        }
+
+        std::vector<JSOutPoint> vSpentInChain;
+        for (; it != setUnspentNotes.end(); ++it) {
+            const PaymentAddress& pa = std::get<0>(*it);
+            const JSOutPoint& jsop = std::get<2>(*it);
+
+            // the index is ordered by address, so we are done with this one
+            if (fFilterAddress && !(pa == filterPaymentAddress)) {
+                break;
+            }
+
+            std::map<uint256, CWalletTx>::const_iterator wit = mapWallet.find(jsop.hash);
+            assert(wit != mapWallet.end());
+            const CWalletTx& wtx = wit->second;
+
+            if (!CheckFinalTx(wtx) || wtx.GetBlocksToMaturity() > 0 || wtx.GetDepthInMainChain() < minDepth) {
+                continue;
+            }
+
+            // skip note which has been spent, and drop it from the index if
+            // the spend has been mined
+            const CNoteData& nd = wtx.mapNoteData.at(jsop);
+            if (nd.nullifier && IsSpent(*nd.nullifier)) {
+                if (IsSpentInMainChain(*nd.nullifier)) {
+                    vSpentInChain.push_back(jsop);
+                }
+                continue;
+            }
+
+            // skip notes which cannot be spent
+            if (ignoreUnspendable && !HaveSpendingKey(pa)) {
+                continue;
+            }
+
+            outEntries.push_back(CNotePlaintextEntry{jsop, mapUnspentNotes.at(jsop).plaintext});
+        }
+
+        for (const JSOutPoint& jsop : vSpentInChain) {
+            RemoveFromUnspentNotes(jsop);
+        }
+        return;
+    }
+
     for (auto & p : mapWallet) {
         CWalletTx wtx = p.second;
 
@@ -3681,45 +4007,12 @@ void CWallet::GetFilteredNotes(std::vector<CNotePlaintextEntry> & outEntries, st
                 continue;
             }
 
-            // skip note which has been spent
-            if (ignoreSpent && nd.nullifier && IsSpent(*nd.nullifier)) {
-                continue;
-            }
-
             // skip notes which cannot be spent
             if (ignoreUnspendable && !HaveSpendingKey(pa)) {
                 continue;
             }
 
-            int i = jsop.js; // Index into CTransaction.vjoinsplit
-            int j = jsop.n; // Index into JSDescription.ciphertexts
-
-            // Get cached decryptor
-            ZCNoteDecryption decryptor;
-            if (!GetNoteDecryptor(pa, decryptor)) {
-                // Note decryptors are created when the wallet is loaded, so it should always exist
-                throw std::runtime_error(strprintf("Could not find note decryptor for payment address %s", CZCPaymentAddress(pa).ToString()));
-            }
-
-            // determine amount of funds in the note
-            auto hSig = wtx.vjoinsplit[i].h_sig(*pzcashParams, wtx.joinSplitPubKey);
-            try {
-                NotePlaintext plaintext = NotePlaintext::decrypt(
-                        decryptor,
-                        wtx.vjoinsplit[i].ciphertexts[j],
-                        wtx.vjoinsplit[i].ephemeralKey,
-                        hSig,
-                        (unsigned char) j);
-
-                outEntries.push_back(CNotePlaintextEntry{jsop, plaintext});
-
-            } catch (const note_decryption_failed &err) {
-                // Couldn't decrypt with this spending key
-                throw std::runtime_error(strprintf("Could not decrypt note for payment address %s", CZCPaymentAddress(pa).ToString()));
-            } catch (const std::exception &exc) {
-                // Unexpected failure
-                throw std::runtime_error(strprintf("Error while decrypting note for payment address %s: %s", CZCPaymentAddress(pa).ToString(), exc.what()));
-            }
+            outEntries.push_back(CNotePlaintextEntry{jsop, DecryptNote(wtx, jsop, pa)});
         }
     }
 }
@@ -30,6 +30,7 @@
 #include <stdexcept>
 #include <stdint.h>
 #include <string>
+#include <tuple>
 #include <utility>
 #include <vector>
 
@@ -270,6 +271,13 @@ struct CNotePlaintextEntry
     libzcash::NotePlaintext plaintext;
 };
 
+/** Decrypted note cached in the wallet's unspent note index. */
+struct CUnspentNote
+{
+    libzcash::PaymentAddress address;
+    libzcash::NotePlaintext plaintext;
+};
+
 
 
 /** A transaction with a merkle branch linking it to the block chain. */
@@ -662,6 +670,20 @@ private:
 
     CWalletDB *pwalletdbEncryption;
 
+    /**
+     * Transaction writes made while a block is being connected go through
+     * here. Each SyncTransaction commits its writes without a sync before it
+     * releases cs_wallet, and ChainTip syncs them all at once. So a block's
+     * writes are not atomic, and a crash can leave only some of them on disk.
+     * This is safe because the best block locator is only written by
+     * SetBestChain, after the block's writes were synced: it still points
+     * before a partially written block, which is rescanned on startup.
+     */
+    CWalletDB *pwalletdbBlock;
+    bool fBatchBlockWrites;
+    //! Whether block writes were committed since the last sync
+    bool fBlockWritesUnsynced;
+
     //! the current wallet version: clients below this version are not able to load the wallet
     int nWalletVersion;
 
@@ -692,6 +714,34 @@ private:
     void AddToSpends(const uint256& nullifier, const uint256& wtxid);
     void AddToSpends(const uint256& wtxid);
 
+    /**
+     * Index of the notes in the wallet that have not been spent by a
+     * transaction in the active chain, ordered by payment address and then by
+     * value, with the decrypted plaintext of each note cached. Notes spent by
+     * unconfirmed transactions are kept in the index and filtered out with
+     * IsSpent() when it is queried, so that they reappear if the spend is
+     * conflicted.
+     *
+     * The index is built the first time it is needed, and is then kept
+     * current by AddToWallet, EraseFromWallet and ChainTip.
+     */
+    typedef std::tuple<libzcash::PaymentAddress, CAmount, JSOutPoint> UnspentNoteKey;
+    std::set<UnspentNoteKey> setUnspentNotes;
+    std::map<JSOutPoint, CUnspentNote> mapUnspentNotes;
+    bool fUnspentNotesIndexed;
+
+    void BuildUnspentNotes();
+    void DiscardUnspentNotes();
+    void IndexUnspentNotes(const CWalletTx& wtx);
+    void AddToUnspentNotes(const CWalletTx& wtx);
+    void RemoveFromUnspentNotes(const JSOutPoint& jsop);
+    void RemoveFromUnspentNotes(const CWalletTx& wtx);
+    void UpdateUnspentNotesWithBlock(const CBlock* pblock, bool added);
+    bool IsSpentInMainChain(const uint256& nullifier) const;
+    libzcash::NotePlaintext DecryptNote(const CWalletTx& wtx,
+                                        const JSOutPoint& jsop,
+                                        const libzcash::PaymentAddress& address) const;
+
 public:
     /*
      * Size of the incremental witness cache for the notes in our wallet.
@@ -761,6 +811,17 @@ protected:
     bool UpdatedNoteData(const CWalletTx& wtxIn, CWalletTx& wtx);
     void MarkAffectedTransactionsDirty(const CTransaction& tx);
 
+    /**
+     * Returns the database handle for writes belonging to the block being
+     * connected, starting its transaction if necessary, or NULL if the writes
+     * cannot be batched.
+     */
+    CWalletDB* GetBlockBatch();
+    /** Commit the pending block transaction, if there is one, without waiting for the disk. */
+    void CommitBlockBatch();
+    /** Commit the pending block transaction and sync the block's writes to disk. */
+    void SyncBlockBatch();
+
 public:
     /*
      * Main wallet lock.
@@ -797,6 +858,7 @@ public:
 
     ~CWallet()
     {
+        SyncBlockBatch();
         delete pwalletdbEncryption;
         pwalletdbEncryption = NULL;
     }
@@ -808,12 +870,16 @@ public:
         fFileBacked = false;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        pwalletdbBlock = NULL;
+        fBatchBlockWrites = false;
+        fBlockWritesUnsynced = false;
         nOrderPosNext = 0;
         nNextResend = 0;
         nLastResend = 0;
         nTimeFirstKey = 0;
         fBroadcastTransactions = false;
         nWitnessCacheSize = 0;
+        fUnspentNotesIndexed = false;
     }
 
     /**
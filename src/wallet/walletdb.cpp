@@ -58,15 +58,129 @@ bool CWalletDB::ErasePurpose(const string& strPurpose)
 bool CWalletDB::WriteTx(uint256 hash, const CWalletTx& wtx)
 {
     nWalletDBUpdated++;
+    if (plogdb)
+        return WriteTxAndWitnesses(hash, wtx);
     return Write(std::make_pair(std::string("tx"), hash), wtx);
 }
 
 bool CWalletDB::EraseTx(uint256 hash)
 {
     nWalletDBUpdated++;
+    if (plogdb) {
+        // Erase the witnesses stored apart from the transaction
+        CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+        std::vector<CDataStream> vKeys;
+        ssPrefix << std::make_pair(std::string("witnessheight"), hash);
+        if (!ListKeysWithPrefix(ssPrefix, vKeys))
+            return false;
+        for (CDataStream& ssKey : vKeys) {
+            std::string strType;
+            JSOutPoint jsop;
+            ssKey >> strType >> jsop;
+            if (!Erase(std::make_pair(strType, jsop)))
+                return false;
+        }
+
+        vKeys.clear();
+        ssPrefix.clear();
+        ssPrefix << std::make_pair(std::string("witness"), hash);
+        if (!ListKeysWithPrefix(ssPrefix, vKeys))
+            return false;
+        for (CDataStream& ssKey : vKeys) {
+            std::string strType;
+            std::pair<JSOutPoint, int> key;
+            ssKey >> strType >> key;
+            if (!Erase(std::make_pair(strType, key)))
+                return false;
+        }
+    }
     return Erase(std::make_pair(std::string("tx"), hash));
 }
 
+/**
+ * The log-structured backend stores note witnesses apart from their
+ * transaction, as one record per note and witness height. The witness cache
+ * changes with every block, but records which are unchanged are not written
+ * again, so connecting a block only appends the newest witness of each note.
+ */
+bool CWalletDB::WriteTxAndWitnesses(const uint256& hash, const CWalletTx& wtx)
+{
+    CWalletTx wtxStripped(wtx);
+    for (mapNoteData_t::value_type& item : wtxStripped.mapNoteData) {
+        item.second.witnesses.clear();
+        item.second.witnessHeight = -1;
+    }
+    if (!Write(std::make_pair(std::string("tx"), hash), wtxStripped))
+        return false;
+
+    for (const mapNoteData_t::value_type& item : wtx.mapNoteData) {
+        const JSOutPoint& jsop = item.first;
+        const CNoteData& nd = item.second;
+        if (!Write(std::make_pair(std::string("witnessheight"), jsop), nd.witnessHeight))
+            return false;
+
+        // Erase witnesses which have dropped out of the cache
+        int nMinHeight = nd.witnessHeight - (int)nd.witnesses.size();
+        CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+        ssPrefix << std::make_pair(std::string("witness"), jsop);
+        std::vector<CDataStream> vKeys;
+        if (!ListKeysWithPrefix(ssPrefix, vKeys))
+            return false;
+        for (CDataStream& ssKey : vKeys) {
+            std::string strType;
+            JSOutPoint jsopKey;
+            int nHeight;
+            ssKey >> strType >> jsopKey >> nHeight;
+            if (nHeight <= nMinHeight || nHeight > nd.witnessHeight) {
+                if (!Erase(std::make_pair(strType, std::make_pair(jsopKey, nHeight))))
+                    return false;
+            }
+        }
+
+        int nHeight = nd.witnessHeight;
+        for (const ZCIncrementalWitness& witness : nd.witnesses) {
+            if (!Write(std::make_pair(std::string("witness"), std::make_pair(jsop, nHeight)), witness))
+                return false;
+            nHeight--;
+        }
+    }
+    return true;
+}
+
+bool CWalletDB::ListKeysWithPrefix(const CDataStream& ssPrefix, std::vector<CDataStream>& vKeys)
+{
+    CDBCursor* pcursor = GetCursor();
+    if (!pcursor)
+        return false;
+    std::set<CLogDB::Bytes> setKeys;
+    unsigned int fFlags = DB_SET_RANGE;
+    while (true)
+    {
+        CDataStream ssKey(ssPrefix.begin(), ssPrefix.end(), SER_DISK, CLIENT_VERSION);
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+        fFlags = DB_NEXT;
+        if (ret == DB_NOTFOUND)
+            break;
+        else if (ret != 0)
+        {
+            pcursor->close();
+            return false;
+        }
+        if (ssKey.size() < ssPrefix.size() || !std::equal(ssPrefix.begin(), ssPrefix.end(), ssKey.begin()))
+            break;
+        setKeys.insert(CLogDB::Bytes(ssKey.begin(), ssKey.end()));
+    }
+    pcursor->close();
+
+    // The cursor only sees what is committed; add the changes of our own transaction
+    if (activeBatch)
+        activeBatch->MergeKeysWithPrefix(CLogDB::Bytes(ssPrefix.begin(), ssPrefix.end()), setKeys);
+    for (const CLogDB::Bytes& vchKey : setKeys)
+        vKeys.push_back(CDataStream(vchKey, SER_DISK, CLIENT_VERSION));
+    return true;
+}
+
 bool CWalletDB::WriteKey(const CPubKey& vchPubKey, const CPrivKey& vchPrivKey, const CKeyMetadata& keyMeta)
 {
     nWalletDBUpdated++;
@@ -260,7 +374,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
 {
     bool fAllAccounts = (strAccount == "*");
 
-    Dbc* pcursor = GetCursor();
+    CDBCursor* pcursor = GetCursor();
     if (!pcursor)
         throw runtime_error("CWalletDB::ListAccountCreditDebit(): cannot create DB cursor");
     unsigned int fFlags = DB_SET_RANGE;
@@ -387,6 +501,9 @@ public:
     bool fAnyUnordered;
     int nFileVersion;
     vector<uint256> vWalletUpgrade;
+    // Witnesses stored apart from their transactions by the log-structured backend
+    map<JSOutPoint, int> mapWitnessHeights;
+    map<pair<JSOutPoint, int>, ZCIncrementalWitness> mapWitnesses;
 
     CWalletScanState() {
         nKeys = nCKeys = nKeyMeta = nZKeys = nCZKeys = nZKeyMeta = 0;
@@ -708,6 +825,18 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         {
             ssValue >> pwallet->nWitnessCacheSize;
         }
+        else if (strType == "witnessheight")
+        {
+            JSOutPoint jsop;
+            ssKey >> jsop;
+            ssValue >> wss.mapWitnessHeights[jsop];
+        }
+        else if (strType == "witness")
+        {
+            pair<JSOutPoint, int> key;
+            ssKey >> key;
+            ssValue >> wss.mapWitnesses[key];
+        }
     } catch (...)
     {
         return false;
@@ -741,7 +870,7 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
         {
             LogPrintf("Error getting wallet database cursor\n");
@@ -783,6 +912,26 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 LogPrintf("%s\n", strErr);
         }
         pcursor->close();
+
+        // Reattach witnesses which were stored apart from their transactions
+        for (const pair<JSOutPoint, int>& item : wss.mapWitnessHeights) {
+            const JSOutPoint& jsop = item.first;
+            auto wtxIt = pwallet->mapWallet.find(jsop.hash);
+            if (wtxIt == pwallet->mapWallet.end())
+                continue;
+            auto ndIt = wtxIt->second.mapNoteData.find(jsop);
+            if (ndIt == wtxIt->second.mapNoteData.end())
+                continue;
+            CNoteData& nd = ndIt->second;
+            nd.witnessHeight = item.second;
+            nd.witnesses.clear();
+            for (int nHeight = item.second; ; nHeight--) {
+                auto witnessIt = wss.mapWitnesses.find(make_pair(jsop, nHeight));
+                if (witnessIt == wss.mapWitnesses.end())
+                    break;
+                nd.witnesses.push_back(witnessIt->second);
+            }
+        }
     }
     catch (const boost::thread_interrupted&) {
         throw;
@@ -844,7 +993,7 @@ DBErrors CWalletDB::FindWalletTx(CWallet* pwallet, vector<uint256>& vTxHash, vec
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
         {
             LogPrintf("Error getting wallet database cursor\n");
@@ -935,7 +1084,15 @@ void ThreadFlushWalletDB(const string& strFile)
             nLastWalletUpdate = GetTime();
         }
 
-        if (nLastFlushed != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= 2)
+        if (nLastFlushed != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= 2 &&
+            GetWalletBackend() == WALLET_BACKEND_LOG)
+        {
+            // Make the log durable, compacting it if it has grown too large
+            boost::this_thread::interruption_point();
+            nLastFlushed = nWalletDBUpdated;
+            logdbenv.Flush(false);
+        }
+        else if (nLastFlushed != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= 2)
         {
             TRY_LOCK(bitdb.cs_db,lockDb);
             if (lockDb)
@@ -976,6 +1133,20 @@ bool BackupWallet(const CWallet& wallet, const string& strDest)
 {
     if (!wallet.fFileBacked)
         return false;
+    if (GetWalletBackend() == WALLET_BACKEND_LOG)
+    {
+        boost::filesystem::path pathDest(strDest);
+        if (boost::filesystem::is_directory(pathDest))
+            pathDest /= wallet.strWalletFile;
+        CLogDB* plogdb = logdbenv.Open(wallet.strWalletFile, false);
+        if (plogdb == NULL)
+            return false;
+        bool fSuccess = plogdb->Backup(pathDest);
+        logdbenv.Release(wallet.strWalletFile);
+        if (fSuccess)
+            LogPrintf("copied wallet.dat to %s\n", pathDest.string());
+        return fSuccess;
+    }
     while (true)
     {
         {
@@ -148,6 +148,9 @@ private:
     void operator=(const CWalletDB&);
 
     bool WriteAccountingEntry(const uint64_t nAccEntryNum, const CAccountingEntry& acentry);
+
+    bool WriteTxAndWitnesses(const uint256& hash, const CWalletTx& wtx);
+    bool ListKeysWithPrefix(const CDataStream& ssPrefix, std::vector<CDataStream>& vKeys);
 };
 
 bool BackupWallet(const CWallet& wallet, const std::string& strDest);
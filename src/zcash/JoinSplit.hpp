@@ -43,6 +43,25 @@ public:
     Note note(const uint252& phi, const uint256& r, size_t i, const uint256& h_sig) const;
 };
 
+/**
+ * The private inputs to the JoinSplit circuit. prove() fills this in when
+ * asked to, so that the zk-SNARK for a JoinSplit whose public fields have
+ * already been computed can be generated later, on another thread.
+ */
+template<size_t NumInputs, size_t NumOutputs>
+class JSProofWitness {
+public:
+    uint252 phi;
+    uint256 rt;
+    uint256 h_sig;
+    boost::array<JSInput, NumInputs> inputs;
+    boost::array<Note, NumOutputs> notes;
+    uint64_t vpub_old;
+    uint64_t vpub_new;
+
+    JSProofWitness() : vpub_old(0), vpub_new(0) { }
+};
+
 template<size_t NumInputs, size_t NumOutputs>
 class JoinSplit {
 public:
@@ -77,7 +96,14 @@ public:
         // For paymentdisclosure, we need to retrieve the esk.
         // Reference as non-const parameter with default value leads to compile error.
         // So use pointer for simplicity.
-        uint256 *out_esk = nullptr
+        uint256 *out_esk = nullptr,
+        // For deferred proving, we need the private inputs to the circuit.
+        JSProofWitness<NumInputs, NumOutputs> *out_witness = nullptr
+    ) = 0;
+
+    // Generates the zk-SNARK for a witness captured by prove().
+    virtual ZCProof prove(
+        const JSProofWitness<NumInputs, NumOutputs>& witness
     ) = 0;
 
     virtual bool verify(
@@ -101,5 +127,7 @@ protected:
 
 typedef libzcash::JoinSplit<ZC_NUM_JS_INPUTS,
                             ZC_NUM_JS_OUTPUTS> ZCJoinSplit;
+typedef libzcash::JSProofWitness<ZC_NUM_JS_INPUTS,
+                                 ZC_NUM_JS_OUTPUTS> ZCJSProofWitness;
 
 #endif // ZC_JOINSPLIT_H_
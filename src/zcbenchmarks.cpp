@@ -16,12 +16,14 @@
 #include "consensus/validation.h"
 #include "main.h"
 #include "miner.h"
+#include "policy/fees.h"
 #include "pow.h"
 #include "rpcserver.h"
 #include "script/sign.h"
 #include "sodium.h"
 #include "streams.h"
 #include "txdb.h"
+#include "txmempool.h"
 #include "utiltest.h"
 #include "wallet/wallet.h"
 
@@ -470,3 +472,55 @@ double benchmark_listunspent()
     auto unspent = listunspent(params, false);
     return timer_stop(tv_start);
 }
+
+double benchmark_estimatefee()
+{
+    // Fee transactions of increasing fee, where the higher ones get mined
+    // sooner, as in the policy estimator unit tests
+    CTxMemPool mpool(CFeeRate(1000));
+    std::list<CTransaction> dummyConflicted;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    std::vector<uint256> txHashes[10];
+    auto addTxs = [&](int blocknum, int j) {
+        for (int k = 0; k < 4; k++) {
+            tx.vin[0].prevout.n = 10000*blocknum+100*j+k;
+            uint256 hash = tx.GetHash();
+            mpool.addUnchecked(hash, CTxMemPoolEntry(tx, 1000 * (j+1), GetTime(), 0, blocknum, mpool.HasNoInputsOf(tx)));
+            txHashes[j].push_back(hash);
+        }
+    };
+    auto mineBlock = [&](int blocknum) {
+        std::vector<CTransaction> block;
+        for (int h = 0; h <= blocknum%10; h++) {
+            while (txHashes[9-h].size()) {
+                CTransaction btx;
+                if (mpool.lookup(txHashes[9-h].back(), btx))
+                    block.push_back(btx);
+                txHashes[9-h].pop_back();
+            }
+        }
+        mpool.removeForBlock(block, blocknum + 1, dummyConflicted);
+    };
+    int blocknum = 0;
+    for (; blocknum < 200; blocknum++) {
+        for (int j = 0; j < 10; j++)
+            addTxs(blocknum, j);
+        mineBlock(blocknum);
+    }
+
+    // A wallet asking for an estimate for every payment it sends, while
+    // transactions keep arriving and blocks keep being found
+    struct timeval tv_start;
+    timer_start(tv_start);
+    for (; blocknum < 300; blocknum++) {
+        for (int j = 0; j < 10; j++) {
+            addTxs(blocknum, j);
+            for (int i = 0; i < 10; i++)
+                mpool.estimateFee(1 + (j + i) % MAX_BLOCK_CONFIRMS);
+        }
+        mineBlock(blocknum);
+    }
+    return timer_stop(tv_start);
+}
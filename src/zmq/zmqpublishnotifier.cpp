@@ -4,6 +4,7 @@
 
 #include "zmqpublishnotifier.h"
 #include "main.h"
+#include "txmempool.h"
 #include "util.h"
 
 static std::multimap<std::string, CZMQAbstractPublishNotifier*> mapPublishNotifiers;
@@ -12,6 +13,7 @@ static const char *MSG_HASHBLOCK = "hashblock";
 static const char *MSG_HASHTX    = "hashtx";
 static const char *MSG_RAWBLOCK  = "rawblock";
 static const char *MSG_RAWTX     = "rawtx";
+static const char *MSG_SEQUENCE  = "sequence";
 
 // Internal function to send multipart message
 static int zmq_send_multipart(void *sock, const void* data, size_t size, ...)
@@ -187,3 +189,28 @@ bool CZMQPublishRawTransactionNotifier::NotifyTransaction(const CTransaction &tr
     ss << transaction;
     return SendMessage(MSG_RAWTX, &(*ss.begin()), ss.size());
 }
+
+bool CZMQPublishSequenceNotifier::NotifyTransactionAcceptance(const CTransaction &transaction, uint64_t nMempoolSequence)
+{
+    uint256 hash = transaction.GetHash();
+    LogPrint("zmq", "zmq: Publish sequence %d added %s\n", nMempoolSequence, hash.GetHex());
+    unsigned char data[32 + 1 + 8];
+    for (unsigned int i = 0; i < 32; i++)
+        data[31 - i] = hash.begin()[i];
+    data[32] = 'A';
+    WriteLE64(&data[33], nMempoolSequence);
+    return SendMessage(MSG_SEQUENCE, data, sizeof(data));
+}
+
+bool CZMQPublishSequenceNotifier::NotifyTransactionRemoval(const CTransaction &transaction, MemPoolRemovalReason reason, uint64_t nMempoolSequence)
+{
+    uint256 hash = transaction.GetHash();
+    LogPrint("zmq", "zmq: Publish sequence %d removed %s\n", nMempoolSequence, hash.GetHex());
+    unsigned char data[32 + 1 + 8 + 1];
+    for (unsigned int i = 0; i < 32; i++)
+        data[31 - i] = hash.begin()[i];
+    data[32] = 'R';
+    WriteLE64(&data[33], nMempoolSequence);
+    data[41] = static_cast<unsigned char>(reason);
+    return SendMessage(MSG_SEQUENCE, data, sizeof(data));
+}
@@ -52,4 +52,17 @@ public:
     bool NotifyTransaction(const CTransaction &transaction);
 };
 
+/**
+ * Publishes the transactions entering and leaving the mempool, in order. The body
+ * is the transaction hash (32 bytes, RPC byte order), a label ('A' for added or
+ * 'R' for removed), the mempool sequence number (8 bytes, little endian) and,
+ * for removals, the reason as one byte (see MemPoolRemovalReason).
+ */
+class CZMQPublishSequenceNotifier : public CZMQAbstractPublishNotifier
+{
+public:
+    bool NotifyTransactionAcceptance(const CTransaction &transaction, uint64_t nMempoolSequence);
+    bool NotifyTransactionRemoval(const CTransaction &transaction, MemPoolRemovalReason reason, uint64_t nMempoolSequence);
+};
+
 #endif // BITCOIN_ZMQ_ZMQPUBLISHNOTIFIER_H